@@ -0,0 +1,69 @@
+#ifndef __AFF4_CODECS_H
+#define __AFF4_CODECS_H
+
+/** Chunk codecs.
+
+    Image streams compress each chunk independently with a codec. The
+    codec used is recorded in the stream's aff4:compression attribute
+    as the codec id below, so readers can dispatch to the right one.
+
+    The ids for stored and deflate are the zip compression methods
+    (so older images remain readable), and zstd uses its zip method
+    number too. The zip format has no methods for LZ4 and Snappy, so
+    they are given ids outside the 16 bit zip range.
+*/
+#define AFF4_CODEC_STORED   0
+#define AFF4_CODEC_DEFLATE  8
+#define AFF4_CODEC_ZSTD     93
+#define AFF4_CODEC_LZ4      0x10000
+#define AFF4_CODEC_SNAPPY   0x10001
+
+/** A codec is a stateless class - we only ever use the registered
+    class templates and never instantiate it. The methods are called
+    without the global lock held so they must not allocate memory or
+    raise errors - they just return -1 on failure and the caller
+    raises.
+*/
+CLASS(AFF4Codec, Object)
+     // A short name for the codec (e.g. "deflate").
+     char *name;
+
+     // The id stored in aff4:compression.
+     int id;
+
+     // The level used when the image does not specify one, and the
+     // range of valid levels.
+     int default_level;
+     int min_level;
+     int max_level;
+
+     /* Returns the largest compressed size for length bytes of
+        input. The destination buffer for compress() must be at least
+        this long.
+     */
+     int METHOD(AFF4Codec, compress_bound, int length);
+
+     /* Compresses length bytes from source into dest. Returns the
+        compressed length or -1 on error.
+     */
+     int METHOD(AFF4Codec, compress, char *dest, int dest_length,    \
+                char *source, int length, int level);
+
+     /* Decompresses length bytes from source into dest which is
+        dest_length long. Returns the decompressed length or -1 on
+        error.
+     */
+     int METHOD(AFF4Codec, decompress, char *dest, int dest_length,  \
+                char *source, int length);
+END_CLASS
+
+/** This registers a new codec (a class template). */
+void register_codec(AFF4Codec classref);
+
+/** Find a registered codec by its id or its name. Returns NULL if the
+    codec is not supported by this build.
+*/
+AFF4Codec codec_from_id(int id);
+AFF4Codec codec_from_name(char *name);
+
+#endif
@@ -16,6 +16,11 @@
 #define DATATYPE_RDF_URN       RDF_NAMESPACE "urn"
 #define DATATYPE_XSD_DATETIME  XSD_NAMESPACE "dateTime"
 
+// Hash digests are hex strings typed by the hash algorithm:
+#define DATATYPE_MD5           PREDICATE_NAMESPACE "MD5"
+#define DATATYPE_SHA1          PREDICATE_NAMESPACE "SHA1"
+#define DATATYPE_SHA256        PREDICATE_NAMESPACE "SHA256"
+
 // RDFValues we use
 #define AFF4_MAP_TEXT PREDICATE_NAMESPACE "map_text"
 #define AFF4_MAP_BINARY PREDICATE_NAMESPACE "map_binary"
@@ -37,6 +42,13 @@
 #define CONFIG_VERBOSE  CONFIGURATION_NS  "verbosity"
 #define CONFIG_AUTOLOAD  CONFIGURATION_NS "autoload"
 #define CONFIG_PAD       CONFIGURATION_NS "pad"
+#define CONFIG_CHUNK_CACHE_SIZE CONFIGURATION_NS "chunk_cache_size"
+#define CONFIG_READ_AHEAD CONFIGURATION_NS "read_ahead"
+#define CONFIG_COMPRESSION_LEVEL CONFIGURATION_NS "compression_level"
+#define CONFIG_DEDUP CONFIGURATION_NS "dedup"
+#define CONFIG_DEDUP_TABLE_SIZE CONFIGURATION_NS "dedup_table_size"
+#define CONFIG_HASHES CONFIGURATION_NS "hashes"
+#define CONFIG_WRITE_BUFFER_SIZE CONFIGURATION_NS "write_buffer_size"
 
 /** These are standard aff4 attributes */
 #define AFF4_STORED     PREDICATE_NAMESPACE "stored"
@@ -44,6 +56,7 @@
 #define AFF4_INTERFACE  PREDICATE_NAMESPACE "interface"
 #define AFF4_SIZE       PREDICATE_NAMESPACE "size"
 #define AFF4_SHA        PREDICATE_NAMESPACE "sha256"
+#define AFF4_HASH       PREDICATE_NAMESPACE "hash"
 #define AFF4_TIMESTAMP  PREDICATE_NAMESPACE "createdTime"
 #define AFF4_MAP_DATA   PREDICATE_NAMESPACE "map"
 
@@ -109,6 +122,9 @@
 // the RDF encoding):
 #define AFF4_INFORMATION     "information."
 
+// The RDF encoding of binary graphs (see RDFSerializer).
+#define AFF4_BINARY_GRAPH    "binary"
+
 // Encrypted stream attributes
 // Thats the passphrase that will be used to encrypt the session key
 #define AFF4_VOLATILE_PASSPHRASE VOLATILE_NS "passphrase"
@@ -200,6 +216,11 @@
 #define RESOLVER_MODE_NONPERSISTANT 1
 #define RESOLVER_MODE_DEBUG_MEMORY 2
 
+/* Graphs stored in volumes are only parsed when their subject is
+   first resolved, rather than all at once. Resolving a subject which
+   has no graph of its own still parses them all. */
+#define RESOLVER_MODE_LAZY_GRAPHS 4
+
 /** Objects can be marked as dirty in a number of cases: */
 #define DIRTY_STATE_UNKNOWN 0
 
@@ -3,37 +3,235 @@
 
 /* This is the worker object itself (private) */
 struct ImageWorker_t;
+struct DedupTable;
+
+/* The default size of the decompressed chunk cache in bytes. This can
+   be overridden by setting CONFIG_CHUNK_CACHE_SIZE on the image URN.
+*/
+#define AFF4_DEFAULT_CHUNK_CACHE_SIZE (32 * 1024 * 1024)
+
+/* The number of parsed bevy indexes we keep resident. */
+#define AFF4_BEVY_INDEX_CACHE_SIZE 256
+
+/* The default largest read ahead window in chunks. This can be
+   overridden by setting CONFIG_READ_AHEAD on the image URN.
+*/
+#define AFF4_DEFAULT_READ_AHEAD 16
+
+/* The most threads the read pool shared by all images starts. */
+#define AFF4_MAX_READ_THREADS 16
+
+/** The bevy index (the idx member of each bevy).
+
+    Version 2 indexes start with a header followed by one entry per
+    chunk. Each entry gives the exact location and compressed length
+    of the chunk and flags describing how it is stored.
+
+    The original (version 1) index is just an array of uint32_t
+    offsets into the bevy with no header - the length of a chunk is
+    implied by the next offset. Version 1 indexes are still read.
+*/
+#define AFF4_BEVY_INDEX_MAGIC   0x32584449    /* "IDX2" */
+#define AFF4_BEVY_INDEX_VERSION 2
+
+struct BevyIndexHeader {
+  uint32_t magic;
+  uint32_t version;
+} __attribute__((packed));
+
+/* The chunk is stored uncompressed in the bevy. */
+#define AFF4_CHUNK_STORED    1
+
+/* Every byte of the chunk is the same. The fill value is in offset
+   and the chunk takes no space in the bevy (e.g. zero chunks).
+*/
+#define AFF4_CHUNK_CONSTANT  2
+
+/* The chunk is a duplicate of an earlier chunk in the stream. offset
+   is the chunk id of the original and the chunk takes no space.
+*/
+#define AFF4_CHUNK_REFERENCE 4
+
+struct BevyIndexEntry {
+  uint64_t offset;
+  uint32_t length;
+  uint32_t flags;
+} __attribute__((packed));
+
+/* The default memory budget for bevies in flight while writing. This
+   can be overridden by setting CONFIG_WRITE_BUFFER_SIZE on the image
+   URN.
+*/
+#define AFF4_DEFAULT_WRITE_BUFFER_SIZE (256 * 1024 * 1024)
+
+/* The default memory (in bytes) used to remember chunk digests for
+   deduplication. Each digest takes 40 bytes.
+*/
+#define AFF4_DEFAULT_DEDUP_TABLE_SIZE (16 * 1024 * 1024)
+
+/* The hashes which may be computed over the stream while writing. */
+#define AFF4_HASH_MD5    1
+#define AFF4_HASH_SHA1   2
+#define AFF4_HASH_SHA256 4
+#define AFF4_HASH_ALL    (AFF4_HASH_MD5 | AFF4_HASH_SHA1 | AFF4_HASH_SHA256)
+
+#define AFF4_NUMBER_OF_HASHES 3
 
 /** The Image Stream represents an Image in chunks */
 CLASS(AFF4Image, FileLikeObject)
 /* This is the volume where the image is stored */
   RDFURN stored;
 
-  /* Chunks are cached here for faster randoom reading performance.
+  /* Decompressed chunks are cached here for faster random reading
+     performance. The cache is keyed by chunk number and expires the
+     least recently used chunks once chunk_cache_size bytes are held.
   */
   Cache chunk_cache;
+  uint64_t chunk_cache_size;
+
+  /* Parsed bevy indexes are kept resident here, keyed by bevy
+     number, so we do not need to reopen and reparse the index segment
+     for every chunk we read.
+  */
+  Cache bevy_index_cache;
+
+  /* Statistics about the effectiveness of the chunk cache. */
+  uint64_t chunk_cache_hits;
+  uint64_t chunk_cache_misses;
+
+  /* The size of the image stream. This is maintained while writing
+     and resolved from AFF4_SIZE when reading.
+  */
+  uint64_t size;
+
+  /* When reads follow a constant stride (e.g. sequential reads) we
+     decompress the following chunks on the thread pool before they
+     are asked for. read_ahead is the largest window in chunks - set
+     it before calling finish() or through CONFIG_READ_AHEAD. A
+     negative value disables read ahead. The current window grows
+     while the stride holds and collapses when access turns random.
+  */
+  int read_ahead;
+  int read_ahead_window;
+  int64_t read_stride;
+  uint64_t last_chunk_read;
+  uint64_t read_ahead_scheduled;
+
+  /* Prefetch jobs which have been scheduled but not yet completed
+     and a condition signalled as each one completes.
+  */
+  struct list_head prefetch_jobs;
+  pthread_cond_t prefetch_done;
 
   /* Thats the current worker we are using - when it gets full, we
      simply dump its bevy and take a new worker here.
   */
   struct ImageWorker_t *current;
 
-  /* The thread pool that will be used to compress bevies. */
+  /* The thread pool that will be used to compress bevies, or the
+     shared read pool once a reader needs it.
+  */
   ThreadPool thread_pool;
 
   /** Some parameters about this image */
   int chunk_size;
+
+  /* The id of the codec chunks are compressed with (see
+     aff4_codecs.h) and the codec itself. When writing the level may
+     be set before calling finish() or through
+     CONFIG_COMPRESSION_LEVEL - 0 means the codec's default level.
+  */
   int compression;
+  int compression_level;
+  AFF4Codec codec;
+
   int chunks_in_segment;
   uint32_t bevy_size;
 
   /* The current bevy we are working on. */
   int segment_count;
 
-  EVP_MD_CTX digest;
+  /* Bevies are compressed concurrently but committed to the volume
+     in bevy order, so they are laid out sequentially. Compressed
+     bevies wait on commit_queue until all earlier bevies have been
+     committed - next_bevy_to_commit is the one we are waiting for.
+  */
+  struct list_head commit_queue;
+  int next_bevy_to_commit;
+
+  // Set while a thread is reserving bevies from the queue.
+  int committing;
+
+  /* Set when a bevy could not be compressed, reserved or committed,
+     and never cleared. From then on write() and close() fail with
+     the error in failure, and no more bevies, hashes or stream
+     attributes are written.
+  */
+  int failed;
+  char *failure;
+
+  /* The memory used by bevies while writing is bounded by
+     write_buffer_size bytes - set it before calling finish() or
+     through CONFIG_WRITE_BUFFER_SIZE. Each bevy in flight (compressing
+     or waiting to be committed) is charged for its buffer and its
+     compressed copy, and the bevy being filled for its buffer. Once
+     max_bevies_in_flight are in flight write() blocks until one is
+     committed.
+
+     Bevy buffers are allocated at their full size and reused - spare
+     buffers are kept in free_bevies.
+  */
+  uint64_t write_buffer_size;
+  int max_bevies_in_flight;
+  int bevies_in_flight;
+  pthread_cond_t bevy_committed;
+
+  StringIO *free_bevies;
+  int free_bevy_count;
+
+  // The time (in microseconds) write() spent blocked.
+  uint64_t write_blocked_usec;
+
+  /* Statistics about the time (in microseconds) bevies spent waiting
+     in the commit queue for earlier bevies to finish compressing.
+  */
+  uint64_t reorder_wait_usec;
+  uint64_t reorder_max_wait_usec;
+  uint64_t reordered_bevies;
+
+  /* The number of constant chunks which were written as bevy index
+     entries only.
+  */
+  uint64_t constant_chunks;
+
+  /* When dedup is set (before calling finish() or through
+     CONFIG_DEDUP) chunks whose content was already written to this
+     stream are stored as references to the earlier chunk. The table
+     of chunk digests uses dedup_table_size bytes
+     (CONFIG_DEDUP_TABLE_SIZE) - the least recently seen are forgotten
+     first. A bevy's digests are only added to it once the bevy is
+     committed, so references always point at chunks in the volume.
+  */
+  int dedup;
+  uint64_t dedup_table_size;
+  struct DedupTable *dedup_table;
+  uint64_t duplicate_chunks;
+
+  /* The hashes to compute while writing - a mask of AFF4_HASH_*
+     set before calling finish() or through CONFIG_HASHES (all of
+     them by default). A negative value disables hashing.
+
+     The stream is hashed as bevies are committed (so in stream
+     order) and the digests are stored as aff4:hash on close. Each
+     bevy's segment also gets an aff4:hash of its uncompressed data
+     so bevies can be verified independently.
+  */
+  int hashes;
+  EVP_MD_CTX *digest[AFF4_NUMBER_OF_HASHES];
 
-  /* The number of threads to use in the threadpool. Set this before
-     calling finish().
+  /* The number of threads to use in the threadpool when writing. Set
+     this before calling finish(). Readers share one pool with a
+     thread per core, up to AFF4_MAX_READ_THREADS.
    */
   int thread_count;
 
@@ -37,6 +37,7 @@ typedef  unsigned long int in_addr_t;
 #include <raptor.h>
 #include <setjmp.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 
 #define O_BINARY 0
 #endif
@@ -140,6 +141,10 @@ char *escape_filename_data(void *ctx, XSDString name);
 /* New reference */
 XSDString unescape_filename(void *ctx, const char *filename);
 
+// Unescapes length bytes of filename into buffer (which must be at
+// least as long) and returns the unescaped length.
+int unescape_filename_to(char *buffer, const char *filename, unsigned int length);
+
 TDB_DATA tdb_data_from_string(char *string);
 
 // A helper to access the URN of an object.
@@ -113,6 +113,16 @@ CLASS(FileLikeObject, AFFObject)
      int METHOD(FileLikeObject, write, char *buffer, \
                 unsigned int length);
 
+     /* Like read and write above but at the given offset. These do
+        not use or move the readptr, so many threads can use the same
+        object at once. Classes which can not do this seek first
+        instead.
+     */
+     int METHOD(FileLikeObject, read_at, uint64_t offset, OUT char *buffer, \
+                unsigned int length);
+     int METHOD(FileLikeObject, write_at, uint64_t offset, char *buffer, \
+                unsigned int length);
+
      uint64_t METHOD(FileLikeObject, tell);
 
   // This can be used to get the content of the FileLikeObject in a
@@ -124,14 +134,43 @@ CLASS(FileLikeObject, AFFObject)
   // This method is just like the standard ftruncate call
      int METHOD(FileLikeObject, truncate, uint64_t offset);
 
+  // Returns a pointer to length bytes at offset which stays valid for
+  // as long as we do, without copying them or moving the
+  // readptr. Returns NULL when the data can not be borrowed (e.g. it
+  // is not mapped) - callers should read() it instead.
+     char *METHOD(FileLikeObject, borrow, uint64_t offset, unsigned int length);
+
+  // Tells us how a range will be accessed (one of the AFF4_ACCESS_*
+  // hints below). This is only a hint and may be ignored.
+     void METHOD(FileLikeObject, advise, uint64_t offset, uint64_t length, \
+                 int access);
+
 // This closes the FileLikeObject and also frees it - it is not valid
 // to use the FileLikeObject after calling this (it gets free'd).
 //     DESTRUCTOR int METHOD(FileLikeObject, close);
 END_CLASS
 
-// This file like object is backed by a real disk file:
+#define AFF4_ACCESS_NORMAL 0
+#define AFF4_ACCESS_SEQUENTIAL 1
+#define AFF4_ACCESS_RANDOM 2
+#define AFF4_ACCESS_WILLNEED 3
+
+// This file like object is backed by a real disk file. Reads and
+// writes are done with the global lock released, under the object's
+// own lock. read_at and write_at use pread and pwrite and need no
+// locks at all.
+//
+// Files opened for reading are mapped into memory, so reads are
+// copied from the page cache without system calls and the data can
+// be borrowed. The file must not be truncated while it is mapped.
 CLASS(FileBackedObject, FileLikeObject)
      int fd;
+     AFF4Lock lock;
+
+     // The mapping (NULL if the file is not mapped) and its size. We
+     // fall back to pread for anything past the end of the mapping.
+     char *map;
+     uint64_t map_size;
 END_CLASS
 
 PROXY_CLASS(FileLikeObject);
@@ -167,6 +206,14 @@ CLASS(AFF4Volume, AFFObject)
      DEFAULT(mode) = "r"
   */
      int METHOD(AFF4Volume, load_from, RDFURN fd_urn, char mode);
+
+  /* Parses the graphs (members called information.<format>) holding
+     the statements about subject into the resolver, or all the graphs
+     if subject is NULL. Graphs which were parsed before are skipped
+     but still counted. Returns the number of graphs, or -1 if one of
+     them could not be parsed.
+  */
+     int METHOD(AFF4Volume, load_graphs, RDFURN subject);
 END_CLASS
 
 #endif      /* !AFF4_IO_H_ */
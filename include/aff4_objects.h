@@ -154,6 +154,7 @@ PROXY_CLASS(Image);
 
   /* Definitions related to the zip volume storage. */
 #include "aff4_zip.h"
+#include "aff4_codecs.h"
 #include "aff4_image.h"
 
 // A directory volume implementation - all elements live in a single
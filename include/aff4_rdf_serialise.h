@@ -8,6 +8,32 @@
 
 #include "aff4_rdf.h"
 #include "aff4_io.h"
+#include "aff4_resolver.h"
+
+/* Graphs in the AFF4_BINARY_GRAPH format do not need an RDF parser
+   to load. They are the triples, then the strings they use and then
+   this footer.
+
+   Each triple is the ids of its subject, attribute and value type,
+   the length of the value and then the value as the data store keeps
+   it (see RDFValue.encode()). The ids and lengths are variable length
+   numbers, 7 bits to a byte with the top bit set on all but the last
+   byte. The strings are NULL terminated, and the first one has id 1.
+
+   The footer is little endian, and so are integer values, which are
+   the only values the data store keeps in the byte order of the host.
+*/
+struct RDFBinaryFooter {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t triples;
+  uint64_t triples_size;
+  uint64_t strings;
+  uint64_t strings_size;
+}__attribute__((packed));
+
+#define RDF_BINARY_MAGIC 0x46445242
+#define RDF_BINARY_VERSION 1
 
 /***** Following is an implementation of a serialiser */
 CLASS(RDFSerializer, Object)
@@ -19,17 +45,33 @@ CLASS(RDFSerializer, Object)
      char buff[BUFF_SIZE*2];
      int i;
 
+     /* Binary graphs are written with the strings interned here, and
+        the footer is filled in as we go.
+     */
+     int binary;
+     struct DataStoreStrings strings;
+     struct RDFBinaryFooter footer;
+
      Cache attributes;
      Resolver resolver;
+
+     /* The format is AFF4_BINARY_GRAPH or one raptor can serialize.
+
+        DEFAULT(format) = "turtle";
+     */
      RDFSerializer METHOD(RDFSerializer, Con, char *base_urn, \
-                          FileLikeObject fd, Resolver resolver);
+                          FileLikeObject fd, Resolver resolver, char *format);
      int METHOD(RDFSerializer, serialize_urn, RDFURN urn);
-     int METHOD(RDFSerializer, serialize_statement, Object *iter, RDFURN urn, \
-                RDFURN attribute);
+
+     /* Serializes all the values of the attribute of urn. */
+     int METHOD(RDFSerializer, serialize_statement, RDFURN urn, char *attribute);
      void METHOD(RDFSerializer, set_namespace, char *prefix, char *namespc);
      DESTRUCTOR void METHOD(RDFSerializer, close);
 END_CLASS
 
+/* How many parsed triples are added to the resolver at once. */
+#define RDF_PARSER_BATCH_SIZE 1024
+
 CLASS(RDFParser, Object)
      char message[BUFF_SIZE];
      jmp_buf env;
@@ -39,12 +81,25 @@ CLASS(RDFParser, Object)
 
      Cache member_cache;
      Resolver resolver;
+
+     /* Parsed triples are added to the resolver in batches. Their
+        subjects, attributes and values belong to batch. Subjects
+        usually repeat, so we reuse the last one when they do.
+     */
+     struct ResolverTriple *triples;
+     int triples_count;
+     void *batch;
+     RDFURN subject;
+     char *subject_string;
+
      void METHOD(void *, triples_handler, const raptor_statement *triple);
      void METHOD(void *, message_handler, raptor_locator* locator, \
                  const char *message);
 
 // Parses data stored in fd using the format specified. fd is assumed
 // to contain a base URN specified (or NULL if non specified).
+// Binary graphs (AFF4_BINARY_GRAPH) are added straight to the data
+// store.
      int METHOD(RDFParser, parse, FileLikeObject fd, char *format, char *base);
 RDFParser METHOD(RDFParser, Con, Resolver resolver);
 END_CLASS
@@ -32,6 +32,13 @@
 
 struct SecurityProvider_t;
 
+/* A statement for Resolver.add_triples(). */
+struct ResolverTriple {
+  RDFURN subject;
+  char *attribute;
+  RDFValue value;
+};
+
 /* These are the objects which are stored in the data store */
 CLASS(DataStoreObject, Object)
   char *data;
@@ -43,8 +50,18 @@ CLASS(DataStoreObject, Object)
                          unsigned int length, char *rdf_type);
 END_CLASS
 
+/* A value to add with DataStore.add_values(). */
+struct DataStoreValue {
+  char *uri;
+  char *attribute;
+  DataStoreObject value;
+};
+
 /** The abstract data store. */
 CLASS(DataStore, Object)
+  /* Set once the store is frozen. */
+  int frozen;
+
   /* constructor.
 
      DEFAULT(logger) = NULL;
@@ -67,6 +84,13 @@ CLASS(DataStore, Object)
   void METHOD(DataStore, add, char *uri, char *attribute, \
               DataStoreObject value);
 
+  /* Adds many values, as add() does, under a single lock. Values are
+   * usually about the same uri and attribute as the one before, which
+   * are then only looked up once. The values are stolen.
+   */
+  void METHOD(DataStore, add_values, struct DataStoreValue *values, \
+              int count);
+
   /* Get a borrowed reference to the first object. The DataStore must remain
    * locked as long as the returned object is used.
    */
@@ -81,20 +105,119 @@ CLASS(DataStore, Object)
    * DataStore must be locked for the duration of the iteration.
    */
   DataStoreObject METHOD(DataStore, next, Object *iter);
+
+  /* Makes the store an immutable snapshot. After this, set(), add()
+   * and del() fail, while get(), iter() and next() may be called from
+   * any number of threads without the global lock.
+   */
+  void METHOD(DataStore, freeze);
 END_CLASS
 
 
+/* Strings interned to ids (from 1). The strings are kept one after
+   the other in data, and found with an open addressing table of their
+   ids (0 is an empty slot) which doubles in size as it fills up.
+*/
+struct DataStoreStrings {
+  uint32_t *table;
+  uint32_t table_size;
+
+  // The offset of each string in data and its hash, by id.
+  uint64_t *offsets;
+  uint32_t *hashes;
+  uint32_t count;
+
+  char *data;
+  uint64_t data_size;
+  uint64_t data_allocated;
+};
+
+void DataStoreStrings_init(struct DataStoreStrings *strings);
+void DataStoreStrings_free(struct DataStoreStrings *strings);
+
+/* Returns the id of the string, adding it if we do not have it (0 if
+   we run out of memory).
+*/
+uint32_t DataStoreStrings_intern(struct DataStoreStrings *strings, char *string);
+
+/* The values of an (urn, attribute) pair. The key packs the urn id
+   in the top 32 bits and the attribute id in the bottom (0 is an
+   empty slot). The values are at offset in the store's values, with
+   room for capacity of them and a NULL after the last one.
+*/
+struct DataStoreEntry {
+  uint64_t key;
+  uint64_t offset;
+  uint32_t count;
+  uint32_t capacity;
+};
+
 CLASS(MemoryDataStore, DataStore)
-    int id_counter;
-    Cache urn_db;
-    Cache attribute_db;
-    Cache data_db;
+    struct DataStoreStrings urns;
+    struct DataStoreStrings attributes;
+
+    /* An open addressing table of entries, which doubles in size as
+       it fills up.
+    */
+    struct DataStoreEntry *entries;
+    uint64_t entries_size;
+    uint64_t entries_used;
+
+    /* All the value lists, one after the other. A list which runs out
+       of room is moved to the end with twice the capacity.
+    */
+    DataStoreObject *values;
+    uint64_t values_size;
+    uint64_t values_used;
 END_CLASS
 
 
 DLL_PUBLIC DataStore new_MemoryDataStore(void *ctx);
 
 
+/* The number of hash chains in a new tdb file. */
+#define TDB_DATASTORE_HASH_SIZE 131071
+
+/* The number of (urn, attribute) pairs whose decoded values are kept
+   in memory.
+*/
+#define TDB_DATASTORE_CACHE_SIZE 1024
+
+/** A DataStore kept in a tdb file. The file is mapped, so the
+    metadata does not need to fit in memory, and a later process
+    (or many at once) can open the same file and use it without
+    loading anything.
+
+    Each (urn, attribute) pair is a record keyed by the urn and
+    attribute (separated by a NUL), holding its values one after the
+    other. Values returned by get() and iter() are decoded into a
+    small cache, and stay valid until their attribute is changed or
+    many other attributes are read.
+
+    tdb is not thread safe, so unlike the MemoryDataStore a frozen
+    TDBDataStore is still only read with the global lock held.
+*/
+CLASS(TDBDataStore, DataStore)
+    struct tdb_context *tdb;
+    char *filename;
+
+    /* Decoded values, keyed by the record key. */
+    Cache values;
+
+    /* lock() takes a lock on the whole file so other processes see
+       our changes together. This counts nested locks.
+    */
+    int lock_depth;
+
+    /* Opens (or creates) the file. With mode 'r' the file is opened
+       read only and the store is frozen.
+    */
+    int METHOD(TDBDataStore, open, char *filename, char mode);
+END_CLASS
+
+DLL_PUBLIC DataStore new_TDBDataStore(void *ctx, char *filename, char mode);
+
+
 /** The resolver is at the heart of the AFF4 specification - it is
     responsible for returning objects keyed by attribute from a
     globally unique identifier (URI) and managing the central
@@ -131,6 +254,18 @@ CLASS(Resolver, Object)
        */
        Logger logger;
 
+       /* The mode we were made with (RESOLVER_MODE_*). */
+       int mode;
+
+       /* Volumes with graphs which have not been parsed yet (see
+          defer_graphs()), keyed by their URN.
+       */
+       Cache lazy_volumes;
+
+       /* Set while the lazy volumes parse their graphs, since
+          parsing may come back to us. */
+       int loading_graphs;
+
        /*
          Main constructor for the resolver. Mode can be set to turn on
          various options, mainly for developement.
@@ -226,6 +361,16 @@ CLASS(Resolver, Object)
        int METHOD(Resolver, add, \
                   RDFURN uri, char *attribute, RDFValue value);
 
+       /* Adds many statements at once, as add() would one at a
+          time. The values are encoded and then added to the data
+          store together, so bulk imports do not pay for the locking
+          and lookups of each statement. If any of them can not be
+          encoded nothing is added, and the error names the triple.
+          Returns 0 on error.
+       */
+       int METHOD(Resolver, add_triples, struct ResolverTriple *triples, \
+                  int count);
+
        /** This function is used to register a new RDFValue class with
            the RDF subsystem. It can then be serialised, and parsed.
 
@@ -274,6 +419,25 @@ CLASS(Resolver, Object)
        */
        int METHOD(Resolver, load, RDFURN uri);
 
+       /* Called by volumes instead of parsing all their graphs when
+          they are opened. All of the volume's graphs are parsed
+          (with load_graphs()) the first time we set, resolve or open
+          anything. With RESOLVER_MODE_LAZY_GRAPHS only the graphs
+          about the subject are parsed, and the rest when a lookup
+          (other than of configuration) about a subject without
+          graphs of its own misses. Either way this only happens
+          while the volume remains in the read cache.
+       */
+       void METHOD(Resolver, defer_graphs, RDFURN volume);
+
+       /* Freezes the metadata once all the volumes we need have been
+          loaded read only. The data store becomes an immutable
+          snapshot which threads may query (through the store's get(),
+          iter() and next() methods) without the global lock. Setting
+          or adding values after this fails.
+       */
+       void METHOD(Resolver, freeze);
+
        /** A generic interface to the logger allows any code to send
            messages to the provided logger.
        */
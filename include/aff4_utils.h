@@ -14,6 +14,7 @@
 #include "class.h"
 #include "tdb.h"
 #include "list.h"
+#include <stdint.h>
 
 
 /* Thread control within the AFF4 library:
@@ -53,9 +54,37 @@
    attention to memory ownership to ensure another thread does not
    free an object currently in use by the blocked thread - use the
    resolver's manage/own/cache_return semantics to ensure that.
+
+   5 Objects whose state must stay consistent while the global lock
+     is released (e.g. a file offset across a read system call) carry
+     their own AFF4Lock. An AFF4Lock has its own mutex, so it can be
+     taken with or without the global lock, and a thread holding the
+     global lock releases it while it waits, so it can never deadlock
+     against the global lock. Code which only touches the object
+     (e.g. reading a FileBackedObject) therefore needs no global lock
+     at all. When
+     more than one is needed they must be taken in the order
+     volume, then member/stream, then backing file - e.g. a
+     ZipSegment locks itself, then its ZipFile, then the
+     FileBackedObject underneath. Positioned reads and writes
+     (read_at/write_at) do not use a file offset, so most of them
+     need no object lock at all. The resolver and the talloc tree do
+     not have their own locks - they are only ever touched with the
+     global lock held, and no resolver method releases it.
+
+   With this, independent streams (e.g. images in different volumes)
+   do their I/O and compression concurrently and only serialise on
+   the short bookkeeping sections which need the global lock. The
+   error state (see aff4_errors.h) is kept per thread.
+
+   Evidence which is only read can go further. Once the volumes are
+   loaded, Resolver.freeze() makes the metadata an immutable snapshot
+   which is queried without the global lock, and members of volumes
+   opened for reading are read without any lock once loaded.
  */
 CLASS(AFF4GlobalLock, Object)
    pthread_mutex_t mutex;
+   /* The thread holding the lock (0 when nobody does). */
    pthread_t current_thread;
    /* The recursiveness of this lock. */
    int depth;
@@ -65,18 +94,47 @@ CLASS(AFF4GlobalLock, Object)
    void METHOD(AFF4GlobalLock, unlock, int times);
    int METHOD(AFF4GlobalLock, timedwait, pthread_cond_t *condition, int timeout);
 
+   /* Waits on the condition with the lock completely released. */
+   void METHOD(AFF4GlobalLock, wait, pthread_cond_t *condition);
+
    int METHOD(AFF4GlobalLock, allow_threads);
 END_CLASS
 
 extern AFF4GlobalLock aff4_gl_lock;
 
+/** A recursive lock protecting a single object (or volume) while
+    the global lock is released. See rule 5 above.
+*/
+CLASS(AFF4Lock, Object)
+   pthread_mutex_t mutex;
+   pthread_cond_t released;
+   pthread_t owner;
+   int depth;
+
+   /* How often a thread had to wait for this lock, and for how
+      long in total. */
+   uint64_t contended;
+   uint64_t wait_usec;
+
+   AFF4Lock METHOD(AFF4Lock, Con);
+
+   /* Blocks (with the global lock released) until no other thread
+      holds this lock. */
+   void METHOD(AFF4Lock, acquire);
+
+   /* Only the thread holding the lock may release it. Anyone else
+      gets an EProgrammingError and 0, and the lock stays held. */
+   int METHOD(AFF4Lock, release);
+END_CLASS
+
    /* Use these on entry and exit from each function. */
 #define AFF4_GL_LOCK CALL(aff4_gl_lock, lock, 1);
 #define AFF4_GL_UNLOCK CALL(aff4_gl_lock, unlock, 1);
 
    /* Use these when it is safe to allow other threads to run
       concurrently. Code between the begin and end macro must not
-      allocate any AFF4 memory or access any AFF4 objects.
+      allocate any AFF4 memory or access any AFF4 objects. They do
+      nothing if the calling thread does not hold the lock.
    */
 #define AFF4_BEGIN_ALLOW_THREADS {int _depth = CALL(aff4_gl_lock, allow_threads);
 #define AFF4_END_ALLOW_THREADS   CALL(aff4_gl_lock, lock, _depth); };
@@ -162,6 +220,11 @@ PRIVATE CLASS(Cache, Object)
      int hash_table_width;
      Cache *hash_table;
 
+     /* Set by freeze(). A frozen cache can not be changed, and may be
+        read from many threads without the global lock.
+     */
+     int frozen;
+
      /* These functions can be tuned to manage the hash table. The
         default implementation assumes key is a null terminated
         string.
@@ -205,6 +268,13 @@ PRIVATE CLASS(Cache, Object)
      BORROWED Object METHOD(Cache, iter, char *key, int len);
      BORROWED Object METHOD(Cache, next, Object *iter);
 
+     /* Makes the cache immutable. After this put() and get() fail,
+        and borrow(), present(), iter() and next() do not take the
+        global lock or change the order of the cache, so they are
+        safe to call concurrently.
+     */
+     void METHOD(Cache, freeze);
+
      int METHOD(Cache, print_cache);
 END_CLASS
 
@@ -236,29 +306,88 @@ extern Logger AFF4_LOGGER;
 
 #include "queue.h"
 
-/* A generic thread pool implementation. */
+/* A generic thread pool implementation.
+
+   Each worker has its own deque of jobs, guarded by its own mutex
+   rather than the global lock. Jobs scheduled from outside the pool
+   go through a bounded Queue, which is what makes schedule() wait
+   when the pool is busy, and a worker scheduling a job puts it on
+   its own deque. Workers take their own newest job first (it is most
+   likely still in cache), then the oldest job from the queue and,
+   when both run out, steal the oldest job of the busiest
+   worker. Idle workers sleep on a
+   condition variable, so new jobs and join() are noticed straight
+   away. Only running a job takes the global lock.
+
+   The job is also the handle for its result. Once it has run, its
+   complete() method is called on the thread which scheduled it, in
+   the order the jobs were scheduled, when that thread calls
+   ThreadPool.complete(), wait() or join(). The pool frees the job
+   after that - so results should be collected in complete().
+*/
+enum ThreadPoolJob_state {
+  JOB_QUEUED,
+  JOB_RUNNING,
+  JOB_DONE
+};
+
 CLASS(ThreadPoolJob, Object)
   /* The thread which is running this job. */
   pthread_t thread_id;
 
+  /* The thread which scheduled the job - complete() is run there. */
+  pthread_t owner;
+
+  enum ThreadPoolJob_state state;
+
+  /* The job is on a worker's deque through list while it is queued,
+     and on its owner's list of incomplete jobs through pending until
+     it is completed.
+  */
+  struct list_head list;
+  struct list_head pending;
+
   /* This actual function will be run in another thread. */
   void METHOD(ThreadPoolJob, run);
 
-  /* This function will be run in the main thread when the pool calls
-     complete().
+  /* This function will be run in the scheduling thread after run()
+     has finished. Its return value is returned by ThreadPool.wait().
   */
   int METHOD(ThreadPoolJob, complete);
 END_CLASS
 
 
+struct ThreadPoolWorker_t;
 struct Queue_t;
 
 CLASS(ThreadPool, Object)
-    struct Queue_t *jobs;
-    struct Queue_t *completed_jobs;
-
+    struct ThreadPoolWorker_t *workers;
     int number_of_threads;
-    pthread_t *threads;
+
+    /* Each thread which schedules jobs has a list of the ones it has
+       not completed yet, in the order it scheduled them, so it never
+       looks at other threads' jobs. Guarded by the global lock.
+    */
+    struct list_head owners;
+
+    /* Jobs scheduled from outside the pool wait here until a worker
+       takes them. It has a slot per worker and schedule() blocks when
+       they are all full.
+    */
+    struct Queue_t *injection;
+
+    /* The number of jobs waiting on the queue and the deques. */
+    int queued;
+
+    /* Idle workers wait for work under this mutex. job_done is
+       signalled with the global lock held.
+    */
+    pthread_mutex_t lock;
+    pthread_cond_t work_available;
+    pthread_cond_t job_done;
+
+    // The number of jobs workers took from another worker's deque.
+    uint64_t jobs_stolen;
 
     // This can be set to False to cause all workers to quit.
     int active;
@@ -266,17 +395,33 @@ CLASS(ThreadPool, Object)
     ThreadPool METHOD(ThreadPool, Con, int number);
 
     /* Schedule the job on the thread pool. Timeout is the number of
-       seconds we are prepared to wait to be scheduled.  Returns value
-       is 1 for success and 0 for failure to schedule the task.
+       seconds we are prepared to wait to be scheduled. Returns the
+       job, which now belongs to the pool, or NULL if it could not be
+       scheduled (in which case the caller still owns it).
     */
-    int METHOD(ThreadPool, schedule, ThreadPoolJob job, int timeout);
+    ThreadPoolJob METHOD(ThreadPool, schedule, ThreadPoolJob job, int timeout);
 
-    /* Can be called regularly by the main thread to complete
-       any outstanding threads.
+    /* Removes a job which has not started running from the pool. The
+       job is stolen to ctx. Returns 1 if the job was cancelled and 0
+       if it is already running or done.
+    */
+    int METHOD(ThreadPool, cancel, void *ctx, ThreadPoolJob job);
+
+    /* Waits for the job to finish and completes it (along with any of
+       our jobs scheduled before it). Returns the result of the job's
+       complete() method.
+    */
+    int METHOD(ThreadPool, wait, ThreadPoolJob job);
+
+    /* Can be called regularly by the scheduling thread to complete
+       its jobs which have finished. Returns the number of jobs
+       completed.
     */
     int METHOD(ThreadPool, complete);
 
-    /* Terminate and Join all the workers. */
+    /* Terminate and Join all the workers. The calling thread's jobs
+       are completed - jobs owned by other threads are just freed.
+    */
     void METHOD(ThreadPool, join);
 
 END_CLASS
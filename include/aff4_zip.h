@@ -58,6 +58,15 @@ struct ZipFileHeader {
 }__attribute__((packed));
 
 
+/* Follows the data of members written with flag 0x08. */
+struct ZipDataDescriptor {
+  uint32_t magic;
+  uint32_t crc32;
+  uint32_t compress_size;
+  uint32_t file_size;
+}__attribute__((packed));
+
+
 struct Zip64EndCD {
   uint32_t magic;
   uint64_t size_of_header;
@@ -80,6 +89,40 @@ struct Zip64CDLocator {
 }__attribute__((packed));
 
 
+/* A member of a read only volume. The directory keeps these sorted by
+   name, and the member index stores them just like that so it can be
+   used without any parsing.
+*/
+struct ZipDirectoryEntry {
+  struct CDFileHeader cd;
+  uint64_t offset_of_file_header;
+  // Where the (NULL terminated) name is in the directory names.
+  uint64_t name_offset;
+}__attribute__((packed));
+
+
+/* The member index is a zip member written just before the central
+   directory: the sorted entries, their names and then this footer.
+*/
+struct ZipIndexFooter {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t entries;
+  uint64_t names_size;
+  // The directory we were written with, so we know we are current.
+  uint64_t offset_of_cd;
+}__attribute__((packed));
+
+#define ZIP_INDEX_MAGIC 0x58444e49
+#define ZIP_INDEX_VERSION 1
+#define ZIP_INDEX_NAME "__member_index__"
+
+/* Volumes with at least this many members get a member index by
+   default.
+*/
+#define ZIP_INDEX_THRESHOLD 1024
+
+
 struct ZipFile_t;
 
 
@@ -93,6 +136,12 @@ CLASS(ZipSegment, FileLikeObject)
   int compression_method;
   time_t timestamp;
 
+  /* Members which grow larger than this are streamed to the volume
+     as they are written (0 streams from the first write). This can
+     be changed up to the first write.
+  */
+  uint64_t stream_threshold;
+
   z_stream strm;
   uint64_t offset_of_file_header;
   XSDString filename;
@@ -101,9 +150,62 @@ CLASS(ZipSegment, FileLikeObject)
    * closed.
    *
    * Note that in AFF4 we assume segments are not too large so we can cache them
-   *  in memory.
+   *  in memory. Once a segment passes stream_threshold it is streaming
+   *  instead (if no other segment is): the local header is written
+   *  immediately and the buffer only holds compressed data until the
+   *  end of each write.
    */
   StringIO buffer;
+
+  /* Set while we stream to the volume (see
+     ZipFile.streaming_segment).
+  */
+  int streaming;
+
+  /* Links us into ZipFile.deferred_members if we were closed while
+     another member was streaming.
+  */
+  struct list_head deferred;
+
+  /* Where our data starts in the volume (0 until we check the file
+     header). Stored segments are not loaded into the buffer, we read
+     them from here instead.
+  */
+  uint64_t data_offset;
+
+  /* Set once room is reserved for our data (see reserve()). Our next
+     write goes to write_offset, and the room ends at reserved_end.
+  */
+  int reserved;
+  uint64_t write_offset;
+  uint64_t reserved_end;
+
+  /* Our data borrowed from the volume's mapping, if it is mapped. */
+  char *mapped;
+
+  /* Held while the segment is loaded from the volume. */
+  AFF4Lock lock;
+
+  /* Set for members of read only volumes. Once their buffer is
+     loaded it never changes, so it is read without any locks.
+  */
+  int frozen;
+
+  /* Reserves room in the volume for length bytes of our (compressed)
+     data, before the first write. The local header is written
+     straight away and our data goes into the reserved range with
+     write_at, so members can be written concurrently without holding
+     the volume lock. Writing more than length bytes is an error -
+     anything less leaves the rest of the range unused.
+  */
+  int METHOD(ZipSegment, reserve, uint64_t length);
+
+  /* Gives up on a member which is being written. It is removed from
+     the volume so it never appears in the central directory, and any
+     room it already took in the volume is left unused. The segment
+     must not be used afterwards.
+  */
+  void METHOD(ZipSegment, discard);
 END_CLASS
 
 
@@ -123,8 +225,49 @@ CLASS(ZipFile, AFF4Volume)
 
     /* The file we are stored on. */
     FileLikeObject backing_store;
+
+    /* Held while members are appended to the backing store, since
+       the global lock may be released in between writes. Members
+       with a reservation only hold it to make the reservation, and
+       members are read with read_at so readers do not need it. */
+    AFF4Lock lock;
+
+    /* The segment which is streaming to the volume. Nothing else is
+       appended in the middle of its data: members closed in the
+       meantime wait on deferred_members and are appended when it is
+       closed, and reservations are refused. Neither holds the lock
+       for longer than one call, so it may be closed from any thread.
+    */
+    ZipSegment streaming_segment;
+    struct list_head deferred_members;
+
+    /* Volumes opened for reading never change their members, so we
+       keep them sorted by filename to find them with a binary
+       search. Segments are only made for the members which are
+       opened. This is NULL for writable volumes.
+    */
+    struct ZipDirectoryEntry *directory;
+    char *directory_names;
+    ZipSegment *directory_segments;
+    uint64_t directory_size;
+
+    /* Set when the directory came from the member index. */
+    int directory_from_index;
+
+    /* Which directory entries were parsed as graphs. */
+    char *graphs_loaded;
+
+    /* We write a member index when we are closed with at least this
+       many members (0 never writes one). Reopening the volume then
+       does not need to parse the central directory. This can be
+       changed before we are closed.
+    */
+    uint64_t index_threshold;
 END_CLASS
 
 #define ZIP_STORED 0
 #define ZIP_DEFLATE 8
+
+/* The default ZipSegment stream_threshold */
+#define ZIP_STREAM_THRESHOLD (4 * 1024 * 1024)
 #endif   /* __ZIP_H */
@@ -1,47 +1,76 @@
 #ifndef   	AFF4_QUEUE_H
 # define   	AFF4_QUEUE_H
 
-/** This is an implementation of a queue */
+/** This is an implementation of a bounded multi-producer,
+    multi-consumer queue.
+
+    The queue is a ring of preallocated slots. Each slot carries a
+    sequence number which tells producers and consumers whether it is
+    free or full for their position, and positions are claimed with
+    an atomic compare and swap. Putting and getting therefore never
+    allocates memory and never takes the global lock - the queue does
+    not own the objects which pass through it.
+
+    Threads which have to wait (for an item, or for a free slot)
+    sleep on an event count which is bumped by every put and get
+    (using a futex where available), so nobody polls. If the caller
+    holds the global lock it is released while it waits.
+*/
 #include "aff4_utils.h"
 #include <pthread.h>
-#include "list.h"
+#include <stdint.h>
 
-typedef struct QueueItem_t {
-  struct list_head list;
+struct QueueSlot {
+  uint64_t sequence;
   void *data;
-} *QueueItem;
+};
 
 CLASS(Queue, Object)
-     /* A list of QueueItem waiting to be fetched. */
-     struct list_head items;
-
-     // This condition variable is waited on for clients which want to
-     // get Queue objects
+     /* The ring of maxsize slots. */
+     struct QueueSlot *slots;
      int maxsize;
-     int queue_size;
 
-     pthread_cond_t not_empty;
-     pthread_cond_t not_full;
-     pthread_cond_t all_tasks_done;
+     /* The positions of the next put and the next get. These are
+        padded onto their own cache lines since producers and
+        consumers hammer them from different cores.
+     */
+     char pad1[64];
+     uint64_t put_position;
+     char pad2[64];
+     uint64_t get_position;
+     char pad3[64];
+
+     /* Event counts bumped after each put and get. Waiters sleep
+        until the count changes from the value they saw.
+     */
+     uint32_t puts;
+     uint32_t gets;
+
+     /* The number of threads sleeping on either event. */
+     int waiters;
+
+#ifndef __linux__
+     pthread_mutex_t event_mutex;
+     pthread_cond_t event;
+#endif
 
+     /* maxsize is the number of slots (at least two) - put() blocks
+        when they are all full.
+     */
      Queue METHOD(Queue, Con, int maxsize);
 
      /* Gets the first object in the queue - or blocks until an object
-        appears on the queue. The object is stolen to belong to the
-        new context. If timeout is exceeded, returns NULL. Timeout is
-        given in microseconds.
+        appears on the queue. If timeout is exceeded, returns
+        NULL. Timeout is given in microseconds.
      */
      void *METHOD(Queue, get, int timeout);
 
      /* Add a new object to the end of the queue. Returns 1 for
         success and 0 for timeout exceeded. Timeout is given in
-        microseconds.
+        microseconds. The queue does not take ownership of the data.
      */
      int METHOD(Queue, put, void *data, int timeout);
 
-     // Remove data from the queue (wherever it is)
-     void *METHOD(Queue, remove, void *ctx, void *data);
-
      // Blocks until all items in the queue were removed.
      void METHOD(Queue, join);
 END_CLASS
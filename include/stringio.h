@@ -48,6 +48,10 @@ CLASS(StringIO,Object)
   /** Truncates the end of the stream to this size */
   void METHOD(StringIO, truncate, int len);
 
+  /** Allocates enough memory to hold len bytes so writes up to that
+      size do not need to reallocate the buffer */
+  void METHOD(StringIO, reserve, unsigned int len);
+
   /** Removes the first len bytes from the start of the stream. The
       stream is repositioned at its start */
   void METHOD(StringIO, skip, int len);
@@ -2,9 +2,14 @@
 */
 #include "aff4_internal.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /*************************************************************
   The Image stream works by collecting chunks into segments. Chunks
-  are compressed seperately using zlib's compress function.
+  are compressed seperately using the codec selected by
+  aff4:compression (see aff4_codecs.h).
 
   Defined attributes:
 
@@ -14,6 +19,7 @@
   aff4:stored              The URN of the object which stores this
                            stream - This must be a "volume" object
   aff4:size                The size of this stream in bytes (0)
+  aff4:compression         The id of the chunk codec (0 - stored)
 
   Note that bevies are segment objects with an implied URN of:
 
@@ -23,6 +29,61 @@
 This implementation uses threads to compress bevies concurrently. We
 also maintain a chunk cache for faster read access.
 
+Compressed bevies are held in memory until all the bevies before them
+have room reserved in the volume, so bevies are laid out in order no
+matter which thread finishes first. The time bevies spend waiting for
+their turn is recorded in reorder_wait_usec. Reserving only holds the
+volume lock while the member headers are written, and the bevies are
+then copied into their room concurrently (see ZipSegment.reserve).
+
+The memory held by bevies in flight is bounded by write_buffer_size.
+When the budget is used up write() blocks until a bevy is committed
+(write_blocked_usec records for how long), and bevy buffers are
+allocated at their full size once and reused.
+
+The committing thread also feeds each bevy into the stream hashes
+(MD5, SHA1 and SHA256 by default), so the image is hashed in stream
+order while it is written rather than by reading it back. The hashes
+are stored as aff4:hash on close. Each bevy segment also gets an
+aff4:hash of its uncompressed data, computed by the compression
+workers.
+
+When reading we keep two caches:
+
+  - A cache of decompressed chunks keyed by chunk number. This is an
+    LRU cache bounded by chunk_cache_size bytes, so hot chunks (e.g. a
+    filesystem's metadata) stay resident across random reads.
+
+  - A cache of parsed bevy indexes keyed by bevy number. This means we
+    only open and parse the idx segment once per bevy rather than once
+    per chunk read.
+
+Both caches are flushed when the stream is finished, and the entries
+for a bevy are invalidated when the bevy is rewritten.
+
+When reads follow a constant stride we also decompress the following
+chunks into the chunk cache on the thread pool (read ahead), so
+sequential readers are not limited to a single inflate core.
+
+Large reads covering several whole chunks are fanned out across the
+thread pool, each job decompressing straight into its slice of the
+caller's buffer.
+
+Each bevy has an index (the idx member) giving the offset, compressed
+length and flags of every chunk (see BevyIndexEntry), so readers do a
+single exact sized read for each chunk. Chunks which do not compress
+are stored uncompressed.
+
+Chunks filled with a single byte value (typically zeros on a wiped
+disk) are not compressed or stored at all - their index entry is
+flagged AFF4_CHUNK_CONSTANT and readers recreate them with memset().
+
+In dedup mode each chunk's SHA256 is looked up in a table of fixed
+size holding the chunks already committed to the stream, and in the
+chunks already stored by its own bevy. Repeats are flagged
+AFF4_CHUNK_REFERENCE with the original chunk id in the index, and
+readers follow the reference.
+
 **************************************************************/
 
 /** This class is used by the image worker thread to dump the segments
@@ -37,311 +98,1957 @@ PRIVATE CLASS(ImageWorker, ThreadPoolJob)
      // we compress it all and dump it to the output file.
      StringIO bevy;
 
+     // The compressed bevy and its index are built here and wait in
+     // the image's commit_queue until it is our turn to be written.
+     StringIO segment_data;
+     StringIO index_data;
+     struct list_head list;
+
+     // The members of the bevy and its index. They are reserved in
+     // the volume in bevy order and then written concurrently.
+     ZipFile zip;
+     RDFURN bevy_urn;
+     ZipSegment segment;
+     ZipSegment index_segment;
+
+     // When we finished compressing (to measure the reorder wait).
+     struct timeval compressed;
+
+     // The digests of the chunks this bevy stored, which are added to
+     // the image's dedup table once the bevy is committed.
+     struct DedupTable *new_digests;
+
+     // The hash of the uncompressed bevy (-1 if not hashed).
+     int bevy_hash;
+     unsigned char bevy_digest[EVP_MAX_MD_SIZE];
+     unsigned int bevy_digest_length;
+
      ImageWorker METHOD(ImageWorker, Con, AFF4Image parent, int segment_count);
 
      // A write method for the worker
      int METHOD(ImageWorker, close);
 END_CLASS
 
+/** A bevy index. These are kept resident in the image's
+    bevy_index_cache so the idx segment is only opened once per bevy.
+*/
+PRIVATE CLASS(BevyIndex, Object)
+     int bevy_number;
+
+     // The bevy segment and its index. These are owned by the volume
+     // - we only hold references to them.
+     FileLikeObject segment;
+     FileLikeObject index_segment;
+
+     // The index version (1 or 2).
+     int version;
+
+     // The entries for each chunk. Version 2 entries are read from
+     // the index segment as they are needed, and loaded marks the
+     // ones we have. Version 1 indexes are converted when we open
+     // them.
+     struct BevyIndexEntry *entries;
+     char *loaded;
+     int number_of_chunks;
+
+     BevyIndex METHOD(BevyIndex, Con, AFF4Image image, int bevy_number);
+END_CLASS
+
+enum prefetch_state {
+  PREFETCH_QUEUED,
+  PREFETCH_RUNNING
+};
+
+/** A job which decompresses a single chunk into the chunk cache ahead
+    of the reader. These are scheduled on the image's thread pool when
+    read ahead is active.
+*/
+PRIVATE CLASS(ChunkPrefetcher, ThreadPoolJob)
+     AFF4Image image;
+     uint64_t chunk_id;
+     enum prefetch_state state;
+
+     // We stay on the image's prefetch_jobs list until we complete.
+     struct list_head list;
+
+     ChunkPrefetcher METHOD(ChunkPrefetcher, Con, AFF4Image image, uint64_t chunk_id);
+END_CLASS
+
+/** Tracks the chunks of a single large read which are being
+    decompressed in parallel.
+*/
+PRIVATE CLASS(ParallelRead, Object)
+     // The number of chunk jobs which have not completed yet.
+     int outstanding;
+
+     // Set if any chunk failed to decompress.
+     int error;
+
+     // The end of the data we read. This is pulled back if we hit the
+     // end of the stream.
+     uint64_t end;
+
+     // Signalled as each chunk completes.
+     pthread_cond_t done;
+
+     ParallelRead METHOD(ParallelRead, Con, uint64_t end);
+END_CLASS
+
+/** A job which decompresses one chunk of a ParallelRead directly into
+    the caller's buffer.
+*/
+PRIVATE CLASS(ChunkDecompressor, ThreadPoolJob)
+     AFF4Image image;
+     ParallelRead request;
+     uint64_t chunk_id;
+
+     // Where the chunk should be decompressed to. This is chunk_size
+     // long.
+     char *target;
+
+     ChunkDecompressor METHOD(ChunkDecompressor, Con, AFF4Image image, \
+                              ParallelRead request, uint64_t chunk_id, \
+                              char *target);
+END_CLASS
+
+
+/* Returns a bevy buffer for a new worker, reusing a spare one if we
+   have it.
+*/
+static StringIO get_bevy_buffer(AFF4Image image, void *ctx) {
+  StringIO result;
+
+  if(image->free_bevy_count > 0) {
+    result = image->free_bevies[--image->free_bevy_count];
+    talloc_steal(ctx, result);
+  } else {
+    result = CONSTRUCT(StringIO, StringIO, Con, ctx);
+    CALL(result, reserve, image->bevy_size);
+  };
+
+  return result;
+};
+
+/* Keeps the buffer for the next worker. */
+static void release_bevy_buffer(AFF4Image image, StringIO buffer) {
+  if(image->free_bevy_count <= image->max_bevies_in_flight) {
+    CALL(buffer, truncate, 0);
+    image->free_bevies[image->free_bevy_count++] = buffer;
+    talloc_steal(image, buffer);
+  } else {
+    talloc_free(buffer);
+  };
+};
+
 
 static ImageWorker ImageWorker_Con(ImageWorker self, AFF4Image parent, int segment_count) {
   self->image = parent;
   self->segment_count = segment_count;
 
-  self->bevy = CONSTRUCT(StringIO, StringIO, Con, self);
+  self->bevy = get_bevy_buffer(parent, self);
+  self->bevy_hash = -1;
+  INIT_LIST_HEAD(&self->list);
 
   return self;
 };
 
 
-static void ImageWorker_run(ThreadPoolJob this) {
-  ImageWorker self = (ImageWorker) this;
-  RDFURN bevy_urn = CALL(URNOF(self->image), copy, self);
-  ZipFile zip;
-  FileLikeObject segment, index_segment;
-  Resolver resolver = ((AFFObject)(self->image))->resolver;
-  uint32_t chunk_offset = 0;
-  uint32_t compressed_offset = 0;
+/* Converts a version 1 index (an array of uint32_t offsets) into
+   entries. The length of each chunk is implied by the next chunk's
+   offset or the end of the segment. Every bit of the offsets is
+   significant - constant and duplicate chunks only exist in version 2
+   indexes.
+*/
+static int load_v1_index(BevyIndex self, AFF4Image image) {
+  uint32_t *offsets = talloc_array(self, uint32_t, image->chunks_in_segment);
+  uint64_t next_offset = CALL(self->segment, seek, 0, SEEK_END);
+  int length, i;
 
-  CALL(bevy_urn, add, talloc_asprintf(bevy_urn, "%08X", self->segment_count));
+  length = CALL(self->index_segment, read_at, 0, (char *)offsets,
+                image->chunks_in_segment * sizeof(uint32_t));
+  if(length < 0)
+    return 0;
 
-  /* First open the segment so we can write on it. */
-  zip = (ZipFile)CALL(resolver, own, self->image->stored, 'w');
-  segment = (FileLikeObject)CALL((AFF4Volume)zip, open_member, bevy_urn, 'w', ZIP_STORED);
+  self->number_of_chunks = length / sizeof(uint32_t);
+  self->entries = talloc_zero_array(self, struct BevyIndexEntry,
+                                    self->number_of_chunks);
 
-  CALL(bevy_urn, add, "idx");
-  index_segment = (FileLikeObject)CALL((AFF4Volume)zip, open_member, bevy_urn, 'w', ZIP_STORED);
+  for(i=self->number_of_chunks - 1; i>=0; i--) {
+    struct BevyIndexEntry *entry = &self->entries[i];
 
-  CALL(resolver, cache_return, (AFFObject)zip);
+    entry->offset = offsets[i];
+    entry->length = next_offset - offsets[i];
+    if(image->codec->id == AFF4_CODEC_STORED)
+      entry->flags = AFF4_CHUNK_STORED;
 
-  /* Now we compress chunks from our bevy into the segment. */
-  while(chunk_offset < self->bevy->size) {
-    uLong length = min(self->image->chunk_size, self->bevy->size - chunk_offset);
+    next_offset = offsets[i];
+  };
 
-    // We just use compress() to get the compressed buffer.
-    uLongf clength = compressBound(self->image->chunk_size);
-    char cbuffer[clength];
-    char buffer[length];
+  talloc_free(offsets);
+  return 1;
+};
 
-    memcpy(buffer, self->bevy->data + chunk_offset, length);
 
-    // Should we offer to store chunks uncompressed?
-    if(self->image->compression == ZIP_STORED) {
-      memcpy(cbuffer, buffer, length);
-      clength = length;
-    } else {
-      int res;
+static BevyIndex BevyIndex_Con(BevyIndex self, AFF4Image image, int bevy_number) {
+  Resolver resolver = ((AFFObject)image)->resolver;
+  RDFURN bevy_urn = CALL(URNOF(image), copy, self);
+  struct BevyIndexHeader header;
+  ZipFile zip;
+  int length;
 
-      /* This can run concurrently. */
-      AFF4_BEGIN_ALLOW_THREADS;
+  self->bevy_number = bevy_number;
+  CALL(bevy_urn, add, talloc_asprintf(bevy_urn, "%08X", bevy_number));
 
-      res = compress2((Bytef *)cbuffer, &clength,
-                      (Bytef *)buffer, (uLong)length, 1);
+  zip = (ZipFile)CALL(resolver, own, image->stored, 'r');
+  if(!zip) {
+    RaiseError(EIOError, "Unable to open volume %s", image->stored->value);
+    goto error;
+  };
 
-      AFF4_END_ALLOW_THREADS;
+  self->segment = CALL((AFF4Volume)zip, open_member, bevy_urn, 'r', 0);
 
-      if(res != Z_OK) {
-	RaiseError(ERuntimeError, "Compression error");
-        goto error;
-      };
+  CALL(bevy_urn, add, "idx");
+  self->index_segment = CALL((AFF4Volume)zip, open_member, bevy_urn, 'r', 0);
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+
+  if(!self->segment || !self->index_segment) {
+    RaiseError(EIOError, "Bevy %d not found", bevy_number);
+    goto error;
+  };
+
+  /* The segments are owned by the volume, but we must make sure they
+     do not disappear while we hold them in the cache.
+  */
+  talloc_reference(self, self->segment);
+  talloc_reference(self, self->index_segment);
+
+  length = CALL(self->index_segment, read_at, 0, (char *)&header, sizeof(header));
+
+  if(length == sizeof(header) && header.magic == AFF4_BEVY_INDEX_MAGIC) {
+    if(header.version != AFF4_BEVY_INDEX_VERSION) {
+      RaiseError(ERuntimeError, "Bevy %d has an unsupported index version %d",
+                 bevy_number, header.version);
+      goto error;
     };
 
-    // Update the index to point at the current segment stream buffer
-    // offset
-    CALL(index_segment, write, (char *)&compressed_offset, sizeof(uint32_t));
-    CALL(segment, write, cbuffer, clength);
+    /* We only need the size of the index to count the chunks. */
+    self->version = 2;
+    self->number_of_chunks = (CALL(self->index_segment, seek, 0, SEEK_END) -
+                              sizeof(header)) / sizeof(struct BevyIndexEntry);
+    self->entries = talloc_array(self, struct BevyIndexEntry, self->number_of_chunks);
+    self->loaded = talloc_zero_array(self, char, self->number_of_chunks);
 
-    compressed_offset += clength;
-    chunk_offset += length;
+  } else {
+    self->version = 1;
+    if(!load_v1_index(self, image))
+      goto error;
   };
 
-  CALL((AFFObject)segment, close);
-  CALL((AFFObject)index_segment, close);
+  return self;
 
  error:
-  return;
+  talloc_free(self);
+  return NULL;
 };
 
 
+/* Returns the index entry for the chunk, reading it from the index
+   segment if needed. Returns NULL on error.
+*/
+static struct BevyIndexEntry *get_index_entry(BevyIndex self, int chunk) {
+  struct BevyIndexEntry *entry = &self->entries[chunk];
+
+  if(self->version == 2 && !self->loaded[chunk]) {
+    uint64_t offset = sizeof(struct BevyIndexHeader) + (uint64_t)chunk * sizeof(*entry);
+    char *stored = CALL(self->index_segment, borrow, offset, sizeof(*entry));
+
+    // Mapped indexes are copied without going through the volume.
+    if(stored) {
+      memcpy(entry, stored, sizeof(*entry));
+
+    } else if(CALL(self->index_segment, read_at, offset, (char *)entry,
+                   sizeof(*entry)) != sizeof(*entry)) {
+      RaiseError(EIOError, "Unable to read index entry %d of bevy %d",
+                 chunk, self->bevy_number);
+      return NULL;
+    };
 
-VIRTUAL(ImageWorker, ThreadPoolJob) {
-  VMETHOD(Con) = ImageWorker_Con;
-  VMETHOD_BASE(ThreadPoolJob, run) = ImageWorker_run;
-} END_VIRTUAL
+    self->loaded[chunk] = 1;
+  };
 
+  return entry;
+};
 
-static int AFF4Image_finish(AFFObject this) {
-  AFF4Image self = (AFF4Image)this;
-  int result;
+VIRTUAL(BevyIndex, Object) {
+  VMETHOD(Con) = BevyIndex_Con;
+} END_VIRTUAL
 
-  AFF4_GL_LOCK;
 
-  /* Update the size of the bevy */
-  self->bevy_size = self->chunk_size * self->chunks_in_segment;
+/* Remove all cached data for this bevy. This is called when a bevy
+   is (re)written so readers do not see stale data.
+*/
+static void invalidate_bevy(AFF4Image self, int bevy_number) {
+  uint64_t chunk_id = (uint64_t)bevy_number * self->chunks_in_segment;
+  int i;
+
+  if(self->bevy_index_cache &&
+     CALL(self->bevy_index_cache, present, (char *)&bevy_number, sizeof(bevy_number))) {
+    talloc_free(CALL(self->bevy_index_cache, get, NULL,
+                     (char *)&bevy_number, sizeof(bevy_number)));
+  };
 
-  switch(this->mode) {
+  if(!self->chunk_cache)
+    return;
 
-  case 'w': {
-    if(!self->stored) {
-      RaiseError(EProgrammingError, "Image has no storage.");
-      goto error;
+  for(i=0; i<self->chunks_in_segment; i++, chunk_id++) {
+    if(CALL(self->chunk_cache, present, (char *)&chunk_id, sizeof(chunk_id))) {
+      talloc_free(CALL(self->chunk_cache, get, NULL,
+                       (char *)&chunk_id, sizeof(chunk_id)));
     };
+  };
+};
 
-    /* Set sensible defaults */
-    if(!self->chunk_size) {
-      self->chunk_size = 32 * 1024;
-    };
 
-    if(!self->compression) {
-      self->compression = ZIP_STORED;
-    };
+/** The table of chunk digests used for deduplication. Its memory is
+    fixed when it is created: each digest maps to a set of DEDUP_WAYS
+    entries kept most recently seen first, and the least recently
+    seen entry of a full set is forgotten. The digests are already
+    uniformly distributed so we index the sets with their leading
+    bytes.
+*/
+#define DEDUP_WAYS 4
+#define DEDUP_DIGEST_SIZE 32
 
-    if(!self->chunks_in_segment) {
-      self->chunks_in_segment = 1024;
-    };
+struct DedupEntry {
+  unsigned char digest[DEDUP_DIGEST_SIZE];
 
-    self->segment_count = 0;
-    self->current = CONSTRUCT(ImageWorker, ImageWorker, Con, self, self, self->segment_count);
+  // The chunk holding this content plus one (0 marks a free entry).
+  uint64_t chunk;
+};
 
-    if(self->thread_count <= 0) {
-      self->thread_count = 1;
-    };
+struct DedupTable {
+  struct DedupEntry *entries;
+  uint64_t sets;
+};
 
-    self->thread_pool = CONSTRUCT(ThreadPool, ThreadPool,
-                                  Con, self, self->thread_count);
+static int DedupTable_destructor(void *this) {
+  struct DedupTable *self = (struct DedupTable *)this;
 
-  }; break;
+  free(self->entries);
+  return 0;
+};
 
-  default:
-    RaiseError(EProgrammingError, "Unknown mode");
-    goto error;
+/* Creates a table using at most size bytes for its entries. */
+static struct DedupTable *new_dedup_table(void *ctx, uint64_t size) {
+  struct DedupTable *result = talloc(ctx, struct DedupTable);
+
+  result->sets = max(1, size / (DEDUP_WAYS * sizeof(struct DedupEntry)));
+  result->entries = calloc(result->sets * DEDUP_WAYS, sizeof(struct DedupEntry));
+  if(!result->entries) {
+    RaiseError(ERuntimeError, "Unable to allocate %llu bytes for the dedup table",
+               (unsigned long long)size);
+    talloc_free(result);
+    return NULL;
   };
 
-  result = SUPER(AFFObject, FileLikeObject, finish);
-  AFF4_GL_UNLOCK;
+  talloc_set_destructor((void *)result, DedupTable_destructor);
   return result;
+};
 
- error:
-  SUPER(AFFObject, FileLikeObject, finish);
-  AFF4_GL_UNLOCK;
-  return 0;
+static struct DedupEntry *dedup_set(struct DedupTable *self, unsigned char *digest) {
+  uint64_t hash;
+
+  memcpy(&hash, digest, sizeof(hash));
+  return self->entries + (hash % self->sets) * DEDUP_WAYS;
 };
 
+/* Returns the chunk holding the content with this digest or -1. */
+static int64_t dedup_lookup(struct DedupTable *self, unsigned char *digest) {
+  struct DedupEntry *set = dedup_set(self, digest);
+  struct DedupEntry found;
+  int i;
 
-static int AFF4Image_write(FileLikeObject this, char *buffer, unsigned int length) {
-  AFF4Image self = (AFF4Image) this;
-  int offset = 0;
+  for(i=0; i<DEDUP_WAYS && set[i].chunk; i++) {
+    if(!memcmp(set[i].digest, digest, DEDUP_DIGEST_SIZE)) {
+      // Move it to the front of its set.
+      found = set[i];
+      memmove(set + 1, set, i * sizeof(*set));
+      set[0] = found;
 
-  AFF4_GL_LOCK;
+      return found.chunk - 1;
+    };
+  };
 
-  do {
-    int need_to_write = length - offset;
-    int availbale_to_write = self->bevy_size - self->current->bevy->size;
+  return -1;
+};
 
-    if(need_to_write <= 0) break;
+static void dedup_insert(struct DedupTable *self, unsigned char *digest, uint64_t chunk) {
+  struct DedupEntry *set = dedup_set(self, digest);
 
-    CALL(self->current->bevy, write, buffer + offset,
-         min(need_to_write, availbale_to_write));
-    offset += availbale_to_write;
+  // The last entry of the set is the least recently seen.
+  memmove(set + 1, set, (DEDUP_WAYS - 1) * sizeof(*set));
+  memcpy(set[0].digest, digest, DEDUP_DIGEST_SIZE);
+  set[0].chunk = chunk + 1;
+};
 
-    if(self->current->bevy->size >= self->bevy_size) {
-      /* Flush the worker to the thread pool and get a new one. */
-      CALL(self->thread_pool, schedule, (ThreadPoolJob)self->current, 60);
+/* Adds the digests of the chunks a bevy stored to the image's table.
+   This is only done once the bevy is committed, so references never
+   point at chunks which did not make it into the volume.
+*/
+static void publish_digests(AFF4Image image, struct DedupTable *digests) {
+  uint64_t i;
 
-      self->segment_count ++;
-      self->current = CONSTRUCT(ImageWorker, ImageWorker, Con, self, self, self->segment_count);
-    };
-  } while(1);
+  if(!digests || !image->dedup_table)
+    return;
 
-  AFF4_GL_UNLOCK;
-  return length;
+  for(i=0; i<digests->sets * DEDUP_WAYS; i++) {
+    if(digests->entries[i].chunk) {
+      dedup_insert(image->dedup_table, digests->entries[i].digest,
+                   digests->entries[i].chunk - 1);
+    };
+  };
 };
 
 
-static int _partial_read(FileLikeObject this, char *buffer, int length) {
-  AFF4Image self = (AFF4Image)this;
-  int segment_number = this->readptr / self->bevy_size;
-  int segment_offset = this->readptr % self->bevy_size;
+/* Returns 1 if every byte of the data is the same, storing that byte
+   in fill. This is called for every chunk written so it is vectorised
+   where possible.
+*/
+static int is_constant_chunk(char *data, int length, unsigned char *fill) {
+  int i = 0;
 
-  /* Find the correct segment */
-  RDFURN bevy = CALL(URNOF(self), copy, NULL);
-  ZipFile zip = (ZipFile)CALL(RESOLVER, own, self->stored, 'r');
-  FileLikeObject segment, index_segment;
-  int availbale_to_read;
+  if(length <= 0)
+    return 0;
+
+  *fill = data[0];
+
+#ifdef __SSE2__
+  {
+    __m128i pattern = _mm_set1_epi8(data[0]);
+
+    for(; i + 64 <= length; i += 64) {
+      __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(data + i)), pattern);
+      __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(data + i + 16)), pattern);
+      __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(data + i + 32)), pattern);
+      __m128i d = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(data + i + 48)), pattern);
 
+      a = _mm_and_si128(_mm_and_si128(a, b), _mm_and_si128(c, d));
+      if(_mm_movemask_epi8(a) != 0xFFFF)
+        return 0;
+    };
+  };
+#endif
 
-  CALL(bevy, add, talloc_asprintf(bevy, "%08X", segment_number));
+  for(; i < length; i++) {
+    if(data[i] != data[0])
+      return 0;
+  };
 
-  segment = CALL((AFF4Volume)zip, open_member, bevy, 'r', 0);
+  return 1;
+};
 
-  CALL(bevy, add, "idx");
-  index_segment = CALL((AFF4Volume)zip, open_member, bevy, 'r', 0);
 
-  CALL(RESOLVER, cache_return, (AFFObject)zip);
+/* The hashes we can compute over the stream (see AFF4_HASH_*). They
+   are listed from the weakest to the strongest.
+*/
+static struct {
+  int flag;
+  char *dataType;
+  const EVP_MD *(*md)(void);
+} image_hashes[AFF4_NUMBER_OF_HASHES] = {
+  {AFF4_HASH_MD5, DATATYPE_MD5, EVP_md5},
+  {AFF4_HASH_SHA1, DATATYPE_SHA1, EVP_sha1},
+  {AFF4_HASH_SHA256, DATATYPE_SHA256, EVP_sha256}
+};
 
-  if(segment && index_segment) {
-    int chunk_number = segment_offset / self->chunk_size;
-    int chunk_offset = segment_offset % self->chunk_size;
-    uint32_t chunk_data_offsets[self->chunks_in_segment];
-    char uncompressed_buffer[self->chunk_size];
-    int read_length;
+/* Makes an aff4:hash value for the digest. */
+static RDFValue digest_value(void *ctx, int hash, unsigned char *digest,
+                             unsigned int length) {
+  XSDString result = (XSDString)new_rdfvalue(ctx, image_hashes[hash].dataType);
+  char hex[EVP_MAX_MD_SIZE * 2 + 1];
+  int i;
 
-    /* Read all the indexes into the chunk_data_offsets array */
-    CALL(index_segment, read, (char *)&chunk_data_offsets,
-         self->chunks_in_segment * sizeof(uint32_t));
-    CALL(segment, seek, chunk_data_offsets[chunk_number], SEEK_SET);
-    switch(self->compression) {
+  for(i=0; i<length; i++) {
+    sprintf(hex + i * 2, "%02x", digest[i]);
+  };
 
-    case ZIP_DEFLATE: {
-      /* Temporary storage for the compressed chunk. Zlib doesnt mind
-         if we read a bit extra and this avoids us having to calculate
-         the size of the chunks.
-      */
-      const Bytef compressed_chunk[self->chunk_size];
-      int res;
+  CALL(result, set, hex, length * 2);
 
-      CALL(segment, read, (char *)compressed_chunk, self->chunk_size);
+  return (RDFValue)result;
+};
 
-      AFF4_BEGIN_ALLOW_THREADS;
+/* Marks the image as failed with the error raised on this thread.
+   Only the first failure is kept. Must be called with the global
+   lock held.
+*/
+static void fail_image(AFF4Image self) {
+  char *error_str = NULL;
 
-      // Try to decompress it:
-      res = uncompress(uncompressed_buffer, &read_length, compressed_chunk,
-                       (uLong)self->chunk_size);
+  if(self->failed)
+    return;
 
-      AFF4_END_ALLOW_THREADS;
+  self->failed = 1;
+  if(!*aff4_get_current_error(&error_str) || !error_str)
+    error_str = "Unknown error";
 
-      if(res != Z_OK ) {
-        RaiseError(ERuntimeError, "Unable to decompress chunk %d", chunk_number);
-        goto error;
-      };
-    }; break;
+  self->failure = talloc_strdup(self, error_str);
+};
 
-    case ZIP_STORED:
-    default: {
-      read_length = CALL(segment, read, uncompressed_buffer, self->chunk_size);
-    }; break;
-    };
+/* Raises the error which failed the image on this thread. */
+static int raise_failure(AFF4Image self) {
+  RaiseError(EIOError, "Writing image %s failed: %s", URNOF(self)->value,
+             self->failure);
+  return -1;
+};
+
+/* Opens a member of the volume for writing and reserves room for
+   length bytes in it.
+*/
+static ZipSegment reserve_member(ZipFile zip, RDFURN urn, uint64_t length) {
+  ZipSegment result = (ZipSegment)CALL((AFF4Volume)zip, open_member, urn, 'w',
+                                       ZIP_STORED);
+
+  if(result && !CALL(result, reserve, length)) {
+    CALL(result, discard);
+    result = NULL;
+  };
+
+  return result;
+};
+
+/* Gives up the members reserved for the bevy, so they do not end up
+   in the volume.
+*/
+static void discard_bevy(ImageWorker self) {
+  Resolver resolver = ((AFFObject)self->image)->resolver;
 
-    /* Now copy the partial buffer. */
-    availbale_to_read = max(read_length - chunk_offset, length);
-    memcpy(buffer, uncompressed_buffer + chunk_offset, availbale_to_read);
+  if(self->segment) {
+    CALL(self->segment, discard);
+    self->segment = NULL;
   };
 
-  if(segment) {
-    CALL((AFFObject)segment, close);
-    talloc_free(segment);
+  if(self->index_segment) {
+    CALL(self->index_segment, discard);
+    self->index_segment = NULL;
   };
 
-  if(index_segment) {
-    CALL((AFFObject)index_segment, close);
-    talloc_free(index_segment);
+  if(self->zip) {
+    CALL(resolver, cache_return, (AFFObject)self->zip);
+    self->zip = NULL;
   };
+};
 
-  talloc_free(bevy);
-  return availbale_to_read;
+/* Reserves the room for a compressed bevy and its index in the
+   volume. This is done in bevy order so bevies are laid out
+   sequentially, but only takes the volume lock for as long as it
+   takes to write the headers.
+*/
+static int reserve_bevy(ImageWorker self) {
+  AFF4Image image = self->image;
+  Resolver resolver = ((AFFObject)image)->resolver;
+  RDFURN index_urn;
+
+  self->bevy_urn = CALL(URNOF(image), copy, self);
+  CALL(self->bevy_urn, add, talloc_asprintf(self->bevy_urn, "%08X",
+                                            self->segment_count));
+
+  self->zip = (ZipFile)CALL(resolver, own, image->stored, 'w');
+  if(!self->zip) {
+    RaiseError(EIOError, "Unable to open volume %s", image->stored->value);
+    goto error;
+  };
+
+  /* Rewriting a bevy supersedes its members, so drop the cached
+     index which still refers to the old ones.
+  */
+  invalidate_bevy(image, self->segment_count);
+
+  self->segment = reserve_member(self->zip, self->bevy_urn, self->segment_data->size);
+  if(!self->segment) goto error;
+
+  index_urn = CALL(self->bevy_urn, copy, self->bevy_urn);
+  CALL(index_urn, add, "idx");
+  self->index_segment = reserve_member(self->zip, index_urn, self->index_data->size);
+  if(!self->index_segment) goto error;
+
+  return 1;
 
  error:
-  talloc_free(bevy);
-  return -1;
+  PUSH_ERROR_STATE;
+  discard_bevy(self);
+  POP_ERROR_STATE;
+  return 0;
 };
 
+/* Writes a compressed bevy and its index into the room reserved for
+   them. Many threads can do this at the same time. Returns 0 (with
+   the members discarded) if anything could not be written.
+*/
+static int commit_bevy(ImageWorker self) {
+  AFF4Image image = self->image;
+  Resolver resolver = ((AFFObject)image)->resolver;
 
-static int AFF4Image_read(FileLikeObject this, char *buffer, unsigned int length) {
-  AFF4Image self = (AFF4Image)this;
-  int offset = 0;
+  if(!self->zip) {
+    RaiseError(EProgrammingError, "Bevy %d was not reserved", self->segment_count);
+    return 0;
+  };
 
-  AFF4_GL_LOCK;
+  if(CALL((FileLikeObject)self->segment, write, self->segment_data->data,
+          self->segment_data->size) < 0 ||
+     CALL((FileLikeObject)self->index_segment, write, self->index_data->data,
+          self->index_data->size) < 0)
+    goto error;
 
-  while(length > 0) {
-    int res = _partial_read(this, buffer + offset, length);
-    if(res == 0) break;
+  /* Closing adds the members to the volume. Members which fail to
+     close are discarded below.
+  */
+  if(!CALL((AFFObject)self->segment, close))
+    goto error;
+  self->segment = NULL;
 
-    offset += res;
-    length -= res;
+  if(!CALL((AFFObject)self->index_segment, close))
+    goto error;
+  self->index_segment = NULL;
+
+  if(self->bevy_hash >= 0) {
+    CALL(resolver, set, self->bevy_urn, AFF4_HASH,
+         digest_value(self->bevy_urn, self->bevy_hash, self->bevy_digest,
+                      self->bevy_digest_length));
   };
 
-  AFF4_GL_UNLOCK;
-  return offset;
+  CALL(resolver, cache_return, (AFFObject)self->zip);
+  self->zip = NULL;
+
+  invalidate_bevy(image, self->segment_count);
+  return 1;
+
+ error:
+  PUSH_ERROR_STATE;
+  discard_bevy(self);
+  POP_ERROR_STATE;
+  return 0;
 };
 
 
-static int AFF4Image_close(AFFObject this) {
-  AFF4Image self = (AFF4Image) this;
+/* Adds a compressed bevy to the image's commit queue (which is kept
+   sorted by bevy number), and then reserves room in the volume for
+   as many bevies from the head of the queue as are now in sequence.
 
-  AFF4_GL_LOCK;
+   Only one thread reserves at a time. The reserving thread hashes
+   each bevy into the stream hashes without the global lock, and
+   bevies queued by other threads meanwhile are picked up by it. The
+   bevies it reserved are then written after it lets go, so the next
+   thread can reserve its bevies while they are written.
+
+   Once the image has failed bevies still take their turn (so the
+   writer is not blocked) but are neither hashed nor written.
+*/
+static void queue_for_commit(AFF4Image image, ImageWorker worker) {
+  ImageWorker i, next;
+  struct list_head *position = &image->commit_queue;
+  struct list_head reserved;
+  int hash;
+
+  list_for_each_entry(i, &image->commit_queue, list) {
+    if(i->segment_count > worker->segment_count) {
+      position = &i->list;
+      break;
+    };
+  };
 
-  printf("About to flush last bevy.");
+  // Insert before the first bevy which comes after us. We keep the
+  // worker alive until it is committed.
+  list_add_tail(&worker->list, position);
+  talloc_reference(image, worker);
 
-  /* Flush the last worker */
-  CALL(self->thread_pool, schedule, (ThreadPoolJob)self->current, 60);
+  // The committing thread will get to us.
+  if(image->committing)
+    return;
 
-  /* Wait for all threads to finish */
-  CALL(self->thread_pool, join);
-  printf("Closing image.");
-  fflush(stdout);
+  image->committing = 1;
+  INIT_LIST_HEAD(&reserved);
 
-  AFF4_GL_UNLOCK;
-  return 1;
+  while(!list_empty(&image->commit_queue)) {
+    struct timeval now;
+    uint64_t wait;
+
+    list_next(i, &image->commit_queue, list);
+    if(i->segment_count != image->next_bevy_to_commit)
+      break;
+
+    gettimeofday(&now, NULL);
+    wait = (now.tv_sec - i->compressed.tv_sec) * 1000000LL +
+      now.tv_usec - i->compressed.tv_usec;
+
+    image->reorder_wait_usec += wait;
+    image->reorder_max_wait_usec = max(image->reorder_max_wait_usec, wait);
+
+    // Count the bevies which had to wait for an earlier one.
+    if(i != worker)
+      image->reordered_bevies++;
+
+    list_del(&i->list);
+    image->next_bevy_to_commit++;
+
+    /* Nobody else touches the stream hashes while we commit. */
+    if(i->bevy && !image->failed) {
+      AFF4_BEGIN_ALLOW_THREADS;
+
+      for(hash=0; hash<AFF4_NUMBER_OF_HASHES; hash++) {
+        if(image->digest[hash]) {
+          EVP_DigestUpdate(image->digest[hash], i->bevy->data, i->bevy->size);
+        };
+      };
+
+      AFF4_END_ALLOW_THREADS;
+    };
+
+    if(!image->failed && !reserve_bevy(i))
+      fail_image(image);
+
+    list_add_tail(&i->list, &reserved);
+  };
+
+  image->committing = 0;
+
+  list_for_each_entry_safe(i, next, &reserved, list) {
+    list_del(&i->list);
+
+    /* Bevies reserved before the image failed are not written. */
+    if(image->failed) {
+      discard_bevy(i);
+    } else if(commit_bevy(i)) {
+      publish_digests(image, i->new_digests);
+    } else {
+      fail_image(image);
+    };
+
+    if(i->bevy) {
+      release_bevy_buffer(image, i->bevy);
+      i->bevy = NULL;
+    };
+
+    talloc_free(i->segment_data);
+    talloc_free(i->index_data);
+    i->segment_data = i->index_data = NULL;
+
+    /* The thread pool frees the worker once we let go of it. */
+    talloc_unlink(image, i);
+
+    // Let the writer know there is room for another bevy.
+    image->bevies_in_flight--;
+    pthread_cond_broadcast(&image->bevy_committed);
+  };
+};
+
+
+static void ImageWorker_run(ThreadPoolJob this) {
+  ImageWorker self = (ImageWorker) this;
+  StringIO segment, index_segment;
+  struct BevyIndexHeader header;
+  uint32_t chunk_offset = 0;
+  uint64_t compressed_offset = 0;
+  int hash;
+
+  /* The bevy is compressed into memory first - it is only written to
+     the volume once all the bevies before it have been.
+  */
+  segment = self->segment_data = CONSTRUCT(StringIO, StringIO, Con, self);
+  index_segment = self->index_data = CONSTRUCT(StringIO, StringIO, Con, self);
+
+  // Chunks never take more space than they do uncompressed.
+  CALL(segment, reserve, self->bevy->size);
+  CALL(index_segment, reserve, sizeof(struct BevyIndexHeader) +
+       sizeof(struct BevyIndexEntry) * self->image->chunks_in_segment);
+
+  header.magic = AFF4_BEVY_INDEX_MAGIC;
+  header.version = AFF4_BEVY_INDEX_VERSION;
+  CALL(index_segment, write, (char *)&header, sizeof(header));
+
+  if(self->image->dedup_table) {
+    self->new_digests = new_dedup_table(self, 2 * self->image->chunks_in_segment *
+                                        sizeof(struct DedupEntry));
+    if(!self->new_digests) goto error;
+  };
+
+  /* Now we compress chunks from our bevy into the segment. */
+  while(chunk_offset < self->bevy->size) {
+    AFF4Image image = self->image;
+    char *data = self->bevy->data + chunk_offset;
+    int length = min(image->chunk_size, self->bevy->size - chunk_offset);
+    uint64_t chunk_id = (uint64_t)self->segment_count * image->chunks_in_segment +
+      chunk_offset / image->chunk_size;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length = 0;
+    int64_t original = -1;
+    struct BevyIndexEntry entry;
+    unsigned char fill;
+    int constant;
+
+    memset(&entry, 0, sizeof(entry));
+
+    /* This can run concurrently. */
+    AFF4_BEGIN_ALLOW_THREADS;
+
+    constant = is_constant_chunk(data, length, &fill);
+    if(!constant && image->dedup_table) {
+      EVP_Digest(data, length, digest, &digest_length, EVP_sha256(), NULL);
+    };
+
+    AFF4_END_ALLOW_THREADS;
+
+    /* Chunks may refer to committed chunks or to earlier chunks of
+       this bevy.
+    */
+    if(digest_length) {
+      original = dedup_lookup(self->new_digests, digest);
+      if(original < 0)
+        original = dedup_lookup(image->dedup_table, digest);
+    };
+
+    if(constant) {
+      /* Constant chunks only get an index entry. */
+      entry.flags = AFF4_CHUNK_CONSTANT;
+      entry.offset = fill;
+      image->constant_chunks++;
+
+    } else if(original >= 0) {
+      /* So do chunks we already stored - they refer to the original. */
+      entry.flags = AFF4_CHUNK_REFERENCE;
+      entry.offset = original;
+      image->duplicate_chunks++;
+
+    } else {
+      AFF4Codec codec = image->codec;
+      int clength = CALL(codec, compress_bound, image->chunk_size);
+      char cbuffer[clength];
+
+      // Remember where this content lives.
+      if(digest_length)
+        dedup_insert(self->new_digests, digest, chunk_id);
+
+      if(codec->id != AFF4_CODEC_STORED) {
+        AFF4_BEGIN_ALLOW_THREADS;
+
+        clength = CALL(codec, compress, cbuffer, clength, data, length,
+                       image->compression_level);
+
+        AFF4_END_ALLOW_THREADS;
+
+        if(clength < 0) {
+          RaiseError(ERuntimeError, "Compression error (%s)", codec->name);
+          goto error;
+        };
+      };
+
+      entry.offset = compressed_offset;
+
+      /* Chunks which do not compress are stored as they are. */
+      if(codec->id == AFF4_CODEC_STORED || clength >= length) {
+        entry.flags = AFF4_CHUNK_STORED;
+        entry.length = length;
+        CALL(segment, write, data, length);
+      } else {
+        entry.length = clength;
+        CALL(segment, write, cbuffer, clength);
+      };
+
+      compressed_offset += entry.length;
+    };
+
+    CALL(index_segment, write, (char *)&entry, sizeof(entry));
+    chunk_offset += length;
+  };
+
+  /* Hash the bevy with the strongest hash we are computing. */
+  for(hash=AFF4_NUMBER_OF_HASHES-1; hash>=0; hash--) {
+    if(self->image->digest[hash]) {
+      const EVP_MD *md = image_hashes[hash].md();
+
+      AFF4_BEGIN_ALLOW_THREADS;
+      EVP_Digest(self->bevy->data, self->bevy->size, self->bevy_digest,
+                 &self->bevy_digest_length, md, NULL);
+      AFF4_END_ALLOW_THREADS;
+
+      self->bevy_hash = hash;
+      break;
+    };
+  };
+
+  goto exit;
+
+ error:
+  fail_image(self->image);
+
+ exit:
+  /* Even a failed bevy takes its turn in the commit queue so it does
+     not hold back the bevies after it.
+  */
+  gettimeofday(&self->compressed, NULL);
+
+  // We do not need the uncompressed bevy while we wait unless the
+  // stream is being hashed.
+  if(self->bevy_hash < 0) {
+    release_bevy_buffer(self->image, self->bevy);
+    self->bevy = NULL;
+  };
+
+  queue_for_commit(self->image, self);
+};
+
+
+
+VIRTUAL(ImageWorker, ThreadPoolJob) {
+  VMETHOD(Con) = ImageWorker_Con;
+  VMETHOD_BASE(ThreadPoolJob, run) = ImageWorker_run;
+} END_VIRTUAL
+
+
+/* Resolves an integer attribute of the image, returning default_value
+   if it is not set.
+*/
+static uint64_t resolve_int(AFF4Image self, char *attribute, uint64_t default_value) {
+  XSDInteger value = (XSDInteger)CALL(RESOLVER, resolve, NULL, URNOF(self), attribute);
+  uint64_t result = default_value;
+
+  if(value) {
+    result = value->value;
+    talloc_free(value);
+  };
+
+  return result;
+};
+
+
+/* (Re)creates the read caches. Any previously cached data is
+   discarded.
+*/
+static void flush_caches(AFF4Image self) {
+  int max_chunks;
+
+  if(self->chunk_cache)
+    talloc_free(self->chunk_cache);
+
+  if(self->bevy_index_cache)
+    talloc_free(self->bevy_index_cache);
+
+  if(!self->chunk_cache_size) {
+    self->chunk_cache_size = resolve_int(self, CONFIG_CHUNK_CACHE_SIZE,
+                                         AFF4_DEFAULT_CHUNK_CACHE_SIZE);
+  };
+
+  /* The cache counts entries, so we convert the byte budget into a
+     number of chunks.
+  */
+  max_chunks = max(1, self->chunk_cache_size / self->chunk_size);
+
+  self->chunk_cache = CONSTRUCT(Cache, Cache, Con, self, HASH_TABLE_SIZE, max_chunks);
+  self->chunk_cache->policy = CACHE_EXPIRE_LEAST_USED;
+
+  self->bevy_index_cache = CONSTRUCT(Cache, Cache, Con, self, HASH_TABLE_SIZE,
+                                     AFF4_BEVY_INDEX_CACHE_SIZE);
+  self->bevy_index_cache->policy = CACHE_EXPIRE_LEAST_USED;
+
+  self->chunk_cache_hits = 0;
+  self->chunk_cache_misses = 0;
+};
+
+
+/* Drops all prefetch jobs which have not started yet. Jobs which are
+   already running are left to complete.
+*/
+static void drop_prefetch(AFF4Image self) {
+  ChunkPrefetcher i, j;
+
+  list_for_each_entry_safe(i, j, &self->prefetch_jobs, list) {
+    if(i->state == PREFETCH_QUEUED &&
+       CALL(self->thread_pool, cancel, NULL, (ThreadPoolJob)i)) {
+      list_del(&i->list);
+      talloc_free(i);
+    };
+  };
+
+  self->read_ahead_window = 0;
+};
+
+
+/* All readers in the process share this pool. It is only started
+   when the first image needs it.
+*/
+static ThreadPool shared_read_pool = NULL;
+
+/* Returns the pool to decompress on, starting the shared read pool
+   if this is its first use.
+*/
+static ThreadPool get_thread_pool(AFF4Image self) {
+  if(self->thread_pool)
+    return self->thread_pool;
+
+  if(!shared_read_pool) {
+    int threads = min(AFF4_MAX_READ_THREADS,
+                      max(1, sysconf(_SC_NPROCESSORS_ONLN)));
+
+    shared_read_pool = CONSTRUCT(ThreadPool, ThreadPool, Con, NULL, threads);
+  };
+
+  self->thread_pool = shared_read_pool;
+  return self->thread_pool;
+};
+
+/* Waits for all outstanding work on the thread pool. The writer's
+   own pool is shut down, while for the shared read pool we only wait
+   for our prefetches since everyone else's jobs are still on it.
+*/
+static void stop_thread_pool(AFF4Image self) {
+  if(!self->thread_pool)
+    return;
+
+  drop_prefetch(self);
+
+  if(self->thread_pool == shared_read_pool) {
+    while(!list_empty(&self->prefetch_jobs)) {
+      CALL(aff4_gl_lock, wait, &self->prefetch_done);
+    };
+
+    CALL(self->thread_pool, complete);
+  } else {
+    CALL(self->thread_pool, join);
+    talloc_free(self->thread_pool);
+  };
+
+  self->thread_pool = NULL;
+};
+
+
+/* The thread pool may still be working on our behalf when we are
+   freed, so we must stop it before any of our members go away.
+*/
+static int AFF4Image_destructor(void *this) {
+  AFF4Image self = (AFF4Image)this;
+  int hash;
+
+  AFF4_GL_LOCK;
+  stop_thread_pool(self);
+
+  for(hash=0; hash<AFF4_NUMBER_OF_HASHES; hash++) {
+    if(self->digest[hash]) {
+      EVP_MD_CTX_destroy(self->digest[hash]);
+      self->digest[hash] = NULL;
+    };
+  };
+  AFF4_GL_UNLOCK;
+
+  return 0;
+};
+
+
+/* Finds the codec for the image's compression and validates the
+   compression level. Returns 0 if the codec is not supported.
+*/
+static int select_codec(AFF4Image self) {
+  self->codec = codec_from_id(self->compression);
+  if(!self->codec) {
+    RaiseError(EInvalidParameter, "Compression codec %d is not supported",
+               self->compression);
+    return 0;
+  };
+
+  if(!self->compression_level) {
+    self->compression_level = resolve_int(self, CONFIG_COMPRESSION_LEVEL,
+                                          self->codec->default_level);
+  };
+
+  self->compression_level = max(self->compression_level, self->codec->min_level);
+  self->compression_level = min(self->compression_level, self->codec->max_level);
+
+  return 1;
+};
+
+
+static int AFF4Image_finish(AFFObject this) {
+  AFF4Image self = (AFF4Image)this;
+  int result;
+
+  AFF4_GL_LOCK;
+
+  INIT_LIST_HEAD(&self->prefetch_jobs);
+  pthread_cond_init(&self->prefetch_done, NULL);
+  talloc_set_destructor((void *)self, AFF4Image_destructor);
+
+  switch(this->mode) {
+
+  case 'w': {
+    if(!self->stored) {
+      RaiseError(EProgrammingError, "Image has no storage.");
+      goto error;
+    };
+
+    /* Set sensible defaults */
+    if(!self->chunk_size) {
+      self->chunk_size = 32 * 1024;
+    };
+
+    if(!select_codec(self))
+      goto error;
+
+    if(!self->chunks_in_segment) {
+      self->chunks_in_segment = 1024;
+    };
+
+    self->bevy_size = self->chunk_size * self->chunks_in_segment;
+    self->size = 0;
+    self->segment_count = 0;
+    self->constant_chunks = 0;
+    self->duplicate_chunks = 0;
+
+    INIT_LIST_HEAD(&self->commit_queue);
+    self->next_bevy_to_commit = 0;
+    self->committing = 0;
+    self->reorder_wait_usec = 0;
+    self->reorder_max_wait_usec = 0;
+    self->reordered_bevies = 0;
+
+    /* Work out how many bevies we can have in flight - the bevy
+       being filled takes one buffer and each bevy in flight takes
+       two (the bevy and its compressed copy).
+    */
+    if(!self->write_buffer_size) {
+      self->write_buffer_size = resolve_int(self, CONFIG_WRITE_BUFFER_SIZE,
+                                            AFF4_DEFAULT_WRITE_BUFFER_SIZE);
+    };
+
+    self->max_bevies_in_flight = max(1, ((int64_t)self->write_buffer_size -
+                                         self->bevy_size) / (2 * self->bevy_size));
+    self->bevies_in_flight = 0;
+    self->write_blocked_usec = 0;
+    pthread_cond_init(&self->bevy_committed, NULL);
+
+    self->free_bevies = talloc_array(self, StringIO, self->max_bevies_in_flight + 1);
+    self->free_bevy_count = 0;
+
+    /* The dedup table is only used while writing. */
+    if(!self->dedup) {
+      self->dedup = resolve_int(self, CONFIG_DEDUP, 0);
+    };
+
+    if(self->dedup) {
+      if(!self->dedup_table_size) {
+        self->dedup_table_size = resolve_int(self, CONFIG_DEDUP_TABLE_SIZE,
+                                             AFF4_DEFAULT_DEDUP_TABLE_SIZE);
+      };
+
+      self->dedup_table = new_dedup_table(self, self->dedup_table_size);
+      if(!self->dedup_table) goto error;
+    };
+
+    if(!self->hashes) {
+      self->hashes = resolve_int(self, CONFIG_HASHES, AFF4_HASH_ALL);
+    };
+
+    if(self->hashes > 0) {
+      int hash;
+
+      for(hash=0; hash<AFF4_NUMBER_OF_HASHES; hash++) {
+        if(self->hashes & image_hashes[hash].flag) {
+          self->digest[hash] = EVP_MD_CTX_create();
+          EVP_DigestInit_ex(self->digest[hash], image_hashes[hash].md(), NULL);
+        };
+      };
+    };
+
+    self->current = CONSTRUCT(ImageWorker, ImageWorker, Con, self, self, self->segment_count);
+
+    if(self->thread_count <= 0) {
+      self->thread_count = 1;
+    };
+
+    self->thread_pool = CONSTRUCT(ThreadPool, ThreadPool,
+                                  Con, self, self->thread_count);
+
+    flush_caches(self);
+  }; break;
+
+  case 'r': {
+    if(!self->stored) {
+      RDFURN stored = (RDFURN)CALL(RESOLVER, resolve, self, URNOF(self), AFF4_STORED);
+
+      if(!stored) {
+        RaiseError(EProgrammingError, "Image has no storage.");
+        goto error;
+      };
+      self->stored = stored;
+    };
+
+    /* Parameters not set explicitly come from the resolver. */
+    if(!self->chunk_size) {
+      self->chunk_size = resolve_int(self, AFF4_CHUNK_SIZE, 32 * 1024);
+    };
+
+    if(!self->compression) {
+      self->compression = resolve_int(self, AFF4_COMPRESSION, AFF4_CODEC_STORED);
+    };
+
+    if(!select_codec(self))
+      goto error;
+
+    if(!self->chunks_in_segment) {
+      self->chunks_in_segment = resolve_int(self, AFF4_CHUNKS_IN_SEGMENT, 1024);
+    };
+
+    self->bevy_size = self->chunk_size * self->chunks_in_segment;
+
+    /* A size of 0 means the size is unknown - we read until we run
+       out of bevies.
+    */
+    self->size = resolve_int(self, AFF4_SIZE, 0);
+
+    flush_caches(self);
+
+    if(!self->read_ahead) {
+      self->read_ahead = resolve_int(self, CONFIG_READ_AHEAD, AFF4_DEFAULT_READ_AHEAD);
+    };
+
+    /* There is no point reading further ahead than the cache can
+       hold.
+    */
+    self->read_ahead = min(self->read_ahead, self->chunk_cache->max_cache_size / 2);
+    self->read_ahead_window = 0;
+    self->read_stride = 1;
+    self->last_chunk_read = -1;
+
+    /* Read ahead and large reads use the shared read pool, which is
+       only attached when we first need it.
+    */
+    self->thread_pool = NULL;
+  }; break;
+
+  default:
+    RaiseError(EProgrammingError, "Unknown mode");
+    goto error;
+  };
+
+  result = SUPER(AFFObject, FileLikeObject, finish);
+  AFF4_GL_UNLOCK;
+  return result;
+
+ error:
+  SUPER(AFFObject, FileLikeObject, finish);
+  AFF4_GL_UNLOCK;
+  return 0;
+};
+
+
+/* Hands the current bevy to the thread pool. If there are already too
+   many bevies in flight we wait for one to be committed first.
+
+   Returns 0 and fails the image if the bevy could not be scheduled.
+*/
+static int schedule_bevy(AFF4Image self) {
+  /* There is no point compressing any more of a failed image. */
+  if(self->failed) {
+    talloc_free(self->current);
+    self->current = NULL;
+    return 0;
+  };
+
+  if(self->bevies_in_flight >= self->max_bevies_in_flight) {
+    struct timeval start, now;
+
+    gettimeofday(&start, NULL);
+
+    while(self->bevies_in_flight >= self->max_bevies_in_flight) {
+      CALL(aff4_gl_lock, wait, &self->bevy_committed);
+    };
+
+    gettimeofday(&now, NULL);
+    self->write_blocked_usec += (now.tv_sec - start.tv_sec) * 1000000LL +
+      now.tv_usec - start.tv_usec;
+  };
+
+  self->bevies_in_flight++;
+  if(!CALL(self->thread_pool, schedule, (ThreadPoolJob)self->current, 60)) {
+    /* The job was never queued so it is still ours to free. */
+    RaiseError(ERuntimeError, "Timed out scheduling bevy %d of %s",
+               self->current->segment_count, URNOF(self)->value);
+    self->bevies_in_flight--;
+    fail_image(self);
+
+    talloc_free(self->current);
+    self->current = NULL;
+    return 0;
+  };
+  self->current = NULL;
+
+  // Free the workers which are done with.
+  CALL(self->thread_pool, complete);
+  return 1;
+};
+
+
+static int AFF4Image_write(FileLikeObject this, char *buffer, unsigned int length) {
+  AFF4Image self = (AFF4Image) this;
+  int offset = 0;
+
+  AFF4_GL_LOCK;
+
+  do {
+    int need_to_write = length - offset;
+
+    if(self->failed) {
+      AFF4_GL_UNLOCK;
+      return raise_failure(self);
+    };
+    int availbale_to_write = self->bevy_size - self->current->bevy->size;
+
+    if(need_to_write <= 0) break;
+
+    availbale_to_write = min(need_to_write, availbale_to_write);
+    CALL(self->current->bevy, write, buffer + offset, availbale_to_write);
+    offset += availbale_to_write;
+    self->size += availbale_to_write;
+
+    if(self->current->bevy->size >= self->bevy_size) {
+      /* Flush the worker to the thread pool and get a new one. */
+      if(!schedule_bevy(self)) {
+        AFF4_GL_UNLOCK;
+        return raise_failure(self);
+      };
+
+      self->segment_count ++;
+      self->current = CONSTRUCT(ImageWorker, ImageWorker, Con, self, self, self->segment_count);
+    };
+  } while(1);
+
+  AFF4_GL_UNLOCK;
+  return length;
+};
+
+
+static int read_chunk(AFF4Image self, uint64_t chunk_id, char *buffer);
+
+/* Decompresses the chunk into buffer (which must be chunk_size
+   long). Returns the uncompressed length or -1 on error.
+*/
+static int decompress_chunk(AFF4Image self, BevyIndex index, int chunk,
+                            char *buffer) {
+  // The index may be expired while we decompress with threads allowed.
+  int bevy_number = index->bevy_number;
+  struct BevyIndexEntry *entry_ptr = get_index_entry(index, chunk);
+  struct BevyIndexEntry entry;
+  FileLikeObject segment;
+  char *cbuffer = NULL, *cdata;
+  int length;
+
+  if(!entry_ptr)
+    return -1;
+
+  entry = *entry_ptr;
+
+  if(entry.flags & AFF4_CHUNK_CONSTANT) {
+    uint64_t chunk_start = ((uint64_t)bevy_number * self->chunks_in_segment + chunk) *
+      self->chunk_size;
+
+    /* Only the last chunk of the stream can be short. */
+    length = self->chunk_size;
+    if(self->size && chunk_start + length > self->size) {
+      length = self->size - chunk_start;
+    };
+
+    memset(buffer, entry.offset & 0xFF, length);
+    return length;
+  };
+
+  /* Duplicate chunks are read from the original. */
+  if(entry.flags & AFF4_CHUNK_REFERENCE) {
+    return read_chunk(self, entry.offset, buffer);
+  };
+
+  /* The segment read may release the global lock, so we keep the
+     segment alive in case the index is expired meanwhile.
+  */
+  segment = index->segment;
+  talloc_reference(NULL, segment);
+
+  /* Stored chunks are read straight into the buffer. */
+  if(entry.flags & AFF4_CHUNK_STORED) {
+    length = CALL(segment, read_at, entry.offset, buffer,
+                  min(entry.length, self->chunk_size));
+    talloc_unlink(NULL, segment);
+    return length;
+  };
+
+  /* Mapped chunks are decompressed in place. The segment keeps the
+     mapping alive until we are done.
+  */
+  cdata = CALL(segment, borrow, entry.offset, entry.length);
+  if(cdata) {
+    length = entry.length;
+  } else {
+    cdata = cbuffer = talloc_size(NULL, entry.length);
+    length = CALL(segment, read_at, entry.offset, cbuffer, entry.length);
+    if(length < 0) {
+      talloc_unlink(NULL, segment);
+      goto error;
+    };
+  };
+
+  AFF4_BEGIN_ALLOW_THREADS;
+
+  length = CALL(self->codec, decompress, buffer, self->chunk_size, cdata, length);
+
+  AFF4_END_ALLOW_THREADS;
+
+  talloc_unlink(NULL, segment);
+
+  if(length < 0) {
+    RaiseError(ERuntimeError, "Unable to decompress chunk %d in bevy %d (%s)",
+               chunk, bevy_number, self->codec->name);
+    goto error;
+  };
+
+  talloc_free(cbuffer);
+  return length;
+
+ error:
+  talloc_free(cbuffer);
+  return -1;
+};
+
+
+/* Returns the parsed index for the bevy, loading it if needed. The
+   result is borrowed from the bevy index cache.
+*/
+static BevyIndex get_bevy_index(AFF4Image self, int bevy_number) {
+  BevyIndex result = (BevyIndex)CALL(self->bevy_index_cache, borrow,
+                                     (char *)&bevy_number, sizeof(bevy_number));
+
+  if(result)
+    return result;
+
+  result = CONSTRUCT(BevyIndex, BevyIndex, Con, NULL, self, bevy_number);
+  if(!result)
+    return NULL;
+
+  CALL(self->bevy_index_cache, put, (char *)&bevy_number, sizeof(bevy_number),
+       (Object)result);
+
+  return result;
+};
+
+
+/* Reads and decompresses a chunk into buffer (which must be chunk_size
+   long) bypassing the cache. Returns the length of the chunk, 0 at the
+   end of the stream and -1 on error.
+*/
+static int read_chunk(AFF4Image self, uint64_t chunk_id, char *buffer) {
+  BevyIndex index = get_bevy_index(self, chunk_id / self->chunks_in_segment);
+  int chunk = chunk_id % self->chunks_in_segment;
+
+  if(!index) {
+    /* If we do not know the size, running out of bevies is the end
+       of the stream.
+    */
+    if(self->size)
+      return -1;
+
+    ClearError();
+    return 0;
+  };
+
+  if(chunk >= index->number_of_chunks)
+    return 0;
+
+  return decompress_chunk(self, index, chunk, buffer);
+};
+
+
+/* Like read_chunk() but returns a new buffer sized to the chunk, or
+   NULL with length set to 0 at the end of the stream and -1 on error.
+*/
+static char *load_chunk(AFF4Image self, uint64_t chunk_id, int *length) {
+  char *result = talloc_size(NULL, self->chunk_size);
+
+  *length = read_chunk(self, chunk_id, result);
+  if(*length <= 0) {
+    talloc_free(result);
+    return NULL;
+  };
+
+  /* The size of the allocation is the length of the chunk. */
+  return talloc_realloc_size(NULL, result, *length);
+};
+
+
+static ChunkPrefetcher find_prefetch(AFF4Image self, uint64_t chunk_id) {
+  ChunkPrefetcher i;
+
+  list_for_each_entry(i, &self->prefetch_jobs, list) {
+    if(i->chunk_id == chunk_id)
+      return i;
+  };
+
+  return NULL;
+};
+
+
+/* If the chunk is being prefetched, waits for it to land in the cache
+   and returns 1. A prefetch which has not started yet is cancelled
+   since it is quicker to just decompress it ourselves.
+*/
+static int wait_for_prefetch(AFF4Image self, uint64_t chunk_id) {
+  ChunkPrefetcher job = find_prefetch(self, chunk_id);
+
+  if(!job)
+    return 0;
+
+  if(job->state == PREFETCH_QUEUED &&
+     CALL(self->thread_pool, cancel, NULL, (ThreadPoolJob)job)) {
+    list_del(&job->list);
+    talloc_free(job);
+    return 0;
+  };
+
+  while(find_prefetch(self, chunk_id)) {
+    CALL(aff4_gl_lock, wait, &self->prefetch_done);
+  };
+
+  return 1;
+};
+
+
+/* Called each time the reader moves to a new chunk. We track the
+   stride between successive chunks - while it holds we grow the
+   window and schedule the chunks ahead of the reader. When the stride
+   changes the access is considered random and outstanding prefetches
+   are dropped.
+*/
+static void schedule_read_ahead(AFF4Image self, uint64_t chunk_id) {
+  int64_t stride;
+  int i;
+
+  if(self->read_ahead <= 0 || chunk_id == self->last_chunk_read)
+    return;
+
+  stride = chunk_id - self->last_chunk_read;
+  self->last_chunk_read = chunk_id;
+
+  if(stride <= 0 || stride != self->read_stride) {
+    drop_prefetch(self);
+    self->read_stride = stride;
+    return;
+  };
+
+  self->read_ahead_window = min(self->read_ahead,
+                                max(1, self->read_ahead_window * 2));
+
+  // Free the prefetchers which have finished.
+  CALL(get_thread_pool(self), complete);
+
+  for(i=1; i<=self->read_ahead_window; i++) {
+    uint64_t next = chunk_id + i * stride;
+    ChunkPrefetcher job;
+
+    if(self->size && next * self->chunk_size >= self->size)
+      break;
+
+    if(find_prefetch(self, next) ||
+       CALL(self->chunk_cache, present, (char *)&next, sizeof(next)))
+      continue;
+
+    job = CONSTRUCT(ChunkPrefetcher, ChunkPrefetcher, Con, NULL, self, next);
+    list_add_tail(&job->list, &self->prefetch_jobs);
+
+    /* Never block the reader on a busy pool - we will try again on
+       the next chunk.
+    */
+    if(!CALL(self->thread_pool, schedule, (ThreadPoolJob)job, 0)) {
+      list_del(&job->list);
+      talloc_free(job);
+      break;
+    };
+
+    self->read_ahead_scheduled++;
+  };
+};
+
+
+/* Returns the decompressed chunk, reading it through the chunk cache.
+   The result is borrowed from the cache and is only valid until the
+   next cache operation. Its length is returned in length.
+*/
+static char *get_chunk(AFF4Image self, uint64_t chunk_id, int *length) {
+  char *result;
+
+  schedule_read_ahead(self, chunk_id);
+
+  result = (char *)CALL(self->chunk_cache, borrow,
+                        (char *)&chunk_id, sizeof(chunk_id));
+
+  /* The chunk may be on its way from the thread pool. */
+  if(!result && wait_for_prefetch(self, chunk_id)) {
+    result = (char *)CALL(self->chunk_cache, borrow,
+                          (char *)&chunk_id, sizeof(chunk_id));
+  };
+
+  if(result) {
+    self->chunk_cache_hits++;
+    *length = talloc_get_size(result);
+    return result;
+  };
+
+  self->chunk_cache_misses++;
+
+  result = load_chunk(self, chunk_id, length);
+  if(!result)
+    return NULL;
+
+  CALL(self->chunk_cache, put, (char *)&chunk_id, sizeof(chunk_id),
+       (Object)result);
+
+  return result;
+};
+
+
+static ChunkPrefetcher ChunkPrefetcher_Con(ChunkPrefetcher self, AFF4Image image,
+                                           uint64_t chunk_id) {
+  self->image = image;
+  self->chunk_id = chunk_id;
+  self->state = PREFETCH_QUEUED;
+  INIT_LIST_HEAD(&self->list);
+
+  return self;
+};
+
+
+static void ChunkPrefetcher_run(ThreadPoolJob this) {
+  ChunkPrefetcher self = (ChunkPrefetcher)this;
+  AFF4Image image = self->image;
+  uint64_t chunk_id = self->chunk_id;
+  char *chunk;
+  int length;
+
+  self->state = PREFETCH_RUNNING;
+
+  chunk = load_chunk(image, chunk_id, &length);
+  if(!chunk) {
+    /* Errors are reported when the reader gets to this chunk. */
+    ClearError();
+  } else if(CALL(image->chunk_cache, present, (char *)&chunk_id, sizeof(chunk_id))) {
+    talloc_free(chunk);
+  } else {
+    CALL(image->chunk_cache, put, (char *)&chunk_id, sizeof(chunk_id),
+         (Object)chunk);
+  };
+
+  list_del(&self->list);
+  pthread_cond_broadcast(&image->prefetch_done);
+};
+
+
+VIRTUAL(ChunkPrefetcher, ThreadPoolJob) {
+  VMETHOD(Con) = ChunkPrefetcher_Con;
+  VMETHOD_BASE(ThreadPoolJob, run) = ChunkPrefetcher_run;
+} END_VIRTUAL
+
+
+static ParallelRead ParallelRead_Con(ParallelRead self, uint64_t end) {
+  self->end = end;
+  pthread_cond_init(&self->done, NULL);
+
+  return self;
+};
+
+VIRTUAL(ParallelRead, Object) {
+  VMETHOD(Con) = ParallelRead_Con;
+} END_VIRTUAL
+
+
+static ChunkDecompressor ChunkDecompressor_Con(ChunkDecompressor self, AFF4Image image,
+                                               ParallelRead request, uint64_t chunk_id,
+                                               char *target) {
+  self->image = image;
+  self->request = request;
+  self->chunk_id = chunk_id;
+  self->target = target;
+
+  return self;
+};
+
+
+static void ChunkDecompressor_run(ThreadPoolJob this) {
+  ChunkDecompressor self = (ChunkDecompressor)this;
+  AFF4Image image = self->image;
+  ParallelRead request = self->request;
+  int length = read_chunk(image, self->chunk_id, self->target);
+
+  if(length < 0) {
+    request->error = 1;
+
+    /* A short chunk can only be the end of the stream. */
+  } else if(length < image->chunk_size) {
+    request->end = min(request->end, self->chunk_id * image->chunk_size + length);
+  };
+
+  request->outstanding --;
+  pthread_cond_broadcast(&request->done);
+};
+
+
+VIRTUAL(ChunkDecompressor, ThreadPoolJob) {
+  VMETHOD(Con) = ChunkDecompressor_Con;
+  VMETHOD_BASE(ThreadPoolJob, run) = ChunkDecompressor_run;
+} END_VIRTUAL
+
+
+/* Reads length bytes (a multiple of chunk_size) starting at the
+   chunk aligned offset. Chunks we already have are copied
+   from the cache, the rest are decompressed in parallel on the thread
+   pool straight into the caller's buffer. If the pool is busy the
+   caller decompresses the chunk itself rather than wait.
+*/
+static int parallel_read(AFF4Image self, uint64_t offset, char *buffer,
+                         unsigned int length) {
+  uint64_t first_chunk = offset / self->chunk_size;
+  int count = length / self->chunk_size;
+  ParallelRead request = CONSTRUCT(ParallelRead, ParallelRead, Con, NULL,
+                                   offset + length);
+  ThreadPool pool = get_thread_pool(self);
+  int result = -1;
+  int i;
+
+  for(i=0; i<count; i++) {
+    uint64_t chunk_id = first_chunk + i;
+    char *target = buffer + i * self->chunk_size;
+    ChunkDecompressor job;
+    char *cached;
+
+    wait_for_prefetch(self, chunk_id);
+    cached = (char *)CALL(self->chunk_cache, borrow, (char *)&chunk_id,
+                          sizeof(chunk_id));
+    if(cached) {
+      int chunk_length = talloc_get_size(cached);
+
+      self->chunk_cache_hits++;
+      memcpy(target, cached, chunk_length);
+      if(chunk_length < self->chunk_size) {
+        request->end = min(request->end, chunk_id * self->chunk_size + chunk_length);
+      };
+      continue;
+    };
+
+    self->chunk_cache_misses++;
+    job = CONSTRUCT(ChunkDecompressor, ChunkDecompressor, Con, NULL, self,
+                    request, chunk_id, target);
+    request->outstanding ++;
+
+    if(!CALL(pool, schedule, (ThreadPoolJob)job, 0)) {
+      CALL((ThreadPoolJob)job, run);
+      talloc_free(job);
+    };
+  };
+
+  /* Wait for all the chunks to arrive. */
+  while(request->outstanding > 0) {
+    CALL(aff4_gl_lock, wait, &request->done);
+  };
+
+  CALL(pool, complete);
+
+  if(request->error) {
+    if(!*aff4_get_current_error(NULL)) {
+      RaiseError(ERuntimeError, "Unable to read chunks %llu-%llu",
+                 (unsigned long long)first_chunk,
+                 (unsigned long long)(first_chunk + count - 1));
+    };
+    goto exit;
+  };
+
+  result = max(0, (int64_t)(request->end - offset));
+
+  /* Sequential readers which follow with small reads should continue
+     to read ahead from here.
+  */
+  self->last_chunk_read = first_chunk + count - 1;
+  self->read_stride = 1;
+
+ exit:
+  talloc_free(request);
+  return result;
+};
+
+
+static int _partial_read(AFF4Image self, uint64_t offset, char *buffer, int length) {
+  uint64_t chunk_id = offset / self->chunk_size;
+  int chunk_offset = offset % self->chunk_size;
+  int chunk_length;
+  int availbale_to_read;
+  char *chunk;
+
+  if(self->size) {
+    if(offset >= self->size)
+      return 0;
+
+    length = min(length, self->size - offset);
+  };
+
+  chunk = get_chunk(self, chunk_id, &chunk_length);
+  if(!chunk)
+    return chunk_length < 0 ? -1 : 0;
+
+  availbale_to_read = min(chunk_length - chunk_offset, length);
+  if(availbale_to_read <= 0)
+    return 0;
+
+  memcpy(buffer, chunk + chunk_offset, availbale_to_read);
+
+  return availbale_to_read;
+};
+
+
+/* The chunks are shared through the chunk cache, so any number of
+   threads can read different parts of the image at once.
+*/
+static int AFF4Image_read_at(FileLikeObject this, uint64_t offset, char *buffer,
+                             unsigned int length) {
+  AFF4Image self = (AFF4Image)this;
+  int done = 0;
+
+  AFF4_GL_LOCK;
+
+  if(self->size) {
+    if(offset >= self->size) {
+      length = 0;
+    } else {
+      length = min(length, self->size - offset);
+    };
+  };
+
+  while(length > 0) {
+    int res;
+
+    /* Runs of whole chunks are decompressed in parallel. */
+    if(offset % self->chunk_size == 0 &&
+       length >= 2 * self->chunk_size) {
+      int whole_chunks = length - length % self->chunk_size;
+
+      res = parallel_read(self, offset, buffer + done, whole_chunks);
+      if(res < 0) goto error;
+
+      offset += res;
+      done += res;
+      length -= res;
+
+      // We hit the end of the stream.
+      if(res < whole_chunks) break;
+      continue;
+    };
+
+    res = _partial_read(self, offset, buffer + done, length);
+    if(res < 0) goto error;
+    if(res == 0) break;
+
+    offset += res;
+    done += res;
+    length -= res;
+  };
+
+  AFF4_GL_UNLOCK;
+  return done;
+
+ error:
+  AFF4_GL_UNLOCK;
+  return -1;
+};
+
+static int AFF4Image_read(FileLikeObject this, char *buffer, unsigned int length) {
+  int result;
+
+  AFF4_GL_LOCK;
+
+  result = AFF4Image_read_at(this, this->readptr, buffer, length);
+  if(result > 0)
+    this->readptr += result;
+
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+/* Images are written as a stream so we can only append. */
+static int AFF4Image_write_at(FileLikeObject this, uint64_t offset, char *buffer,
+                              unsigned int length) {
+  AFF4Image self = (AFF4Image)this;
+  int result;
+
+  AFF4_GL_LOCK;
+
+  if(offset != self->size) {
+    RaiseError(EIOError, "Images can only be appended to.");
+    result = -1;
+  } else {
+    result = CALL(this, write, buffer, length);
+  };
+
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+
+static int AFF4Image_close(AFFObject this) {
+  AFF4Image self = (AFF4Image) this;
+  int result = 1;
+  int hash;
+
+  AFF4_GL_LOCK;
+
+  if(this->mode == 'w') {
+    /* Flush the last worker */
+    schedule_bevy(self);
+  };
+
+  /* Wait for all threads to finish */
+  stop_thread_pool(self);
+
+  /* A failed stream is not described at all, so it can not be
+     mistaken for a good one.
+  */
+  if(this->mode == 'w' && self->failed) {
+    for(hash=0; hash<AFF4_NUMBER_OF_HASHES; hash++) {
+      if(self->digest[hash]) {
+        EVP_MD_CTX_destroy(self->digest[hash]);
+        self->digest[hash] = NULL;
+      };
+    };
+
+    result = raise_failure(self);
+
+  /* Record the parameters readers need to decode the stream. */
+  } else if(this->mode == 'w') {
+    CALL(this, set, AFF4_SIZE, rdfvalue_from_int(self, self->size));
+    CALL(this, set, AFF4_CHUNK_SIZE, rdfvalue_from_int(self, self->chunk_size));
+    CALL(this, set, AFF4_CHUNKS_IN_SEGMENT,
+         rdfvalue_from_int(self, self->chunks_in_segment));
+    CALL(this, set, AFF4_COMPRESSION, rdfvalue_from_int(self, self->compression));
+
+    /* All the bevies have been hashed now. */
+    CALL(RESOLVER, del, URNOF(self), AFF4_HASH);
+    for(hash=0; hash<AFF4_NUMBER_OF_HASHES; hash++) {
+      unsigned char digest[EVP_MAX_MD_SIZE];
+      unsigned int length;
+
+      if(!self->digest[hash])
+        continue;
+
+      EVP_DigestFinal_ex(self->digest[hash], digest, &length);
+      EVP_MD_CTX_destroy(self->digest[hash]);
+      self->digest[hash] = NULL;
+
+      CALL(this, add, AFF4_HASH, digest_value(self, hash, digest, length));
+    };
+  };
+
+  AFF4_GL_UNLOCK;
+  return result;
 };
 
 
@@ -350,11 +2057,17 @@ VIRTUAL(AFF4Image, FileLikeObject) {
   VMETHOD_BASE(AFFObject, close) = AFF4Image_close;
   VMETHOD_BASE(FileLikeObject, write) = AFF4Image_write;
   VMETHOD_BASE(FileLikeObject, read) = AFF4Image_read;
+  VMETHOD_BASE(FileLikeObject, read_at) = AFF4Image_read_at;
+  VMETHOD_BASE(FileLikeObject, write_at) = AFF4Image_write_at;
 } END_VIRTUAL
 
 
 AFF4_MODULE_INIT(A000_image) {
   INIT_CLASS(ImageWorker);
+  INIT_CLASS(BevyIndex);
+  INIT_CLASS(ChunkPrefetcher);
+  INIT_CLASS(ParallelRead);
+  INIT_CLASS(ChunkDecompressor);
 
   register_type_dispatcher(AFF4_IMAGE, (AFFObject *)GETCLASS(AFF4Image));
 };
@@ -41,19 +41,16 @@ static Cache Cache_Con(Cache self, int hash_table_width, int max_cache_size) {
   return self;
 };
 
-/** Quick and simple */
+/** Quick and simple (FNV-1a) */
 static int Cache_hash(Cache self, char *key, int len) {
-  // Use int size to obtain the hashes this should be faster... NOTE
-  // that we dont process up to the last 3 bytes.
   unsigned char *name = (unsigned char *)key;
-  // Alternate function - maybe faster?
-  //  unsigned uint32_t *name = (unsigned uint32_t *)key;
-  unsigned int result = 0;
+  unsigned int result = 2166136261U;
   int i;
-  int count = len / sizeof(*name);
 
-  for(i=0; i<count; i++)
+  for(i=0; i<len; i++) {
     result ^= name[i];
+    result *= 16777619U;
+  };
 
   return result % self->hash_table_width;
 };
@@ -90,6 +87,12 @@ static Cache Cache_put(Cache self, char *key, int len, Object data) {
 
   AFF4_GL_LOCK;
 
+  if(self->frozen) {
+    RaiseError(ERuntimeError, "Cache is frozen");
+    AFF4_GL_UNLOCK;
+    return NULL;
+  };
+
   // Check to see if we need to expire something else. We do this
   // first to avoid the possibility that we might expire the same key
   // we are about to add.
@@ -147,6 +150,11 @@ static Object Cache_get(Cache self, void *ctx, char *key, int len) {
 
   AFF4_GL_LOCK;
 
+  if(self->frozen) {
+    RaiseError(ERuntimeError, "Cache is frozen");
+    goto error;
+  };
+
   if(!self->hash_table)
     goto error;
 
@@ -185,20 +193,21 @@ static Object Cache_get(Cache self, void *ctx, char *key, int len) {
 };
 
 
-static Object Cache_borrow(Cache self, char *key, int len) {
+/* Finds the first entry for the key. This does not lock, so the
+   caller must hold the global lock unless the cache is frozen.
+*/
+static Cache find_entry(Cache self, char *key, int len) {
   int hash;
   Cache hash_list_head;
   Cache i;
 
-  AFF4_GL_LOCK;
-
   if(!self->hash_table)
-    goto error;
+    return NULL;
 
   hash = CALL(self, hash, key, len);
   hash_list_head = self->hash_table[hash];
   if(!hash_list_head)
-    goto error;
+    return NULL;
 
   // There are 2 lists each Cache object is on - the hash list is a
   // shorter list at the end of each hash table slot, while the cache
@@ -206,43 +215,53 @@ static Object Cache_borrow(Cache self, char *key, int len) {
   // object using the hash list, but expire the object based on the
   // cache list which is also kept in sorted order.
   list_for_each_entry(i, &hash_list_head->hash_list, hash_list) {
-    if(i->key_len == len && !CALL(i, cmp, key, len)) {
-      AFF4_GL_UNLOCK;
-
-      return i->data;
-    };
+    if(i->key_len == len && !CALL(i, cmp, key, len))
+      return i;
   };
 
- error:
-  AFF4_GL_UNLOCK;
   return NULL;
 };
 
-
-int Cache_present(Cache self, char *key, int len) {
-  int hash;
-  Cache hash_list_head;
+static Object Cache_borrow(Cache self, char *key, int len) {
   Cache i;
 
+  // Nothing can change in a frozen cache.
+  if(self->frozen) {
+    i = find_entry(self, key, len);
+    return i ? i->data : NULL;
+  };
+
   AFF4_GL_LOCK;
 
-  if(self->hash_table) {
-    hash = CALL(self, hash, key, len);
-    hash_list_head = self->hash_table[hash];
-    if(!hash_list_head)
-      goto exit;
+  i = find_entry(self, key, len);
+  if(!i)
+    goto error;
 
-    list_for_each_entry(i, &hash_list_head->hash_list, hash_list) {
-      if(i->key_len == len && !CALL(i, cmp, key, len)) {
-        AFF4_GL_UNLOCK;
-        return 1;
-      };
-    };
+  /* Using an object makes it the most recently used. */
+  if(self->policy == CACHE_EXPIRE_LEAST_USED) {
+    list_move_tail(&i->cache_list, &self->cache_list);
   };
 
- exit:
   AFF4_GL_UNLOCK;
-  return 0;
+  return i->data;
+
+ error:
+  AFF4_GL_UNLOCK;
+  return NULL;
+};
+
+
+int Cache_present(Cache self, char *key, int len) {
+  int result;
+
+  if(self->frozen)
+    return find_entry(self, key, len) != NULL;
+
+  AFF4_GL_LOCK;
+  result = find_entry(self, key, len) != NULL;
+  AFF4_GL_UNLOCK;
+
+  return result;
 };
 
 static Object Cache_iter(Cache self, char *key, int len) {
@@ -308,11 +327,18 @@ static Object Cache_next(Cache self, Object *opaque_iter) {
   result = iter->data;
 
   // We refresh the current object in the cache:
-  list_move_tail(&iter->cache_list, &self->cache_list);
+  if(!self->frozen)
+    list_move_tail(&iter->cache_list, &self->cache_list);
 
   return result;
 };
 
+static void Cache_freeze(Cache self) {
+  AFF4_GL_LOCK;
+  self->frozen = 1;
+  AFF4_GL_UNLOCK;
+};
+
 
 VIRTUAL(Cache, Object) {
      VMETHOD(Con) = Cache_Con;
@@ -322,6 +348,7 @@ VIRTUAL(Cache, Object) {
      VMETHOD(get) = Cache_get;
      VMETHOD(present) = Cache_present;
      VMETHOD(borrow) = Cache_borrow;
+     VMETHOD(freeze) = Cache_freeze;
 
      VMETHOD(iter) = Cache_iter;
      VMETHOD(next) = Cache_next;
@@ -331,52 +358,261 @@ VIRTUAL(Cache, Object) {
 } END_VIRTUAL
 
 
+static int ThreadPoolJob_complete(ThreadPoolJob self) {
+  return 1;
+};
+
 VIRTUAL(ThreadPoolJob, Object) {
   UNIMPLEMENTED(ThreadPoolJob, run);
+  VMETHOD(complete) = ThreadPoolJob_complete;
 } END_VIRTUAL
 
 
-static void *ThreadPool_worker(void *ctx) {
-  ThreadPool pool = (ThreadPool) ctx;
+/* Each worker thread has its own deque of jobs. The worker takes
+   jobs from the tail and thieves take them from the head, both under
+   the worker's mutex - never the global lock.
+*/
+struct ThreadPoolWorker_t {
+  ThreadPool pool;
+  pthread_t thread;
 
-  AFF4_GL_LOCK;
+  pthread_mutex_t lock;
+  struct list_head jobs;
+  int queued;
+};
+
+/* The jobs one thread has scheduled but not completed yet. */
+struct ThreadPoolOwner_t {
+  pthread_t thread;
+  struct list_head jobs;
+  struct list_head list;
+};
+
+/* Returns the worker for the current thread or NULL if this is not
+   one of our threads.
+*/
+static struct ThreadPoolWorker_t *current_worker(ThreadPool self) {
+  pthread_t thread = pthread_self();
+  int i;
+
+  for(i=0; i<self->number_of_threads; i++) {
+    if(pthread_equal(self->workers[i].thread, thread))
+      return &self->workers[i];
+  };
+
+  return NULL;
+};
+
+/* Returns the calling thread's list of jobs, making one if create is
+   set. Must be called with the global lock held.
+*/
+static struct ThreadPoolOwner_t *find_owner(ThreadPool self, int create) {
+  pthread_t thread = pthread_self();
+  struct ThreadPoolOwner_t *owner;
+
+  list_for_each_entry(owner, &self->owners, list) {
+    if(pthread_equal(owner->thread, thread))
+      return owner;
+  };
+
+  if(!create)
+    return NULL;
+
+  owner = talloc_zero(self, struct ThreadPoolOwner_t);
+  if(!owner)
+    return NULL;
+
+  owner->thread = thread;
+  INIT_LIST_HEAD(&owner->jobs);
+  list_add_tail(&owner->list, &self->owners);
+
+  return owner;
+};
+
+/* Takes a job off the worker's deque - the newest one if we are the
+   worker and the oldest one if we are stealing. Returns NULL if the
+   deque is empty.
+*/
+static ThreadPoolJob pop_job(struct ThreadPoolWorker_t *worker, int steal) {
+  ThreadPool pool = worker->pool;
+  ThreadPoolJob job = NULL;
+
+  pthread_mutex_lock(&worker->lock);
+  if(!list_empty(&worker->jobs)) {
+    if(steal) {
+      list_next(job, &worker->jobs, list);
+    } else {
+      list_prev(job, &worker->jobs, list);
+    };
+
+    list_del_init(&job->list);
+    __atomic_sub_fetch(&worker->queued, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+  };
+  pthread_mutex_unlock(&worker->lock);
+
+  return job;
+};
+
+/* Takes the oldest job scheduled from outside the pool without
+   waiting. Returns NULL if there is none.
+*/
+static ThreadPoolJob get_injected(ThreadPool self) {
+  ThreadPoolJob job = (ThreadPoolJob)CALL(self->injection, get, 0);
+
+  if(job)
+    __atomic_sub_fetch(&self->queued, 1, __ATOMIC_RELAXED);
+
+  return job;
+};
+
+/* Moves everything on the injection queue onto the worker deques so
+   it can be found there. Must be called with the global lock held so
+   nobody can schedule in the meantime.
+*/
+static void drain_injected(ThreadPool self) {
+  ThreadPoolJob job;
+  int i = 0;
+
+  while((job = (ThreadPoolJob)CALL(self->injection, get, 0))) {
+    struct ThreadPoolWorker_t *worker = &self->workers[i++ % self->number_of_threads];
+
+    pthread_mutex_lock(&worker->lock);
+    list_add(&job->list, &worker->jobs);
+    __atomic_add_fetch(&worker->queued, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&worker->lock);
+  };
+};
+
+/* Finds the next job for the worker. We take our own newest job
+   first, then the oldest one scheduled from outside. If there are
+   none we steal the oldest job of the busiest worker - it is the one
+   its owner is least likely to get to soon.
+*/
+static ThreadPoolJob next_job(ThreadPool self, struct ThreadPoolWorker_t *worker) {
+  struct ThreadPoolWorker_t *victim = NULL;
+  int victim_queued = 0;
+  ThreadPoolJob job;
+  int i;
+
+  job = pop_job(worker, 0);
+  if(job)
+    return job;
+
+  job = get_injected(self);
+  if(job)
+    return job;
+
+  for(i=0; i<self->number_of_threads; i++) {
+    int queued = __atomic_load_n(&self->workers[i].queued, __ATOMIC_RELAXED);
+
+    if(queued > victim_queued) {
+      victim = &self->workers[i];
+      victim_queued = queued;
+    };
+  };
+
+  if(!victim)
+    return NULL;
+
+  job = pop_job(victim, 1);
+  if(job)
+    __atomic_add_fetch(&self->jobs_stolen, 1, __ATOMIC_RELAXED);
+
+  return job;
+};
+
+static void *ThreadPool_worker(void *ctx) {
+  struct ThreadPoolWorker_t *worker = (struct ThreadPoolWorker_t *)ctx;
+  ThreadPool pool = worker->pool;
 
   while(1) {
-    /* One hundredth of a second time resolution for cancelation. */
-    ThreadPoolJob job;
+    ThreadPoolJob job = next_job(pool, worker);
 
-    job = CALL(pool->jobs, get, 100000);
     if(job) {
-      // Run the job
+      // Only the job itself runs under the global lock
+      AFF4_GL_LOCK;
+      job->state = JOB_RUNNING;
+      job->thread_id = pthread_self();
+
+      // Errors left by the last job must not be blamed on this one.
+      ClearError();
       CALL(job, run);
 
-      /* Only quit if the pool is not active and there are no more
-         waiting tasks.
-      */
-    } else if(!pool->active) {
+      job->state = JOB_DONE;
+      pthread_cond_broadcast(&pool->job_done);
+      AFF4_GL_UNLOCK;
+      continue;
+    };
+
+    /* Only quit if the pool is not active and there are no more
+       waiting tasks. Schedule() and join() signal with the mutex held
+       so we can not miss them between the check and the wait. The
+       count can dip below zero when a worker takes a job from the
+       queue before schedule() has counted it.
+    */
+    pthread_mutex_lock(&pool->lock);
+    while(pool->active &&
+          __atomic_load_n(&pool->queued, __ATOMIC_RELAXED) <= 0) {
+      pthread_cond_wait(&pool->work_available, &pool->lock);
+    };
+
+    if(!pool->active &&
+       __atomic_load_n(&pool->queued, __ATOMIC_RELAXED) <= 0) {
+      pthread_mutex_unlock(&pool->lock);
       break;
     };
+    pthread_mutex_unlock(&pool->lock);
   };
 
-  AFF4_GL_UNLOCK;
   return NULL;
 };
 
 
+static int ThreadPool_destructor(void *this) {
+  ThreadPool self = (ThreadPool)this;
+  int i;
+
+  for(i=0; i<self->number_of_threads; i++) {
+    pthread_mutex_destroy(&self->workers[i].lock);
+  };
+
+  pthread_mutex_destroy(&self->lock);
+  pthread_cond_destroy(&self->work_available);
+  pthread_cond_destroy(&self->job_done);
+
+  return 0;
+};
+
 static ThreadPool ThreadPool_Con(ThreadPool self, int number) {
   int i = 0;
 
   AFF4_GL_LOCK;
 
-  self->jobs = CONSTRUCT(Queue, Queue, Con, self, number);
-  self->completed_jobs = CONSTRUCT(Queue, Queue, Con, self, number);
+  INIT_LIST_HEAD(&self->owners);
+  self->workers = talloc_zero_array(self, struct ThreadPoolWorker_t, number);
+  self->injection = CONSTRUCT(Queue, Queue, Con, self, number);
   self->number_of_threads = number;
-  self->threads = talloc_array(self, pthread_t, number + 1);
   self->active = True;
 
-  /* Start up all the threads. */
+  pthread_mutex_init(&self->lock, NULL);
+  pthread_cond_init(&self->work_available, NULL);
+  pthread_cond_init(&self->job_done, NULL);
+
+  for(i = 0; i<number; i++) {
+    self->workers[i].pool = self;
+    pthread_mutex_init(&self->workers[i].lock, NULL);
+    INIT_LIST_HEAD(&self->workers[i].jobs);
+  };
+
+  talloc_set_destructor((void *)self, ThreadPool_destructor);
+
+  /* Start up all the threads. The workers are all set up before
+     they look at them.
+  */
   for(i = 0; i<number; i++) {
-    pthread_create(&self->threads[i], NULL, ThreadPool_worker, self);
+    pthread_create(&self->workers[i].thread, NULL, ThreadPool_worker,
+                   &self->workers[i]);
   };
 
   AFF4_GL_UNLOCK;
@@ -384,34 +620,214 @@ static ThreadPool ThreadPool_Con(ThreadPool self, int number) {
 };
 
 
-static int ThreadPool_schedule(ThreadPool self, ThreadPoolJob job, 
-                               int timeout) {
-  int result;
+static ThreadPoolJob ThreadPool_schedule(ThreadPool self, ThreadPoolJob job,
+                                         int timeout) {
+  struct ThreadPoolWorker_t *worker;
+  struct ThreadPoolOwner_t *owner;
+  ThreadPoolJob result = NULL;
+
+  AFF4_GL_LOCK;
+
+  worker = current_worker(self);
+  owner = find_owner(self, 1);
+  if(!owner) {
+    RaiseError(ENoMemory, "Unable to allocate memory");
+    goto exit;
+  };
+
+  /* Workers scheduling jobs put them on their own deque and do not
+     wait for room - they might be the ones which need to make
+     it. Everyone else waits on the queue, which releases the global
+     lock, so the job must not be touched until it is in.
+  */
+  if(worker) {
+    pthread_mutex_lock(&worker->lock);
+    list_add_tail(&job->list, &worker->jobs);
+    __atomic_add_fetch(&worker->queued, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&worker->lock);
+  } else if(!CALL(self->injection, put, job, max(timeout, 0) * 1000000)) {
+    goto exit;
+  };
+
+  /* We now own the job. The workers only run it with the global lock
+     held, so it is all set up before they do.
+  */
+  talloc_steal(self, job);
+
+  job->owner = owner->thread;
+  job->state = JOB_QUEUED;
+  list_add_tail(&job->pending, &owner->jobs);
+
+  __atomic_add_fetch(&self->queued, 1, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&self->lock);
+  pthread_cond_signal(&self->work_available);
+  pthread_mutex_unlock(&self->lock);
+
+  result = job;
+
+ exit:
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+
+static int ThreadPool_cancel(ThreadPool self, void *ctx, ThreadPoolJob job) {
+  int i;
+  int result = 0;
 
   AFF4_GL_LOCK;
 
-  result = CALL(self->jobs, put, job, timeout * 1000000);
+  /* A worker might have taken the job off its deque or the queue but
+     not started it yet - then it is too late to cancel.
+  */
+  if(job->state == JOB_QUEUED) {
+    drain_injected(self);
+
+    for(i=0; i<self->number_of_threads && !result; i++) {
+      struct ThreadPoolWorker_t *worker = &self->workers[i];
+      ThreadPoolJob j;
+
+      pthread_mutex_lock(&worker->lock);
+      list_for_each_entry(j, &worker->jobs, list) {
+        if(j == job) {
+          list_del_init(&job->list);
+          __atomic_sub_fetch(&worker->queued, 1, __ATOMIC_RELAXED);
+          __atomic_sub_fetch(&self->queued, 1, __ATOMIC_RELAXED);
+          result = 1;
+          break;
+        };
+      };
+      pthread_mutex_unlock(&worker->lock);
+    };
+  };
+
+  if(result) {
+    list_del_init(&job->pending);
+    talloc_steal(ctx, job);
+  };
 
   AFF4_GL_UNLOCK;
+  return result;
+};
+
+
+/* Completes the calling thread's jobs in the order they were
+   scheduled, up to (and including) last or the first job which is not
+   done yet. Returns the number of jobs completed, and the result of
+   last in result.
+*/
+static int complete_jobs(ThreadPool self, ThreadPoolJob last, int *result) {
+  struct ThreadPoolOwner_t *owner = find_owner(self, 0);
+  ThreadPoolJob i, j;
+  int count = 0;
 
+  if(!owner)
+    return 0;
+
+  list_for_each_entry_safe(i, j, &owner->jobs, pending) {
+    int job_result;
+
+    if(i->state != JOB_DONE)
+      break;
+
+    list_del(&i->pending);
+    job_result = CALL(i, complete);
+    count ++;
+
+    /* The job may still be referenced by whoever it worked for - we
+       just drop our link to it.
+    */
+    talloc_unlink(self, i);
+
+    if(i == last) {
+      *result = job_result;
+      break;
+    };
+  };
+
+  // Threads which are done scheduling do not leave anything behind
+  if(list_empty(&owner->jobs)) {
+    list_del(&owner->list);
+    talloc_free(owner);
+  };
+
+  return count;
+};
+
+
+static int ThreadPool_wait(ThreadPool self, ThreadPoolJob job) {
+  int result = 0;
+  ThreadPoolJob i;
+
+  AFF4_GL_LOCK;
+
+  /* Our jobs are completed in order, so we wait for all of ours
+     which were scheduled before this one too.
+  */
+  while(1) {
+    struct ThreadPoolOwner_t *owner = find_owner(self, 0);
+    int ready = 1;
+
+    if(!owner)
+      break;
+
+    list_for_each_entry(i, &owner->jobs, pending) {
+      if(i->state != JOB_DONE) {
+        ready = 0;
+        break;
+      };
+
+      if(i == job)
+        break;
+    };
+
+    if(ready)
+      break;
+
+    CALL(aff4_gl_lock, wait, &self->job_done);
+  };
+
+  complete_jobs(self, job, &result);
+
+  AFF4_GL_UNLOCK;
   return result;
 };
 
+
+static int ThreadPool_complete(ThreadPool self) {
+  int result;
+  int count;
+
+  AFF4_GL_LOCK;
+  count = complete_jobs(self, NULL, &result);
+  AFF4_GL_UNLOCK;
+
+  return count;
+};
+
+
 static void ThreadPool_join(ThreadPool self) {
   int i;
-  int depth;
+  int result;
 
   AFF4_GL_LOCK;
+
+  pthread_mutex_lock(&self->lock);
   self->active = False;
+  pthread_cond_broadcast(&self->work_available);
+  pthread_mutex_unlock(&self->lock);
 
   /* Wait for the workers to quit. */
   for(i=0; i < self->number_of_threads; i++) {
     /* Allow other threads to run while we wait here. */
     AFF4_BEGIN_ALLOW_THREADS;
-    pthread_join(self->threads[i], NULL);
+    pthread_join(self->workers[i].thread, NULL);
     AFF4_END_ALLOW_THREADS;
   };
 
+  complete_jobs(self, NULL, &result);
+
   AFF4_GL_UNLOCK;
 };
 
@@ -419,6 +835,9 @@ static void ThreadPool_join(ThreadPool self) {
 VIRTUAL(ThreadPool, Object) {
   VMETHOD(Con) = ThreadPool_Con;
   VMETHOD(schedule) = ThreadPool_schedule;
+  VMETHOD(cancel) = ThreadPool_cancel;
+  VMETHOD(wait) = ThreadPool_wait;
+  VMETHOD(complete) = ThreadPool_complete;
   VMETHOD(join) = ThreadPool_join;
 } END_VIRTUAL
 
@@ -440,6 +859,7 @@ void AFF4GlobalLock_lock(AFF4GlobalLock self, int number){
 
   for(i=0; i<number; i++) {
     if(pthread_mutex_lock(&self->mutex) == 0) {
+      self->current_thread = pthread_self();
       self->depth ++;
     } else {
       printf("Error locking %08X\n", pthread_self());
@@ -455,6 +875,12 @@ void AFF4GlobalLock_unlock(AFF4GlobalLock self, int number) {
 
   for(i=0; i<number; i++) {
     self->depth --;
+
+    // Only the owner ever sets current_thread to itself, so clearing
+    // it here lets other threads tell they do not hold the lock.
+    if(self->depth == 0)
+      self->current_thread = 0;
+
     pthread_mutex_unlock(&self->mutex);
   };
 };
@@ -468,6 +894,10 @@ int AFF4GlobalLock_timedwait(AFF4GlobalLock self, pthread_cond_t *condition, int
   gettimeofday(&now, NULL);
   deadline.tv_sec = now.tv_sec + timeout / 1000000;
   deadline.tv_nsec = (now.tv_usec + timeout % 1000000) * 1000;
+  if(deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec ++;
+    deadline.tv_nsec -= 1000000000;
+  };
 
   /* Now we unlock the mutex until a depth of one, then wait on the
      condition variable. This ensures the mutex becomes completely
@@ -481,8 +911,10 @@ int AFF4GlobalLock_timedwait(AFF4GlobalLock self, pthread_cond_t *condition, int
      so we need to track it.
   */
   self->depth --;
+  self->current_thread = 0;
   res = pthread_cond_timedwait(condition,
                                &self->mutex, &deadline);
+  self->current_thread = pthread_self();
   self->depth ++;
 
   /* Restore the lock level. */
@@ -491,9 +923,31 @@ int AFF4GlobalLock_timedwait(AFF4GlobalLock self, pthread_cond_t *condition, int
 };
 
 
-static int AFF4GlobalLock_allow_threads(AFF4GlobalLock self) {
+void AFF4GlobalLock_wait(AFF4GlobalLock self, pthread_cond_t *condition) {
   int depth = self->depth;
 
+  /* As in timedwait, the condition wait releases the last level. */
+  CALL(self, unlock, depth - 1);
+
+  self->depth --;
+  self->current_thread = 0;
+  pthread_cond_wait(condition, &self->mutex);
+  self->current_thread = pthread_self();
+  self->depth ++;
+
+  CALL(self, lock, depth - 1);
+};
+
+
+static int AFF4GlobalLock_allow_threads(AFF4GlobalLock self) {
+  int depth;
+
+  // Nothing to release if we do not hold the lock.
+  if(!pthread_equal(self->current_thread, pthread_self()))
+    return 0;
+
+  depth = self->depth;
+
   CALL(self, unlock, depth);
   return depth;
 };
@@ -504,5 +958,87 @@ VIRTUAL(AFF4GlobalLock, Object) {
   VMETHOD(lock) = AFF4GlobalLock_lock;
   VMETHOD(unlock) = AFF4GlobalLock_unlock;
   VMETHOD(timedwait) = AFF4GlobalLock_timedwait;
+  VMETHOD(wait) = AFF4GlobalLock_wait;
   VMETHOD(allow_threads) = AFF4GlobalLock_allow_threads;
 } END_VIRTUAL
+
+
+static int AFF4Lock_destructor(void *this) {
+  AFF4Lock self = (AFF4Lock)this;
+
+  pthread_mutex_destroy(&self->mutex);
+  pthread_cond_destroy(&self->released);
+  return 0;
+};
+
+static AFF4Lock AFF4Lock_Con(AFF4Lock self) {
+  pthread_mutex_init(&self->mutex, NULL);
+  pthread_cond_init(&self->released, NULL);
+  talloc_set_destructor((void *)self, AFF4Lock_destructor);
+
+  return self;
+};
+
+static void AFF4Lock_acquire(AFF4Lock self) {
+  pthread_t me = pthread_self();
+  struct timeval start, now;
+
+  pthread_mutex_lock(&self->mutex);
+
+  if(self->depth == 0 || pthread_equal(self->owner, me)) {
+    self->owner = me;
+    self->depth++;
+    pthread_mutex_unlock(&self->mutex);
+    return;
+  };
+
+  self->contended++;
+  pthread_mutex_unlock(&self->mutex);
+
+  /* We must not hold the global lock (or our mutex) while we wait for
+     the global lock back, or the owner could never release us.
+  */
+  gettimeofday(&start, NULL);
+
+  AFF4_BEGIN_ALLOW_THREADS;
+  pthread_mutex_lock(&self->mutex);
+
+  while(self->depth > 0) {
+    pthread_cond_wait(&self->released, &self->mutex);
+  };
+
+  self->owner = me;
+  self->depth = 1;
+
+  gettimeofday(&now, NULL);
+  self->wait_usec += (now.tv_sec - start.tv_sec) * 1000000LL +
+    now.tv_usec - start.tv_usec;
+
+  pthread_mutex_unlock(&self->mutex);
+  AFF4_END_ALLOW_THREADS;
+};
+
+static int AFF4Lock_release(AFF4Lock self) {
+  int result = 1;
+
+  pthread_mutex_lock(&self->mutex);
+
+  if(self->depth == 0 || !pthread_equal(self->owner, pthread_self())) {
+    result = 0;
+  } else if(--self->depth == 0) {
+    pthread_cond_broadcast(&self->released);
+  };
+
+  pthread_mutex_unlock(&self->mutex);
+
+  if(!result)
+    RaiseError(EProgrammingError, "Lock released by a thread which does not hold it");
+
+  return result;
+};
+
+VIRTUAL(AFF4Lock, Object) {
+  VMETHOD(Con) = AFF4Lock_Con;
+  VMETHOD(acquire) = AFF4Lock_acquire;
+  VMETHOD(release) = AFF4Lock_release;
+} END_VIRTUAL
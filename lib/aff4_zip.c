@@ -44,7 +44,11 @@ static AFFObject ZipSegment_Con(AFFObject this, RDFURN urn, char mode, Resolver
 
   self->cd.external_file_attr = 0644 << 16L;
 
+  self->stream_threshold = ZIP_STREAM_THRESHOLD;
+
   INIT_LIST_HEAD(&self->members);
+  INIT_LIST_HEAD(&self->deferred);
+  self->lock = CONSTRUCT(AFF4Lock, AFF4Lock, Con, self);
 
   result = SUPER(AFFObject, FileLikeObject, Con, urn, mode, resolver);
 
@@ -109,8 +113,188 @@ static int ZipSegment_finish(AFFObject this) {
 /**
    This zlib trickery comes from http://www.zlib.net/zlib_how.html
 **/
+/* Writes our local file header at the end of the volume. The crc and
+   sizes are not known yet so they follow the data in a data
+   descriptor (flag 0x08). Must be called with the volume lock held.
+*/
+static int write_file_header(ZipSegment self, ZipFile zip) {
+  struct ZipFileHeader header;
+  char *filename;
+
+  self->offset_of_file_header = CALL(zip->backing_store, seek, 0, SEEK_END);
+
+  // Make a filename suitable for a zip file.
+  filename = segment_name_from_URN(NULL, URNOF(self), self->container);
+  CALL(self->filename, set, ZSTRING_NO_NULL(filename));
+  talloc_free(filename);
+
+  // Write a file header on
+  memset(&header, 0, sizeof(header));
+  header.magic = 0x4034b50;
+  header.version = 0x14;
+  // We prefer to write trailing directory structures
+  header.flags = 0x08;
+
+  header.compression_method = self->cd.compression_method;
+  header.file_name_length = self->filename->length;
+  header.lastmoddate = self->cd.dosdate;
+  header.lastmodtime = self->cd.dostime;
+
+  if(CALL(zip->backing_store, write,(char *)&header, sizeof(header)) < 0 ||
+     CALL(zip->backing_store, write, self->filename->value,
+          self->filename->length) < 0) {
+    RaiseError(EIOError, "Unable to write file header.");
+    return 0;
+  };
+
+  return 1;
+};
+
+/* Writes our data to the volume - into our reservation if we have
+   one, otherwise appended with the volume lock held.
+*/
+static int write_data(ZipSegment self, ZipFile zip, char *data, unsigned int length) {
+  int result;
+
+  if(!self->reserved) {
+    CALL(zip->lock, acquire);
+    result = CALL(zip->backing_store, write, data, length);
+    CALL(zip->lock, release);
+
+    return result;
+  };
+
+  if(self->write_offset + length > self->reserved_end) {
+    RaiseError(EIOError, "Segment %s does not fit in its reservation",
+               self->filename->value);
+    return -1;
+  };
+
+  result = CALL(zip->backing_store, write_at, self->write_offset, data, length);
+  if(result > 0)
+    self->write_offset += result;
+
+  return result;
+};
+
+/* Moves the compressed data in our buffer to the volume. */
+static int flush_buffer(ZipSegment self, ZipFile zip) {
+  if(self->buffer->size > 0) {
+    if(write_data(self, zip, self->buffer->data, self->buffer->size) < 0) {
+      RaiseError(EIOError, "Unable to write compressed data.");
+      return 0;
+    };
+
+    CALL(self->buffer, truncate, 0);
+  };
+
+  return 1;
+};
+
+/* Writes the Zip64 data descriptor which follows our data (Segments
+   will never be larger than 4G). Reserved segments always have room
+   for it after the reserved range.
+*/
+static int write_descriptor(ZipSegment self, ZipFile zip) {
+  struct ZipDataDescriptor descriptor;
+
+  descriptor.magic = 0x08074b50;
+  descriptor.crc32 = self->cd.crc32;
+  descriptor.compress_size = self->cd.compress_size;
+  descriptor.file_size = self->cd.file_size;
+
+  if(self->reserved)
+    return CALL(zip->backing_store, write_at, self->write_offset, (char *)&descriptor,
+                sizeof(descriptor)) == sizeof(descriptor);
+
+  return CALL(zip->backing_store, write, (char *)&descriptor,
+              sizeof(descriptor)) == sizeof(descriptor);
+};
+
+/* Takes the volume lock so self can append to the volume, unless
+   another segment is streaming. Then we are refused, since anything
+   appended now would end up in the middle of its data.
+*/
+static int lock_for_append(ZipSegment self, ZipFile zip) {
+  CALL(zip->lock, acquire);
+
+  if(zip->streaming_segment && zip->streaming_segment != self) {
+    RaiseError(EIOError, "Can not append %s while %s is streaming to the volume",
+               self->filename->value, zip->streaming_segment->filename->value);
+    CALL(zip->lock, release);
+    return 0;
+  };
+
+  return 1;
+};
+
+/* Starts streaming this segment to the volume. The lock is only held
+   to write our header - while we are zip->streaming_segment nothing
+   else is appended in the middle of our data. Only one segment
+   streams at a time, the others keep their data in memory.
+*/
+static int start_streaming(ZipSegment self, ZipFile zip) {
+  CALL(zip->lock, acquire);
+
+  if(zip->streaming_segment) {
+    CALL(zip->lock, release);
+    return 1;
+  };
+
+  if(!write_file_header(self, zip)) {
+    CALL(zip->lock, release);
+    return 0;
+  };
+
+  AFF4_LOG(AFF4_LOG_MESSAGE, AFF4_SERVICE_ZIP_VOLUME, URNOF(self),
+           "Streaming segment to volume");
+
+  self->streaming = 1;
+  zip->streaming_segment = self;
+  CALL(zip->lock, release);
+  return 1;
+};
+
+/* Appends a member which was closed while we were streaming. Members
+   which can not be written are left out of the volume.
+*/
+static int append_deferred(ZipSegment self, ZipFile zip) {
+  list_del_init(&self->deferred);
+
+  if(!write_file_header(self, zip) || !flush_buffer(self, zip) ||
+     !write_descriptor(self, zip)) {
+    RaiseError(EIOError, "Unable to write segment %s", self->filename->value);
+    list_del_init(&self->members);
+    return 0;
+  };
+
+  talloc_free(self->buffer);
+  self->buffer = NULL;
+  return 1;
+};
+
+/* Stops streaming and appends the members which were closed in the
+   meantime. Returns 0 if any of them could not be written.
+*/
+static int stop_streaming(ZipSegment self, ZipFile zip) {
+  ZipSegment i, j;
+  int result = 1;
+
+  CALL(zip->lock, acquire);
+
+  self->streaming = 0;
+  zip->streaming_segment = NULL;
+
+  list_for_each_entry_safe(i, j, &zip->deferred_members, deferred)
+    result = append_deferred(i, zip) && result;
+
+  CALL(zip->lock, release);
+  return result;
+};
+
 static int ZipSegment_write(FileLikeObject self, char *buffer, unsigned int length) {
   ZipSegment this = (ZipSegment)self;
+  ZipFile zip = NULL;
   int result = 0;
 
   AFF4_GL_LOCK;
@@ -122,11 +306,15 @@ static int ZipSegment_write(FileLikeObject self, char *buffer, unsigned int leng
     goto error;
   }
 
+  // Once we are streaming (or reserved) data goes straight to the volume.
+  if(this->streaming || this->reserved) {
+    zip = (ZipFile)CALL(((AFFObject)self)->resolver, own, this->container, 'w');
+    if(!zip) {
+      RaiseError(ERuntimeError, "Unable to get container.");
+      goto error;
+    };
+  };
 
-  // Update the crc:
-  this->cd.crc32 = crc32(this->cd.crc32,
-                         (unsigned char*)buffer,
-                         (unsigned int)length);
 
   // Is this compressed?
   switch(this->cd.compression_method) {
@@ -160,13 +348,47 @@ static int ZipSegment_write(FileLikeObject self, char *buffer, unsigned int leng
     case ZIP_STORED:
     default:
       /** Without compression, we just write the buffer right away */
-      result = CALL(this->buffer, write, buffer, length);
+      if(zip)
+        result = write_data(this, zip, buffer, length);
+      else
+        result = CALL(this->buffer, write, buffer, length);
+
+      if(result<0) {
+        RaiseError(EIOError, "Unable to write data.");
+        goto error;
+      };
   };
 
+  // Update the crc:
+  this->cd.crc32 = crc32(this->cd.crc32,
+                         (unsigned char*)buffer,
+                         (unsigned int)length);
+
   /** Update our compressed size here */
   this->cd.compress_size += result;
   this->cd.file_size += length;
 
+  /* Large segments are not kept in memory, unless another one is
+     already streaming.
+  */
+  if(!zip && this->buffer->size > this->stream_threshold) {
+    zip = (ZipFile)CALL(((AFFObject)self)->resolver, own, this->container, 'w');
+    if(!zip) {
+      RaiseError(ERuntimeError, "Unable to get container.");
+      goto error;
+    };
+
+    if(!start_streaming(this, zip))
+      goto error;
+  };
+
+  if(zip) {
+    if((this->streaming || this->reserved) && !flush_buffer(this, zip))
+      goto error;
+
+    CALL(((AFFObject)self)->resolver, cache_return, (AFFObject)zip);
+  };
+
  exit:
   // Non error path
   ClearError();
@@ -175,82 +397,131 @@ static int ZipSegment_write(FileLikeObject self, char *buffer, unsigned int leng
   return result;
 
  error:
+  // Returning the volume clears the error.
+  if(zip) {
+    PUSH_ERROR_STATE;
+    CALL(((AFFObject)self)->resolver, cache_return, (AFFObject)zip);
+    POP_ERROR_STATE;
+  };
+
   AFF4_GL_UNLOCK;
   return -1;
 };
 
 
-/* Read the entire segment into memory. */
-static int decompress_segment(ZipSegment self) {
-  AFFObject oself = (AFFObject)self;
-  ZipFile zip = (ZipFile)CALL(oself->resolver, own, self->container, 'r');
-  struct ZipFileHeader file_header;
+/* Checks the local file header against the CD and finds where our
+   data starts. We use positioned reads so the volume is not locked.
+*/
+static int locate_data(ZipSegment self, ZipFile zip,
+                       struct ZipFileHeader *file_header) {
   char filename[BUFF_SIZE];
+  uint64_t data_offset;
   int length;
 
-  if(!zip) {
-    RaiseError(EIOError, "Unable to open container.");
+  if(CALL(zip->backing_store, read_at, self->offset_of_file_header,
+          (char *)file_header, sizeof(*file_header)) != sizeof(*file_header)) {
+    RaiseError(EIOError, "Unable to read file header.");
     return 0;
   };
 
-  CALL(zip->backing_store, seek, self->offset_of_file_header, SEEK_SET);
-  CALL(zip->backing_store, read, (char *)&file_header, sizeof(file_header));
-
   /* Check the file header makes sense: */
-  if(file_header.file_name_length != self->cd.file_name_length) {
+  if(file_header->magic != 0x4034b50 ||
+     file_header->file_name_length != self->cd.file_name_length ||
+     file_header->compression_method != self->cd.compression_method) {
     RaiseError(EIOError, "File header does not match CD record.");
-    goto error;
+    return 0;
   };
 
-  length = CALL(zip->backing_store, read, filename,
-                min(BUFF_SIZE, file_header.file_name_length));
-  if(length != file_header.file_name_length)
-    goto error;
+  length = CALL(zip->backing_store, read_at,
+                self->offset_of_file_header + sizeof(*file_header), filename,
+                min(BUFF_SIZE, file_header->file_name_length));
+  if(length != file_header->file_name_length) {
+    RaiseError(EIOError, "Unable to read file header.");
+    return 0;
+  };
 
   /* Check the filenames match. */
   if(memcmp(self->filename->value, filename, self->filename->length)) {
     RaiseError(EIOError, "Filename does not match CD record.");
-    goto error;
+    return 0;
   };
 
-  // Make a new buffer.
-  self->buffer = CONSTRUCT(StringIO, StringIO, Con, self);
+  data_offset = self->offset_of_file_header + sizeof(*file_header) +
+    file_header->file_name_length + file_header->extra_field_len;
+
+  /* Readers which see the data_offset may use the mapping without
+     any locks.
+  */
+  __atomic_store_n(&self->mapped, CALL(zip->backing_store, borrow, data_offset,
+                                       self->cd.compress_size), __ATOMIC_RELEASE);
+  __atomic_store_n(&self->data_offset, data_offset, __ATOMIC_RELEASE);
+
+  return 1;
+};
+
+/* Read the entire segment into memory. The caller holds the segment
+   lock. We inflate with the global lock released. Stored segments are
+   never loaded - see read_stored_segment().
+*/
+static int decompress_segment(ZipSegment self) {
+  AFFObject oself = (AFFObject)self;
+  ZipFile zip = (ZipFile)CALL(oself->resolver, own, self->container, 'r');
+  struct ZipFileHeader file_header;
+  StringIO buffer = NULL;
+  unsigned char *cbuff = NULL;
+  int length;
+
+  if(!zip) {
+    RaiseError(EIOError, "Unable to open container.");
+    return 0;
+  };
+
+  if(!locate_data(self, zip, &file_header))
+    goto error;
+
+  // Make a new buffer. We only publish it in self->buffer once it is
+  // filled.
+  buffer = CONSTRUCT(StringIO, StringIO, Con, self);
 
   // Pre-allocate the buffer
-  CALL(self->buffer, seek, self->cd.file_size, SEEK_SET);
+  CALL(buffer, seek, self->cd.file_size, SEEK_SET);
 
   /* Depending on the compression_method we do different things here. */
   switch(file_header.compression_method) {
-
-    /* Just read the data directly into the buffer. */
-    case ZIP_STORED: {
-      self->buffer->readptr = CALL(zip->backing_store, read, self->buffer->data,
-                                   self->buffer->size);
-    }; break;
-
     case ZIP_DEFLATE: {
       z_stream strm;
-      unsigned char *cbuff = talloc_size(NULL, self->cd.compress_size);
-      int length = CALL(zip->backing_store, read, (char *)cbuff, self->cd.compress_size);
+      int ret;
+
+      /* Mapped volumes are decompressed in place. */
+      if(self->mapped) {
+        length = self->cd.compress_size;
+      } else {
+        cbuff = talloc_size(NULL, self->cd.compress_size);
+        length = CALL(zip->backing_store, read_at, self->data_offset,
+                      (char *)cbuff, self->cd.compress_size);
+      };
 
       /** Set up our decompressor */
-      strm.next_in = cbuff;
+      memset(&strm, 0, sizeof(strm));
+      strm.next_in = self->mapped ? (unsigned char *)self->mapped : cbuff;
       strm.avail_in = length;
-      strm.next_out = (unsigned char *)self->buffer->data;
-      strm.avail_out = self->buffer->size;
+      strm.next_out = (unsigned char *)buffer->data;
+      strm.avail_out = buffer->size;
       strm.zalloc = Z_NULL;
       strm.zfree = Z_NULL;
 
       if(inflateInit2(&strm, -15) != Z_OK) {
         RaiseError(ERuntimeError, "Failed to initialise zlib");
-        talloc_free(cbuff);
         goto error;
       };
 
-      if(inflate(&strm, Z_FINISH) != Z_STREAM_END ||     \
-         strm.total_out != self->cd.file_size) {
+      AFF4_BEGIN_ALLOW_THREADS;
+      ret = inflate(&strm, Z_FINISH);
+      AFF4_END_ALLOW_THREADS;
+
+      if(ret != Z_STREAM_END || strm.total_out != self->cd.file_size) {
         RaiseError(ERuntimeError, "Failed to fully decompress chunk (%s)", strm.msg);
-        talloc_free(cbuff);
+        inflateEnd(&strm);
         goto error;
       };
 
@@ -264,42 +535,147 @@ static int decompress_segment(ZipSegment self) {
       goto error;
   };
 
+  // Readers of frozen segments check the buffer without any locks.
+  __atomic_store_n(&self->buffer, buffer, __ATOMIC_RELEASE);
+
   CALL(oself->resolver, cache_return, (AFFObject)zip);
   return 1;
 
 error:
+  if(cbuff) talloc_free(cbuff);
+  if(buffer) talloc_free(buffer);
+
   CALL(oself->resolver, cache_return, (AFFObject)zip);
   return 0;
 };
 
 
-static int ZipSegment_read(FileLikeObject this, char *buffer, unsigned int length) {
+/* Copies out of a loaded segment buffer. This does not touch the
+   buffer's readptr so any number of threads may do it at once.
+*/
+static int read_loaded_segment(StringIO data, uint64_t offset, char *buffer,
+                               unsigned int length) {
+  if(offset >= data->size)
+    return 0;
+
+  length = min(length, data->size - offset);
+  memcpy(buffer, data->data + offset, length);
+
+  return length;
+};
+
+/* Finds where our data starts in the volume. */
+static int find_data(ZipSegment self) {
+  AFFObject oself = (AFFObject)self;
+  struct ZipFileHeader file_header;
+  ZipFile zip;
+  int result;
+
+  AFF4_GL_LOCK;
+
+  zip = (ZipFile)CALL(oself->resolver, own, self->container, 'r');
+  if(!zip) {
+    RaiseError(EIOError, "Unable to open container.");
+    AFF4_GL_UNLOCK;
+    return 0;
+  };
+
+  result = self->data_offset || locate_data(self, zip, &file_header);
+
+  CALL(oself->resolver, cache_return, (AFFObject)zip);
+
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+/* Stored segments are just a range of the volume, so we read the
+   bytes we need straight from the backing store.
+*/
+static int read_stored_segment(ZipSegment self, uint64_t offset, char *buffer,
+                               unsigned int length) {
+  AFFObject oself = (AFFObject)self;
+  ZipFile zip;
+  int result = -1;
+
+  if(offset >= self->cd.file_size)
+    return 0;
+
+  length = min(length, self->cd.file_size - offset);
+
+  // We only check the file header on the first read.
+  if(!__atomic_load_n(&self->data_offset, __ATOMIC_ACQUIRE) && !find_data(self))
+    return -1;
+
+  /* Mapped volumes are read without any locks. */
+  if(self->mapped) {
+    memcpy(buffer, self->mapped + offset, length);
+    return length;
+  };
+
+  AFF4_GL_LOCK;
+
+  zip = (ZipFile)CALL(oself->resolver, own, self->container, 'r');
+  if(!zip) {
+    RaiseError(EIOError, "Unable to open container.");
+    goto exit;
+  };
+
+  result = CALL(zip->backing_store, read_at, self->data_offset + offset,
+                buffer, length);
+
+  CALL(oself->resolver, cache_return, (AFFObject)zip);
+
+ exit:
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+static int ZipSegment_read_at(FileLikeObject this, uint64_t offset, char *buffer,
+                              unsigned int length) {
   ZipSegment self = (ZipSegment)this;
   int result;
 
+  if(((AFFObject)self)->mode == 'r' && self->cd.compression_method == ZIP_STORED)
+    return read_stored_segment(self, offset, buffer, length);
+
+  /* Members of read only volumes only need the locks to load. */
+  if(self->frozen) {
+    StringIO data = __atomic_load_n(&self->buffer, __ATOMIC_ACQUIRE);
+
+    if(data)
+      return read_loaded_segment(data, offset, buffer, length);
+  };
+
   AFF4_GL_LOCK;
+  CALL(self->lock, acquire);
 
   /* Decompress entire segment on demand. */
   if(!self->buffer && !decompress_segment(self)) {
     goto error;
   };
 
-  CALL(self->buffer, seek, this->readptr, SEEK_SET);
-  result = CALL(self->buffer, read, buffer, length);
+  result = read_loaded_segment(self->buffer, offset, buffer, length);
 
+  CALL(self->lock, release);
   AFF4_GL_UNLOCK;
   return result;
 
 error:
+  CALL(self->lock, release);
   AFF4_GL_UNLOCK;
   return -1;
 };
 
+/* Note that reading does not move the readptr. */
+static int ZipSegment_read(FileLikeObject this, char *buffer, unsigned int length) {
+  return ZipSegment_read_at(this, this->readptr, buffer, length);
+};
+
 
 /** This writes a zip64 end of central directory and a central
     directory locator */
 static void write_zip64_CD(ZipFile self, StringIO fd, uint64_t offset_of_end_cd,
-                           uint64_t directory_offset, int total_entries) {
+                           uint64_t directory_offset, uint64_t total_entries) {
   struct Zip64CDLocator locator;
   struct Zip64EndCD end_cd;
 
@@ -324,15 +700,26 @@ static void write_zip64_CD(ZipFile self, StringIO fd, uint64_t offset_of_end_cd,
 };
 
 
+/* Zip members are written as a stream so we can only append. */
+static int ZipSegment_write_at(FileLikeObject this, uint64_t offset, char *buffer,
+                               unsigned int length) {
+  ZipSegment self = (ZipSegment)this;
+
+  if(offset != self->cd.file_size) {
+    RaiseError(EIOError, "Zip members can only be appended to.");
+    return -1;
+  };
+
+  return CALL(this, write, buffer, length);
+};
+
+
 /* Flush the new segment to our container. */
 static int ZipSegment_close(AFFObject this) {
   ZipSegment self = (ZipSegment)this;
-  uint32_t magic = 0x08074b50;
-  struct ZipFileHeader header;
-  char *filename;
   int result;
-  // By owning the zip file we guarantee we are the only thread which is writing
-  // to it now.
+  int written = 1, appended = 1;
+  // Owning the zip file keeps it alive while we write to it.
   ZipFile zip;
 
   AFF4_GL_LOCK;
@@ -348,9 +735,6 @@ static int ZipSegment_close(AFFObject this) {
     goto error;
   };
 
-  /* We append this file to the end of the zip file. */
-  self->offset_of_file_header = CALL(zip->backing_store, seek, 0, SEEK_END);
-
   /* Finalize the compressor. */
   switch(self->cd.compression_method) {
     case ZIP_DEFLATE: {
@@ -369,64 +753,221 @@ static int ZipSegment_close(AFFObject this) {
         self->cd.compress_size += ret;
       } while(self->strm.avail_out == 0);
 
-      (void)deflateEnd(&self->strm);
-    }; break;
+      (void)deflateEnd(&self->strm);
+    }; break;
+
+    default:
+      break;
+  };
+
+  /* A reserved segment writes into its own room in the volume, so it
+     does not need the volume lock.
+  */
+  if(self->reserved) {
+    written = flush_buffer(self, zip) && write_descriptor(self, zip);
+
+  /* We append this file to the end of the zip file. The volume lock
+     keeps other writers from appending until we are done, even
+     while the global lock is released for the writes below. A
+     streaming segment has already written its header.
+  */
+  } else {
+    CALL(zip->lock, acquire);
+
+    /* Appending now would put us in the middle of another segment's
+       data, so we are appended after it when it is closed.
+    */
+    if(zip->streaming_segment && zip->streaming_segment != self) {
+      list_add_tail(&self->deferred, &zip->deferred_members);
+      CALL(zip->lock, release);
+      CALL(((AFFObject)self)->resolver, cache_return, (AFFObject)zip);
+      goto exit;
+    };
+
+    if(!self->streaming)
+      written = write_file_header(self, zip);
+
+    written = written && flush_buffer(self, zip) && write_descriptor(self, zip);
+
+    if(self->streaming)
+      appended = stop_streaming(self, zip);
+
+    CALL(zip->lock, release);
+  };
+
+  /* We are not added to the volume unless all of it was written. */
+  if(!written) {
+    RaiseError(EIOError, "Unable to write segment %s", self->filename->value);
+
+    PUSH_ERROR_STATE;
+    CALL(((AFFObject)self)->resolver, cache_return, (AFFObject)zip);
+    POP_ERROR_STATE;
+    goto error;
+  };
+
+  // Signal that we are done
+  talloc_free(self->buffer);
+  self->buffer = NULL;
+
+  /* We are in the volume, but a member which was waiting for us was
+     not.
+  */
+  if(!appended) {
+    PUSH_ERROR_STATE;
+    CALL(((AFFObject)self)->resolver, cache_return, (AFFObject)zip);
+    POP_ERROR_STATE;
+    goto error;
+  };
+
+  // Now we can release the zip file
+  CALL(((AFFObject)self)->resolver, cache_return, (AFFObject)zip);
+
+exit:
+  result = SUPER(AFFObject, FileLikeObject, close);
+  AFF4_GL_UNLOCK;
+  return result;
+
+error:
+  SUPER(AFFObject, FileLikeObject, close);
+  AFF4_GL_UNLOCK;
+  return 0;
+};
+
+/* Stored segments lend out the volume's mapping, and loaded members
+   of read only volumes their buffer.
+*/
+static char *ZipSegment_borrow(FileLikeObject this, uint64_t offset,
+                               unsigned int length) {
+  ZipSegment self = (ZipSegment)this;
+  char *data = NULL;
+
+  if(((AFFObject)this)->mode != 'r' || offset + length > self->cd.file_size)
+    return NULL;
+
+  if(self->cd.compression_method == ZIP_STORED) {
+    if(__atomic_load_n(&self->data_offset, __ATOMIC_ACQUIRE) || find_data(self))
+      data = self->mapped;
+
+  } else if(self->frozen) {
+    StringIO buffer = __atomic_load_n(&self->buffer, __ATOMIC_ACQUIRE);
+
+    if(buffer)
+      data = buffer->data;
+  };
+
+  return data ? data + offset : NULL;
+};
+
+/* Members we read know their own size from the CD. */
+static RDFValue ZipSegment_resolve(AFFObject this, void *ctx, char *attribute) {
+  ZipSegment self = (ZipSegment)this;
+
+  if(this->mode == 'r' && !strcmp(attribute, AFF4_SIZE)) {
+    XSDInteger result = new_XSDInteger(ctx);
+
+    result->value = self->cd.file_size;
+    return (RDFValue)result;
+  };
+
+  return SUPER(AFFObject, FileLikeObject, resolve, ctx, attribute);
+};
+
+
+static int ZipSegment_reserve(ZipSegment self, uint64_t length) {
+  struct ZipDataDescriptor descriptor;
+  ZipFile zip;
+
+  AFF4_GL_LOCK;
+
+  if(((AFFObject)self)->mode != 'w' || !self->buffer || self->streaming ||
+     self->reserved || self->cd.file_size > 0) {
+    RaiseError(EIOError, "Segment %s can only be reserved before it is written",
+               self->filename->value);
+    goto error;
+  };
+
+  zip = (ZipFile)CALL(((AFFObject)self)->resolver, own, self->container, 'w');
+  if(!zip) {
+    RaiseError(ERuntimeError, "Unable to get container.");
+    goto error;
+  };
+
+  /* Only the header and the end of the range are written under the
+     lock. Writing the (empty) descriptor after the range extends the
+     volume, so the next member is appended after it.
+  */
+  if(!lock_for_append(self, zip))
+    goto error_return;
+
+  if(!write_file_header(self, zip)) {
+    CALL(zip->lock, release);
+    goto error_return;
+  };
+
+  self->data_offset = self->offset_of_file_header + sizeof(struct ZipFileHeader) +
+    self->filename->length;
+  self->write_offset = self->data_offset;
+  self->reserved_end = self->data_offset + length;
+  self->reserved = 1;
+
+  memset(&descriptor, 0, sizeof(descriptor));
+  CALL(zip->backing_store, write_at, self->reserved_end, (char *)&descriptor,
+       sizeof(descriptor));
+
+  CALL(zip->lock, release);
+  CALL(((AFFObject)self)->resolver, cache_return, (AFFObject)zip);
+
+  AFF4_GL_UNLOCK;
+  return 1;
+
+ error_return:
+  PUSH_ERROR_STATE;
+  CALL(((AFFObject)self)->resolver, cache_return, (AFFObject)zip);
+  POP_ERROR_STATE;
+
+ error:
+  AFF4_GL_UNLOCK;
+  return 0;
+};
 
-    default:
-      break;
-  };
 
-  // Make a filename suitable for a zip file.
-  filename = segment_name_from_URN(NULL, URNOF(self), self->container);
-  CALL(self->filename, set, ZSTRING(filename));
-  talloc_free(filename);
+static void ZipSegment_discard(ZipSegment self) {
+  ZipFile zip;
 
-  // Write a file header on
-  memset(&header, 0, sizeof(header));
-  header.magic = 0x4034b50;
-  header.version = 0x14;
-  // We prefer to write trailing directory structures
-  header.flags = 0x08;
+  AFF4_GL_LOCK;
 
-  header.compression_method = self->cd.compression_method;
-  header.file_name_length = self->filename->length;
-  header.lastmoddate = self->cd.dosdate;
-  header.lastmodtime = self->cd.dostime;
+  // Only members which are still being written can be discarded.
+  if(((AFFObject)self)->mode != 'w' || !self->buffer)
+    goto exit;
 
-  CALL(zip->backing_store, write,(char *)&header, sizeof(header));
-  CALL(zip->backing_store, write, self->filename->value, self->filename->length);
+  if(self->compression_method == ZIP_DEFLATE)
+    (void)deflateEnd(&self->strm);
 
-  // Now write the file content
-  CALL(zip->backing_store, write, self->buffer->data, self->buffer->size);
+  zip = (ZipFile)CALL(((AFFObject)self)->resolver, own, self->container, 'w');
+  if(!zip) {
+    RaiseError(ERuntimeError, "Unable to get container.");
+    goto exit;
+  };
 
-  /* Write the Zip64 data descriptor */
-  // Write a signature:
-  CALL(zip->backing_store, write, (char *)&magic, sizeof(magic));
-  CALL(zip->backing_store, write, (char *)&self->cd.crc32,
-       sizeof(self->cd.crc32));
+  AFF4_LOG(AFF4_LOG_MESSAGE, AFF4_SERVICE_ZIP_VOLUME, URNOF(self),
+           "Discarding segment");
 
-  // Zip64 data descriptor (Segments will never be larger than 4G).
-  CALL(zip->backing_store, write, (char *)&self->cd.compress_size,
-       sizeof(self->cd.compress_size));
-  CALL(zip->backing_store, write, (char *)&self->cd.file_size,
-       sizeof(self->cd.file_size));
+  /* Members which were waiting for us are appended after the data
+     we already streamed.
+  */
+  if(self->streaming)
+    stop_streaming(self, zip);
 
-  // Signal that we are done
-  talloc_free(self->buffer);
-  self->buffer = NULL;
+  list_del_init(&self->deferred);
 
-  // Now we can release the zip file
-  CALL(((AFFObject)self)->resolver, cache_return, (AFFObject)zip);
+  /* Whoever still holds a reference to us keeps us alive. */
+  list_del(&self->members);
+  talloc_unlink(zip, self);
 
-exit:
-  result = SUPER(AFFObject, FileLikeObject, close);
-  AFF4_GL_UNLOCK;
-  return result;
+  CALL(((AFFObject)zip)->resolver, cache_return, (AFFObject)zip);
 
-error:
-  SUPER(AFFObject, FileLikeObject, close);
+ exit:
   AFF4_GL_UNLOCK;
-  return 0;
 };
 
 
@@ -435,18 +976,31 @@ VIRTUAL(ZipSegment, FileLikeObject) {
   VMETHOD_BASE(AFFObject, finish) = ZipSegment_finish;
 
   VMETHOD_BASE(FileLikeObject, read) = ZipSegment_read;
+  VMETHOD_BASE(FileLikeObject, borrow) = ZipSegment_borrow;
   VMETHOD_BASE(FileLikeObject, write) = ZipSegment_write;
+  VMETHOD_BASE(FileLikeObject, read_at) = ZipSegment_read_at;
+  VMETHOD_BASE(FileLikeObject, write_at) = ZipSegment_write_at;
   VMETHOD_BASE(AFFObject, close) = ZipSegment_close;
+  VMETHOD_BASE(AFFObject, resolve) = ZipSegment_resolve;
+
+  VMETHOD(reserve) = ZipSegment_reserve;
+  VMETHOD(discard) = ZipSegment_discard;
 } END_VIRTUAL;
 
 
 VIRTUAL(AFF4Volume, AFFObject) {
-
+  UNIMPLEMENTED(AFF4Volume, load_graphs);
 } END_VIRTUAL;
 
 
-static int find_EndCentralDirectory(ZipFile self) {
-  char buffer[BUFF_SIZE];
+/* Finds the central directory and how many entries it has. Returns 0
+   if this is not a zip file.
+*/
+static int find_EndCentralDirectory(ZipFile self, uint64_t *directory_offset,
+                                    uint64_t *size_of_cd, uint64_t *entries) {
+  // One extra byte so the comment is always null terminated.
+  char buffer[BUFF_SIZE + 1];
+  uint64_t end_offset;
   int length, i;
   char *comment;
 
@@ -454,17 +1008,16 @@ static int find_EndCentralDirectory(ZipFile self) {
      data and scan for the header from the end, just in case there is
      an archive comment appended to the end.
   */
-  uint64_t directory_offset = CALL(self->backing_store, seek, -(int64_t)BUFF_SIZE,
-                                   SEEK_END);
+  end_offset = CALL(self->backing_store, seek, -(int64_t)BUFF_SIZE, SEEK_END);
 
-  memset(buffer, 0, BUFF_SIZE);
-  length = CALL(self->backing_store, read, buffer, BUFF_SIZE - sizeof(uint32_t));
+  memset(buffer, 0, sizeof(buffer));
+  length = CALL(self->backing_store, read_at, end_offset, buffer, BUFF_SIZE);
 
   if(length<0)
     goto error;
 
   // Scan the buffer backwards for an End of Central Directory magic
-  for(i=length; i>0; i--) {
+  for(i=length - sizeof(uint32_t); i>0; i--) {
     if(*(uint32_t *)(buffer+i) == 0x6054b50) {
       break;
     };
@@ -475,7 +1028,7 @@ static int find_EndCentralDirectory(ZipFile self) {
     goto error;
 
   // This is now the offset to the end of central directory record
-  directory_offset += i;
+  end_offset += i;
   self->end = (struct EndCentralDirectory *)talloc_memdup(self, buffer + i,
                                                           sizeof(*self->end));
 
@@ -492,18 +1045,20 @@ static int find_EndCentralDirectory(ZipFile self) {
     };
   };
 
+  *directory_offset = self->end->offset_of_cd;
+  *size_of_cd = self->end->size_of_cd;
+  *entries = self->end->total_entries_in_cd;
+
   /* Handle extended Zip64 CD */
-  directory_offset = self->end->offset_of_cd;
-  if(self->end->offset_of_cd == -1) {
+  if(self->end->offset_of_cd == 0xFFFFFFFF ||
+     self->end->total_entries_in_cd == 0xFFFF) {
     struct Zip64CDLocator locator;
     struct Zip64EndCD end_cd;
 
-    // We reposition ourselved just before the EndCentralDirectory to
-    // find the locator:
-    CALL(self->backing_store, seek, directory_offset - sizeof(locator), SEEK_SET);
-    CALL(self->backing_store, read, (char *)&locator, sizeof(locator));
-
-    if(locator.magic != 0x07064b50) {
+    // The locator is just before the EndCentralDirectory.
+    if(CALL(self->backing_store, read_at, end_offset - sizeof(locator),
+            (char *)&locator, sizeof(locator)) != sizeof(locator) ||
+       locator.magic != 0x07064b50) {
       RaiseError(EIOError, "No valid Zip64CDLocator magic.");
       goto error;
     };
@@ -514,10 +1069,9 @@ static int find_EndCentralDirectory(ZipFile self) {
     };
 
     // Now the Zip64EndCD
-    CALL(self->backing_store, seek, locator.offset_of_end_cd, SEEK_SET);
-    CALL(self->backing_store, read, (char *)&end_cd, sizeof(end_cd));
-
-    if(end_cd.magic != 0x06064b50) {
+    if(CALL(self->backing_store, read_at, locator.offset_of_end_cd,
+            (char *)&end_cd, sizeof(end_cd)) != sizeof(end_cd) ||
+       end_cd.magic != 0x06064b50) {
       RaiseError(EIOError, "No valid Zip64EndCD magic.");
       goto error;
     };
@@ -528,14 +1082,12 @@ static int find_EndCentralDirectory(ZipFile self) {
       goto error;
     };
 
-    self->end->total_entries_in_cd = end_cd.number_of_entries_in_total;
-    directory_offset = end_cd.offset_of_cd;
+    *directory_offset = end_cd.offset_of_cd;
+    *size_of_cd = end_cd.size_of_cd;
+    *entries = end_cd.number_of_entries_in_total;
   };
 
-
-  // Reposition ourself to the start of the CD.
-  CALL(self->backing_store, seek, directory_offset, SEEK_SET);
-  return directory_offset;
+  return 1;
 
 error:
   RaiseError(EIOError, "Unable to find the end of central directory.");
@@ -543,32 +1095,16 @@ error:
 };
 
 
-static ZipSegment load_entry_from_CD(ZipFile self) {
+/* Makes the segment for a member we found in the directory. */
+static ZipSegment new_segment(ZipFile self, struct ZipDirectoryEntry *entry,
+                              char *name) {
   ZipSegment result = CONSTRUCT(ZipSegment, AFFObject, Con, self, NULL, 'r', RESOLVER);
-  char buffer[BUFF_SIZE];
-  int length;
 
   result->container = URNOF(self);
-
-  // The length of the struct up to the filename
-  // Only read up to the filename member
-  if(sizeof(result->cd) !=
-     CALL(self->backing_store, read, (char *)AS_BUFFER(result->cd)))
-    goto error;
-
-  // Does the magic match?
-  if(result->cd.magic != 0x2014b50)
-    goto error;
-
-  // Now read the filename
-  length = min(result->cd.file_name_length, BUFF_SIZE - 1);
-  if(CALL(self->backing_store, read, buffer, length) != length)
-    goto error;
-
-  buffer[length] = 0;
-  result->filename = unescape_filename(result, buffer);
-
-  printf("Found %s\n", result->filename->value);
+  result->frozen = (((AFFObject)self)->mode == 'r');
+  result->cd = entry->cd;
+  result->offset_of_file_header = entry->offset_of_file_header;
+  CALL(result->filename, set, ZSTRING_NO_NULL(name));
 
   // Parse the time from the CD
   {
@@ -585,41 +1121,285 @@ static ZipSegment load_entry_from_CD(ZipFile self) {
     result->timestamp = mktime(&x);
   };
 
-  //  parse_extra_field(self, fd, cd_header.extra_field_len);
-  self->compression_method = result->cd.compression_method;
+  return result;
+};
+
+/* Finds the local header offset in a Zip64 extra field. The field
+   only has the values which did not fit in the CD record, in this
+   order.
+*/
+static uint64_t parse_zip64_offset(struct CDFileHeader *cd, char *extra) {
+  char *end = extra + cd->extra_field_len;
+
+  while(extra + 4 <= end) {
+    uint16_t id = *(uint16_t *)extra;
+    uint16_t length = *(uint16_t *)(extra + 2);
+    char *value = extra + 4;
+
+    if(id == 1) {
+      if(cd->file_size == 0xFFFFFFFF) value += sizeof(uint64_t);
+      if(cd->compress_size == 0xFFFFFFFF) value += sizeof(uint64_t);
+      if(value + sizeof(uint64_t) <= min(extra + 4 + length, end))
+        return *(uint64_t *)value;
+    };
+
+    extra += 4 + length;
+  };
+
+  return cd->relative_offset_local_header;
+};
+
+/* Parses the central directory, already in memory, into entries and
+   their (unescaped) names. Names of entries are stored in names,
+   which must be at least size + count long. Returns how many entries
+   we found.
+*/
+static uint64_t parse_CD(ZipFile self, char *data, uint64_t size, uint64_t count,
+                         struct ZipDirectoryEntry *entries, char *names) {
+  char *end = data + size;
+  uint64_t names_size = 0;
+  uint64_t i;
+
+  for(i=0; i<count && data + sizeof(struct CDFileHeader) <= end; i++) {
+    struct ZipDirectoryEntry *entry = &entries[i];
+    char *name = data + sizeof(struct CDFileHeader);
+    int length;
+
+    memcpy(&entry->cd, data, sizeof(entry->cd));
+
+    // Does the magic match?
+    if(entry->cd.magic != 0x2014b50 ||
+       name + entry->cd.file_name_length + entry->cd.extra_field_len > end)
+      break;
+
+    entry->offset_of_file_header = entry->cd.relative_offset_local_header;
+    if(entry->cd.relative_offset_local_header == 0xFFFFFFFF)
+      entry->offset_of_file_header = parse_zip64_offset(
+          &entry->cd, name + entry->cd.file_name_length);
 
-  // The following checks for zip64 values
-  result->offset_of_file_header = result->cd.relative_offset_local_header;
+    length = unescape_filename_to(names + names_size, name,
+                                  entry->cd.file_name_length);
+    names[names_size + length] = 0;
+    entry->name_offset = names_size;
+    names_size += length + 1;
 
-  if(result->cd.relative_offset_local_header == -1) {
-    result->offset_of_file_header = result->cd.relative_offset_local_header;
+    data = name + entry->cd.file_name_length + entry->cd.extra_field_len +
+      entry->cd.file_comment_length;
+
+    self->compression_method = entry->cd.compression_method;
   };
 
+  return i;
+};
+
+/* The name of our member index in the zip file. */
+static char *index_name(void *ctx, ZipFile self) {
+  RDFURN urn = CALL(URNOF(self), copy, ctx);
+  char *result;
+
+  CALL(urn, add, ZIP_INDEX_NAME);
+  result = segment_name_from_URN(ctx, urn, URNOF(self));
+  talloc_free(urn);
+
+  return result;
+};
+
+/* Sorts by name, and keeps duplicated names in central directory
+   order so we find the first one as the list search does.
+*/
+struct directory_key {
+  char *name;
+  uint64_t index;
+};
+
+static int compare_keys(const void *a, const void *b) {
+  const struct directory_key *x = a;
+  const struct directory_key *y = b;
+  int result = strcmp(x->name, y->name);
+
+  if(result == 0)
+    result = (x->index > y->index) - (x->index < y->index);
+
   return result;
+};
 
-error:
-  talloc_free(result);
-  return NULL;
+/* Makes the sorted directory of a read only volume, leaving out our
+   member index.
+*/
+static void build_directory(ZipFile self, struct ZipDirectoryEntry *entries,
+                            char *names, uint64_t count) {
+  struct directory_key *keys = talloc_array(NULL, struct directory_key, max(count, 1));
+  char *index = index_name(keys, self);
+  uint64_t i;
+
+  for(i=0; i<count; i++) {
+    keys[self->directory_size].name = names + entries[i].name_offset;
+    keys[self->directory_size].index = i;
+
+    if(strcmp(keys[self->directory_size].name, index))
+      self->directory_size++;
+  };
+
+  qsort(keys, self->directory_size, sizeof(*keys), compare_keys);
+
+  self->directory = talloc_array(self, struct ZipDirectoryEntry,
+                                 max(self->directory_size, 1));
+  for(i=0; i<self->directory_size; i++)
+    self->directory[i] = entries[keys[i].index];
+
+  self->directory_names = talloc_steal(self, names);
+  self->directory_segments = talloc_zero_array(self, ZipSegment,
+                                               max(self->directory_size, 1));
+  self->graphs_loaded = talloc_zero_array(self, char, max(self->directory_size, 1));
+
+  talloc_free(keys);
 };
 
+/* Checks that every entry of a member index names a string inside
+   the names, and that the names are sorted, since lookups bisect the
+   index and read the names in place.
+*/
+static int check_index(struct ZipDirectoryEntry *entries, char *names,
+                       uint64_t count, uint64_t names_size) {
+  char *last = NULL;
+  uint64_t i;
+
+  for(i=0; i<count; i++) {
+    uint64_t name_offset = entries[i].name_offset;
+    char *name = names + name_offset;
+
+    if(name_offset >= names_size ||
+       !memchr(name, 0, names_size - name_offset))
+      return 0;
+
+    if(last && strcmp(last, name) > 0)
+      return 0;
+
+    last = name;
+  };
+
+  return 1;
+};
+
+/* Tries to use the member index written just before the central
+   directory. It is only used when it was written with this exact
+   directory, and is ignored if it is not consistent so we fall back
+   to the directory.
+*/
+static int load_index(ZipFile self, uint64_t directory_offset, uint64_t count) {
+  // The index is followed by its data descriptor.
+  uint64_t footer_offset = directory_offset - sizeof(struct ZipDataDescriptor) -
+    sizeof(struct ZipIndexFooter);
+  struct ZipIndexFooter footer;
+  uint64_t entries_size, start;
+  char *data, *buffer = NULL;
+
+  if(directory_offset < sizeof(struct ZipDataDescriptor) + sizeof(footer) ||
+     count == 0 ||
+     CALL(self->backing_store, read_at, footer_offset, (char *)&footer,
+          sizeof(footer)) != sizeof(footer))
+    return 0;
+
+  if(footer.magic != ZIP_INDEX_MAGIC || footer.version != ZIP_INDEX_VERSION ||
+     footer.offset_of_cd != directory_offset || footer.entries != count - 1)
+    return 0;
+
+  /* Check each size on its own so a corrupt footer can not wrap
+     around.
+  */
+  if(footer.entries > footer_offset / sizeof(struct ZipDirectoryEntry))
+    return 0;
+
+  entries_size = footer.entries * sizeof(struct ZipDirectoryEntry);
+  if(footer.names_size > footer_offset - entries_size ||
+     entries_size + footer.names_size > UINT32_MAX)
+    return 0;
+
+  start = footer_offset - entries_size - footer.names_size;
+
+  /* Mapped volumes use the index in place. */
+  data = CALL(self->backing_store, borrow, start, entries_size + footer.names_size);
+  if(!data) {
+    buffer = data = talloc_size(NULL, entries_size + footer.names_size);
+    if(!data) return 0;
+
+    if(CALL(self->backing_store, read_at, start, data,
+            entries_size + footer.names_size) != entries_size + footer.names_size) {
+      talloc_free(data);
+      return 0;
+    };
+  };
+
+  if(!check_index((struct ZipDirectoryEntry *)data, data + entries_size,
+                  footer.entries, footer.names_size)) {
+    if(buffer) talloc_free(buffer);
+    return 0;
+  };
+
+  if(buffer) talloc_steal(self, buffer);
+
+  self->directory = (struct ZipDirectoryEntry *)data;
+  self->directory_names = data + entries_size;
+  self->directory_size = footer.entries;
+  self->directory_segments = talloc_zero_array(self, ZipSegment,
+                                               max(self->directory_size, 1));
+  self->graphs_loaded = talloc_zero_array(self, char, max(self->directory_size, 1));
+  self->directory_from_index = 1;
+
+  return 1;
+};
 
 static int ZipFile_load_from_backing_store(ZipFile self) {
-  int directory_offset = find_EndCentralDirectory(self);
-  int i;
+  uint64_t directory_offset, size_of_cd, count, i;
+  struct ZipDirectoryEntry *entries;
+  char *names, *data, *buffer = NULL;
 
-  if(!directory_offset) {
+  if(!find_EndCentralDirectory(self, &directory_offset, &size_of_cd, &count)) {
     goto error;
   };
 
-  CALL(self->backing_store, seek, directory_offset, SEEK_SET);
+  // Reopening a volume with a member index skips the directory.
+  if(((AFFObject)self)->mode == 'r' && load_index(self, directory_offset, count))
+    return 1;
+
+  /* We read the whole directory at once, or use it in place if the
+     volume is mapped.
+  */
+  CALL(self->backing_store, advise, directory_offset, size_of_cd,
+       AFF4_ACCESS_SEQUENTIAL);
+  data = CALL(self->backing_store, borrow, directory_offset, size_of_cd);
+  if(!data) {
+    buffer = data = talloc_size(NULL, size_of_cd);
+    if(CALL(self->backing_store, read_at, directory_offset, data, size_of_cd) !=
+       size_of_cd) {
+      RaiseError(EIOError, "Unable to read the central directory.");
+      talloc_free(buffer);
+      goto error;
+    };
+  };
+
+  entries = talloc_array(NULL, struct ZipDirectoryEntry, max(count, 1));
+  names = talloc_size(NULL, size_of_cd + count + 1);
+  count = parse_CD(self, data, size_of_cd, count, entries, names);
+  if(buffer) talloc_free(buffer);
+
+  if(((AFFObject)self)->mode == 'r') {
+    build_directory(self, entries, names, count);
+
+  } else {
+    /* Writable volumes keep all their members as segments, since
+       they are all written into the new directory.
+    */
+    for(i=0; i<count; i++) {
+      ZipSegment segment = new_segment(self, &entries[i], names + entries[i].name_offset);
 
-  for(i=0; i<self->end->total_entries_in_cd; i++) {
-    ZipSegment segment = load_entry_from_CD(self);
-    if(segment) {
       list_add_tail(&segment->members, &self->members);
     };
+
+    talloc_free(names);
   };
 
+  talloc_free(entries);
   return 1;
 
 error:
@@ -635,6 +1415,9 @@ static AFFObject ZipFile_Con(AFFObject this, RDFURN urn, char mode, Resolver res
 
   self->storage_urn = new_RDFURN(self);
   INIT_LIST_HEAD(&self->members);
+  INIT_LIST_HEAD(&self->deferred_members);
+  self->lock = CONSTRUCT(AFF4Lock, AFF4Lock, Con, self);
+  self->index_threshold = ZIP_INDEX_THRESHOLD;
 
   result = SUPER(AFFObject, AFF4Volume, Con, urn, mode, resolver);
 
@@ -665,6 +1448,18 @@ static int ZipFile_finish(AFFObject this) {
   result = SUPER(AFFObject, AFF4Volume, finish);
   CALL(this->resolver, manage, (AFFObject)self);
 
+  /* The graphs are parsed with us in the read cache, when the
+     resolver first needs them, so opening a volume does not cost
+     more than reading its directory. Lazy resolvers get the graph
+     about the volume now and the others by subject.
+  */
+  if(result && self->directory) {
+    if(this->resolver->mode & RESOLVER_MODE_LAZY_GRAPHS)
+      CALL((AFF4Volume)self, load_graphs, URNOF(self));
+
+    CALL(this->resolver, defer_graphs, URNOF(self));
+  };
+
   AFF4_GL_UNLOCK;
   return result;
 
@@ -674,6 +1469,46 @@ static int ZipFile_finish(AFFObject this) {
 };
 
 
+/* Binary search of the directory for the first member not before
+   name.
+*/
+static int64_t directory_lower_bound(ZipFile self, char *name) {
+  int64_t low = 0, high = self->directory_size;
+
+  while(low < high) {
+    int64_t middle = low + (high - low) / 2;
+
+    if(strcmp(self->directory_names + self->directory[middle].name_offset, name) < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  };
+
+  return low;
+};
+
+/* Returns the first member called name or -1 if there is none. */
+static int64_t find_directory_entry(ZipFile self, char *name) {
+  int64_t found = directory_lower_bound(self, name);
+
+  if(found < self->directory_size &&
+     !strcmp(self->directory_names + self->directory[found].name_offset, name))
+    return found;
+
+  return -1;
+};
+
+/* Segments are only made when they are first opened. */
+static ZipSegment directory_segment(ZipFile self, int64_t i) {
+  if(!self->directory_segments[i])
+    self->directory_segments[i] = new_segment(
+        self, &self->directory[i],
+        self->directory_names + self->directory[i].name_offset);
+
+  return self->directory_segments[i];
+};
+
+
 static FileLikeObject ZipFile_open_member(AFF4Volume this, RDFURN member, char mode,
                                           int compression_method) {
   ZipFile self = (ZipFile)this;
@@ -684,9 +1519,40 @@ static FileLikeObject ZipFile_open_member(AFF4Volume this, RDFURN member, char m
 
   segment_filename = segment_name_from_URN(NULL, member, URNOF(self));
 
+  /* Read only volumes have a sorted directory. */
+  if(self->directory) {
+    int64_t found = find_directory_entry(self, segment_filename);
+
+    if(mode != 'r') {
+      RaiseError(EIOError, "Volume %s is read only", URNOF(self)->value);
+      result = NULL;
+      goto exit;
+    };
+
+    if(found < 0) {
+      result = NULL;
+      goto exit;
+    };
+
+    result = directory_segment(self, found);
+    goto exit;
+  };
+
   /* Do we know about this segment already? */
   list_for_each_entry(result, &self->members, members) {
     if(!strcmp(result->filename->value, segment_filename)) {
+      /* Writing a member which is already complete (e.g. when
+         appending to an existing volume) supersedes the old one.
+      */
+      if(mode == 'w' && (((AFFObject)result)->mode != 'w' || !result->buffer)) {
+        /* A cached BevyIndex may still hold the old member through a
+           talloc_reference, so we only drop our own link to it.
+        */
+        list_del(&result->members);
+        talloc_unlink(self, result);
+        break;
+      };
+
       // Found it!
       goto exit;
     }
@@ -699,7 +1565,7 @@ static FileLikeObject ZipFile_open_member(AFF4Volume this, RDFURN member, char m
     result = (ZipSegment)CONSTRUCT(ZipSegment, AFFObject, Con, self, member, mode, RESOLVER);
     result->container = URNOF(self);
     result->compression_method = compression_method;
-    CALL(result->filename, set, ZSTRING(segment_filename));
+    CALL(result->filename, set, ZSTRING_NO_NULL(segment_filename));
 
     if(!CALL((AFFObject)result, finish)) {
       talloc_free(result);
@@ -721,16 +1587,193 @@ static FileLikeObject ZipFile_open_member(AFF4Volume this, RDFURN member, char m
 };
 
 
+/* Parses the graph in directory entry i, unless it was parsed
+   before.
+*/
+static int parse_graph(ZipFile self, int64_t i) {
+  char *name = self->directory_names + self->directory[i].name_offset;
+  char *format = strrchr(name, '/');
+  RDFParser parser;
+  int result;
+
+  if(self->graphs_loaded[i])
+    return 1;
+
+  self->graphs_loaded[i] = 1;
+  format = (format ? format + 1 : name) + strlen(AFF4_INFORMATION);
+
+  parser = CONSTRUCT(RDFParser, RDFParser, Con, NULL, RESOLVER);
+  result = CALL(parser, parse, (FileLikeObject)directory_segment(self, i),
+                format, URNOF(self)->value);
+  talloc_free(parser);
+
+  return result;
+};
+
+/* The graph about a subject is stored in the member named after it,
+   e.g. /information.turtle is about the volume and
+   aff4://1234/information.turtle about aff4://1234. The directory is
+   sorted so the graphs about a subject are found with a binary
+   search.
+*/
+static int ZipFile_load_graphs(AFF4Volume this, RDFURN subject) {
+  ZipFile self = (ZipFile)this;
+  int information_length = strlen(AFF4_INFORMATION);
+  int result = 0, error = 0;
+  int64_t i;
+
+  AFF4_GL_LOCK;
+
+  /* Only read only volumes have a directory. */
+  if(!self->directory)
+    goto exit;
+
+  if(!subject) {
+    for(i=0; i<self->directory_size; i++) {
+      char *name = self->directory_names + self->directory[i].name_offset;
+      char *base_name = strrchr(name, '/');
+
+      base_name = base_name ? base_name + 1 : name;
+      if(!strncmp(base_name, AFF4_INFORMATION, information_length)) {
+        result++;
+        error |= !parse_graph(self, i);
+      };
+    };
+  } else {
+    char *prefix = segment_name_from_URN(NULL, subject, URNOF(self));
+    int prefix_length;
+
+    prefix = talloc_asprintf_append(prefix, "/" AFF4_INFORMATION);
+    prefix_length = strlen(prefix);
+
+    for(i=directory_lower_bound(self, prefix); i<self->directory_size; i++) {
+      char *name = self->directory_names + self->directory[i].name_offset;
+
+      if(strncmp(name, prefix, prefix_length))
+        break;
+
+      // Not a graph about a member of subject
+      if(!strchr(name + prefix_length, '/')) {
+        result++;
+        error |= !parse_graph(self, i);
+      };
+    };
+
+    talloc_free(prefix);
+  };
+
+ exit:
+  AFF4_GL_UNLOCK;
+  return error ? -1 : result;
+};
+
+/* Sorts the closed members for the member index. */
+struct index_key {
+  ZipSegment segment;
+  uint64_t index;
+};
+
+static int compare_index_keys(const void *a, const void *b) {
+  const struct index_key *x = a;
+  const struct index_key *y = b;
+  int result = strcmp(x->segment->filename->value, y->segment->filename->value);
+
+  if(result == 0)
+    result = (x->index > y->index) - (x->index < y->index);
+
+  return result;
+};
+
+/* Writes the member index of all our closed members. It must be the
+   last member before the central directory, so we are called with
+   the lock held just before it is written.
+*/
+static int write_member_index(ZipFile self, char *name, uint64_t count) {
+  struct index_key *keys = talloc_array(NULL, struct index_key, max(count, 1));
+  StringIO names = CONSTRUCT(StringIO, StringIO, Con, keys);
+  StringIO data = CONSTRUCT(StringIO, StringIO, Con, keys);
+  struct ZipIndexFooter footer;
+  FileLikeObject index;
+  ZipSegment segment;
+  RDFURN urn;
+  uint64_t i = 0;
+
+  list_for_each_entry(segment, &self->members, members) {
+    if(!segment->buffer) {
+      keys[i].segment = segment;
+      keys[i].index = i;
+      i++;
+    };
+  };
+
+  qsort(keys, count, sizeof(*keys), compare_index_keys);
+
+  for(i=0; i<count; i++) {
+    struct ZipDirectoryEntry entry;
+    char *filename = keys[i].segment->filename->value;
+    char buffer[BUFF_SIZE];
+    int length = unescape_filename_to(buffer, filename,
+                                      min(strlen(filename), BUFF_SIZE - 1));
+
+    buffer[length] = 0;
+
+    entry.cd = keys[i].segment->cd;
+    entry.cd.file_name_length = keys[i].segment->filename->length;
+    entry.cd.extra_field_len = 0;
+    entry.cd.relative_offset_local_header = min(keys[i].segment->offset_of_file_header,
+                                                0xFFFFFFFF);
+    entry.offset_of_file_header = keys[i].segment->offset_of_file_header;
+    entry.name_offset = names->size;
+
+    CALL(data, write, (char *)&entry, sizeof(entry));
+    CALL(names, write, buffer, length + 1);
+  };
+
+  CALL(data, write, names->data, names->size);
+
+  /* The directory follows straight after our header, the data, the
+     footer and our data descriptor. Nobody else can append while we
+     hold the lock.
+  */
+  memset(&footer, 0, sizeof(footer));
+  footer.magic = ZIP_INDEX_MAGIC;
+  footer.version = ZIP_INDEX_VERSION;
+  footer.entries = count;
+  footer.names_size = names->size;
+  footer.offset_of_cd = CALL(self->backing_store, seek, 0, SEEK_END) +
+    sizeof(struct ZipFileHeader) + strlen(name) + data->size + sizeof(footer) +
+    sizeof(struct ZipDataDescriptor);
+  CALL(data, write, (char *)&footer, sizeof(footer));
+
+  urn = CALL(URNOF(self), copy, keys);
+  CALL(urn, add, ZIP_INDEX_NAME);
+
+  index = CALL((AFF4Volume)self, open_member, urn, 'w', ZIP_STORED);
+  if(!index || CALL(index, write, data->data, data->size) < 0 ||
+     !CALL((AFFObject)index, close))
+    goto error;
+
+  talloc_free(keys);
+  return 1;
+
+error:
+  RaiseError(EIOError, "Unable to write the member index.");
+  talloc_free(keys);
+  return 0;
+};
+
+
 /* Write the central directory on the end and finalize the zip file. */
 static int ZipFile_close(AFFObject this) {
   ZipFile self = (ZipFile)this;
-  ZipSegment segment;
+  ZipSegment segment, next;
   StringIO zip64_header;
   // We dont want to write small buffers
   StringIO buffer;
   struct EndCentralDirectory end;
   uint64_t start_of_cd, offset_of_end_cd;
-  int total_entries = 0;
+  uint64_t total_entries = 0;
+  char *index;
   int result;
 
   AFF4_GL_LOCK;
@@ -750,6 +1793,40 @@ static int ZipFile_close(AFFObject this) {
   AFF4_LOG(AFF4_LOG_MESSAGE, AFF4_SERVICE_ZIP_VOLUME, URNOF(this),
            "Closing ZipFile volume");
 
+  CALL(self->lock, acquire);
+
+  /* The directory would end up in the middle of a streaming
+     segment's data, and reserved segments would overwrite it.
+  */
+  list_for_each_entry(segment, &self->members, members) {
+    if(segment->streaming || (segment->reserved && segment->buffer)) {
+      RaiseError(EIOError, "Segment %s must be closed before the volume",
+                 segment->filename->value);
+      CALL(self->lock, release);
+      talloc_free(buffer);
+      goto error;
+    };
+  };
+
+  /* Any member index we were opened with is out of date now. */
+  index = index_name(buffer, self);
+  list_for_each_entry_safe(segment, next, &self->members, members) {
+    if(!strcmp(segment->filename->value, index)) {
+      list_del(&segment->members);
+      talloc_free(segment);
+    } else if(!segment->buffer) {
+      total_entries ++;
+    };
+  };
+
+  if(self->index_threshold > 0 && total_entries >= self->index_threshold &&
+     !write_member_index(self, index, total_entries)) {
+    CALL(self->lock, release);
+    talloc_free(buffer);
+    goto error;
+  };
+
+  total_entries = 0;
   start_of_cd = CALL(self->backing_store, seek, 0, SEEK_END);
 
   /* Iterate over all our members */
@@ -802,15 +1879,18 @@ static int ZipFile_close(AFFObject this) {
   offset_of_end_cd = CALL(self->backing_store, tell) + buffer->size;
   end.size_of_cd = offset_of_end_cd - start_of_cd;
 
-  if(start_of_cd > ZIP64_LIMIT) {
+  /* The entry counts are only 16 bits. */
+  if(start_of_cd > ZIP64_LIMIT || total_entries >= 0xFFFF) {
     end.offset_of_cd = -1;
+    end.total_entries_in_cd_on_disk = 0xFFFF;
+    end.total_entries_in_cd = 0xFFFF;
     write_zip64_CD(self, buffer, offset_of_end_cd, start_of_cd, total_entries);
   } else {
     end.offset_of_cd = start_of_cd;
+    end.total_entries_in_cd_on_disk = total_entries;
+    end.total_entries_in_cd = total_entries;
   };
 
-  end.total_entries_in_cd_on_disk = total_entries;
-  end.total_entries_in_cd = total_entries;
   end.comment_len = strlen(URNOF(self)->value)+1;
 
   // Make sure to add our URN to the comment field in the end
@@ -819,6 +1899,7 @@ static int ZipFile_close(AFFObject this) {
 
   /* Flush the buffers */
   CALL(self->backing_store, write, buffer->data, buffer->readptr);
+  CALL(self->lock, release);
   talloc_free(buffer);
 
   result = SUPER(AFFObject, AFF4Volume, close);
@@ -830,11 +1911,15 @@ exit:
   SUPER(AFFObject, AFF4Volume, close);
   AFF4_GL_UNLOCK;
   return 0;
+error:
+  AFF4_GL_UNLOCK;
+  return 0;
 };
 
 
 VIRTUAL(ZipFile, AFF4Volume) {
   VMETHOD_BASE(AFF4Volume, open_member) = ZipFile_open_member;
+  VMETHOD_BASE(AFF4Volume, load_graphs) = ZipFile_load_graphs;
   VMETHOD_BASE(AFFObject, Con) = ZipFile_Con;
   VMETHOD_BASE(AFFObject, close) = ZipFile_close;
   VMETHOD_BASE(AFFObject, finish) = ZipFile_finish;
@@ -0,0 +1,317 @@
+/** This file implements the chunk codecs used by image streams.
+
+    Each codec is a subclass of AFF4Codec and is registered in the
+    codec registry at init time. Deflate and stored are always
+    available. The faster codecs are only built in when their
+    libraries were found at configure time.
+*/
+#include "aff4_internal.h"
+
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+#include <zstd.h>
+#define AFF4_WITH_ZSTD 1
+#endif
+
+#if defined(HAVE_LZ4_H) && defined(HAVE_LIBLZ4)
+#include <lz4.h>
+#define AFF4_WITH_LZ4 1
+
+#ifdef HAVE_LZ4HC_H
+#include <lz4hc.h>
+#endif
+#endif
+
+#if defined(HAVE_SNAPPY_C_H) && defined(HAVE_LIBSNAPPY)
+#include <snappy-c.h>
+#define AFF4_WITH_SNAPPY 1
+#endif
+
+static int AFF4Codec_compress_bound(AFF4Codec self, int length) {
+  return length;
+};
+
+static int AFF4Codec_compress(AFF4Codec self, char *dest, int dest_length,
+                              char *source, int length, int level) {
+  if(length > dest_length)
+    return -1;
+
+  memcpy(dest, source, length);
+  return length;
+};
+
+static int AFF4Codec_decompress(AFF4Codec self, char *dest, int dest_length,
+                                char *source, int length) {
+  return AFF4Codec_compress(self, dest, dest_length, source, length, 0);
+};
+
+/* The base class just stores the data. */
+VIRTUAL(AFF4Codec, Object) {
+  VATTR(name) = "stored";
+  VATTR(id) = AFF4_CODEC_STORED;
+
+  VMETHOD(compress_bound) = AFF4Codec_compress_bound;
+  VMETHOD(compress) = AFF4Codec_compress;
+  VMETHOD(decompress) = AFF4Codec_decompress;
+} END_VIRTUAL
+
+
+/** Zlib's deflate. We default to level 1 since anything higher is
+    too slow to keep up with a disk.
+*/
+PRIVATE CLASS(DeflateCodec, AFF4Codec)
+END_CLASS
+
+static int DeflateCodec_compress_bound(AFF4Codec self, int length) {
+  return compressBound(length);
+};
+
+static int DeflateCodec_compress(AFF4Codec self, char *dest, int dest_length,
+                                 char *source, int length, int level) {
+  uLongf clength = dest_length;
+
+  if(compress2((Bytef *)dest, &clength, (Bytef *)source, length, level) != Z_OK)
+    return -1;
+
+  return clength;
+};
+
+static int DeflateCodec_decompress(AFF4Codec self, char *dest, int dest_length,
+                                   char *source, int length) {
+  uLongf read_length = dest_length;
+
+  if(uncompress((Bytef *)dest, &read_length, (Bytef *)source, length) != Z_OK)
+    return -1;
+
+  return read_length;
+};
+
+VIRTUAL(DeflateCodec, AFF4Codec) {
+  VMETHOD_BASE(AFF4Codec, name) = "deflate";
+  VMETHOD_BASE(AFF4Codec, id) = AFF4_CODEC_DEFLATE;
+  VMETHOD_BASE(AFF4Codec, default_level) = 1;
+  VMETHOD_BASE(AFF4Codec, min_level) = 1;
+  VMETHOD_BASE(AFF4Codec, max_level) = 9;
+
+  VMETHOD_BASE(AFF4Codec, compress_bound) = DeflateCodec_compress_bound;
+  VMETHOD_BASE(AFF4Codec, compress) = DeflateCodec_compress;
+  VMETHOD_BASE(AFF4Codec, decompress) = DeflateCodec_decompress;
+} END_VIRTUAL
+
+
+#ifdef AFF4_WITH_ZSTD
+/** Zstandard. The low levels are about as fast as LZ4 with a ratio
+    close to deflate.
+*/
+PRIVATE CLASS(ZstdCodec, AFF4Codec)
+END_CLASS
+
+static int ZstdCodec_compress_bound(AFF4Codec self, int length) {
+  return ZSTD_compressBound(length);
+};
+
+static int ZstdCodec_compress(AFF4Codec self, char *dest, int dest_length,
+                              char *source, int length, int level) {
+  size_t res = ZSTD_compress(dest, dest_length, source, length, level);
+
+  if(ZSTD_isError(res))
+    return -1;
+
+  return res;
+};
+
+static int ZstdCodec_decompress(AFF4Codec self, char *dest, int dest_length,
+                                char *source, int length) {
+  size_t res = ZSTD_decompress(dest, dest_length, source, length);
+
+  if(ZSTD_isError(res))
+    return -1;
+
+  return res;
+};
+
+VIRTUAL(ZstdCodec, AFF4Codec) {
+  VMETHOD_BASE(AFF4Codec, name) = "zstd";
+  VMETHOD_BASE(AFF4Codec, id) = AFF4_CODEC_ZSTD;
+  VMETHOD_BASE(AFF4Codec, default_level) = 1;
+  VMETHOD_BASE(AFF4Codec, min_level) = 1;
+  VMETHOD_BASE(AFF4Codec, max_level) = 19;
+
+  VMETHOD_BASE(AFF4Codec, compress_bound) = ZstdCodec_compress_bound;
+  VMETHOD_BASE(AFF4Codec, compress) = ZstdCodec_compress;
+  VMETHOD_BASE(AFF4Codec, decompress) = ZstdCodec_decompress;
+} END_VIRTUAL
+#endif
+
+
+#ifdef AFF4_WITH_LZ4
+/** LZ4. Level 1 is the fast compressor, higher levels use LZ4HC
+    (when available) which compresses better but decompresses just as
+    fast.
+*/
+PRIVATE CLASS(LZ4Codec, AFF4Codec)
+END_CLASS
+
+static int LZ4Codec_compress_bound(AFF4Codec self, int length) {
+  return LZ4_compressBound(length);
+};
+
+static int LZ4Codec_compress(AFF4Codec self, char *dest, int dest_length,
+                             char *source, int length, int level) {
+  int res;
+
+#ifdef HAVE_LZ4HC_H
+  if(level > 1) {
+    res = LZ4_compress_HC(source, dest, length, dest_length, level);
+  } else
+#endif
+    res = LZ4_compress_default(source, dest, length, dest_length);
+
+  if(res <= 0)
+    return -1;
+
+  return res;
+};
+
+static int LZ4Codec_decompress(AFF4Codec self, char *dest, int dest_length,
+                               char *source, int length) {
+  int res = LZ4_decompress_safe(source, dest, length, dest_length);
+
+  if(res < 0)
+    return -1;
+
+  return res;
+};
+
+VIRTUAL(LZ4Codec, AFF4Codec) {
+  VMETHOD_BASE(AFF4Codec, name) = "lz4";
+  VMETHOD_BASE(AFF4Codec, id) = AFF4_CODEC_LZ4;
+  VMETHOD_BASE(AFF4Codec, default_level) = 1;
+  VMETHOD_BASE(AFF4Codec, min_level) = 1;
+#ifdef HAVE_LZ4HC_H
+  VMETHOD_BASE(AFF4Codec, max_level) = 12;
+#else
+  VMETHOD_BASE(AFF4Codec, max_level) = 1;
+#endif
+
+  VMETHOD_BASE(AFF4Codec, compress_bound) = LZ4Codec_compress_bound;
+  VMETHOD_BASE(AFF4Codec, compress) = LZ4Codec_compress;
+  VMETHOD_BASE(AFF4Codec, decompress) = LZ4Codec_decompress;
+} END_VIRTUAL
+#endif
+
+
+#ifdef AFF4_WITH_SNAPPY
+/** Snappy. There are no compression levels. */
+PRIVATE CLASS(SnappyCodec, AFF4Codec)
+END_CLASS
+
+static int SnappyCodec_compress_bound(AFF4Codec self, int length) {
+  return snappy_max_compressed_length(length);
+};
+
+static int SnappyCodec_compress(AFF4Codec self, char *dest, int dest_length,
+                                char *source, int length, int level) {
+  size_t clength = dest_length;
+
+  if(snappy_compress(source, length, dest, &clength) != SNAPPY_OK)
+    return -1;
+
+  return clength;
+};
+
+static int SnappyCodec_decompress(AFF4Codec self, char *dest, int dest_length,
+                                  char *source, int length) {
+  size_t read_length = dest_length;
+
+  if(snappy_uncompress(source, length, dest, &read_length) != SNAPPY_OK)
+    return -1;
+
+  return read_length;
+};
+
+VIRTUAL(SnappyCodec, AFF4Codec) {
+  VMETHOD_BASE(AFF4Codec, name) = "snappy";
+  VMETHOD_BASE(AFF4Codec, id) = AFF4_CODEC_SNAPPY;
+
+  VMETHOD_BASE(AFF4Codec, compress_bound) = SnappyCodec_compress_bound;
+  VMETHOD_BASE(AFF4Codec, compress) = SnappyCodec_compress;
+  VMETHOD_BASE(AFF4Codec, decompress) = SnappyCodec_decompress;
+} END_VIRTUAL
+#endif
+
+
+/** The codec registry is keyed by both the codec id and its name. */
+static Cache codecs_by_id = NULL;
+static Cache codecs_by_name = NULL;
+
+void register_codec(AFF4Codec classref) {
+  AFF4_GL_LOCK;
+
+  if(!codecs_by_id) {
+    codecs_by_id = CONSTRUCT(Cache, Cache, Con, NULL, 100, 0);
+    talloc_set_name_const(codecs_by_id, "Codec registry (id)");
+
+    codecs_by_name = CONSTRUCT(Cache, Cache, Con, NULL, 100, 0);
+    talloc_set_name_const(codecs_by_name, "Codec registry (name)");
+  };
+
+  if(!CALL(codecs_by_id, present, (char *)&classref->id, sizeof(classref->id))) {
+    Object tmp = talloc_memdup(NULL, classref, SIZEOF(classref));
+
+    talloc_set_name(tmp, "Codec %s", classref->name);
+    CALL(codecs_by_id, put, (char *)&classref->id, sizeof(classref->id), tmp);
+    talloc_unlink(NULL, tmp);
+
+    tmp = talloc_memdup(NULL, classref, SIZEOF(classref));
+    talloc_set_name(tmp, "Codec %s", classref->name);
+    CALL(codecs_by_name, put, ZSTRING(classref->name), tmp);
+    talloc_unlink(NULL, tmp);
+  };
+
+  AFF4_GL_UNLOCK;
+};
+
+AFF4Codec codec_from_id(int id) {
+  AFF4Codec result = NULL;
+
+  AFF4_GL_LOCK;
+  if(codecs_by_id)
+    result = (AFF4Codec)CALL(codecs_by_id, borrow, (char *)&id, sizeof(id));
+  AFF4_GL_UNLOCK;
+
+  return result;
+};
+
+AFF4Codec codec_from_name(char *name) {
+  AFF4Codec result = NULL;
+
+  AFF4_GL_LOCK;
+  if(codecs_by_name)
+    result = (AFF4Codec)CALL(codecs_by_name, borrow, ZSTRING(name));
+  AFF4_GL_UNLOCK;
+
+  return result;
+};
+
+
+AFF4_MODULE_INIT(A000_codecs) {
+  register_codec((AFF4Codec)GETCLASS(AFF4Codec));
+
+  INIT_CLASS(DeflateCodec);
+  register_codec((AFF4Codec)GETCLASS(DeflateCodec));
+
+#ifdef AFF4_WITH_ZSTD
+  INIT_CLASS(ZstdCodec);
+  register_codec((AFF4Codec)GETCLASS(ZstdCodec));
+#endif
+
+#ifdef AFF4_WITH_LZ4
+  INIT_CLASS(LZ4Codec);
+  register_codec((AFF4Codec)GETCLASS(LZ4Codec));
+#endif
+
+#ifdef AFF4_WITH_SNAPPY
+  INIT_CLASS(SnappyCodec);
+  register_codec((AFF4Codec)GETCLASS(SnappyCodec));
+#endif
+};
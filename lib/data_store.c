@@ -18,14 +18,189 @@ VIRTUAL(DataStoreObject, Object)
 END_VIRTUAL
 
 
+/* Tables start this big and double when they are 3/4 full. They
+   quickly outgrow what talloc will allocate so they are malloced, and
+   freed by our destructor.
+*/
+#define INITIAL_TABLE_SIZE 1024
+
+static uint32_t hash_string(char *string, int length) {
+  // FNV-1a
+  uint32_t result = 2166136261U;
+  int i;
+
+  for(i=0; i<length; i++) {
+    result ^= (unsigned char)string[i];
+    result *= 16777619U;
+  };
+
+  return result;
+};
+
+static uint64_t hash_key(uint64_t key) {
+  // The splitmix64 finalizer
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9ULL;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111ebULL;
+  key ^= key >> 31;
+
+  return key;
+};
+
+void DataStoreStrings_init(struct DataStoreStrings *strings) {
+  strings->table_size = INITIAL_TABLE_SIZE;
+  strings->table = calloc(strings->table_size, sizeof(uint32_t));
+
+  // Id 0 is never used.
+  strings->offsets = malloc(strings->table_size * sizeof(uint64_t));
+  strings->hashes = malloc(strings->table_size * sizeof(uint32_t));
+  strings->count = 1;
+
+  strings->data_allocated = INITIAL_TABLE_SIZE * 16;
+  strings->data = malloc(strings->data_allocated);
+  strings->data_size = 0;
+};
+
+void DataStoreStrings_free(struct DataStoreStrings *strings) {
+  free(strings->table);
+  free(strings->offsets);
+  free(strings->hashes);
+  free(strings->data);
+};
+
+/* Returns the slot of the table with the string (or the empty slot
+   where it would go).
+*/
+static uint32_t find_string(struct DataStoreStrings *strings, char *string,
+                            int length, uint32_t hash) {
+  uint32_t mask = strings->table_size - 1;
+  uint32_t slot = hash & mask;
+
+  while(1) {
+    uint32_t id = strings->table[slot];
+
+    if(id == 0)
+      return slot;
+
+    if(strings->hashes[id] == hash) {
+      char *candidate = strings->data + strings->offsets[id];
+
+      if(!memcmp(candidate, string, length) && candidate[length] == 0)
+        return slot;
+    };
+
+    slot = (slot + 1) & mask;
+  };
+};
+
+/* Returns the id of the string (0 if we do not have it). */
+static uint32_t get_string_id(struct DataStoreStrings *strings, char *string) {
+  int length = strlen(string);
+
+  return strings->table[find_string(strings, string, length,
+                                    hash_string(string, length))];
+};
+
+static int grow_strings(struct DataStoreStrings *strings) {
+  uint32_t size = strings->table_size * 2;
+  uint32_t mask = size - 1, i;
+  uint32_t *table = calloc(size, sizeof(uint32_t));
+  uint64_t *offsets = realloc(strings->offsets, size * sizeof(uint64_t));
+  uint32_t *hashes;
+
+  if(offsets) strings->offsets = offsets;
+  hashes = realloc(strings->hashes, size * sizeof(uint32_t));
+  if(hashes) strings->hashes = hashes;
+
+  if(!table || !offsets || !hashes) {
+    free(table);
+    return 0;
+  };
+
+  // We kept the hashes so we do not need to look at the strings.
+  for(i=1; i<strings->count; i++) {
+    uint32_t slot = strings->hashes[i] & mask;
+
+    while(table[slot])
+      slot = (slot + 1) & mask;
+
+    table[slot] = i;
+  };
+
+  free(strings->table);
+  strings->table = table;
+  strings->table_size = size;
+
+  return 1;
+};
+
+/* Returns the id of the string, adding it if we do not have it (0 if
+   we run out of memory).
+*/
+uint32_t DataStoreStrings_intern(struct DataStoreStrings *strings, char *string) {
+  int length = strlen(string);
+  uint32_t hash = hash_string(string, length);
+  uint32_t slot = find_string(strings, string, length, hash);
+  uint32_t id = strings->table[slot];
+
+  if(id)
+    return id;
+
+  if((uint64_t)(strings->count + 1) * 4 > (uint64_t)strings->table_size * 3) {
+    if(!grow_strings(strings))
+      return 0;
+
+    slot = find_string(strings, string, length, hash);
+  };
+
+  if(strings->data_size + length + 1 > strings->data_allocated) {
+    uint64_t allocated = max(strings->data_allocated * 2,
+                             strings->data_size + length + 1);
+    char *data = realloc(strings->data, allocated);
+
+    if(!data)
+      return 0;
+
+    strings->data = data;
+    strings->data_allocated = allocated;
+  };
+
+  id = strings->count++;
+  strings->offsets[id] = strings->data_size;
+  strings->hashes[id] = hash;
+  memcpy(strings->data + strings->data_size, string, length + 1);
+  strings->data_size += length + 1;
+  strings->table[slot] = id;
+
+  return id;
+};
+
+static int MemoryDataStore_destructor(void *this) {
+  MemoryDataStore self = (MemoryDataStore)this;
+
+  DataStoreStrings_free(&self->urns);
+  DataStoreStrings_free(&self->attributes);
+  free(self->entries);
+  free(self->values);
+
+  return 0;
+};
+
 static DataStore DataStore_Con(DataStore this) {
   MemoryDataStore self = (MemoryDataStore)this;
   AFF4_GL_LOCK;
 
-  self->urn_db = CONSTRUCT(Cache, Cache, Con, self, 100, 0);
-  self->attribute_db = CONSTRUCT(Cache, Cache, Con, self, 100, 0);
-  self->data_db = CONSTRUCT(Cache, Cache, Con, self, 100, 0);
-  self->id_counter = 0;
+  DataStoreStrings_init(&self->urns);
+  DataStoreStrings_init(&self->attributes);
+
+  self->entries_size = INITIAL_TABLE_SIZE;
+  self->entries = calloc(self->entries_size, sizeof(struct DataStoreEntry));
+
+  self->values_size = INITIAL_TABLE_SIZE;
+  self->values = malloc(self->values_size * sizeof(DataStoreObject));
+
+  talloc_set_destructor((void *)self, MemoryDataStore_destructor);
 
   AFF4_GL_UNLOCK;
   return this;
@@ -37,76 +212,198 @@ static void DataStore_lock(DataStore this) {
 static void DataStore_unlock(DataStore this) {
 };
 
-static XSDInteger get_or_create(MemoryDataStore self, Cache cache, char *key) {
-  XSDInteger result;
+/* Combines the uri and attribute ids into a key. When create is not
+   set (and always once we are frozen) we do not add new strings, so
+   this returns 0 if either is unknown (or we run out of memory). The
+   caller must hold the global lock unless we are frozen.
+*/
+static uint64_t get_data_key(MemoryDataStore self, char *uri, char *attribute,
+                             int create) {
+  uint64_t uri_id, attribute_id;
+
+  if(create && !((DataStore)self)->frozen) {
+    uri_id = DataStoreStrings_intern(&self->urns, uri);
+    attribute_id = DataStoreStrings_intern(&self->attributes, attribute);
+  } else {
+    uri_id = get_string_id(&self->urns, uri);
+    attribute_id = get_string_id(&self->attributes, attribute);
+  };
 
-  AFF4_GL_LOCK;
-  result = (XSDInteger)CALL(cache, borrow, ZSTRING_NO_NULL(key));
+  if(!uri_id || !attribute_id)
+    return 0;
+
+  return uri_id << 32 | attribute_id;
+};
+
+/* Returns the slot of the entries table with the key (or the empty
+   slot where it would go).
+*/
+static uint64_t find_entry(MemoryDataStore self, uint64_t key) {
+  uint64_t mask = self->entries_size - 1;
+  uint64_t slot = hash_key(key) & mask;
+
+  while(self->entries[slot].key && self->entries[slot].key != key)
+    slot = (slot + 1) & mask;
+
+  return slot;
+};
+
+/* Returns the entry for the key, or NULL if we do not have it. */
+static struct DataStoreEntry *get_entry(MemoryDataStore self, uint64_t key) {
+  struct DataStoreEntry *entry;
+
+  if(!key)
+    return NULL;
 
-  if(!result) {
-    self->id_counter++;
-    result = CONSTRUCT(XSDInteger, RDFValue, Con, self);
-    CALL(result, set, self->id_counter);
-    CALL(cache, put, ZSTRING_NO_NULL(key), (Object)result);
+  entry = &self->entries[find_entry(self, key)];
+
+  return entry->key ? entry : NULL;
+};
+
+static int grow_entries(MemoryDataStore self) {
+  struct DataStoreEntry *old = self->entries;
+  uint64_t old_size = self->entries_size, i;
+  struct DataStoreEntry *entries = calloc(old_size * 2, sizeof(struct DataStoreEntry));
+
+  if(!entries)
+    return 0;
+
+  self->entries = entries;
+  self->entries_size = old_size * 2;
+
+  for(i=0; i<old_size; i++) {
+    if(old[i].key)
+      self->entries[find_entry(self, old[i].key)] = old[i];
   };
 
-  AFF4_GL_UNLOCK;
-  return result;
+  free(old);
+  return 1;
 };
 
+/* Returns the entry for the key, adding an empty one if needed. */
+static struct DataStoreEntry *create_entry(MemoryDataStore self, uint64_t key) {
+  struct DataStoreEntry *entry;
+
+  if(!key)
+    goto error;
+
+  entry = &self->entries[find_entry(self, key)];
+  if(entry->key)
+    return entry;
+
+  if((self->entries_used + 1) * 4 > self->entries_size * 3) {
+    if(!grow_entries(self))
+      goto error;
+
+    entry = &self->entries[find_entry(self, key)];
+  };
+
+  self->entries_used++;
+  entry->key = key;
+  entry->count = 0;
+  entry->capacity = 0;
+
+  return entry;
+
+ error:
+  RaiseError(ENoMemory, "Unable to grow the DataStore");
+  return NULL;
+};
+
+/* Frees all the values of the entry. Its room is kept for new values. */
+static void clear_entry(MemoryDataStore self, struct DataStoreEntry *entry) {
+  uint32_t i;
+
+  for(i=0; i<entry->count; i++)
+    talloc_free(self->values[entry->offset + i]);
+
+  entry->count = 0;
+  if(entry->capacity)
+    self->values[entry->offset] = NULL;
+};
+
+/* Appends the value to the entry, moving its values to the end if it
+   is full. The value is stolen.
+*/
+static void append_value(MemoryDataStore self, struct DataStoreEntry *entry,
+                         DataStoreObject value) {
+  if(entry->count == entry->capacity) {
+    uint32_t capacity = max(1, entry->capacity * 2);
+
+    // Room for the values and the NULL after them.
+    if(self->values_used + capacity + 1 > self->values_size) {
+      uint64_t size = max(self->values_size * 2, self->values_used + capacity + 1);
+      DataStoreObject *values = realloc(self->values, size * sizeof(DataStoreObject));
+
+      if(!values) {
+        RaiseError(ENoMemory, "Unable to grow the DataStore");
+        talloc_free(value);
+        return;
+      };
+
+      self->values = values;
+      self->values_size = size;
+    };
+
+    memcpy(self->values + self->values_used, self->values + entry->offset,
+           entry->count * sizeof(DataStoreObject));
+    entry->offset = self->values_used;
+    entry->capacity = capacity;
+    self->values_used += capacity + 1;
+  };
+
+  self->values[entry->offset + entry->count] = talloc_steal(self, value);
+  entry->count++;
+  self->values[entry->offset + entry->count] = NULL;
+};
 
 static void DataStore_del(DataStore this, char *uri, char *attribute) {
   MemoryDataStore self = (MemoryDataStore)this;
-  uint64_t data_ptr[2];
-  XSDInteger uri_index;
-  XSDInteger attr_index;
+  struct DataStoreEntry *entry;
 
   AFF4_GL_LOCK;
-  uri_index = get_or_create(self, self->urn_db, uri);
-  attr_index = get_or_create(self, self->attribute_db,attribute);
 
-  // Combine the values as an index to the data_db.
-  data_ptr[0] = uri_index->value;
-  data_ptr[1] = attr_index->value;
+  entry = get_entry(self, get_data_key(self, uri, attribute, 0));
+  if(!entry || !entry->count)
+    goto exit;
 
-  // Remove all the objects from the cache.
-  while (1) {
-    Object obj = CALL(self->data_db, get, NULL, (char *)data_ptr, sizeof(data_ptr));
-    if (!obj) break;
-
-    talloc_free(obj);
+  // Deleting values which are not there does not change a frozen
+  // store (e.g. when read only objects are closed).
+  if(this->frozen) {
+    RaiseError(ERuntimeError, "DataStore is frozen");
+    goto exit;
   };
 
+  clear_entry(self, entry);
+
+ exit:
   AFF4_GL_UNLOCK;
 };
 
 static void DataStore_set(DataStore this, char *uri, char *attribute,
                           DataStoreObject value) {
   MemoryDataStore self = (MemoryDataStore)this;
-  uint64_t data_ptr[2];
-  XSDInteger uri_index;
-  XSDInteger attr_index;
+  struct DataStoreEntry *entry;
 
   AFF4_GL_LOCK;
 
-  uri_index = get_or_create(self, self->urn_db, uri);
-  attr_index = get_or_create(self, self->attribute_db, attribute);
-
-  // Combine the values as an index to the data_db
-  data_ptr[0] = uri_index->value;
-  data_ptr[1] = attr_index->value;
-
-  // Remove all the old objects from the cache.
-  while (1) {
-    Object obj = CALL(self->data_db, get, NULL, (char *)data_ptr, sizeof(data_ptr));
-    if (!obj) break;
+  if(this->frozen) {
+    RaiseError(ERuntimeError, "DataStore is frozen");
+    talloc_free(value);
+    goto exit;
+  };
 
-    talloc_free(obj);
+  entry = create_entry(self, get_data_key(self, uri, attribute, 1));
+  if(!entry) {
+    talloc_free(value);
+    goto exit;
   };
 
-  // Set the new object.
-  CALL(self->data_db, put, (char *)data_ptr, sizeof(data_ptr), (Object)value);
+  // Remove all the old objects.
+  clear_entry(self, entry);
+  append_value(self, entry, value);
 
+ exit:
   AFF4_GL_UNLOCK;
 };
 
@@ -114,81 +411,163 @@ static void DataStore_set(DataStore this, char *uri, char *attribute,
 static void DataStore_add(DataStore this, char *uri, char *attribute,
                           DataStoreObject value) {
   MemoryDataStore self = (MemoryDataStore)this;
-  uint64_t data_ptr[2];
-  XSDInteger uri_index;
-  XSDInteger attr_index;
+  struct DataStoreEntry *entry;
 
   AFF4_GL_LOCK;
-  uri_index = get_or_create(self, self->urn_db, uri);
-  attr_index = get_or_create(self, self->attribute_db, attribute);
 
-  // Combine the values as an index to the data_db
-  data_ptr[0] = uri_index->value;
-  data_ptr[1] = attr_index->value;
+  if(this->frozen) {
+    RaiseError(ERuntimeError, "DataStore is frozen");
+    talloc_free(value);
+    goto exit;
+  };
+
+  entry = create_entry(self, get_data_key(self, uri, attribute, 1));
+  if(!entry) {
+    talloc_free(value);
+    goto exit;
+  };
 
-  // Set the new object.
-  CALL(self->data_db, put, (char *)data_ptr, sizeof(data_ptr), (Object)value);
+  append_value(self, entry, value);
 
+ exit:
   AFF4_GL_UNLOCK;
 };
 
-static DataStoreObject DataStore_get(DataStore this, char *uri, char *attribute) {
+static void DataStore_add_values(DataStore this, struct DataStoreValue *values,
+                                 int count) {
   MemoryDataStore self = (MemoryDataStore)this;
-  uint64_t data_ptr[2];
-  XSDInteger uri_index;
-  XSDInteger attr_index;
-  DataStoreObject value;
+  struct DataStoreEntry *entry = NULL;
+  char *uri = NULL, *attribute = NULL;
+  uint64_t uri_id = 0, attribute_id = 0;
+  int i;
 
   AFF4_GL_LOCK;
-  uri_index = get_or_create(self, self->urn_db, uri);
-  attr_index = get_or_create(self, self->attribute_db, attribute);
 
-  // Combine the values as an index to the data_db
-  data_ptr[0] = uri_index->value;
-  data_ptr[1] = attr_index->value;
+  if(this->frozen) {
+    RaiseError(ERuntimeError, "DataStore is frozen");
+    for(i=0; i<count; i++)
+      talloc_free(values[i].value);
+
+    goto exit;
+  };
 
-  // Set the new object.
-  value = (DataStoreObject)CALL(self->data_db, borrow, (char *)data_ptr, sizeof(data_ptr));
+  for(i=0; i<count; i++) {
+    // Only look up what changed since the last value.
+    if(!uri || (uri != values[i].uri && strcmp(uri, values[i].uri))) {
+      uri = values[i].uri;
+      uri_id = DataStoreStrings_intern(&self->urns, uri);
+      entry = NULL;
+    };
+
+    if(!attribute || (attribute != values[i].attribute &&
+                      strcmp(attribute, values[i].attribute))) {
+      attribute = values[i].attribute;
+      attribute_id = DataStoreStrings_intern(&self->attributes, attribute);
+      entry = NULL;
+    };
+
+    if(!entry)
+      entry = create_entry(self, uri_id && attribute_id ?
+                           uri_id << 32 | attribute_id : 0);
+
+    if(!entry) {
+      talloc_free(values[i].value);
+      continue;
+    };
+
+    append_value(self, entry, values[i].value);
+  };
 
+ exit:
   AFF4_GL_UNLOCK;
-  return value;
 };
 
-static Object DataStore_iter(DataStore this, char *uri, char *attribute) {
+/* Returns the values of the uri and attribute, NULL terminated, or
+   NULL if there are none.
+*/
+static DataStoreObject *get_values(MemoryDataStore self, char *uri,
+                                   char *attribute) {
+  struct DataStoreEntry *entry = get_entry(self, get_data_key(self, uri, attribute, 0));
+
+  if(!entry || !entry->count)
+    return NULL;
+
+  return self->values + entry->offset;
+};
+
+static DataStoreObject DataStore_get(DataStore this, char *uri, char *attribute) {
   MemoryDataStore self = (MemoryDataStore)this;
-  uint64_t data_ptr[2];
-  XSDInteger uri_index;
-  XSDInteger attr_index;
-  Object iter;
+  DataStoreObject *values;
+
+  // A frozen store is read without the lock.
+  if(this->frozen) {
+    values = get_values(self, uri, attribute);
+    return values ? values[0] : NULL;
+  };
 
   AFF4_GL_LOCK;
-  uri_index = get_or_create(self, self->urn_db, uri);
-  attr_index = get_or_create(self, self->attribute_db, attribute);
+  values = get_values(self, uri, attribute);
+  AFF4_GL_UNLOCK;
+
+  return values ? values[0] : NULL;
+};
 
-  // Combine the values as an index to the data_db
-  data_ptr[0] = uri_index->value;
-  data_ptr[1] = attr_index->value;
+/* The iterator points at the next value to return. */
+static Object DataStore_iter(DataStore this, char *uri, char *attribute) {
+  MemoryDataStore self = (MemoryDataStore)this;
+  DataStoreObject *values;
 
-  // Set the new object.
-  iter = CALL(self->data_db, iter, (char *)data_ptr, sizeof(data_ptr));
+  if(this->frozen)
+    return (Object)get_values(self, uri, attribute);
 
+  AFF4_GL_LOCK;
+  values = get_values(self, uri, attribute);
   AFF4_GL_UNLOCK;
-  return iter;
+
+  return (Object)values;
 };
 
 static DataStoreObject DataStore_next(DataStore this, Object *iter) {
-  MemoryDataStore self = (MemoryDataStore)this;
-  DataStoreObject result;
+  DataStoreObject *values = (DataStoreObject *)*iter;
+
+  if(!values)
+    return NULL;
+
+  // The values are NULL terminated.
+  *iter = values[1] ? (Object)(values + 1) : NULL;
+
+  return values[0];
+};
 
+static void DataStore_freeze(DataStore this) {
   AFF4_GL_LOCK;
-  result = (DataStoreObject)CALL(self->data_db, next, iter);
-  AFF4_GL_UNLOCK;
 
-  return result;
+  // Nothing changes the tables when they are read, so there is
+  // nothing else to do.
+  this->frozen = 1;
+
+  AFF4_GL_UNLOCK;
 };
 
 
-/* This is an abstract class so it does not implement anything. */
+/* Stores which can not do better add the values one at a time. */
+static void add_each_value(DataStore self, struct DataStoreValue *values,
+                           int count) {
+  int i;
+
+  AFF4_GL_LOCK;
+  CALL(self, lock);
+
+  for(i=0; i<count; i++)
+    CALL(self, add, values[i].uri, values[i].attribute, values[i].value);
+
+  CALL(self, unlock);
+  AFF4_GL_UNLOCK;
+};
+
+/* This is an abstract class so it does not implement anything
+   (apart from add_values() in terms of add()).
+*/
 VIRTUAL(DataStore, Object)
   UNIMPLEMENTED(DataStore, Con);
   UNIMPLEMENTED(DataStore, lock);
@@ -196,9 +575,11 @@ VIRTUAL(DataStore, Object)
   UNIMPLEMENTED(DataStore, del);
   UNIMPLEMENTED(DataStore, set);
   UNIMPLEMENTED(DataStore, add);
+  VMETHOD(add_values) = add_each_value;
   UNIMPLEMENTED(DataStore, get);
   UNIMPLEMENTED(DataStore, iter);
   UNIMPLEMENTED(DataStore, next);
+  UNIMPLEMENTED(DataStore, freeze);
 END_VIRTUAL
 
 VIRTUAL(MemoryDataStore, DataStore)
@@ -208,12 +589,329 @@ VIRTUAL(MemoryDataStore, DataStore)
   VMETHOD_BASE(DataStore, del) = DataStore_del;
   VMETHOD_BASE(DataStore, set) = DataStore_set;
   VMETHOD_BASE(DataStore, add) = DataStore_add;
+  VMETHOD_BASE(DataStore, add_values) = DataStore_add_values;
   VMETHOD_BASE(DataStore, get) = DataStore_get;
   VMETHOD_BASE(DataStore, iter) = DataStore_iter;
   VMETHOD_BASE(DataStore, next) = DataStore_next;
+  VMETHOD_BASE(DataStore, freeze) = DataStore_freeze;
 END_VIRTUAL
 
 
 DataStore new_MemoryDataStore(void *ctx) {
   return CONSTRUCT(MemoryDataStore, DataStore, Con, ctx);
 };
+
+
+/****************************************************
+  A DataStore in a tdb file.
+****************************************************/
+
+/* Each value is stored as this header, then its data, then its
+   rdf_type (with its NUL).
+*/
+struct TDBValueHeader {
+  uint32_t length;
+  uint32_t type_length;
+};
+
+static int TDBDataStore_destructor(void *this) {
+  TDBDataStore self = (TDBDataStore)this;
+
+  if(self->tdb)
+    tdb_close(self->tdb);
+
+  return 0;
+};
+
+static DataStore TDBDataStore_Con(DataStore this) {
+  TDBDataStore self = (TDBDataStore)this;
+  AFF4_GL_LOCK;
+
+  self->values = CONSTRUCT(Cache, Cache, Con, self, HASH_TABLE_SIZE,
+                           TDB_DATASTORE_CACHE_SIZE);
+  talloc_set_destructor((void *)self, TDBDataStore_destructor);
+
+  AFF4_GL_UNLOCK;
+  return this;
+};
+
+static int TDBDataStore_open(TDBDataStore self, char *filename, char mode) {
+  AFF4_GL_LOCK;
+
+  if(self->tdb) {
+    RaiseError(ERuntimeError, "DataStore is already open");
+    goto error;
+  };
+
+  self->tdb = tdb_open(filename, TDB_DATASTORE_HASH_SIZE, TDB_DEFAULT,
+                       mode == 'r' ? O_RDONLY : O_RDWR | O_CREAT, 0644);
+  if(!self->tdb) {
+    RaiseError(EIOError, "Unable to open %s: %s", filename, strerror(errno));
+    goto error;
+  };
+
+  self->filename = talloc_strdup(self, filename);
+  if(mode == 'r')
+    ((DataStore)self)->frozen = 1;
+
+  AFF4_GL_UNLOCK;
+  return 1;
+
+ error:
+  AFF4_GL_UNLOCK;
+  return 0;
+};
+
+static void TDBDataStore_lock(DataStore this) {
+  TDBDataStore self = (TDBDataStore)this;
+  AFF4_GL_LOCK;
+
+  if(self->lock_depth++ == 0) {
+    if(this->frozen)
+      tdb_lockall_read(self->tdb);
+    else
+      tdb_lockall(self->tdb);
+  };
+
+  AFF4_GL_UNLOCK;
+};
+
+static void TDBDataStore_unlock(DataStore this) {
+  TDBDataStore self = (TDBDataStore)this;
+  AFF4_GL_LOCK;
+
+  // Unlocking a store which is not locked does nothing.
+  if(self->lock_depth > 0 && --self->lock_depth == 0) {
+    if(this->frozen)
+      tdb_unlockall_read(self->tdb);
+    else
+      tdb_unlockall(self->tdb);
+  };
+
+  AFF4_GL_UNLOCK;
+};
+
+/* The record key is the uri and attribute separated by a NUL. */
+static TDB_DATA get_record_key(void *ctx, char *uri, char *attribute) {
+  int uri_length = strlen(uri);
+  int attribute_length = strlen(attribute);
+  TDB_DATA result;
+
+  result.dsize = uri_length + 1 + attribute_length;
+  result.dptr = talloc_size(ctx, result.dsize);
+
+  memcpy(result.dptr, uri, uri_length + 1);
+  memcpy(result.dptr + uri_length + 1, attribute, attribute_length);
+
+  return result;
+};
+
+/* Drops the decoded values of the key, after they are changed. */
+static void expire_values(TDBDataStore self, TDB_DATA key) {
+  if(CALL(self->values, present, (char *)key.dptr, key.dsize))
+    talloc_free(CALL(self->values, get, NULL, (char *)key.dptr, key.dsize));
+};
+
+/* Encodes the value as a record and frees it. */
+static TDB_DATA encode_value(void *ctx, DataStoreObject value) {
+  struct TDBValueHeader header;
+  TDB_DATA result;
+
+  header.length = value->length;
+  header.type_length = strlen(value->rdf_type) + 1;
+
+  result.dsize = sizeof(header) + header.length + header.type_length;
+  result.dptr = talloc_size(ctx, result.dsize);
+
+  memcpy(result.dptr, &header, sizeof(header));
+  memcpy(result.dptr + sizeof(header), value->data, header.length);
+  memcpy(result.dptr + sizeof(header) + header.length, value->rdf_type,
+         header.type_length);
+
+  talloc_free(value);
+  return result;
+};
+
+/* Stores the value, appending it to the other values if append is
+   set. */
+static void store_value(DataStore this, char *uri, char *attribute,
+                        DataStoreObject value, int append) {
+  TDBDataStore self = (TDBDataStore)this;
+  void *ctx = talloc_size(NULL, 0);
+  TDB_DATA key, data;
+  int result;
+
+  AFF4_GL_LOCK;
+
+  if(this->frozen) {
+    RaiseError(ERuntimeError, "DataStore is frozen");
+    talloc_free(value);
+    goto exit;
+  };
+
+  key = get_record_key(ctx, uri, attribute);
+  data = encode_value(ctx, value);
+
+  expire_values(self, key);
+
+  if(append)
+    result = tdb_append(self->tdb, key, data);
+  else
+    result = tdb_store(self->tdb, key, data, TDB_REPLACE);
+
+  if(result != 0)
+    RaiseError(EIOError, "Unable to store %s: %s", attribute,
+               tdb_errorstr(self->tdb));
+
+ exit:
+  talloc_free(ctx);
+  AFF4_GL_UNLOCK;
+};
+
+static void TDBDataStore_set(DataStore this, char *uri, char *attribute,
+                             DataStoreObject value) {
+  store_value(this, uri, attribute, value, 0);
+};
+
+static void TDBDataStore_add(DataStore this, char *uri, char *attribute,
+                             DataStoreObject value) {
+  store_value(this, uri, attribute, value, 1);
+};
+
+static void TDBDataStore_del(DataStore this, char *uri, char *attribute) {
+  TDBDataStore self = (TDBDataStore)this;
+  TDB_DATA key;
+
+  AFF4_GL_LOCK;
+
+  key = get_record_key(NULL, uri, attribute);
+  if(!tdb_exists(self->tdb, key))
+    goto exit;
+
+  if(this->frozen) {
+    RaiseError(ERuntimeError, "DataStore is frozen");
+    goto exit;
+  };
+
+  expire_values(self, key);
+  tdb_delete(self->tdb, key);
+
+ exit:
+  talloc_free(key.dptr);
+  AFF4_GL_UNLOCK;
+};
+
+/* Decodes the values of the record into a NULL terminated array. */
+static DataStoreObject *decode_values(void *ctx, TDB_DATA data) {
+  DataStoreObject *result = NULL;
+  int count = 0;
+  size_t offset = 0;
+
+  while(offset + sizeof(struct TDBValueHeader) <= data.dsize) {
+    struct TDBValueHeader header;
+    char *value_data, *rdf_type;
+
+    memcpy(&header, data.dptr + offset, sizeof(header));
+    offset += sizeof(header);
+
+    if(offset + header.length + header.type_length > data.dsize ||
+       header.type_length == 0)
+      break;
+
+    value_data = (char *)data.dptr + offset;
+    rdf_type = value_data + header.length;
+    offset += header.length + header.type_length;
+
+    if(rdf_type[header.type_length - 1] != 0)
+      break;
+
+    result = talloc_realloc(ctx, result, DataStoreObject, count + 2);
+    result[count] = CONSTRUCT(DataStoreObject, DataStoreObject, Con, result,
+                              value_data, header.length, rdf_type);
+    count++;
+  };
+
+  if(result)
+    result[count] = NULL;
+
+  return result;
+};
+
+/* Returns the values of the uri and attribute, NULL terminated, or
+   NULL if there are none.
+*/
+static DataStoreObject *get_tdb_values(TDBDataStore self, char *uri,
+                                       char *attribute) {
+  DataStoreObject *result;
+  TDB_DATA key, data;
+
+  AFF4_GL_LOCK;
+
+  key = get_record_key(NULL, uri, attribute);
+  result = (DataStoreObject *)CALL(self->values, borrow, (char *)key.dptr,
+                                   key.dsize);
+  if(result)
+    goto exit;
+
+  data = tdb_fetch(self->tdb, key);
+  if(!data.dptr)
+    goto exit;
+
+  result = decode_values(NULL, data);
+  free(data.dptr);
+
+  if(result)
+    CALL(self->values, put, (char *)key.dptr, key.dsize, (Object)result);
+
+ exit:
+  talloc_free(key.dptr);
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+static DataStoreObject TDBDataStore_get(DataStore this, char *uri, char *attribute) {
+  DataStoreObject *values = get_tdb_values((TDBDataStore)this, uri, attribute);
+
+  return values ? values[0] : NULL;
+};
+
+static Object TDBDataStore_iter(DataStore this, char *uri, char *attribute) {
+  return (Object)get_tdb_values((TDBDataStore)this, uri, attribute);
+};
+
+static void TDBDataStore_freeze(DataStore this) {
+  AFF4_GL_LOCK;
+
+  // Reads still need the global lock since tdb is not thread safe,
+  // so this only stops further changes.
+  this->frozen = 1;
+
+  AFF4_GL_UNLOCK;
+};
+
+VIRTUAL(TDBDataStore, DataStore)
+  VMETHOD_BASE(DataStore, Con) = TDBDataStore_Con;
+  VMETHOD_BASE(DataStore, lock) = TDBDataStore_lock;
+  VMETHOD_BASE(DataStore, unlock) = TDBDataStore_unlock;
+  VMETHOD_BASE(DataStore, del) = TDBDataStore_del;
+  VMETHOD_BASE(DataStore, set) = TDBDataStore_set;
+  VMETHOD_BASE(DataStore, add) = TDBDataStore_add;
+  VMETHOD_BASE(DataStore, get) = TDBDataStore_get;
+  VMETHOD_BASE(DataStore, iter) = TDBDataStore_iter;
+  VMETHOD_BASE(DataStore, next) = DataStore_next;
+  VMETHOD_BASE(DataStore, freeze) = TDBDataStore_freeze;
+
+  VMETHOD(open) = TDBDataStore_open;
+END_VIRTUAL
+
+
+DataStore new_TDBDataStore(void *ctx, char *filename, char mode) {
+  TDBDataStore result = (TDBDataStore)CONSTRUCT(TDBDataStore, DataStore, Con, ctx);
+
+  if(!CALL(result, open, filename, mode)) {
+    talloc_free(result);
+    return NULL;
+  };
+
+  return (DataStore)result;
+};
@@ -11,17 +11,51 @@
 #include <pthread.h>
 #include <class.h>
 #include <string.h>
+#include <stdlib.h>
 #include "aff4_errors.h"
 
 #define ERROR_BUFF_SIZE 10240
 
-static char error_buffer[ERROR_BUFF_SIZE];
-static int error_type;
+/** The error state is kept per thread so that threads running with
+    the global lock released do not clobber each other's errors. It
+    is allocated with malloc on first use since it must not depend on
+    any talloc context.
+*/
+struct error_state {
+  int error_type;
+  char error_buffer[ERROR_BUFF_SIZE];
+};
+
+static pthread_key_t error_key;
+static pthread_once_t error_key_once = PTHREAD_ONCE_INIT;
+
+static void error_state_free(void *state) {
+  free(state);
+};
+
+static void error_key_init(void) {
+  pthread_key_create(&error_key, error_state_free);
+};
 
+static struct error_state *get_error_state(void) {
+  struct error_state *state;
+
+  pthread_once(&error_key_once, error_key_init);
+
+  state = (struct error_state *)pthread_getspecific(error_key);
+  if(!state) {
+    state = (struct error_state *)calloc(1, sizeof(*state));
+    pthread_setspecific(error_key, state);
+  };
+
+  return state;
+};
 
 DLL_PUBLIC void *aff4_raise_errors(int t, char *reason, ...) {
+  struct error_state *state = get_error_state();
   char tmp[ERROR_BUFF_SIZE];
 
+  *tmp = 0;
   if(reason) {
     va_list ap;
     va_start(ap, reason);
@@ -31,23 +65,29 @@ DLL_PUBLIC void *aff4_raise_errors(int t, char *reason, ...) {
     va_end(ap);
   };
 
-  if(error_type == EZero) {
-    *error_buffer = 0;
+  if(state->error_type == EZero) {
+    *state->error_buffer = 0;
 
     //update the error type
-    error_type = t;
+    state->error_type = t;
   } else {
-    strncat(error_buffer, "\n", ERROR_BUFF_SIZE -1 );
+    strncat(state->error_buffer, "\n",
+            ERROR_BUFF_SIZE - strlen(state->error_buffer) - 1);
   };
 
-  strncat(error_buffer, tmp, ERROR_BUFF_SIZE-1);
+  strncat(state->error_buffer, tmp,
+          ERROR_BUFF_SIZE - strlen(state->error_buffer) - 1);
 
   return NULL;
 };
 
 DLL_PUBLIC int *aff4_get_current_error(char **error_buffer) {
+  struct error_state *state = get_error_state();
+
+  if(error_buffer)
+    *error_buffer = state->error_buffer;
 
-  return &error_type;
+  return &state->error_type;
 };
 
 
@@ -1,5 +1,7 @@
 /** This file implements the basic file handling code. We allow
-    concurrent read/write.
+    concurrent read/write - the system calls are made with the global
+    lock released so threads working on different files do not wait
+    for each other.
 
     FIXME: The FileBackedObject needs to be tailored for windows.
 */
@@ -18,6 +20,11 @@
 static int FileBackedObject_destructor(void *self) {
   FileBackedObject this=(FileBackedObject)self;
 
+#ifndef WINDOWS
+  if(this->map)
+    munmap(this->map, this->map_size);
+#endif
+
   close(this->fd);
 
   return 0;
@@ -57,6 +64,27 @@ static int FileBackedObject_AFFObject_finish(AFFObject this) {
     talloc_set_destructor((void *)self, FileBackedObject_destructor);
   };
 
+  self->lock = CONSTRUCT(AFF4Lock, AFF4Lock, Con, self);
+
+#ifndef WINDOWS
+  /* Files we only read are mapped. If we can not map them we just
+     use pread.
+  */
+  if(this->mode == 'r') {
+    struct stat buf;
+
+    if(fstat(self->fd, &buf) == 0 && buf.st_size > 0 &&
+       (uint64_t)buf.st_size == (size_t)buf.st_size) {
+      void *map = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, self->fd, 0);
+
+      if(map != MAP_FAILED) {
+        self->map = map;
+        self->map_size = buf.st_size;
+      };
+    };
+  };
+#endif
+
   return 1;
 
  error:
@@ -72,8 +100,15 @@ static RDFValue FileBackedObject_resolve(AFFObject this, void *ctx, char *attrib
   FileBackedObject self = (FileBackedObject)this;
 
   if(!strcmp(attribute, AFF4_SIZE)) {
-    result = new_XSDInteger(ctx);
-    result->value = lseek(self->fd, 0, SEEK_END);
+    struct stat buf;
+
+    // Wait for any write in progress so we see its result.
+    CALL(self->lock, acquire);
+    if(fstat(self->fd, &buf) == 0) {
+      result = new_XSDInteger(ctx);
+      result->value = buf.st_size;
+    };
+    CALL(self->lock, release);
   };
 
   return (RDFValue)result;
@@ -94,8 +129,10 @@ static uint64_t FileLikeObject_seek(FileLikeObject self, int64_t offset, int whe
   } else if(whence==SEEK_END) {
     XSDInteger size = (XSDInteger)CALL((AFFObject)self, resolve, NULL, AFF4_SIZE);
 
-    self->readptr = size->value + offset;
-    talloc_free(size);
+    if(size) {
+      self->readptr = size->value + offset;
+      talloc_free(size);
+    };
   };
 
   if(self->readptr < 0) {
@@ -130,23 +167,72 @@ static int FileLikeObject_readline(FileLikeObject self, char *buffer, unsigned i
   return result;
 };
 
+/* Reads at the offset without touching the readptr, so this needs no
+   locks. We release the global lock for the system call.
+*/
+static int FileBackedObject_read_at(FileLikeObject self, uint64_t offset,
+                                    char *buffer, unsigned int length) {
+  FileBackedObject this = (FileBackedObject)self;
+  int result;
+
+  AFF4_BEGIN_ALLOW_THREADS;
+  // The copy may fault in pages from disk so we do not hold the
+  // global lock for it either.
+  if(this->map && offset < this->map_size) {
+    result = min(length, this->map_size - offset);
+    memcpy(buffer, this->map + offset, result);
+  } else {
+    result = pread(this->fd, buffer, length, offset);
+  };
+  AFF4_END_ALLOW_THREADS;
+
+  if(result < 0) {
+    RaiseError(EIOError, "Unable to read from %s (%s)", URNOF(self)->value,
+               strerror(errno));
+    return -1;
+  };
+
+  return result;
+};
+
+static int FileBackedObject_write_at(FileLikeObject self, uint64_t offset,
+                                     char *buffer, unsigned int length) {
+  FileBackedObject this = (FileBackedObject)self;
+  int result;
+
+  if(length == 0) return 0;
+
+  AFF4_BEGIN_ALLOW_THREADS;
+  result = pwrite(this->fd, buffer, length, offset);
+  AFF4_END_ALLOW_THREADS;
+
+  if(result < 0) {
+    RaiseError(EIOError, "Unable to write to %s (%s)", URNOF(self)->value,
+               strerror(errno));
+    return -1;
+  };
+
+  return result;
+};
+
 /**
     read some data from our file into the buffer (which is assumed to
     be large enough).
+
+    We hold the object lock so the readptr can not move under us. We
+    touch nothing else, so the global lock is not needed.
 **/
 static int FileBackedObject_read(FileLikeObject self, char *buffer, unsigned int length) {
   FileBackedObject this = (FileBackedObject)self;
   int result;
 
-  lseek(this->fd,self->readptr,0);
-  result = read(this->fd, buffer, length);
-  if(result < 0) {
-    RaiseError(EIOError, "Unable to read from %s (%s)", URNOF(self), strerror(errno));
-    return -1;
-  };
+  CALL(this->lock, acquire);
 
-  self->readptr += result;
+  result = FileBackedObject_read_at(self, self->readptr, buffer, length);
+  if(result > 0)
+    self->readptr += result;
 
+  CALL(this->lock, release);
   return result;
 };
 
@@ -156,14 +242,13 @@ static int FileBackedObject_write(FileLikeObject self, char *buffer, unsigned in
 
   if(length == 0) return 0;
 
-  lseek(this->fd,self->readptr,SEEK_SET);
-  result = write(this->fd, buffer, length);
-  if(result < 0) {
-    RaiseError(EIOError, "Unable to write to %s (%s)", URNOF(self)->value, strerror(errno));
-  };
+  CALL(this->lock, acquire);
 
-  self->readptr += result;
+  result = FileBackedObject_write_at(self, self->readptr, buffer, length);
+  if(result > 0)
+    self->readptr += result;
 
+  CALL(this->lock, release);
   return result;
 };
 
@@ -181,15 +266,27 @@ static int FileLikeObject_close(AFFObject self) {
 
 static uint64_t FileBackedObject_seek(FileLikeObject self, int64_t offset, int whence) {
   FileBackedObject this = (FileBackedObject)self;
+  int64_t result;
+
+  // Seeking relative to the end must wait for writes in progress.
+  CALL(this->lock, acquire);
 
-  int64_t result = lseek(this->fd, offset, whence);
+  // The file position is not used by pread/pwrite so we seek
+  // relative to the readptr ourselves.
+  if(whence == SEEK_CUR) {
+    offset += self->readptr;
+    whence = SEEK_SET;
+  };
 
+  result = lseek(this->fd, offset, whence);
   if(result < 0) {
     DEBUG_OBJECT("Error seeking %s\n", strerror(errno));
     result = 0;
   };
 
   self->readptr = result;
+
+  CALL(this->lock, release);
   return result;
 };
 
@@ -217,8 +314,35 @@ static XSDString FileLikeObject_get_data(FileLikeObject self, void *ctx) {
   return NULL;
 };
 
+/* By default we seek first, so these share the readptr. */
+static int FileLikeObject_read_at(FileLikeObject self, uint64_t offset,
+                                  char *buffer, unsigned int length) {
+  CALL(self, seek, offset, SEEK_SET);
+  return CALL(self, read, buffer, length);
+};
+
+static int FileLikeObject_write_at(FileLikeObject self, uint64_t offset,
+                                   char *buffer, unsigned int length) {
+  CALL(self, seek, offset, SEEK_SET);
+  return CALL(self, write, buffer, length);
+};
+
+/* By default nothing can be borrowed. */
+static char *FileLikeObject_borrow(FileLikeObject self, uint64_t offset,
+                                   unsigned int length) {
+  return NULL;
+};
+
+static void FileLikeObject_advise(FileLikeObject self, uint64_t offset,
+                                  uint64_t length, int access) {
+};
+
 VIRTUAL(FileLikeObject, AFFObject) {
      VMETHOD(seek) = FileLikeObject_seek;
+     VMETHOD(read_at) = FileLikeObject_read_at;
+     VMETHOD(write_at) = FileLikeObject_write_at;
+     VMETHOD(borrow) = FileLikeObject_borrow;
+     VMETHOD(advise) = FileLikeObject_advise;
      VMETHOD(tell) = FileLikeObject_tell;
      VMETHOD_BASE(AFFObject, close) = FileLikeObject_close;
      VMETHOD(truncate) = FileLikeObject_truncate;
@@ -228,9 +352,57 @@ VIRTUAL(FileLikeObject, AFFObject) {
 
 static int FileBackedObject_truncate(FileLikeObject self, uint64_t offset) {
   FileBackedObject this=(FileBackedObject)self;
+  int result;
+
+  CALL(this->lock, acquire);
 
   ftruncate(this->fd, offset);
-  return SUPER(FileLikeObject, FileLikeObject, truncate, offset);
+  result = SUPER(FileLikeObject, FileLikeObject, truncate, offset);
+
+  CALL(this->lock, release);
+  return result;
+};
+
+/* The mapping is never changed once we are finished, so this needs
+   no locks.
+*/
+static char *FileBackedObject_borrow(FileLikeObject self, uint64_t offset,
+                                     unsigned int length) {
+  FileBackedObject this = (FileBackedObject)self;
+
+  if(!this->map || offset + length > this->map_size)
+    return NULL;
+
+  return this->map + offset;
+};
+
+static void FileBackedObject_advise(FileLikeObject self, uint64_t offset,
+                                    uint64_t length, int access) {
+#ifndef WINDOWS
+  FileBackedObject this = (FileBackedObject)self;
+
+  if(access < AFF4_ACCESS_NORMAL || access > AFF4_ACCESS_WILLNEED)
+    return;
+
+  if(this->map) {
+    int advice[] = {POSIX_MADV_NORMAL, POSIX_MADV_SEQUENTIAL, POSIX_MADV_RANDOM,
+                    POSIX_MADV_WILLNEED};
+    // posix_madvise needs a page aligned address.
+    uint64_t start = offset - offset % sysconf(_SC_PAGESIZE);
+
+    if(start >= this->map_size)
+      return;
+
+    length = min(length + offset - start, this->map_size - start);
+    posix_madvise(this->map + start, length, advice[access]);
+
+  } else {
+    int advice[] = {POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM,
+                    POSIX_FADV_WILLNEED};
+
+    posix_fadvise(this->fd, offset, length, advice[access]);
+  };
+#endif
 };
 
 /** A file backed object extends FileLikeObject */
@@ -241,8 +413,12 @@ VIRTUAL(FileBackedObject, FileLikeObject) {
 
   VMETHOD_BASE(FileLikeObject, read) = FileBackedObject_read;
   VMETHOD_BASE(FileLikeObject, write) = FileBackedObject_write;
+  VMETHOD_BASE(FileLikeObject, read_at) = FileBackedObject_read_at;
+  VMETHOD_BASE(FileLikeObject, write_at) = FileBackedObject_write_at;
   VMETHOD_BASE(FileLikeObject, seek) = FileBackedObject_seek;
   VMETHOD_BASE(FileLikeObject, truncate) = FileBackedObject_truncate;
+  VMETHOD_BASE(FileLikeObject, borrow) = FileBackedObject_borrow;
+  VMETHOD_BASE(FileLikeObject, advise) = FileBackedObject_advise;
 } END_VIRTUAL;
 
 
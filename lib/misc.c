@@ -78,15 +78,11 @@ char *escape_filename_data(void *ctx, XSDString name) {
   return (char *)escape_filename(ctx, (char *)name->value, name->length-1);
 };
 
-XSDString unescape_filename(void *ctx, const char *filename) {
-  char buffer[BUFF_SIZE];
-  XSDString result = new_XSDString(ctx);
-
+int unescape_filename_to(char *buffer, const char *filename, unsigned int length) {
   int i,j=0;
-  int length = strlen(filename);
 
-  for(i=0;i<min(length, BUFF_SIZE-10);i++) {
-    if(filename[i]=='%') {
+  for(i=0;i<length;i++) {
+    if(filename[i]=='%' && i+2 < length) {
       char tmp[10];
       memcpy(tmp+1,filename+i,3);
       tmp[0]='0';
@@ -101,7 +97,16 @@ XSDString unescape_filename(void *ctx, const char *filename) {
     };
   };
 
-  CALL(result, set, buffer, j);
+  return j;
+};
+
+XSDString unescape_filename(void *ctx, const char *filename) {
+  char buffer[BUFF_SIZE];
+  XSDString result = new_XSDString(ctx);
+  int length = unescape_filename_to(buffer, filename,
+                                    min(strlen(filename), BUFF_SIZE-10));
+
+  CALL(result, set, buffer, length);
   return result;
 };
 
@@ -2,110 +2,255 @@
 #include <time.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <limits.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/* unistd.h only declares this when the BSD extensions are enabled,
+   which _XOPEN_SOURCE turns off.
+*/
+extern long syscall(long number, ...);
+#endif
+
+static int Queue_destructor(void *this) {
+#ifndef __linux__
+  Queue self = (Queue)this;
+
+  pthread_mutex_destroy(&self->event_mutex);
+  pthread_cond_destroy(&self->event);
+#endif
+
+  return 0;
+};
 
 static Queue Queue_Con(Queue self, int maxsize) {
-  INIT_LIST_HEAD(&self->items);
-  self->maxsize = maxsize;
-  self->queue_size = 0;
+  int i;
+
+  AFF4_GL_LOCK;
 
-  pthread_cond_init(&self->not_empty, NULL);
-  pthread_cond_init(&self->not_full, NULL);
-  pthread_cond_init(&self->all_tasks_done, NULL);
+  /* With a single slot, a full slot for one get would look free to
+     the next put, so the ring always has at least two.
+  */
+  self->maxsize = max(maxsize, 2);
+  self->slots = talloc_array(self, struct QueueSlot, self->maxsize);
 
+  // A slot is free for the put at position i when its sequence is
+  // i, and full for the get at position i when it is i+1.
+  for(i=0; i<self->maxsize; i++) {
+    self->slots[i].sequence = i;
+    self->slots[i].data = NULL;
+  };
+
+#ifndef __linux__
+  pthread_mutex_init(&self->event_mutex, NULL);
+  pthread_cond_init(&self->event, NULL);
+#endif
+  talloc_set_destructor((void *)self, Queue_destructor);
+
+  AFF4_GL_UNLOCK;
   return self;
 };
 
+static uint64_t now_nsec() {
+  struct timespec now;
 
-static void *Queue_get(Queue self, int timeout) {
-  QueueItem item;
-  void *result = NULL;
-  int res;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+};
 
-  AFF4_GL_LOCK;
+/* Sleeps until the event count changes from seen, or the deadline
+   (in nsec, 0 for none) passes. Returns 0 if we timed out. The
+   wakeup can be spurious so callers retry.
+*/
+static int wait_for_event(Queue self, uint32_t *event, uint32_t seen,
+                          uint64_t deadline) {
+  uint64_t remaining = 0;
+  int result = 1;
 
-  // If there is nothing available we just wait for something new:
-  while(self->queue_size==0) {
-    res = CALL(aff4_gl_lock, timedwait, &self->not_empty, timeout);
-    if(res) {
-      goto exit;
-    };
+  if(deadline) {
+    uint64_t now = now_nsec();
+
+    if(now >= deadline)
+      return 0;
+
+    remaining = deadline - now;
+  };
+
+  __atomic_add_fetch(&self->waiters, 1, __ATOMIC_SEQ_CST);
+
+  AFF4_BEGIN_ALLOW_THREADS;
+#ifdef __linux__
+  {
+    struct timespec timeout;
+
+    timeout.tv_sec = remaining / 1000000000LL;
+    timeout.tv_nsec = remaining % 1000000000LL;
+
+    // The kernel only puts us to sleep if the event is still seen.
+    if(syscall(SYS_futex, event, FUTEX_WAIT_PRIVATE, seen,
+               deadline ? &timeout : NULL, NULL, 0) < 0 &&
+       errno == ETIMEDOUT)
+      result = 0;
   };
+#else
+  {
+    struct timeval now;
+    struct timespec abstime;
 
-  list_next(item, &self->items, list);
-  list_del(&item->list);
-  result = item->data;
-  talloc_free(item);
+    gettimeofday(&now, NULL);
+    remaining += now.tv_usec * 1000LL;
+    abstime.tv_sec = now.tv_sec + remaining / 1000000000LL;
+    abstime.tv_nsec = remaining % 1000000000LL;
 
-  // Let waiters know there is a new item in the queue
-  pthread_cond_signal(&self->not_full);
-  self->queue_size --;
-  if(self->queue_size <= 0) {
-    pthread_cond_signal(&self->all_tasks_done);
+    pthread_mutex_lock(&self->event_mutex);
+    while(result && __atomic_load_n(event, __ATOMIC_SEQ_CST) == seen) {
+      if(!deadline)
+        pthread_cond_wait(&self->event, &self->event_mutex);
+      else if(pthread_cond_timedwait(&self->event, &self->event_mutex,
+                                     &abstime) == ETIMEDOUT)
+        result = 0;
+    };
+    pthread_mutex_unlock(&self->event_mutex);
   };
+#endif
+  AFF4_END_ALLOW_THREADS;
+
+  __atomic_sub_fetch(&self->waiters, 1, __ATOMIC_SEQ_CST);
 
- exit:
-  AFF4_GL_UNLOCK;
   return result;
 };
 
-static int Queue_put(Queue self, void *data, int timeout) {
-  QueueItem item;
+/* Bumps the event count and wakes anyone sleeping on it. */
+static void signal_event(Queue self, uint32_t *event) {
+  __atomic_add_fetch(event, 1, __ATOMIC_SEQ_CST);
 
-  AFF4_GL_LOCK;
+  // Nobody is sleeping so we can avoid the system call.
+  if(__atomic_load_n(&self->waiters, __ATOMIC_SEQ_CST) == 0)
+    return;
+
+#ifdef __linux__
+  syscall(SYS_futex, event, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+  pthread_mutex_lock(&self->event_mutex);
+  pthread_cond_broadcast(&self->event);
+  pthread_mutex_unlock(&self->event_mutex);
+#endif
+};
+
+/* Tries to claim the slot for the next put. Returns 0 if the queue
+   is full.
+*/
+static int try_put(Queue self, void *data) {
+  uint64_t position = __atomic_load_n(&self->put_position, __ATOMIC_RELAXED);
 
-  // If there is nothing available we just wait for something new:
-  if(self->queue_size >= self->maxsize) {
-    int res = CALL(aff4_gl_lock, timedwait, &self->not_full, timeout);
+  while(1) {
+    struct QueueSlot *slot = &self->slots[position % self->maxsize];
+    uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    int64_t difference = (int64_t)(sequence - position);
 
-    // Failed to lock.
-    if(res) {
-      AFF4_GL_UNLOCK;
+    if(difference == 0) {
+      /* The slot is free - claim it. If another producer beats us to
+         it, position is updated to the current put position.
+      */
+      if(__atomic_compare_exchange_n(&self->put_position, &position, position + 1,
+                                     1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        slot->data = data;
+        __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+        return 1;
+      };
+    } else if(difference < 0) {
+      /* The slot still holds the item from the last lap. */
       return 0;
+    } else {
+      /* Another producer already claimed this position. */
+      position = __atomic_load_n(&self->put_position, __ATOMIC_RELAXED);
     };
   };
+};
+
+/* Tries to take the item at the next get. Returns 0 if the queue is
+   empty.
+*/
+static int try_get(Queue self, void **data) {
+  uint64_t position = __atomic_load_n(&self->get_position, __ATOMIC_RELAXED);
+
+  while(1) {
+    struct QueueSlot *slot = &self->slots[position % self->maxsize];
+    uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    int64_t difference = (int64_t)(sequence - (position + 1));
 
-  item = talloc_size(self, sizeof(struct QueueItem_t));
-  item->data = data;
+    if(difference == 0) {
+      if(__atomic_compare_exchange_n(&self->get_position, &position, position + 1,
+                                     1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        *data = slot->data;
 
-  /* We now own the data */
-  talloc_steal(self, data);
-  list_add_tail(&item->list, &self->items);
+        // Free the slot for the put one lap ahead.
+        __atomic_store_n(&slot->sequence, position + self->maxsize,
+                         __ATOMIC_RELEASE);
+        return 1;
+      };
+    } else if(difference < 0) {
+      return 0;
+    } else {
+      position = __atomic_load_n(&self->get_position, __ATOMIC_RELAXED);
+    };
+  };
+};
 
-  self->queue_size ++;
+static void *Queue_get(Queue self, int timeout) {
+  uint64_t deadline = now_nsec() + (uint64_t)timeout * 1000;
+  void *result = NULL;
 
-  // Let waiters know there is a new item in the queue
-  pthread_cond_signal(&self->not_empty);
+  while(1) {
+    // Read the event before trying so a put between the two wakes
+    // us immediately.
+    uint32_t seen = __atomic_load_n(&self->puts, __ATOMIC_SEQ_CST);
 
-  AFF4_GL_UNLOCK;
+    if(try_get(self, &result)) {
+      signal_event(self, &self->gets);
+      return result;
+    };
 
-  return 1;
+    if(!wait_for_event(self, &self->puts, seen, deadline))
+      return NULL;
+  };
 };
 
-/** Search for data in the queue and remove it */
-static void *Queue_remove(Queue self, void *ctx, void *data) {
-  QueueItem i;
-  void *result = NULL;
+static int Queue_put(Queue self, void *data, int timeout) {
+  uint64_t deadline = now_nsec() + (uint64_t)timeout * 1000;
 
-  AFF4_GL_LOCK;
+  while(1) {
+    uint32_t seen = __atomic_load_n(&self->gets, __ATOMIC_SEQ_CST);
 
-  list_for_each_entry(i, &self->items, list){ 
-    if(i->data == data) {
-      result = i->data;
-      list_del(&i->list);
-      talloc_steal(ctx, data);
-      talloc_free(i);
-      goto exit;
+    if(try_put(self, data)) {
+      signal_event(self, &self->puts);
+      return 1;
     };
-  }
 
- exit:
-  AFF4_GL_UNLOCK;
-  return result;
+    if(!wait_for_event(self, &self->gets, seen, deadline))
+      return 0;
+  };
+};
+
+static void Queue_join(Queue self) {
+  while(1) {
+    uint32_t seen = __atomic_load_n(&self->gets, __ATOMIC_SEQ_CST);
+
+    if(__atomic_load_n(&self->get_position, __ATOMIC_SEQ_CST) >=
+       __atomic_load_n(&self->put_position, __ATOMIC_SEQ_CST))
+      return;
+
+    wait_for_event(self, &self->gets, seen, 0);
+  };
 };
 
 VIRTUAL(Queue, Object)
      VMETHOD_BASE(Queue, Con) = Queue_Con;
      VMETHOD_BASE(Queue, get) = Queue_get;
      VMETHOD_BASE(Queue, put) = Queue_put;
-     VMETHOD_BASE(Queue, remove) = Queue_remove;
+     VMETHOD_BASE(Queue, join) = Queue_join;
 END_VIRTUAL
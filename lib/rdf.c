@@ -855,6 +855,19 @@ void register_rdf_value_class(RDFValue classref) {
   };
 };
 
+/* Hash digests are stored as hex strings with the hash algorithm as
+   their dataType, so we register a copy of XSDString for each.
+*/
+static void register_hash_type(char *dataType) {
+  RDFValue classref = talloc_memdup(NULL, GETCLASS(XSDString),
+                                    SIZEOF(GETCLASS(XSDString)));
+
+  classref->dataType = dataType;
+  register_rdf_value_class(classref);
+
+  talloc_free(classref);
+};
+
 /** This function initialises the RDF types registry. */
 AFF4_MODULE_INIT(A000_rdf) {
   raptor_init();
@@ -864,11 +877,49 @@ AFF4_MODULE_INIT(A000_rdf) {
   register_rdf_value_class((RDFValue)GETCLASS(XSDString));
   register_rdf_value_class((RDFValue)GETCLASS(RDFURN));
   register_rdf_value_class((RDFValue)GETCLASS(XSDDatetime));
+
+  register_hash_type(DATATYPE_MD5);
+  register_hash_type(DATATYPE_SHA1);
+  register_hash_type(DATATYPE_SHA256);
   //  register_rdf_value_class((RDFValue)GETCLASS(IntegerArrayBinary));
   //register_rdf_value_class((RDFValue)GETCLASS(IntegerArrayInline));
 };
 
 /** RDF parsing */
+
+/* Adds the batched triples to the resolver. If the batch is refused
+   because one of them can not be encoded, we add them one at a time
+   so only that one is lost.
+*/
+static void flush_triples(RDFParser self) {
+  int i;
+
+  if(self->triples_count &&
+     !CALL(self->resolver, add_triples, self->triples, self->triples_count) &&
+     !self->resolver->store->frozen) {
+    ClearError();
+    for(i=0; i<self->triples_count; i++)
+      CALL(self->resolver, add, self->triples[i].subject, self->triples[i].attribute,
+           self->triples[i].value);
+  };
+
+  self->triples_count = 0;
+  self->subject = NULL;
+  self->subject_string = NULL;
+
+  talloc_free(self->batch);
+  self->batch = talloc_named_const(self, 0, "RDFParser batch");
+};
+
+static void add_triple(RDFParser self, RDFURN subject, char *attribute,
+                       RDFValue value) {
+  struct ResolverTriple *triple = &self->triples[self->triples_count++];
+
+  triple->subject = subject;
+  triple->attribute = attribute;
+  triple->value = value;
+};
+
 static void triples_handler(void *data, const raptor_statement* triple) 
 {
   RDFParser self = (RDFParser)data;
@@ -881,21 +932,26 @@ static void triples_handler(void *data, const raptor_statement* triple)
      triple->predicate_type != RAPTOR_IDENTIFIER_TYPE_RESOURCE)
     return;
 
+  // Make sure there is room for the two triples we may add.
+  if(self->triples_count + 2 > RDF_PARSER_BATCH_SIZE)
+    flush_triples(self);
+
   /* do something with the triple */
   urn_str = (char *)raptor_uri_as_string((raptor_uri *)triple->subject);
   attribute = (char *)raptor_uri_as_string((raptor_uri *)triple->predicate);
   value_str = (char *)raptor_uri_as_string((raptor_uri *)triple->object);
   type_str = (char *)raptor_uri_as_string((raptor_uri *)triple->object_literal_datatype);
 
-  CALL(self->urn, set, urn_str);
+  if(!self->subject || strcmp(self->subject_string, urn_str)) {
+    self->subject = new_RDFURN(self->batch);
+    CALL(self->subject, set, urn_str);
+    self->subject_string = talloc_strdup(self->subject, urn_str);
 
-  if(strcmp(self->volume_urn->value, urn_str)) {
-    if(!CALL(self->member_cache, present, ZSTRING(urn_str))) {
+    if(strcmp(self->volume_urn->value, urn_str) &&
+       !CALL(self->member_cache, present, ZSTRING(urn_str))) {
       // Make sure the volume contains this object
-      printf("!!! %s contains %s\n", self->volume_urn->value, urn_str);
-
-      CALL(self->resolver, add, self->volume_urn, AFF4_VOLATILE_CONTAINS,
-           (RDFValue)self->urn);
+      add_triple(self, self->volume_urn, AFF4_VOLATILE_CONTAINS,
+                 (RDFValue)self->subject);
 
       CALL(self->member_cache, put, ZSTRING(urn_str), NULL);
     };
@@ -908,11 +964,10 @@ static void triples_handler(void *data, const raptor_statement* triple)
                                ZSTRING(type_str));
   };
 
-  result = CONSTRUCT_FROM_REFERENCE(class_ref, Con, NULL);
+  result = CONSTRUCT_FROM_REFERENCE(class_ref, Con, self->batch);
   if(result) {
-    CALL(result, parse, value_str, self->urn);
-    CALL(self->resolver, add, self->urn, attribute, (RDFValue)result);
-    talloc_free(result);
+    CALL(result, parse, value_str, self->subject);
+    add_triple(self, self->subject, talloc_strdup(self->batch, attribute), result);
   };
 }
 
@@ -932,21 +987,220 @@ static void fatal_error_handler(void *data, raptor_locator *locator,
 };
 
 
+/* Binary graphs are little endian whatever the host is, so these
+   swap between the graph's byte order and the host's.
+*/
+static uint32_t binary_uint32(uint32_t value) {
+#if __BYTE_ORDER == __BIG_ENDIAN
+  return __builtin_bswap32(value);
+#else
+  return value;
+#endif
+};
+
+static uint64_t binary_uint64(uint64_t value) {
+#if __BYTE_ORDER == __BIG_ENDIAN
+  return __builtin_bswap64(value);
+#else
+  return value;
+#endif
+};
+
+static void binary_footer(struct RDFBinaryFooter *footer) {
+  footer->magic = binary_uint32(footer->magic);
+  footer->version = binary_uint32(footer->version);
+  footer->triples = binary_uint64(footer->triples);
+  footer->triples_size = binary_uint64(footer->triples_size);
+  footer->strings = binary_uint64(footer->strings);
+  footer->strings_size = binary_uint64(footer->strings_size);
+};
+
+/* Integers are kept in the data store in the host's byte order. */
+static int is_binary_integer(char *type, uint64_t length) {
+  return length == sizeof(uint64_t) && !strcmp(type, DATATYPE_XSD_INTEGER);
+};
+
+/* Reads a variable length number from the binary graph at *data,
+   which ends at end. Returns 0 if it runs past the end.
+*/
+static int read_number(unsigned char **data, unsigned char *end, uint64_t *result) {
+  int shift = 0;
+
+  *result = 0;
+  while(*data < end && shift < 64) {
+    unsigned char byte = *(*data)++;
+
+    *result |= (uint64_t)(byte & 0x7F) << shift;
+    if(!(byte & 0x80))
+      return 1;
+
+    shift += 7;
+  };
+
+  return 0;
+};
+
+/* Adds the triples of a binary graph (see struct RDFBinaryFooter)
+   straight to the data store, without decoding any of the values.
+*/
+static int parse_binary(RDFParser self, FileLikeObject fd) {
+  StringIO graph = CONSTRUCT(StringIO, StringIO, Con, NULL);
+  DataStore store = self->resolver->store;
+  struct RDFBinaryFooter footer;
+  unsigned char *data, *end;
+  char **strings = NULL, *contained;
+  struct DataStoreValue values[RDF_PARSER_BATCH_SIZE];
+  char buff[BUFF_SIZE];
+  uint64_t offset = fd->readptr, i;
+  int len, count = 0;
+
+  AFF4_GL_LOCK;
+
+  if(store->frozen) {
+    RaiseError(ERuntimeError, "Resolver is frozen - can not add graph");
+    goto error;
+  };
+
+  while((len = CALL(fd, read_at, offset, buff, BUFF_SIZE)) > 0) {
+    CALL(graph, write, buff, len);
+    offset += len;
+  };
+
+  if(graph->size < sizeof(footer)) {
+    RaiseError(ERuntimeError, "Binary graph is too short");
+    goto error;
+  };
+
+  memcpy(&footer, graph->data + graph->size - sizeof(footer), sizeof(footer));
+  binary_footer(&footer);
+  if(footer.magic != RDF_BINARY_MAGIC) {
+    RaiseError(ERuntimeError, "Not a binary graph");
+    goto error;
+  };
+
+  if(footer.version != RDF_BINARY_VERSION) {
+    RaiseError(ERuntimeError, "Binary graph version %d is not supported",
+               footer.version);
+    goto error;
+  };
+
+  /* Check the sizes one at a time, since their sum could wrap
+     around.
+  */
+  if(footer.triples_size > graph->size - sizeof(footer) ||
+     footer.strings_size != graph->size - sizeof(footer) - footer.triples_size ||
+     footer.strings > footer.strings_size) {
+    RaiseError(ERuntimeError, "Binary graph is corrupt");
+    goto error;
+  };
+
+  // Find the strings, making sure they are all terminated.
+  data = (unsigned char *)graph->data + footer.triples_size;
+  end = data + footer.strings_size;
+  strings = talloc_array(graph, char *, footer.strings + 1);
+  contained = talloc_zero_array(graph, char, footer.strings + 1);
+  if(!strings || !contained) {
+    RaiseError(ENoMemory, "Unable to allocate %lld binary graph strings",
+               footer.strings);
+    goto error;
+  };
+
+  for(i=1; i<=footer.strings; i++) {
+    unsigned char *string_end = memchr(data, 0, end - data);
+
+    if(!string_end) {
+      RaiseError(ERuntimeError, "Binary graph is corrupt");
+      goto error;
+    };
+
+    strings[i] = (char *)data;
+    data = string_end + 1;
+  };
+
+  data = (unsigned char *)graph->data;
+  end = data + footer.triples_size;
+
+  for(i=0; i<footer.triples; i++) {
+    uint64_t subject, attribute, type, length;
+
+    if(!read_number(&data, end, &subject) ||
+       !read_number(&data, end, &attribute) ||
+       !read_number(&data, end, &type) ||
+       !read_number(&data, end, &length) ||
+       !subject || subject > footer.strings ||
+       !attribute || attribute > footer.strings ||
+       !type || type > footer.strings ||
+       length > end - data) {
+      RaiseError(ERuntimeError, "Binary graph triple %lld is corrupt", i);
+      goto error;
+    };
+
+    // Make sure there is room for the two values we may add.
+    if(count + 2 > RDF_PARSER_BATCH_SIZE) {
+      CALL(store, add_values, values, count);
+      count = 0;
+    };
+
+    // Make sure the volume contains this object
+    if(!contained[subject] && strcmp(strings[subject], self->volume_urn->value)) {
+      values[count].uri = self->volume_urn->value;
+      values[count].attribute = AFF4_VOLATILE_CONTAINS;
+      values[count].value = CONSTRUCT(DataStoreObject, DataStoreObject, Con, NULL,
+                                      ZSTRING(strings[subject]), DATATYPE_RDF_URN);
+      count++;
+    };
+    contained[subject] = 1;
+
+    values[count].uri = strings[subject];
+    values[count].attribute = strings[attribute];
+    if(is_binary_integer(strings[type], length)) {
+      uint64_t value;
+
+      memcpy(&value, data, sizeof(value));
+      value = binary_uint64(value);
+      values[count].value = CONSTRUCT(DataStoreObject, DataStoreObject, Con, NULL,
+                                      (char *)&value, length, strings[type]);
+    } else {
+      values[count].value = CONSTRUCT(DataStoreObject, DataStoreObject, Con, NULL,
+                                      (char *)data, length, strings[type]);
+    };
+    count++;
+    data += length;
+  };
+
+  // The DataStore will steal the objects.
+  CALL(store, add_values, values, count);
+  talloc_free(graph);
+  AFF4_GL_UNLOCK;
+  return 1;
+
+ error:
+  // Keep what we parsed before the error
+  CALL(store, add_values, values, count);
+  talloc_free(graph);
+  AFF4_GL_UNLOCK;
+  return 0;
+};
+
 static int RDFParser_parse(RDFParser self, FileLikeObject fd, char *format, char *base) {
   raptor_parser* rdf_parser;
   raptor_uri uri=NULL;
+  uint64_t offset;
 
   // Take a sensible default
   if(!format) format = "turtle";
 
+  CALL(self->volume_urn ,set , base);
+
+  if(!strcmp(format, AFF4_BINARY_GRAPH))
+    return parse_binary(self, fd);
+
   rdf_parser = raptor_new_parser(format);
   if(!rdf_parser) {
     RaiseError(ERuntimeError, "Unable to create parser for RDF serialization %s", format);
     goto error;
   };
 
-  CALL(self->volume_urn ,set , base);
-
   // Dont talk to the internet
   raptor_set_feature(rdf_parser, RAPTOR_FEATURE_NO_NET, 1);
   raptor_set_statement_handler(rdf_parser, self, self->triples_handler);
@@ -969,18 +1223,23 @@ static int RDFParser_parse(RDFParser self, FileLikeObject fd, char *format, char
   };
 
   raptor_start_parse(rdf_parser, uri);
+  offset = fd->readptr;
   while(1) {
-    // Read some data from our fd
+    // Read some data from our fd. Not all objects move the readptr
+    // when read, so we keep our own offset.
     unsigned char buff[BUFF_SIZE];
-    int len = CALL(fd, read, (char *)buff, BUFF_SIZE);
+    int len = CALL(fd, read_at, offset, (char *)buff, BUFF_SIZE);
 
     if(len<=0) break;
+    offset += len;
     // Shove it into the parser.
     raptor_parse_chunk(rdf_parser, buff, len, 0);
   }
   // Done - flush the parser
   raptor_parse_chunk(rdf_parser, NULL, 0, 1); /* no data and is_end =
 						 1 */
+  flush_triples(self);
+
   // Cleanup
   if(uri)
     raptor_free_uri((raptor_uri *)uri);
@@ -988,6 +1247,9 @@ static int RDFParser_parse(RDFParser self, FileLikeObject fd, char *format, char
   return 1;
 
  error:
+  // Keep what we parsed before the error
+  flush_triples(self);
+
   if(uri)
     raptor_free_uri((raptor_uri *)uri);
   raptor_free_parser(rdf_parser);
@@ -999,7 +1261,10 @@ static RDFParser RDFParser_Con(RDFParser self, Resolver resolver) {
   self->resolver = resolver;
   self->urn = new_RDFURN(self);
   self->volume_urn = new_RDFURN(self);
-  self->member_cache = CONSTRUCT(Cache, Cache, Con, self, 100, 0);
+  // A graph can be about very many members.
+  self->member_cache = CONSTRUCT(Cache, Cache, Con, self, 4096, 0);
+  self->triples = talloc_array(self, struct ResolverTriple, RDF_PARSER_BATCH_SIZE);
+  self->batch = talloc_named_const(self, 0, "RDFParser batch");
   return self;
 };
 
@@ -1061,15 +1326,19 @@ static int RDFSerializer_destructor(void *this) {
   RDFSerializer self = (RDFSerializer)this;
 
   raptor_free_iostream(self->iostream);
+  DataStoreStrings_free(&self->strings);
 
   return 0;
 };
 
 static RDFSerializer RDFSerializer_Con(RDFSerializer self, char *base, 
-                                       FileLikeObject fd, Resolver resolver) {
-  char *type = "turtle";
+                                       FileLikeObject fd, Resolver resolver,
+                                       char *type) {
   self->resolver = resolver;
 
+  // Take a sensible default
+  if(!type) type = "turtle";
+
   // We keep a reference to the FileLikeObject (although we dont
   // technically own it) to ensure that it doesnt get freed from under
   // us.
@@ -1079,6 +1348,18 @@ static RDFSerializer RDFSerializer_Con(RDFSerializer self, char *base,
   (void)talloc_reference(self, fd);
 
   self->iostream = raptor_new_iostream_from_handler2((void *)self, &raptor_special_handler);
+  talloc_set_destructor((void *)self, RDFSerializer_destructor);
+
+  // Binary graphs are written by us.
+  if(!strcmp(type, AFF4_BINARY_GRAPH)) {
+    self->binary = 1;
+    DataStoreStrings_init(&self->strings);
+    self->footer.magic = RDF_BINARY_MAGIC;
+    self->footer.version = RDF_BINARY_VERSION;
+
+    return self;
+  };
+
   // Try to make a new serialiser
   self->rdf_serializer = raptor_new_serializer(type);
   if(!self->rdf_serializer) {
@@ -1100,9 +1381,6 @@ static RDFSerializer RDFSerializer_Con(RDFSerializer self, char *base,
     raptor_free_uri(uri);
   };
 
-
-  talloc_set_destructor((void *)self, RDFSerializer_destructor);
-
   return self;
 
  error:
@@ -1111,85 +1389,171 @@ static RDFSerializer RDFSerializer_Con(RDFSerializer self, char *base,
 };
 
 static void RDFSerializer_set_namespace(RDFSerializer self, char *prefix, char *namespace) {
-  raptor_uri uri = (void*)raptor_new_uri((const unsigned char*)prefix);
+  raptor_uri uri;
+
+  // Binary graphs have no namespaces.
+  if(self->binary)
+    return;
+
+  uri = (void*)raptor_new_uri((const unsigned char*)prefix);
   raptor_serialize_set_namespace(self->rdf_serializer, uri, (unsigned char *)namespace);
   raptor_free_uri(uri);
 };
 
-static int RDFSerializer_serialize_urn(RDFSerializer self, RDFURN urn) {
+/* Writes a number in the binary graph (see struct RDFBinaryFooter). */
+static void write_number(RDFSerializer self, uint64_t number) {
+  unsigned char buff[10];
+  int length = 0;
+
+  while(number >= 0x80) {
+    buff[length++] = (number & 0x7F) | 0x80;
+    number >>= 7;
+  };
+
+  buff[length++] = number;
+  iostream_write_bytes(self, buff, 1, length);
+  self->footer.triples_size += length;
+};
+
+static int serialize_binary_value(RDFSerializer self, RDFURN urn, char *attribute,
+                                  RDFValue value) {
+  DataStoreObject obj = CALL(value, encode, urn, self->resolver);
+  uint32_t subject_id, attribute_id, type_id;
+
+  if(!obj)
+    return 0;
+
+  subject_id = DataStoreStrings_intern(&self->strings, urn->value);
+  attribute_id = DataStoreStrings_intern(&self->strings, attribute);
+  type_id = DataStoreStrings_intern(&self->strings, obj->rdf_type);
+  if(!subject_id || !attribute_id || !type_id) {
+    RaiseError(ENoMemory, "Unable to intern strings");
+    talloc_free(obj);
+    return 0;
+  };
+
+  write_number(self, subject_id);
+  write_number(self, attribute_id);
+  write_number(self, type_id);
+  write_number(self, obj->length);
+  if(is_binary_integer(obj->rdf_type, obj->length)) {
+    uint64_t value;
+
+    memcpy(&value, obj->data, sizeof(value));
+    value = binary_uint64(value);
+    iostream_write_bytes(self, &value, 1, sizeof(value));
+  } else {
+    iostream_write_bytes(self, obj->data, 1, obj->length);
+  };
+
+  self->footer.triples_size += obj->length;
+  self->footer.triples++;
+
+  talloc_free(obj);
+  return 1;
+};
+
+static int serialize_value(RDFSerializer self, RDFURN urn, char *attribute,
+                           RDFValue value) {
   raptor_statement triple;
-  void *raptor_urn;
-  RDFValue value = NULL;
+
+  if(self->binary)
+    return serialize_binary_value(self, urn, attribute, value);
+
+  memset(&triple, 0, sizeof(triple));
+  triple.object = CALL(value, serialise, value, urn);
+  if(!triple.object) {
+    AFF4_LOG(AFF4_LOG_MESSAGE, AFF4_SERVICE_RDF_SUBSYSYEM,
+             urn,
+             "Unable to serialise attribute %s\n",
+             attribute);
+    return 0;
+  };
+
+  triple.subject = (void*)raptor_new_uri((const unsigned char*)urn->value);
+  triple.subject_type = RAPTOR_IDENTIFIER_TYPE_RESOURCE;
+
+  triple.predicate = (void*)raptor_new_uri((const unsigned char*)attribute);
+  triple.predicate_type = RAPTOR_IDENTIFIER_TYPE_RESOURCE;
+  triple.object_type = value->raptor_type;
+
+  // Default to something sensible
+  if(RAPTOR_IDENTIFIER_TYPE_UNKNOWN == triple.object_type)
+    triple.object_type = RAPTOR_IDENTIFIER_TYPE_LITERAL;
+
+  // If the dataType is emptry just have a NULL
+  // object_literal_datatype:
+  triple.object_literal_datatype = value->dataType[0] ? \
+      raptor_new_uri((const unsigned char*)value->dataType) : 0;
+
+  raptor_serialize_statement(self->rdf_serializer, &triple);
+  raptor_free_uri((raptor_uri*)triple.subject);
+  raptor_free_uri((raptor_uri*)triple.predicate);
+  if(triple.object_literal_datatype)
+    raptor_free_uri((raptor_uri*)triple.object_literal_datatype);
+
+  // Special free function for URIs
+  if(triple.object_type == RAPTOR_IDENTIFIER_TYPE_RESOURCE) {
+    raptor_free_uri((raptor_uri*)triple.object);
+  };
+
+  return 1;
+};
+
+static int RDFSerializer_serialize_statement(RDFSerializer self, RDFURN urn,
+                                             char *attribute) {
+  char *ctx = talloc_strdup(NULL, "ctx");
+  RDFValue value = CALL(self->resolver, resolve, ctx, urn, attribute);
+  int result = 1;
+
+  if(value) {
+    RDFValue i = value;
+
+    // All the values are on the list of the first.
+    do {
+      result = serialize_value(self, urn, attribute, i) && result;
+      i = list_entry(i->list.next, struct RDFValue_t, list);
+    } while(i != value);
+  };
+
+  talloc_free(ctx);
+  return result;
+};
+
+static int RDFSerializer_serialize_urn(RDFSerializer self, RDFURN urn) {
   Cache i;
 
   printf(".");
   fflush(stdout);
 
-  raptor_urn = (void*)raptor_new_uri((const unsigned char*)urn->value);
-  memset(&triple, 0, sizeof(triple));
-
   /* List all known attributes and serialize them */
   list_for_each_entry(i, &RDF_Registry->cache_list, cache_list) {
     RDFValue classref = *(RDFValue *)i->data;
-    char *ctx = talloc_strdup(NULL, "ctx");
-    char *attribute = classref->dataType;
-
-    value = CALL(self->resolver, resolve, ctx, urn, attribute);
-    if(value) {
-      RDFValue i;
-
-      list_for_each_entry(i, &value->list, list) {
-        triple.object = CALL(value, serialise, value, urn);
-        if(!triple.object) {
-          AFF4_LOG(AFF4_LOG_MESSAGE, AFF4_SERVICE_RDF_SUBSYSYEM,
-                   urn,
-                   "Unable to serialise attribute %s\n",
-                   attribute);
-        } else {
-          triple.subject = raptor_urn;
-          triple.subject_type = RAPTOR_IDENTIFIER_TYPE_RESOURCE;
-
-          triple.predicate = (void*)raptor_new_uri((const unsigned char*)attribute);
-          triple.predicate_type = RAPTOR_IDENTIFIER_TYPE_RESOURCE;
-          triple.object_type = value->raptor_type;
-
-          // Default to something sensible
-          if(RAPTOR_IDENTIFIER_TYPE_UNKNOWN == triple.object_type)
-            triple.object_type = RAPTOR_IDENTIFIER_TYPE_LITERAL;
-
-          // If the dataType is emptry just have a NULL
-          // object_literal_datatype:
-          triple.object_literal_datatype = value->dataType[0] ? \
-              raptor_new_uri((const unsigned char*)value->dataType) : 0;
-
-          raptor_serialize_statement(self->rdf_serializer, &triple);
-          raptor_free_uri((raptor_uri*)triple.predicate);
-          if(triple.object_literal_datatype)
-            raptor_free_uri((raptor_uri*)triple.object_literal_datatype);
-
-          // Special free function for URIs
-          if(triple.object_type == RAPTOR_IDENTIFIER_TYPE_RESOURCE) {
-            raptor_free_uri((raptor_uri*)triple.object);
-          };
-        };
-      };
 
-      talloc_free(ctx);
-    };
+    CALL(self, serialize_statement, urn, classref->dataType);
   };
 
-  talloc_free(raptor_urn);
   return 1;
 };
 
 
 static void RDFSerializer_close(RDFSerializer self) {
-  raptor_serialize_end(self->rdf_serializer);
+  if(self->binary) {
+    self->footer.strings = self->strings.count - 1;
+    self->footer.strings_size = self->strings.data_size;
+    iostream_write_bytes(self, self->strings.data, 1, self->strings.data_size);
+
+    binary_footer(&self->footer);
+    iostream_write_bytes(self, &self->footer, 1, sizeof(self->footer));
+  } else {
+    raptor_serialize_end(self->rdf_serializer);
+  };
 
   // Flush the buffer
   CALL(self->fd, write, self->buff, self->i);
 
-  raptor_free_serializer(self->rdf_serializer);
+  if(self->rdf_serializer)
+    raptor_free_serializer(self->rdf_serializer);
 
   talloc_free(self);
 };
@@ -1197,6 +1561,7 @@ static void RDFSerializer_close(RDFSerializer self) {
 VIRTUAL(RDFSerializer, Object) {
      VMETHOD(Con) = RDFSerializer_Con;
      VMETHOD(serialize_urn) = RDFSerializer_serialize_urn;
+     VMETHOD(serialize_statement) = RDFSerializer_serialize_statement;
      VMETHOD(set_namespace) = RDFSerializer_set_namespace;
      VMETHOD(close) = RDFSerializer_close;
 } END_VIRTUAL
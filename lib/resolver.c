@@ -92,6 +92,10 @@ static Resolver Resolver_Con(Resolver self, DataStore store, int mode) {
   if(mode & RESOLVER_MODE_DEBUG_MEMORY)
     talloc_enable_leak_report_full();
 
+  self->mode = mode;
+  self->lazy_volumes = CONSTRUCT(Cache, Cache, Con, self, HASH_TABLE_SIZE, 0);
+  talloc_set_name_const(self->lazy_volumes, "Resolver Lazy Volumes");
+
   // Create local read and write caches
   CALL(self, flush);
 
@@ -104,6 +108,70 @@ static Resolver Resolver_Con(Resolver self, DataStore store, int mode) {
 };
 
 
+/* Has each lazy volume parse its graphs about subject. With no
+   subject they parse all their graphs, after which we forget them
+   (as we do volumes which are no longer in the read cache). Unless
+   we are in RESOLVER_MODE_LAZY_GRAPHS all the graphs are parsed the
+   first time any of them are needed. Returns the number of graphs
+   the lazy volumes have about subject.
+*/
+static int load_lazy_graphs(Resolver self, RDFURN subject) {
+  Cache i, j;
+  int graphs = 0;
+
+  if(self->loading_graphs)
+    return 0;
+
+  if(!(self->mode & RESOLVER_MODE_LAZY_GRAPHS))
+    subject = NULL;
+
+  self->loading_graphs = 1;
+  list_for_each_entry_safe(i, j, &self->lazy_volumes->cache_list, cache_list) {
+    AFF4Volume volume = (AFF4Volume)CALL(self, own, (RDFURN)i->data, 'r');
+
+    if(volume) {
+      int found = CALL(volume, load_graphs, subject);
+
+      if(found > 0)
+        graphs += found;
+    };
+
+    if(!volume || !subject)
+      talloc_free(i);
+  };
+  self->loading_graphs = 0;
+
+  return graphs;
+};
+
+/* The graphs named after a subject need not hold all of its
+   statements, so when a lookup about a subject without graphs of its
+   own misses we parse the rest before we give up. Configuration is
+   never stored in a graph so it does not count. Returns 1 if there
+   were any left to parse.
+*/
+static int load_graphs_on_miss(Resolver self, int graphs, char *attribute) {
+  if(graphs > 0 || list_empty(&self->lazy_volumes->cache_list) ||
+     !strncmp(attribute, CONFIGURATION_NS, strlen(CONFIGURATION_NS)))
+    return 0;
+
+  load_lazy_graphs(self, NULL);
+  return 1;
+};
+
+static void Resolver_defer_graphs(Resolver self, RDFURN volume) {
+  AFF4_GL_LOCK;
+
+  if(!CALL(self->lazy_volumes, present, ZSTRING(volume->value))) {
+    RDFURN urn = CALL(volume, copy, NULL);
+
+    CALL(self->lazy_volumes, put, ZSTRING(urn->value), (Object)urn);
+  };
+
+  AFF4_GL_UNLOCK;
+};
+
+
 /** This sets a single triple into the resolver replacing previous
     values set for this attribute
 */
@@ -113,6 +181,14 @@ static int Resolver_set(Resolver self, RDFURN urn, char *attribute_str,
 
   AFF4_GL_LOCK;
 
+  if(self->store->frozen) {
+    RaiseError(ERuntimeError, "Resolver is frozen - can not set %s", attribute_str);
+    AFF4_GL_UNLOCK;
+    return 0;
+  };
+
+  // The graphs must not add to the value later.
+  load_lazy_graphs(self, urn);
   obj = CALL(value, encode, urn, self);
 
   // The DataStore will steal the object.
@@ -127,6 +203,7 @@ static int Resolver_set(Resolver self, RDFURN urn, char *attribute_str,
 static void Resolver_del(Resolver self, RDFURN urn, char *attribute_str) {
   AFF4_GL_LOCK;
 
+  load_lazy_graphs(self, urn);
   CALL(self->store, del, urn->value, attribute_str);
 
   AFF4_GL_UNLOCK;
@@ -142,6 +219,12 @@ static int Resolver_add(Resolver self, RDFURN urn, char *attribute_str,
   AFF4_GL_LOCK;
   CALL(self->store, unlock);
 
+  if(self->store->frozen) {
+    RaiseError(ERuntimeError, "Resolver is frozen - can not add %s", attribute_str);
+    AFF4_GL_UNLOCK;
+    return 0;
+  };
+
   obj = CALL(value, encode, urn, self);
 
   // The DataStore will steal the object.
@@ -152,16 +235,80 @@ static int Resolver_add(Resolver self, RDFURN urn, char *attribute_str,
 };
 
 
+/** Adds many triples, encoding them all before handing them to the
+    store in one go. If any of them can not be encoded none of them
+    are added.
+*/
+static int Resolver_add_triples(Resolver self, struct ResolverTriple *triples,
+                                int count) {
+  struct DataStoreValue *values;
+  int i = 0, j;
+
+  AFF4_GL_LOCK;
+
+  if(self->store->frozen) {
+    RaiseError(ERuntimeError, "Resolver is frozen - can not add triples");
+    AFF4_GL_UNLOCK;
+    return 0;
+  };
+
+  values = talloc_array(NULL, struct DataStoreValue, max(count, 1));
+  if(!values) {
+    RaiseError(ENoMemory, "Unable to allocate %d triples", count);
+    goto error;
+  };
+
+  for(i=0; i<count; i++) {
+    DataStoreObject obj = CALL(triples[i].value, encode, triples[i].subject, self);
+
+    if(!obj) {
+      RaiseError(ERuntimeError, "Unable to encode triple %d (%s %s)", i,
+                 triples[i].subject->value, triples[i].attribute);
+      goto error;
+    };
+
+    values[i].uri = triples[i].subject->value;
+    values[i].attribute = triples[i].attribute;
+    values[i].value = obj;
+  };
+
+  // The DataStore will steal the objects.
+  CALL(self->store, add_values, values, count);
+  talloc_free(values);
+
+  AFF4_GL_UNLOCK;
+  return 1;
+
+ error:
+  // Nothing was added, so the values we encoded are still ours.
+  for(j=0; values && j<i; j++)
+    talloc_free(values[j].value);
+
+  talloc_free(values);
+  AFF4_GL_UNLOCK;
+  return 0;
+};
+
+
 /* Allocate and return all the RDFValues which match the urn and attribute.
  */
 static RDFValue Resolver_resolve(Resolver self, void *ctx, RDFURN urn, char *attribute) {
   Object iter;
   RDFValue result = NULL;
+  int graphs;
 
   AFF4_GL_LOCK;
+  graphs = load_lazy_graphs(self, urn);
   CALL(self->store, lock);
 
   iter = CALL(self->store, iter, urn->value, attribute);
+  if(!iter) {
+    CALL(self->store, unlock);
+    load_graphs_on_miss(self, graphs, attribute);
+    CALL(self->store, lock);
+
+    iter = CALL(self->store, iter, urn->value, attribute);
+  };
 
   while(iter) {
     DataStoreObject obj = CALL(self->store, next, &iter);
@@ -175,9 +322,10 @@ static RDFValue Resolver_resolve(Resolver self, void *ctx, RDFURN urn, char *att
     // Decode it.
     CALL(item, decode, obj, urn, self);
 
-    // Add to the list
+    // Add to the list (not all constructors initialise it)
+    INIT_LIST_HEAD(&item->list);
     if(result) {
-      list_add_tail(&result->list, &item->list);
+      list_add_tail(&item->list, &result->list);
     } else {
       result = item;
     };
@@ -251,6 +399,7 @@ error:
 static AFFObject Resolver_open(Resolver self, RDFURN urn, char mode) {
   AFFObject result = NULL;
   DataStoreObject type_obj;
+  int graphs;
 
   AFF4_GL_LOCK;
   ClearError();
@@ -263,10 +412,17 @@ static AFFObject Resolver_open(Resolver self, RDFURN urn, char mode) {
   DEBUG_OBJECT("Opening %s for mode %c\n", urn->value, mode);
 
   // Object must already exist.
+  graphs = load_lazy_graphs(self, urn);
   CALL(self->store, lock);
   type_obj = CALL(self->store, get, urn->value, AFF4_TYPE);
   CALL(self->store, unlock);
 
+  if(!type_obj && load_graphs_on_miss(self, graphs, AFF4_TYPE)) {
+    CALL(self->store, lock);
+    type_obj = CALL(self->store, get, urn->value, AFF4_TYPE);
+    CALL(self->store, unlock);
+  };
+
   if(!type_obj) {
     RaiseError(ERuntimeError, "Object does not exist.");
     goto exit;
@@ -429,6 +585,16 @@ int Resolver_load(Resolver self, RDFURN uri) {
   return 0;
 };
 
+static void Resolver_freeze(Resolver self) {
+  AFF4_GL_LOCK;
+
+  // The snapshot must have all the graphs in it.
+  load_lazy_graphs(self, NULL);
+
+  CALL(self->store, freeze);
+  AFF4_GL_UNLOCK;
+};
+
 static void Resolver_set_logger(Resolver self, Logger logger) {
   AFF4_GL_LOCK;
 
@@ -492,6 +658,7 @@ VIRTUAL(Resolver, Object) {
      VMETHOD(open) = Resolver_open;
      VMETHOD(set) = Resolver_set;
      VMETHOD(add) = Resolver_add;
+     VMETHOD(add_triples) = Resolver_add_triples;
      VMETHOD(del) = Resolver_del;
 
      VMETHOD(register_rdf_value_class) = Resolver_register_rdf_value_class;
@@ -502,6 +669,8 @@ VIRTUAL(Resolver, Object) {
 #endif
 
      VMETHOD(load) = Resolver_load;
+     VMETHOD(defer_graphs) = Resolver_defer_graphs;
+     VMETHOD(freeze) = Resolver_freeze;
      VMETHOD(register_logger) = Resolver_set_logger;
      VMETHOD(log) = Resolver_log;
      VMETHOD(flush) = Resolver_flush;
@@ -536,6 +705,10 @@ static void AFFObject_set(AFFObject self, char *attribute, RDFValue value) {
   AFF4_GL_UNLOCK;
 };
 
+static RDFValue AFFObject_resolve(AFFObject self, void *ctx, char *attribute) {
+  return CALL(self->resolver, resolve, ctx, self->urn, attribute);
+};
+
 static void AFFObject_add(AFFObject self, char *attribute, RDFValue value) {
   AFF4_GL_LOCK;
 
@@ -584,6 +757,7 @@ VIRTUAL(AFFObject, Object) {
      VMETHOD(finish) = AFFObject_finish;
      VMETHOD(set) = AFFObject_set;
      VMETHOD(add) = AFFObject_add;
+     VMETHOD(resolve) = AFFObject_resolve;
      VMETHOD(close) = AFFObject_close;
 
      VMETHOD(Con) = AFFObject_Con;
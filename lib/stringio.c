@@ -135,6 +135,14 @@ static void StringIO_truncate(StringIO self,int len) {
     self->readptr=self->size;
 };
 
+static void StringIO_reserve(StringIO self, unsigned int len) {
+  // Writes reallocate when they reach alloc_size.
+  if(len >= self->alloc_size) {
+    self->alloc_size = len + 1;
+    self->data = talloc_realloc_size(self, self->data, self->alloc_size);
+  };
+};
+
 static void StringIO_skip(StringIO self, int len) {
   if(len > self->size) 
     len=self->size;
@@ -193,6 +201,7 @@ VIRTUAL(StringIO,Object)
   VMETHOD(get_buffer) = StringIO_get_buffer;
   VMETHOD(eof) = StringIO_eof;
   VMETHOD(truncate) = StringIO_truncate;
+  VMETHOD(reserve) = StringIO_reserve;
   VMETHOD(skip) = StringIO_skip;
   VMETHOD(find) = StringIO_find;
   VMETHOD(ifind) = StringIO_ifind;
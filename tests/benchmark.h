@@ -0,0 +1,30 @@
+/*************************************************
+Benchmarks live in the unit test suites next to the code they
+measure, but they take minutes, use gigabytes and print tables. They
+therefore only run when asked for:
+
+   AFF4_BENCHMARK=1 ./cunit-test basic
+
+and return straight away otherwise.
+***************************************************/
+#ifndef __TESTS_BENCHMARK_H
+#define __TESTS_BENCHMARK_H
+
+#include <stdlib.h>
+#include <sys/time.h>
+
+#define AFF4_ENV_BENCHMARK "AFF4_BENCHMARK"
+
+static int benchmarking(void) {
+  return getenv(AFF4_ENV_BENCHMARK) != NULL;
+};
+
+/* The wall clock time in seconds. */
+static double time_now(void) {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+};
+
+#endif
@@ -3,6 +3,7 @@ This file tests the zip file volume implementation.
 ***************************************************/
 
 #include "aff4_internal.h"
+#include "benchmark.h"
 
 extern char TEMP_DIR[];
 
@@ -59,7 +60,7 @@ TEST(ImageReader) {
   ZipFile zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
   FileLikeObject image = (FileLikeObject)CALL(resolver, create,
                                               NULL, AFF4_IMAGE, 'r');
-
+  int i;
   char buffer[BUFF_SIZE];
 
   CALL(zip->storage_urn, set, "/tmp/Image.zip");
@@ -85,6 +86,1028 @@ TEST(ImageReader) {
 
   CALL((AFFObject)image, finish);
 
-  CALL(image, read, buffer, 10);
+  CU_ASSERT_EQUAL(CALL(image, read, buffer, 12), 12);
+  CU_ASSERT(!memcmp(buffer, "hello world!", 12));
+
+  /* This read spans several chunks and bevies. */
+  CALL(image, seek, 12 * 100, SEEK_SET);
+  CU_ASSERT_EQUAL(CALL(image, read, buffer, 12 * 50), 12 * 50);
+  for(i=0; i<50; i++) {
+    CU_ASSERT(!memcmp(buffer + i * 12, "hello world!", 12));
+  };
+
+  /* Reading past the end returns a short read. */
+  CALL(image, seek, 12 * 1000 - 5, SEEK_SET);
+  CU_ASSERT_EQUAL(CALL(image, read, buffer, 12), 5);
+
+  talloc_free(resolver);
+};
+
+
+TEST(ImageChunkCache) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  ZipFile zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+  AFF4Image image = (AFF4Image)CALL(resolver, create, NULL, AFF4_IMAGE, 'r');
+  char buffer[BUFF_SIZE];
+  uint64_t misses;
+
+  CALL(zip->storage_urn, set, "/tmp/Image.zip");
+  CALL((AFFObject)zip, finish);
+
+  URNOF(image) = CALL(URNOF(zip), copy, image);
+  CALL(URNOF(image), add, "image");
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+
+  image->stored = URNOF(zip);
+  image->chunk_size = 32;
+  image->chunks_in_segment = 10;
+  image->compression = ZIP_DEFLATE;
+
+  /* Only keep 4 chunks in the cache and do not read ahead so we
+     can count the misses.
+  */
+  image->chunk_cache_size = 4 * 32;
+  image->read_ahead = -1;
+
+  CALL((AFFObject)image, finish);
+
+  /* The first read misses, and the second is served from the cache. */
+  CALL((FileLikeObject)image, read, buffer, 10);
+  CU_ASSERT_EQUAL(image->chunk_cache_misses, 1);
+
+  CALL((FileLikeObject)image, seek, 0, SEEK_SET);
+  CALL((FileLikeObject)image, read, buffer, 10);
+  CU_ASSERT_EQUAL(image->chunk_cache_hits, 1);
+  CU_ASSERT_EQUAL(image->chunk_cache_misses, 1);
+
+  /* Touch chunk 0 while reading 4 other chunks - it should remain
+     cached because it is the most recently used.
+  */
+  for(misses=1; misses<5; misses++) {
+    CALL((FileLikeObject)image, seek, misses * 32 * 7, SEEK_SET);
+    CALL((FileLikeObject)image, read, buffer, 10);
+
+    CALL((FileLikeObject)image, seek, 0, SEEK_SET);
+    CALL((FileLikeObject)image, read, buffer, 10);
+  };
+
+  CU_ASSERT_EQUAL(image->chunk_cache_misses, 5);
+  CU_ASSERT_EQUAL(image->chunk_cache_hits, 5);
+
+  talloc_free(resolver);
+};
+
+
+TEST(ImageReadAhead) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  ZipFile zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+  AFF4Image image = (AFF4Image)CALL(resolver, create, NULL, AFF4_IMAGE, 'r');
+  char buffer[BUFF_SIZE];
+  int offset = 0;
+  int i, res;
+
+  CALL(zip->storage_urn, set, "/tmp/Image.zip");
+  CALL((AFFObject)zip, finish);
+
+  URNOF(image) = CALL(URNOF(zip), copy, image);
+  CALL(URNOF(image), add, "image");
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+
+  image->stored = URNOF(zip);
+  image->chunk_size = 32;
+  image->chunks_in_segment = 10;
+  image->compression = ZIP_DEFLATE;
+  image->read_ahead = 8;
+
+  CALL((AFFObject)image, finish);
+
+  /* Read the whole image sequentially in small reads. */
+  while((res = CALL((FileLikeObject)image, read, buffer, 20)) > 0) {
+    for(i=0; i<res; i++) {
+      CU_ASSERT_EQUAL(buffer[i], "hello world!"[(offset + i) % 12]);
+    };
+    offset += res;
+  };
+
+  CU_ASSERT_EQUAL(offset, 12 * 1000);
+  CU_ASSERT(image->read_ahead_scheduled > 0);
+
+  /* Random access collapses the read ahead window. */
+  CALL((FileLikeObject)image, seek, 32 * 100, SEEK_SET);
+  CALL((FileLikeObject)image, read, buffer, 10);
+  CALL((FileLikeObject)image, seek, 32 * 7, SEEK_SET);
+  CALL((FileLikeObject)image, read, buffer, 10);
+  CU_ASSERT_EQUAL(image->read_ahead_window, 0);
+
+  CALL((AFFObject)image, close);
+  talloc_free(resolver);
+};
+
+
+TEST(ImageParallelRead) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  ZipFile zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+  AFF4Image image = (AFF4Image)CALL(resolver, create, NULL, AFF4_IMAGE, 'r');
+  AFF4Image other;
+  char buffer[12 * 1000 + 100];
+  int i;
+
+  CALL(zip->storage_urn, set, "/tmp/Image.zip");
+  CALL((AFFObject)zip, finish);
+
+  URNOF(image) = CALL(URNOF(zip), copy, image);
+  CALL(URNOF(image), add, "image");
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+
+  image->stored = URNOF(zip);
+  image->chunk_size = 32;
+  image->chunks_in_segment = 10;
+  image->compression = ZIP_DEFLATE;
+  image->read_ahead = -1;
+
+  CALL((AFFObject)image, finish);
+
+  /* Readers do not start any threads until they need them. */
+  CU_ASSERT(image->thread_pool == NULL);
+
+  /* One read for the whole image, spanning every bevy and running
+     off the end.
+  */
+  CU_ASSERT_EQUAL(CALL((FileLikeObject)image, read, buffer, sizeof(buffer)), 12 * 1000);
+  for(i=0; i<12 * 1000; i++) {
+    if(buffer[i] != "hello world!"[i % 12]) {
+      CU_FAIL("Data mismatch");
+      break;
+    };
+  };
+
+  /* An unaligned read starts and ends with partial chunks. */
+  CALL((FileLikeObject)image, seek, 1001, SEEK_SET);
+  CU_ASSERT_EQUAL(CALL((FileLikeObject)image, read, buffer, 5000), 5000);
+  for(i=0; i<5000; i++) {
+    if(buffer[i] != "hello world!"[(1001 + i) % 12]) {
+      CU_FAIL("Data mismatch");
+      break;
+    };
+  };
+  CU_ASSERT_EQUAL(((FileLikeObject)image)->readptr, 6001);
+
+  /* Another reader shares the same pool. */
+  other = (AFF4Image)CALL(resolver, create, NULL, AFF4_IMAGE, 'r');
+  URNOF(other) = CALL(URNOF(image), copy, other);
+  other->stored = URNOF(zip);
+  other->chunk_size = 32;
+  other->chunks_in_segment = 10;
+  other->compression = ZIP_DEFLATE;
+  other->read_ahead = -1;
+  CALL((AFFObject)other, finish);
+
+  CU_ASSERT_EQUAL(CALL((FileLikeObject)other, read, buffer, 1000), 1000);
+  CU_ASSERT(image->thread_pool != NULL);
+  CU_ASSERT(other->thread_pool == image->thread_pool);
+  CU_ASSERT(image->thread_pool->number_of_threads <= AFF4_MAX_READ_THREADS);
+
+  CALL((AFFObject)other, close);
+  CALL((AFFObject)image, close);
+  talloc_free(resolver);
+};
+
+
+#define SHARED_READERS 4
+
+static void *shared_image_reader(void *data) {
+  FileLikeObject image = (FileLikeObject)data;
+  unsigned int seed = (unsigned int)pthread_self();
+  char buffer[100];
+  long errors = 0;
+  int i, j;
+
+  /* Everybody reads different places of the same image at once. */
+  for(j=0; j<500; j++) {
+    uint64_t offset = rand_r(&seed) % (12 * 1000 - sizeof(buffer));
+
+    if(CALL(image, read_at, offset, buffer, sizeof(buffer)) != sizeof(buffer)) {
+      errors++;
+      continue;
+    };
+
+    for(i=0; i<sizeof(buffer); i++) {
+      if(buffer[i] != "hello world!"[(offset + i) % 12]) {
+        errors++;
+        break;
+      };
+    };
+  };
+
+  return (void *)errors;
+};
+
+TEST(ImageSharedReadAt) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  ZipFile zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+  AFF4Image image = (AFF4Image)CALL(resolver, create, NULL, AFF4_IMAGE, 'r');
+  pthread_t threads[SHARED_READERS];
+  int i;
+
+  CALL(zip->storage_urn, set, "/tmp/Image.zip");
+  CALL((AFFObject)zip, finish);
+
+  URNOF(image) = CALL(URNOF(zip), copy, image);
+  CALL(URNOF(image), add, "image");
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+
+  image->stored = URNOF(zip);
+  image->chunk_size = 32;
+  image->chunks_in_segment = 10;
+  image->compression = ZIP_DEFLATE;
+
+  CALL((AFFObject)image, finish);
+
+  for(i=0; i<SHARED_READERS; i++)
+    pthread_create(&threads[i], NULL, shared_image_reader, image);
+
+  for(i=0; i<SHARED_READERS; i++) {
+    void *errors;
+
+    pthread_join(threads[i], &errors);
+    CU_ASSERT_EQUAL((long)errors, 0);
+  };
+
+  // Nobody moved the readptr.
+  CU_ASSERT_EQUAL(((FileLikeObject)image)->readptr, 0);
+
+  CALL((AFFObject)image, close);
+  talloc_free(resolver);
+};
+
+
+TEST(ImageConstantChunks) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  ZipFile zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'w');
+  AFF4Image image = (AFF4Image)CALL(resolver, create, NULL, AFF4_IMAGE, 'w');
+  RDFURN image_urn;
+  char data[100 * 24 + 7];
+  char buffer[sizeof(data)];
+  int i;
+
+  /* Chunks alternate between zeros, text and 0xAA, and the last
+     partial chunk is zeros. The odd chunk size exercises both the
+     vectorised and the byte by byte scan.
+  */
+  for(i=0; i<sizeof(data); i++) {
+    switch((i / 100) % 3) {
+    case 0: data[i] = 0; break;
+    case 1: data[i] = "hello world!"[i % 12]; break;
+    case 2: data[i] = 0xAA; break;
+    };
+  };
+
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "Constant.zip");
+  CALL((AFFObject)zip, finish);
+
+  URNOF(image) = CALL(URNOF(zip), copy, image);
+  CALL(URNOF(image), add, "image");
+  image_urn = CALL(URNOF(image), copy, resolver);
+
+  image->stored = URNOF(zip);
+  image->chunk_size = 100;
+  image->chunks_in_segment = 10;
+  image->compression = ZIP_DEFLATE;
+  CALL((AFFObject)image, finish);
+
+  CALL((FileLikeObject)image, write, data, sizeof(data));
+  CALL((AFFObject)image, close);
+
+  /* 8 zero chunks, 8 0xAA chunks and the partial chunk. */
+  CU_ASSERT_EQUAL(image->constant_chunks, 17);
+  talloc_free(image);
+
+  CALL((AFFObject)zip, close);
+  talloc_free(zip);
+
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "Constant.zip");
+  CALL((AFFObject)zip, finish);
+  CALL(resolver, cache_return, (AFFObject)zip);
+
+  image = (AFF4Image)CALL(resolver, create, NULL, AFF4_IMAGE, 'r');
+  URNOF(image) = CALL(image_urn, copy, image);
+  image->stored = URNOF(zip);
+  CALL((AFFObject)image, finish);
+
+  CU_ASSERT_EQUAL(CALL((FileLikeObject)image, read, buffer, sizeof(buffer)),
+                  sizeof(data));
+  CU_ASSERT(!memcmp(buffer, data, sizeof(data)));
+
+  /* Partial reads of a constant chunk. */
+  CALL((FileLikeObject)image, seek, 100 * 2 + 5, SEEK_SET);
+  CU_ASSERT_EQUAL(CALL((FileLikeObject)image, read, buffer, 10), 10);
+  CU_ASSERT(!memcmp(buffer, data + 100 * 2 + 5, 10));
+
+  CALL((AFFObject)image, close);
+  talloc_free(resolver);
+};
+
+
+TEST(ImageDedup) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  ZipFile zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'w');
+  AFF4Image image = (AFF4Image)CALL(resolver, create, NULL, AFF4_IMAGE, 'w');
+  RDFURN image_urn;
+  char data[64 * 30];
+  char buffer[sizeof(data)];
+  int i;
+
+  /* There are only 3 distinct chunks, repeated across 3 bevies. */
+  for(i=0; i<sizeof(data); i++) {
+    data[i] = "abc"[(i / 64) % 3] + (i % 64) % 7;
+  };
+
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "Dedup.zip");
+  CALL((AFFObject)zip, finish);
+
+  URNOF(image) = CALL(URNOF(zip), copy, image);
+  CALL(URNOF(image), add, "image");
+  image_urn = CALL(URNOF(image), copy, resolver);
+
+  image->stored = URNOF(zip);
+  image->chunk_size = 64;
+  image->chunks_in_segment = 10;
+  image->compression = ZIP_DEFLATE;
+  image->dedup = 1;
+  CALL((AFFObject)image, finish);
+
+  CALL((FileLikeObject)image, write, data, sizeof(data));
+  CALL((AFFObject)image, close);
+
+  CU_ASSERT_EQUAL(image->duplicate_chunks, 27);
+  talloc_free(image);
+
+  CALL((AFFObject)zip, close);
+  talloc_free(zip);
+
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "Dedup.zip");
+  CALL((AFFObject)zip, finish);
+  CALL(resolver, cache_return, (AFFObject)zip);
+
+  image = (AFF4Image)CALL(resolver, create, NULL, AFF4_IMAGE, 'r');
+  URNOF(image) = CALL(image_urn, copy, image);
+  image->stored = URNOF(zip);
+  CALL((AFFObject)image, finish);
+
+  CU_ASSERT_EQUAL(CALL((FileLikeObject)image, read, buffer, sizeof(buffer)),
+                  sizeof(data));
+  CU_ASSERT(!memcmp(buffer, data, sizeof(data)));
+
+  /* A partial read of a duplicate chunk in a later bevy. */
+  CALL((FileLikeObject)image, seek, 64 * 25 + 3, SEEK_SET);
+  CU_ASSERT_EQUAL(CALL((FileLikeObject)image, read, buffer, 20), 20);
+  CU_ASSERT(!memcmp(buffer, data + 64 * 25 + 3, 20));
+
+  CALL((AFFObject)image, close);
+  talloc_free(resolver);
+};
+
+
+/* Images written with the original index format (an array of
+   uint32_t offsets) must remain readable.
+*/
+TEST(ImageV1Index) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  ZipFile zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'w');
+  AFF4Image image;
+  FileLikeObject segment, index_segment;
+  RDFURN image_urn, bevy_urn;
+  char data[32 * 15];
+  char buffer[sizeof(data)];
+  int i, j;
+
+  for(i=0; i<sizeof(data); i++) {
+    data[i] = "hello world!"[i % 12] + i / 32;
+  };
+
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "V1Index.zip");
+  CALL((AFFObject)zip, finish);
+
+  image_urn = CALL(URNOF(zip), copy, resolver);
+  CALL(image_urn, add, "image");
+
+  /* Write two bevies of 10 chunks the way the old writer did. */
+  for(i=0; i<2; i++) {
+    uint32_t offset = 0;
+
+    bevy_urn = CALL(image_urn, copy, resolver);
+    CALL(bevy_urn, add, talloc_asprintf(bevy_urn, "%08X", i));
+    segment = CALL((AFF4Volume)zip, open_member, bevy_urn, 'w', ZIP_STORED);
+
+    CALL(bevy_urn, add, "idx");
+    index_segment = CALL((AFF4Volume)zip, open_member, bevy_urn, 'w', ZIP_STORED);
+
+    for(j=i * 10; j<min(i * 10 + 10, 15); j++) {
+      uLongf clength = compressBound(32);
+      char cbuffer[clength];
+
+      compress2((Bytef *)cbuffer, &clength, (Bytef *)data + j * 32, 32, 1);
+      CALL(index_segment, write, (char *)&offset, sizeof(offset));
+      CALL(segment, write, cbuffer, clength);
+      offset += clength;
+    };
 
+    CALL((AFFObject)segment, close);
+    CALL((AFFObject)index_segment, close);
+  };
+
+  CALL((AFFObject)zip, close);
+  talloc_free(zip);
+
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "V1Index.zip");
+  CALL((AFFObject)zip, finish);
+  CALL(resolver, cache_return, (AFFObject)zip);
+
+  image = (AFF4Image)CALL(resolver, create, NULL, AFF4_IMAGE, 'r');
+  URNOF(image) = CALL(image_urn, copy, image);
+  image->stored = URNOF(zip);
+  image->chunk_size = 32;
+  image->chunks_in_segment = 10;
+  image->compression = ZIP_DEFLATE;
+  CALL((AFFObject)image, finish);
+
+  CU_ASSERT_EQUAL(CALL((FileLikeObject)image, read, buffer, sizeof(buffer)),
+                  sizeof(data));
+  CU_ASSERT(!memcmp(buffer, data, sizeof(data)));
+
+  CALL((AFFObject)image, close);
+  talloc_free(resolver);
+};
+
+
+/* With a write budget of only a couple of bevies the writer must
+   wait for the compressors.
+*/
+TEST(ImageWriteBackpressure) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  ZipFile zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'w');
+  AFF4Image image = (AFF4Image)CALL(resolver, create, NULL, AFF4_IMAGE, 'w');
+  RDFURN image_urn;
+  int bevy_size = 1024 * 16;
+  int length = bevy_size * 20;
+  char *data = talloc_size(resolver, length);
+  char *buffer = talloc_size(resolver, length);
+  int i;
+
+  for(i=0; i<length; i++) {
+    data[i] = random();
+  };
+
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "Backpressure.zip");
+  CALL((AFFObject)zip, finish);
+
+  URNOF(image) = CALL(URNOF(zip), copy, image);
+  CALL(URNOF(image), add, "image");
+  image_urn = CALL(URNOF(image), copy, resolver);
+
+  image->stored = URNOF(zip);
+  image->chunk_size = 1024;
+  image->chunks_in_segment = 16;
+  image->compression = ZIP_DEFLATE;
+  image->compression_level = 9;
+  image->thread_count = 4;
+  image->write_buffer_size = bevy_size * 3;
+  CALL((AFFObject)image, finish);
+
+  CU_ASSERT_EQUAL(image->max_bevies_in_flight, 1);
+
+  for(i=0; i<length; i+=1000) {
+    CALL((FileLikeObject)image, write, data + i, min(1000, length - i));
+    CU_ASSERT(image->bevies_in_flight <= image->max_bevies_in_flight);
+  };
+
+  CALL((AFFObject)image, close);
+
+  CU_ASSERT_EQUAL(image->bevies_in_flight, 0);
+  CU_ASSERT(image->write_blocked_usec > 0);
+  CU_ASSERT(image->free_bevy_count <= image->max_bevies_in_flight + 1);
+  talloc_free(image);
+
+  CALL((AFFObject)zip, close);
+  talloc_free(zip);
+
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "Backpressure.zip");
+  CALL((AFFObject)zip, finish);
+  CALL(resolver, cache_return, (AFFObject)zip);
+
+  image = (AFF4Image)CALL(resolver, create, NULL, AFF4_IMAGE, 'r');
+  URNOF(image) = CALL(image_urn, copy, image);
+  image->stored = URNOF(zip);
+  CALL((AFFObject)image, finish);
+
+  CU_ASSERT_EQUAL(CALL((FileLikeObject)image, read, buffer, length), length);
+  CU_ASSERT(!memcmp(buffer, data, length));
+
+  CALL((AFFObject)image, close);
+  talloc_free(resolver);
+};
+
+/* A bevy which can not be written fails the image for good: write()
+   and close() fail and the stream is not described at all.
+*/
+TEST(ImageWriteFailure) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  AFF4Image image = (AFF4Image)CALL(resolver, create, NULL, AFF4_IMAGE, 'w');
+  RDFURN image_urn;
+  char data[64 * 4];
+  int i;
+
+  memset(data, 'x', sizeof(data));
+
+  // The volume is never opened, so reserving the first bevy fails.
+  URNOF(image)->set(URNOF(image), "aff4://missing-volume/image");
+  image_urn = CALL(URNOF(image), copy, resolver);
+  image->stored = new_RDFURN(image);
+  image->stored->set(image->stored, "aff4://missing-volume");
+  image->chunk_size = 64;
+  image->chunks_in_segment = 2;
+  CU_ASSERT_FATAL(CALL((AFFObject)image, finish));
+
+  CU_ASSERT_EQUAL(CALL((FileLikeObject)image, write, data, 64 * 2), 64 * 2);
+
+  for(i=0; i<1000 && !image->failed; i++) {
+    AFF4_GL_LOCK;
+    CALL(aff4_gl_lock, timedwait, &image->bevy_committed, 10000);
+    AFF4_GL_UNLOCK;
+  };
+
+  CU_ASSERT_FATAL(image->failed);
+  CU_ASSERT_EQUAL(CALL((FileLikeObject)image, write, data, sizeof(data)), -1);
+  CU_ASSERT(CheckError(EIOError));
+  ClearError();
+
+  CU_ASSERT_EQUAL(CALL((AFFObject)image, close), -1);
+  CU_ASSERT(CheckError(EIOError));
+  ClearError();
+  talloc_free(image);
+
+  CU_ASSERT_PTR_NULL(CALL(resolver, resolve, resolver, image_urn, AFF4_SIZE));
+  CU_ASSERT_PTR_NULL(CALL(resolver, resolve, resolver, image_urn, AFF4_HASH));
+
+  talloc_free(resolver);
+};
+
+/* The stream and bevy hashes are computed while writing. */
+TEST(ImageHashes) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  ZipFile zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'w');
+  AFF4Image image = (AFF4Image)CALL(resolver, create, NULL, AFF4_IMAGE, 'w');
+  RDFURN bevy_urn;
+  RDFValue hashes, i;
+  char data[64 * 25];
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int length;
+  char hex[EVP_MAX_MD_SIZE * 2 + 1];
+  int found = 0;
+  int j;
+
+  for(j=0; j<sizeof(data); j++) {
+    data[j] = j * 7 + j / 64;
+  };
+
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "Hashes.zip");
+  CALL((AFFObject)zip, finish);
+
+  URNOF(image) = CALL(URNOF(zip), copy, image);
+  CALL(URNOF(image), add, "image");
+
+  image->stored = URNOF(zip);
+  image->chunk_size = 64;
+  image->chunks_in_segment = 10;
+  image->compression = ZIP_DEFLATE;
+  image->thread_count = 4;
+  CALL((AFFObject)image, finish);
+
+  // Write in odd sized pieces.
+  for(j=0; j<sizeof(data); j+=100) {
+    CALL((FileLikeObject)image, write, data + j, min(100, sizeof(data) - j));
+  };
+
+  CALL((AFFObject)image, close);
+
+  // Check the SHA256 of the stream.
+  EVP_Digest(data, sizeof(data), digest, &length, EVP_sha256(), NULL);
+  for(j=0; j<length; j++) {
+    sprintf(hex + j * 2, "%02x", digest[j]);
+  };
+
+  hashes = CALL(resolver, resolve, image, URNOF(image), AFF4_HASH);
+  CU_ASSERT(hashes != NULL);
+
+  if(hashes) {
+    i = hashes;
+    do {
+      if(!strcmp(i->dataType, DATATYPE_SHA256)) {
+        CU_ASSERT_STRING_EQUAL(((XSDString)i)->value, hex);
+      };
+
+      found++;
+      i = list_entry(i->list.next, struct RDFValue_t, list);
+    } while(i != hashes);
+  };
+
+  CU_ASSERT_EQUAL(found, AFF4_NUMBER_OF_HASHES);
+
+  // The second bevy has its own hash.
+  EVP_Digest(data + 640, 640, digest, &length, EVP_sha256(), NULL);
+  for(j=0; j<length; j++) {
+    sprintf(hex + j * 2, "%02x", digest[j]);
+  };
+
+  bevy_urn = CALL(URNOF(image), copy, image);
+  CALL(bevy_urn, add, "00000001");
+  hashes = CALL(resolver, resolve, image, bevy_urn, AFF4_HASH);
+  CU_ASSERT(hashes != NULL);
+  if(hashes) {
+    CU_ASSERT_STRING_EQUAL(hashes->dataType, DATATYPE_SHA256);
+    CU_ASSERT_STRING_EQUAL(((XSDString)hashes)->value, hex);
+  };
+
+  talloc_free(image);
+  CALL((AFFObject)zip, close);
+  talloc_free(resolver);
+};
+
+/* Bevies which compress slowly alternate with ones which are fast
+   (constant chunks), so the threads finish out of order. The bevies
+   must still be laid out in order in the volume.
+*/
+TEST(ImageOrderedCommit) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  ZipFile zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'w');
+  AFF4Image image = (AFF4Image)CALL(resolver, create, NULL, AFF4_IMAGE, 'w');
+  RDFURN image_urn;
+  int bevy_size = 1024 * 16;
+  int number_of_bevies = 32;
+  char *data = talloc_size(resolver, bevy_size * number_of_bevies);
+  char *buffer = talloc_size(resolver, bevy_size * number_of_bevies);
+  uint64_t offsets[32];
+  uint64_t j;
+  int i;
+
+  for(i=0; i<bevy_size * number_of_bevies; i++) {
+    data[i] = (i / bevy_size) % 2 ? 0 : random();
+  };
+
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "OrderedCommit.zip");
+  CALL((AFFObject)zip, finish);
+
+  URNOF(image) = CALL(URNOF(zip), copy, image);
+  CALL(URNOF(image), add, "image");
+  image_urn = CALL(URNOF(image), copy, resolver);
+
+  image->stored = URNOF(zip);
+  image->chunk_size = 1024;
+  image->chunks_in_segment = 16;
+  image->compression = ZIP_DEFLATE;
+  image->compression_level = 9;
+  image->thread_count = 8;
+  CALL((AFFObject)image, finish);
+
+  CALL((FileLikeObject)image, write, data, bevy_size * number_of_bevies);
+  CALL((AFFObject)image, close);
+
+  CU_ASSERT(list_empty(&image->commit_queue));
+  CU_ASSERT_EQUAL(image->next_bevy_to_commit, number_of_bevies + 1);
+
+  // The first bevy never waits for an earlier one.
+  CU_ASSERT(image->reordered_bevies < number_of_bevies + 1);
+  CU_ASSERT(image->reorder_max_wait_usec <= image->reorder_wait_usec);
+  talloc_free(image);
+
+  CALL((AFFObject)zip, close);
+  talloc_free(zip);
+
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "OrderedCommit.zip");
+  CALL((AFFObject)zip, finish);
+
+  /* Find where each bevy was written. */
+  memset(offsets, 0, sizeof(offsets));
+  for(j=0; j<zip->directory_size; j++) {
+    char *name = strrchr(zip->directory_names + zip->directory[j].name_offset, '/');
+
+    if(name && strcmp(name, "/idx")) {
+      i = strtol(name + 1, NULL, 16);
+      if(i < number_of_bevies)
+        offsets[i] = zip->directory[j].offset_of_file_header;
+    };
+  };
+
+  for(i=1; i<number_of_bevies; i++) {
+    CU_ASSERT(offsets[i] > offsets[i-1]);
+  };
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+
+  image = (AFF4Image)CALL(resolver, create, NULL, AFF4_IMAGE, 'r');
+  URNOF(image) = CALL(image_urn, copy, image);
+  image->stored = URNOF(zip);
+  CALL((AFFObject)image, finish);
+
+  CU_ASSERT_EQUAL(CALL((FileLikeObject)image, read, buffer,
+                       bevy_size * number_of_bevies),
+                  bevy_size * number_of_bevies);
+  CU_ASSERT(!memcmp(buffer, data, bevy_size * number_of_bevies));
+
+  CALL((AFFObject)image, close);
+  talloc_free(resolver);
+};
+
+/* Writes the sample image repeatedly with each available codec and
+   reports the compression ratio and throughput. The image is read
+   back without setting any parameters, so the codec must be found
+   from the stream's metadata.
+*/
+TEST(ImageCodecBenchmark) {
+  int codecs[] = {AFF4_CODEC_STORED, AFF4_CODEC_DEFLATE, AFF4_CODEC_ZSTD,
+                  AFF4_CODEC_LZ4, AFF4_CODEC_SNAPPY, -1};
+  int repeats = 64;
+  char sample[BUFF_SIZE * 4];
+  int sample_length, i, j;
+  FILE *fd;
+
+  if(!benchmarking())
+    return;
+
+  fd = fopen("samples/mediumimage.dd", "rb");
+  if(!fd) {
+    printf("samples/mediumimage.dd not found - skipping benchmark\n");
+    return;
+  };
+
+  sample_length = fread(sample, 1, sizeof(sample), fd);
+  fclose(fd);
+
+  printf("\n%-10s %10s %8s %12s %12s\n", "codec", "size", "ratio",
+         "write MB/s", "read MB/s");
+
+  for(i=0; codecs[i] >= 0; i++) {
+    Resolver resolver;
+    ZipFile zip;
+    AFF4Image image;
+    RDFURN image_urn;
+    AFF4Codec codec = codec_from_id(codecs[i]);
+    uint64_t total = (uint64_t)sample_length * repeats;
+    char buffer[sample_length];
+    double start, write_time, read_time;
+    uint64_t stored_size;
+
+    // This codec was not built in.
+    if(!codec) continue;
+
+    resolver = AFF4_get_resolver(NULL, NULL);
+    zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'w');
+    CALL(zip->storage_urn, set, TEMP_DIR);
+    CALL(zip->storage_urn, add, talloc_asprintf(zip, "%s.zip", codec->name));
+    CALL((AFFObject)zip, finish);
+
+    image = (AFF4Image)CALL(resolver, create, NULL, AFF4_IMAGE, 'w');
+    URNOF(image) = CALL(URNOF(zip), copy, image);
+    CALL(URNOF(image), add, "image");
+    image_urn = CALL(URNOF(image), copy, resolver);
+
+    image->stored = URNOF(zip);
+    image->compression = codecs[i];
+    image->thread_count = 4;
+    CALL((AFFObject)image, finish);
+
+    start = time_now();
+    for(j=0; j<repeats; j++) {
+      CALL((FileLikeObject)image, write, sample, sample_length);
+    };
+    CALL((AFFObject)image, close);
+    write_time = time_now() - start;
+    talloc_free(image);
+
+    CALL((AFFObject)zip, close);
+    talloc_free(zip);
+
+    /* Now read it back. */
+    zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+    CALL(zip->storage_urn, set, TEMP_DIR);
+    CALL(zip->storage_urn, add, talloc_asprintf(zip, "%s.zip", codec->name));
+    CALL((AFFObject)zip, finish);
+    stored_size = CALL(zip->backing_store, seek, 0, SEEK_END);
+    CALL(resolver, cache_return, (AFFObject)zip);
+
+    image = (AFF4Image)CALL(resolver, create, NULL, AFF4_IMAGE, 'r');
+    URNOF(image) = CALL(image_urn, copy, image);
+    image->stored = URNOF(zip);
+    CALL((AFFObject)image, finish);
+
+    CU_ASSERT_EQUAL(image->compression, codecs[i]);
+
+    start = time_now();
+    for(j=0; j<repeats; j++) {
+      if(CALL((FileLikeObject)image, read, buffer, sample_length) != sample_length ||
+         memcmp(buffer, sample, sample_length)) {
+        CU_FAIL("Data mismatch");
+        break;
+      };
+    };
+    read_time = time_now() - start;
+
+    printf("%-10s %10llu %8.3f %12.1f %12.1f\n", codec->name,
+           (unsigned long long)stored_size, (double)stored_size / total,
+           total / write_time / 1e6, total / read_time / 1e6);
+
+    CALL((AFFObject)image, close);
+    talloc_free(resolver);
+  };
+};
+
+
+#define CONTENTION_STREAMS 4
+
+struct contention_reader {
+  pthread_t thread;
+  FileLikeObject image;
+  char *sample;
+  int sample_length;
+  int repeats;
+  int errors;
+
+  // If set, every read is made holding this.
+  pthread_mutex_t *serialise;
+};
+
+static void *contention_read(void *data) {
+  struct contention_reader *reader = (struct contention_reader *)data;
+  char buffer[reader->sample_length];
+  int j;
+
+  for(j=0; j<reader->repeats; j++) {
+    int length;
+
+    if(reader->serialise)
+      pthread_mutex_lock(reader->serialise);
+
+    length = CALL(reader->image, read, buffer, reader->sample_length);
+
+    if(reader->serialise)
+      pthread_mutex_unlock(reader->serialise);
+
+    if(length != reader->sample_length ||
+       memcmp(buffer, reader->sample, reader->sample_length))
+      reader->errors++;
+  };
+
+  return NULL;
+};
+
+/* Reads several independent images, each in its own volume: first
+   one after the other from a single thread, then from one thread each
+   but with every read holding one shared lock, and then fully
+   concurrently. The middle pass is the baseline - it is how streams
+   behaved when each library call held the global lock throughout.
+   Since volume and file I/O is now done with the global lock released
+   the concurrent pass should scale with the number of cores. We also
+   report how long threads waited for the volume locks.
+*/
+TEST(ImageContentionBenchmark) {
+  Resolver resolver;
+  struct contention_reader readers[CONTENTION_STREAMS];
+  ZipFile zips[CONTENTION_STREAMS];
+  RDFURN image_urns[CONTENTION_STREAMS];
+  int repeats = 64;
+  char sample[BUFF_SIZE * 4];
+  int sample_length, i, j, pass;
+  double elapsed[3];
+  uint64_t total;
+  pthread_mutex_t one_lock = PTHREAD_MUTEX_INITIALIZER;
+  FILE *fd;
+
+  if(!benchmarking())
+    return;
+
+  fd = fopen("samples/mediumimage.dd", "rb");
+  if(!fd) {
+    printf("samples/mediumimage.dd not found - skipping benchmark\n");
+    return;
+  };
+
+  sample_length = fread(sample, 1, sizeof(sample), fd);
+  fclose(fd);
+  total = (uint64_t)sample_length * repeats * CONTENTION_STREAMS;
+
+  resolver = AFF4_get_resolver(NULL, NULL);
+
+  for(i=0; i<CONTENTION_STREAMS; i++) {
+    AFF4Image image;
+
+    zips[i] = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'w');
+    CALL(zips[i]->storage_urn, set, TEMP_DIR);
+    CALL(zips[i]->storage_urn, add, talloc_asprintf(zips[i], "contention%d.zip", i));
+    CALL((AFFObject)zips[i], finish);
+
+    image = (AFF4Image)CALL(resolver, create, NULL, AFF4_IMAGE, 'w');
+    URNOF(image) = CALL(URNOF(zips[i]), copy, image);
+    CALL(URNOF(image), add, "image");
+    image_urns[i] = CALL(URNOF(image), copy, resolver);
+
+    image->stored = URNOF(zips[i]);
+    image->compression = AFF4_CODEC_DEFLATE;
+    CALL((AFFObject)image, finish);
+
+    for(j=0; j<repeats; j++) {
+      CALL((FileLikeObject)image, write, sample, sample_length);
+    };
+
+    CALL((AFFObject)image, close);
+    talloc_free(image);
+
+    CALL((AFFObject)zips[i], close);
+    talloc_free(zips[i]);
+  };
+
+  printf("\n%-12s %8s %12s %12s %12s\n", "mode", "threads", "seconds",
+         "read MB/s", "lock waits");
+
+  /* Pass 0 reads the streams in turn, pass 1 from concurrent threads
+     under one lock and pass 2 concurrently.
+  */
+  for(pass=0; pass<3; pass++) {
+    uint64_t waits = 0, wait_usec = 0;
+    double start;
+
+    for(i=0; i<CONTENTION_STREAMS; i++) {
+      AFF4Image image;
+
+      zips[i] = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+      CALL(zips[i]->storage_urn, set, TEMP_DIR);
+      CALL(zips[i]->storage_urn, add, talloc_asprintf(zips[i], "contention%d.zip", i));
+      CALL((AFFObject)zips[i], finish);
+
+      image = (AFF4Image)CALL(resolver, create, NULL, AFF4_IMAGE, 'r');
+      URNOF(image) = CALL(image_urns[i], copy, image);
+      image->stored = URNOF(zips[i]);
+      CALL((AFFObject)image, finish);
+
+      readers[i].image = (FileLikeObject)image;
+      readers[i].sample = sample;
+      readers[i].sample_length = sample_length;
+      readers[i].repeats = repeats;
+      readers[i].errors = 0;
+      readers[i].serialise = pass == 1 ? &one_lock : NULL;
+    };
+
+    start = time_now();
+    if(pass == 0) {
+      for(i=0; i<CONTENTION_STREAMS; i++)
+        contention_read(&readers[i]);
+    } else {
+      for(i=0; i<CONTENTION_STREAMS; i++)
+        pthread_create(&readers[i].thread, NULL, contention_read, &readers[i]);
+
+      for(i=0; i<CONTENTION_STREAMS; i++)
+        pthread_join(readers[i].thread, NULL);
+    };
+    elapsed[pass] = time_now() - start;
+
+    for(i=0; i<CONTENTION_STREAMS; i++) {
+      CU_ASSERT_EQUAL(readers[i].errors, 0);
+
+      waits += zips[i]->lock->contended;
+      wait_usec += zips[i]->lock->wait_usec;
+
+      CALL((AFFObject)readers[i].image, close);
+      CALL(resolver, cache_return, (AFFObject)zips[i]);
+    };
+
+    printf("%-12s %8d %12.3f %12.1f %5llu/%5.3fs\n",
+           pass == 0 ? "sequential" : pass == 1 ? "one lock" : "concurrent",
+           pass ? CONTENTION_STREAMS : 1, elapsed[pass],
+           total / elapsed[pass] / 1e6, (unsigned long long)waits,
+           wait_usec / 1e6);
+  };
+
+  printf("Speedup with %d threads: %.2fx over one lock, %.2fx over one thread\n",
+         CONTENTION_STREAMS, elapsed[1] / elapsed[2], elapsed[0] / elapsed[2]);
+
+  talloc_free(resolver);
 };
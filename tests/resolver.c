@@ -3,6 +3,9 @@ This file tests the resolver.
 ***************************************************/
 
 #include "aff4_internal.h"
+#include "benchmark.h"
+
+extern char TEMP_DIR[];
 
 INIT() {
   Cache_init((Object)&__Cache);
@@ -78,9 +81,379 @@ TEST(MemoryDataStoreTestAdd) {
 };
 
 
+#define FROZEN_KEYS 1000
+#define FROZEN_THREADS 4
+
+static void *frozen_reader(void *data) {
+  DataStore store = (DataStore)data;
+  char uri[BUFF_SIZE];
+  long errors = 0;
+  int i, j;
+
+  /* A frozen store is read without the global lock. */
+  for(j=0; j<10; j++) {
+    for(i=0; i<FROZEN_KEYS; i++) {
+      DataStoreObject test;
+      Object iter;
+
+      snprintf(uri, sizeof(uri), "url%d", i);
+      test = CALL(store, get, uri, "attribute");
+      if(!test || atoi(test->data) != i)
+        errors++;
+
+      iter = CALL(store, iter, uri, "attribute");
+      test = CALL(store, next, &iter);
+      if(!test || atoi(test->data) != i || iter)
+        errors++;
+    };
+  };
+
+  return (void *)errors;
+};
+
+TEST(MemoryDataStoreTestFreeze) {
+  DataStore store = new_MemoryDataStore(NULL);
+  pthread_t threads[FROZEN_THREADS];
+  char data[BUFF_SIZE];
+  DataStoreObject value;
+  int i;
+
+  for(i=0; i<FROZEN_KEYS; i++) {
+    snprintf(data, sizeof(data), "url%d", i);
+    value = CONSTRUCT(DataStoreObject, DataStoreObject, Con, store,
+                      ZSTRING(data + 3), "xsd:string");
+    CALL(store, set, data, "attribute", value);
+  };
+
+  CALL(store, freeze);
+  ClearError();
+
+  for(i=0; i<FROZEN_THREADS; i++)
+    pthread_create(&threads[i], NULL, frozen_reader, store);
+
+  for(i=0; i<FROZEN_THREADS; i++) {
+    void *errors;
+
+    pthread_join(threads[i], &errors);
+    CU_ASSERT_EQUAL((long)errors, 0);
+  };
+
+  /* Unknown keys are just not found. */
+  CU_ASSERT_PTR_NULL(CALL(store, get, "unknown", "attribute"));
+  CU_ASSERT_PTR_NULL(CALL(store, iter, "url1", "unknown"));
+
+  /* Changes are refused. */
+  value = CONSTRUCT(DataStoreObject, DataStoreObject, Con, store,
+                    ZSTRING("changed"), "xsd:string");
+  CALL(store, set, "url1", "attribute", value);
+  CU_ASSERT(CheckError(ERuntimeError));
+  ClearError();
+  CU_ASSERT_STRING_EQUAL(CALL(store, get, "url1", "attribute")->data, "1");
+
+  /* Deleting nothing is not a change. */
+  CALL(store, del, "url1", "unknown");
+  CU_ASSERT(CheckError(EZero));
+
+  CALL(store, del, "url1", "attribute");
+  CU_ASSERT(CheckError(ERuntimeError));
+  ClearError();
+
+  aff4_free(store);
+};
+
+
+#define GROW_URNS 20000
+
+/* Adds enough keys and values to grow all the tables many times. */
+TEST(MemoryDataStoreTestGrow) {
+  DataStore store = new_MemoryDataStore(NULL);
+  char uri[BUFF_SIZE], data[BUFF_SIZE];
+  DataStoreObject test;
+  Object iter;
+  int i, j, errors = 0;
+
+  for(i=0; i<GROW_URNS; i++) {
+    snprintf(uri, sizeof(uri), "aff4://volume/segment%d", i);
+
+    for(j=0; j<3; j++) {
+      snprintf(data, sizeof(data), "%d", i + j);
+      CALL(store, add, uri, j ? "aff4:stored" : "aff4:size",
+           CONSTRUCT(DataStoreObject, DataStoreObject, Con, store,
+                     ZSTRING(data), "xsd:string"));
+    };
+  };
+
+  // Every other urn is deleted.
+  for(i=0; i<GROW_URNS; i+=2) {
+    snprintf(uri, sizeof(uri), "aff4://volume/segment%d", i);
+    CALL(store, del, uri, "aff4:stored");
+  };
+
+  for(i=0; i<GROW_URNS; i++) {
+    snprintf(uri, sizeof(uri), "aff4://volume/segment%d", i);
+
+    test = CALL(store, get, uri, "aff4:size");
+    if(!test || atoi(test->data) != i)
+      errors++;
+
+    iter = CALL(store, iter, uri, "aff4:stored");
+    if(i % 2) {
+      for(j=1; j<3; j++) {
+        test = CALL(store, next, &iter);
+        if(!test || atoi(test->data) != i + j)
+          errors++;
+      };
+    };
+
+    if(iter)
+      errors++;
+  };
+
+  CU_ASSERT_EQUAL(errors, 0);
+
+  /* Deleted values can be added again. */
+  CALL(store, add, "aff4://volume/segment0", "aff4:stored",
+       CONSTRUCT(DataStoreObject, DataStoreObject, Con, store,
+                 ZSTRING("again"), "xsd:string"));
+  test = CALL(store, get, "aff4://volume/segment0", "aff4:stored");
+  CU_ASSERT_PTR_NOT_NULL_FATAL(test);
+  CU_ASSERT_STRING_EQUAL(test->data, "again");
+
+  CU_ASSERT_PTR_NULL(CALL(store, get, "aff4://volume/unknown", "aff4:size"));
+
+  aff4_free(store);
+};
+
+
+#define BENCHMARK_TRIPLES 10000000
+#define BENCHMARK_ATTRIBUTES 10
+#define BENCHMARK_BATCH 1024
+
+/* Loads 10 million triples (a million urns with ten attributes each),
+   one at a time and then in batches through add_values, and reports
+   how fast they are added and then found again.
+*/
+TEST(MemoryDataStoreBenchmark) {
+  DataStore store;
+  char *attributes[BENCHMARK_ATTRIBUTES];
+  char uri[BUFF_SIZE], data[BUFF_SIZE];
+  struct DataStoreValue values[BENCHMARK_BATCH];
+  char uris[BENCHMARK_BATCH][64];
+  DataStore batched;
+  double start, load_time, batch_time, get_time;
+  int i, errors = 0;
+
+  if(!benchmarking())
+    return;
+
+  store = new_MemoryDataStore(NULL);
+  for(i=0; i<BENCHMARK_ATTRIBUTES; i++)
+    attributes[i] = talloc_asprintf(store, "aff4:attribute%d", i);
+
+  /* Load the triples in batches into a separate store first. */
+  batched = new_MemoryDataStore(NULL);
+  start = time_now();
+  for(i=0; i<BENCHMARK_TRIPLES; i++) {
+    int length = snprintf(data, sizeof(data), "%d", i);
+    int j = i % BENCHMARK_BATCH;
+
+    snprintf(uris[j], sizeof(uris[j]), "aff4://volume/segment%08d",
+             i / BENCHMARK_ATTRIBUTES);
+    values[j].uri = uris[j];
+    values[j].attribute = attributes[i % BENCHMARK_ATTRIBUTES];
+    values[j].value = CONSTRUCT(DataStoreObject, DataStoreObject, Con, batched,
+                                data, length + 1, "xsd:integer");
+
+    if(j == BENCHMARK_BATCH - 1 || i == BENCHMARK_TRIPLES - 1)
+      CALL(batched, add_values, values, j + 1);
+  };
+  batch_time = time_now() - start;
+  aff4_free(batched);
+
+  start = time_now();
+  for(i=0; i<BENCHMARK_TRIPLES; i++) {
+    int length = snprintf(data, sizeof(data), "%d", i);
+
+    snprintf(uri, sizeof(uri), "aff4://volume/segment%08d", i / BENCHMARK_ATTRIBUTES);
+    CALL(store, set, uri, attributes[i % BENCHMARK_ATTRIBUTES],
+         CONSTRUCT(DataStoreObject, DataStoreObject, Con, store,
+                   data, length + 1, "xsd:integer"));
+  };
+  load_time = time_now() - start;
+
+  /* Look them up again in a different order. */
+  start = time_now();
+  for(i=0; i<BENCHMARK_TRIPLES; i++) {
+    int j = (int)(((uint64_t)i * 7919) % BENCHMARK_TRIPLES);
+    DataStoreObject test;
+
+    snprintf(uri, sizeof(uri), "aff4://volume/segment%08d", j / BENCHMARK_ATTRIBUTES);
+    test = CALL(store, get, uri, attributes[j % BENCHMARK_ATTRIBUTES]);
+    if(!test || atoi(test->data) != j)
+      errors++;
+  };
+  get_time = time_now() - start;
+
+  CU_ASSERT_EQUAL(errors, 0);
+
+  printf("\n%d triples: loaded in %.2f s (%.0f/s), batched in %.2f s (%.0f/s), "
+         "found in %.2f s (%.0f/s)\n",
+         BENCHMARK_TRIPLES, load_time, BENCHMARK_TRIPLES / load_time,
+         batch_time, BENCHMARK_TRIPLES / batch_time,
+         get_time, BENCHMARK_TRIPLES / get_time);
+
+  aff4_free(store);
+};
+
+
+/**********************************************
+Test TDBDataStore object
+***********************************************/
+#define TDB_FILENAME "/tmp/DataStore.tdb"
+#define TDB_URNS 5000
+
+TEST(TDBDataStoreTest) {
+  DataStore store;
+  DataStoreObject value, test;
+  char uri[BUFF_SIZE];
+  Object iter;
+  int i, errors = 0;
+
+  unlink(TDB_FILENAME);
+  store = new_TDBDataStore(NULL, TDB_FILENAME, 'w');
+  CU_ASSERT_PTR_NOT_NULL_FATAL(store);
+
+  /* More urns than are kept decoded. */
+  CALL(store, lock);
+  for(i=0; i<TDB_URNS; i++) {
+    snprintf(uri, sizeof(uri), "aff4://%d", i);
+
+    value = CONSTRUCT(DataStoreObject, DataStoreObject, Con, store,
+                      ZSTRING(uri), "xsd:string");
+    CALL(store, set, uri, "aff4:stored", value);
+
+    value = CONSTRUCT(DataStoreObject, DataStoreObject, Con, store,
+                      ZSTRING("1"), "xsd:integer");
+    CALL(store, add, uri, "aff4:size", value);
+
+    value = CONSTRUCT(DataStoreObject, DataStoreObject, Con, store,
+                      ZSTRING("2"), "xsd:integer");
+    CALL(store, add, uri, "aff4:size", value);
+  };
+  CALL(store, unlock);
+
+  /* Setting again displaces the old value, even once it is decoded. */
+  CU_ASSERT_STRING_EQUAL(CALL(store, get, "aff4://1", "aff4:stored")->data,
+                         "aff4://1");
+  value = CONSTRUCT(DataStoreObject, DataStoreObject, Con, store,
+                    ZSTRING("changed"), "xsd:string");
+  CALL(store, set, "aff4://1", "aff4:stored", value);
+  CU_ASSERT_STRING_EQUAL(CALL(store, get, "aff4://1", "aff4:stored")->data,
+                         "changed");
+
+  CALL(store, del, "aff4://2", "aff4:size");
+  CU_ASSERT_PTR_NULL(CALL(store, iter, "aff4://2", "aff4:size"));
+  CU_ASSERT_PTR_NULL(CALL(store, get, "unknown", "aff4:size"));
+
+  aff4_free(store);
+
+  /* Another reader sees everything without loading it. */
+  store = new_TDBDataStore(NULL, TDB_FILENAME, 'r');
+  CU_ASSERT_PTR_NOT_NULL_FATAL(store);
+
+  for(i=3; i<TDB_URNS; i++) {
+    snprintf(uri, sizeof(uri), "aff4://%d", i);
+
+    test = CALL(store, get, uri, "aff4:stored");
+    if(!test || strcmp(test->data, uri) || strcmp(test->rdf_type, "xsd:string"))
+      errors++;
+
+    iter = CALL(store, iter, uri, "aff4:size");
+    test = CALL(store, next, &iter);
+    if(!test || strcmp(test->data, "1") || strcmp(test->rdf_type, "xsd:integer"))
+      errors++;
+
+    test = CALL(store, next, &iter);
+    if(!test || strcmp(test->data, "2") || iter)
+      errors++;
+  };
+
+  CU_ASSERT_EQUAL(errors, 0);
+  CU_ASSERT_STRING_EQUAL(CALL(store, get, "aff4://1", "aff4:stored")->data,
+                         "changed");
+  CU_ASSERT_PTR_NULL(CALL(store, get, "aff4://2", "aff4:size"));
+
+  /* A read only store is frozen. */
+  value = CONSTRUCT(DataStoreObject, DataStoreObject, Con, store,
+                    ZSTRING("changed"), "xsd:string");
+  CALL(store, set, "aff4://3", "aff4:stored", value);
+  CU_ASSERT(CheckError(ERuntimeError));
+  ClearError();
+
+  aff4_free(store);
+  unlink(TDB_FILENAME);
+};
+
+
 /**********************************************
 Test Resolver object
 ***********************************************/
+/* Adds a batch of values in runs which share the urn or attribute and
+   checks they come back in order, both from the MemoryDataStore and
+   from the generic implementation the TDBDataStore uses.
+*/
+static void check_add_values(DataStore store) {
+  struct DataStoreValue values[6];
+  char *uris[] = {"url", "url", "url", "url1", "url1", "url"};
+  char *attributes[] = {"attribute", "attribute", "attribute1",
+                        "attribute1", "attribute", "attribute"};
+  char *data[] = {"0", "1", "2", "3", "4", "5"};
+  DataStoreObject test;
+  Object iter;
+  int i;
+
+  for(i=0; i<6; i++) {
+    values[i].uri = uris[i];
+    values[i].attribute = attributes[i];
+    values[i].value = CONSTRUCT(DataStoreObject, DataStoreObject, Con, store,
+                                ZSTRING(data[i]), "xsd:string");
+  };
+
+  CALL(store, add_values, values, 6);
+
+  CALL(store, lock);
+  iter = CALL(store, iter, "url", "attribute");
+  test = CALL(store, next, &iter);
+  CU_ASSERT_STRING_EQUAL(test->data, "0");
+  test = CALL(store, next, &iter);
+  CU_ASSERT_STRING_EQUAL(test->data, "1");
+  test = CALL(store, next, &iter);
+  CU_ASSERT_STRING_EQUAL(test->data, "5");
+  CU_ASSERT_PTR_NULL(iter);
+
+  test = CALL(store, get, "url", "attribute1");
+  CU_ASSERT_STRING_EQUAL(test->data, "2");
+  test = CALL(store, get, "url1", "attribute1");
+  CU_ASSERT_STRING_EQUAL(test->data, "3");
+  test = CALL(store, get, "url1", "attribute");
+  CU_ASSERT_STRING_EQUAL(test->data, "4");
+  CALL(store, unlock);
+};
+
+TEST(DataStoreTestAddValues) {
+  DataStore store = new_MemoryDataStore(NULL);
+
+  check_add_values(store);
+  aff4_free(store);
+
+  unlink(TDB_FILENAME);
+  store = new_TDBDataStore(NULL, TDB_FILENAME, 'w');
+  CU_ASSERT_PTR_NOT_NULL_FATAL(store);
+
+  check_add_values(store);
+  aff4_free(store);
+};
+
 TEST(AFF4ResolverTest) {
   Resolver resolver = AFF4_get_resolver(NULL, NULL);
   RDFURN urn = new_RDFURN(resolver);
@@ -98,3 +471,130 @@ TEST(AFF4ResolverTest) {
 
   aff4_free(resolver);
 };
+
+/* Resolving an attribute with several values returns all of them,
+   chained in the order they were added.
+*/
+TEST(AFF4ResolverMultipleValues) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  RDFURN urn = new_RDFURN(resolver);
+  RDFURN value = new_RDFURN(resolver);
+  RDFValue result, item;
+  char expected[64];
+  int count = 0;
+  int i;
+
+  urn->set(urn, "http://www.test.com/multiple");
+
+  for(i=0; i<3; i++) {
+    snprintf(expected, sizeof(expected), "http://www.test.com/value%d", i);
+    value->set(value, expected);
+    CALL(resolver, add, urn, "attribute", (RDFValue)value);
+  };
+
+  result = CALL(resolver, resolve, resolver, urn, "attribute");
+  CU_ASSERT_PTR_NOT_NULL_FATAL(result);
+  CU_ASSERT_STRING_EQUAL(((RDFURN)result)->value, "http://www.test.com/value0");
+
+  list_for_each_entry(item, &result->list, list) {
+    count++;
+    snprintf(expected, sizeof(expected), "http://www.test.com/value%d", count);
+    CU_ASSERT_STRING_EQUAL(((RDFURN)item)->value, expected);
+  };
+  CU_ASSERT_EQUAL(count, 2);
+
+  aff4_free(resolver);
+};
+
+static DataStoreObject failing_encode(RDFValue self, RDFURN subject,
+                                      Resolver resolver) {
+  RaiseError(ERuntimeError, "Can not encode this value");
+  return NULL;
+};
+
+/* add_triples() adds all of the triples or, if one of them can not
+   be encoded or the resolver is frozen, none of them.
+*/
+TEST(AFF4ResolverAddTriples) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  struct ResolverTriple triples[3];
+  char *error_str = NULL;
+  int i;
+
+  for(i=0; i<3; i++) {
+    triples[i].subject = new_RDFURN(resolver);
+    CALL(triples[i].subject, set, "http://www.test.com/triples");
+    triples[i].attribute = talloc_asprintf(resolver, "attribute%d", i);
+    triples[i].value = rdfvalue_from_int(resolver, i);
+  };
+
+  // The middle one fails so nothing is added.
+  triples[1].value->encode = failing_encode;
+  CU_ASSERT_EQUAL(CALL(resolver, add_triples, triples, 3), 0);
+  CU_ASSERT_EQUAL(*aff4_get_current_error(&error_str), ERuntimeError);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(strstr(error_str, "triple 1"));
+  ClearError();
+
+  for(i=0; i<3; i++)
+    CU_ASSERT_PTR_NULL(CALL(resolver, resolve, resolver, triples[i].subject,
+                            triples[i].attribute));
+
+  triples[1].value = rdfvalue_from_int(resolver, 1);
+  CU_ASSERT_EQUAL(CALL(resolver, add_triples, triples, 3), 1);
+
+  for(i=0; i<3; i++) {
+    XSDInteger value = (XSDInteger)CALL(resolver, resolve, resolver,
+                                        triples[i].subject, triples[i].attribute);
+
+    CU_ASSERT_PTR_NOT_NULL_FATAL(value);
+    CU_ASSERT_EQUAL(value->value, i);
+  };
+
+  // A frozen resolver refuses them all.
+  CALL(resolver, freeze);
+  triples[0].attribute = "frozen";
+  CU_ASSERT_EQUAL(CALL(resolver, add_triples, triples, 1), 0);
+  CU_ASSERT_EQUAL(*aff4_get_current_error(&error_str), ERuntimeError);
+  ClearError();
+  CU_ASSERT_PTR_NULL(CALL(resolver, resolve, resolver, triples[0].subject, "frozen"));
+
+  aff4_free(resolver);
+};
+
+/* A binary graph whose footer sizes only add up to the graph size
+   once they wrap around is rejected rather than read out of bounds.
+*/
+TEST(AFF4ResolverCorruptBinaryGraph) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  RDFParser parser = CONSTRUCT(RDFParser, RDFParser, Con, resolver, resolver);
+  RDFURN urn = new_RDFURN(resolver);
+  struct RDFBinaryFooter footer;
+  FileLikeObject fd;
+  FILE *graph;
+
+  CALL(urn, set, TEMP_DIR);
+  CALL(urn, add, "CorruptGraph.bin");
+
+  footer.magic = RDF_BINARY_MAGIC;
+  footer.version = RDF_BINARY_VERSION;
+  footer.triples = 1;
+  footer.strings = 1;
+  footer.strings_size = 1LL << 40;
+  footer.triples_size = 8 - footer.strings_size;
+
+  graph = fopen(urn->parser->query, "wb");
+  CU_ASSERT_PTR_NOT_NULL_FATAL(graph);
+  fwrite("01234567", 8, 1, graph);
+  fwrite(&footer, sizeof(footer), 1, graph);
+  fclose(graph);
+
+  fd = (FileLikeObject)CALL(resolver, create, urn, AFF4_FILE, 'r');
+  CU_ASSERT_FATAL(fd && CALL((AFFObject)fd, finish));
+
+  CU_ASSERT_EQUAL(CALL(parser, parse, fd, AFF4_BINARY_GRAPH, "aff4://volume"), 0);
+  ClearError();
+
+  talloc_free(fd);
+  unlink(urn->parser->query);
+  aff4_free(resolver);
+};
@@ -85,6 +85,42 @@ TEST(CacheTestExpiry) {
   aff4_free(test);
 };
 
+#define SPREAD_WIDTH 4096
+#define SPREAD_KEYS 4096
+
+/* Keys which differ only in their order or in a few bytes should
+   still spread over the whole hash table.
+*/
+TEST(CacheTestHashSpread) {
+  Cache test = CONSTRUCT(Cache, Cache, Con, NULL, SPREAD_WIDTH, 0);
+  char *used = talloc_zero_size(test, SPREAD_WIDTH);
+  char key[64];
+  int buckets = 0;
+  int i;
+
+  for(i=0; i<SPREAD_KEYS; i++) {
+    int len = snprintf(key, sizeof(key), "aff4://volume/subject%d", i);
+    int hash = CALL(test, hash, key, len);
+
+    CU_ASSERT_FATAL(hash >= 0 && hash < SPREAD_WIDTH);
+    if(!used[hash]) {
+      used[hash] = 1;
+      buckets++;
+    };
+  };
+
+  // Hashing should fill most of the table (about 63% for a random
+  // hash). Anything which only mixes the bytes together (like xor)
+  // reaches at most 256 buckets.
+  CU_ASSERT_TRUE(buckets > SPREAD_WIDTH / 2);
+
+  // Anagrams of the same key are different keys.
+  CU_ASSERT_NOT_EQUAL(CALL(test, hash, ZSTRING_NO_NULL("ab")),
+                      CALL(test, hash, ZSTRING_NO_NULL("ba")));
+
+  aff4_free(test);
+};
+
 
 static int time_difference(struct timeval *prev, struct timeval *now) {
   uint64_t prev_usec = prev->tv_sec * 1000000 + prev->tv_usec;
@@ -130,6 +166,89 @@ TEST(QueueTest) {
   CU_ASSERT(time_difference(&prev, &now) > timeout);
 
   talloc_free(queue);
+
+  /* A queue asked for a single slot must not lose items. */
+  queue = CONSTRUCT(Queue, Queue, Con, NULL, 1);
+  CU_ASSERT(1 == CALL(queue, put, "1", 0));
+  CU_ASSERT(1 == CALL(queue, put, "2", 0));
+  CU_ASSERT_STRING_EQUAL("1", CALL(queue, get, 0));
+  CU_ASSERT_STRING_EQUAL("2", CALL(queue, get, 0));
+  CU_ASSERT(NULL == CALL(queue, get, 0));
+
+  talloc_free(queue);
+};
+
+
+#define QUEUE_THREADS 4
+#define QUEUE_ITEMS 20000
+
+static int queue_seen[QUEUE_THREADS * QUEUE_ITEMS];
+
+static void *queue_producer(void *data) {
+  Queue queue = (Queue)data;
+  static int next_producer = 0;
+  int producer = __atomic_fetch_add(&next_producer, 1, __ATOMIC_SEQ_CST);
+  long i, failed = 0;
+
+  for(i=0; i<QUEUE_ITEMS; i++) {
+    // Items are never NULL.
+    if(!CALL(queue, put, (void *)(producer * QUEUE_ITEMS + i + 1), 10000000))
+      failed++;
+  };
+
+  return (void *)failed;
+};
+
+static void *queue_consumer(void *data) {
+  Queue queue = (Queue)data;
+  long i, failed = 0;
+
+  for(i=0; i<QUEUE_ITEMS; i++) {
+    long item = (long)CALL(queue, get, 10000000);
+
+    if(item <= 0 || item > QUEUE_THREADS * QUEUE_ITEMS)
+      failed++;
+    else
+      __atomic_add_fetch(&queue_seen[item - 1], 1, __ATOMIC_SEQ_CST);
+  };
+
+  return (void *)failed;
+};
+
+/* Many producers and consumers share a small queue so they block on
+   each other often. Every item must be delivered exactly once.
+*/
+TEST(QueueConcurrencyTest) {
+  Queue queue = CONSTRUCT(Queue, Queue, Con, NULL, 8);
+  pthread_t producers[QUEUE_THREADS], consumers[QUEUE_THREADS];
+  int i, missing = 0;
+
+  for(i=0; i<QUEUE_THREADS; i++) {
+    pthread_create(&consumers[i], NULL, queue_consumer, queue);
+    pthread_create(&producers[i], NULL, queue_producer, queue);
+  };
+
+  for(i=0; i<QUEUE_THREADS; i++) {
+    void *failed;
+
+    pthread_join(producers[i], &failed);
+    CU_ASSERT_EQUAL((long)failed, 0);
+
+    pthread_join(consumers[i], &failed);
+    CU_ASSERT_EQUAL((long)failed, 0);
+  };
+
+  for(i=0; i<QUEUE_THREADS * QUEUE_ITEMS; i++) {
+    if(queue_seen[i] != 1)
+      missing++;
+  };
+
+  CU_ASSERT_EQUAL(missing, 0);
+
+  /* Everything was taken out. */
+  CALL(queue, join);
+
+  talloc_free(queue);
 };
 
 
@@ -180,7 +299,7 @@ TEST(ThreadPoolTest) {
     CU_ASSERT_EQUAL(results[i], 0);
 
     /* This should wait if there are no available threads. */
-    CU_ASSERT(CALL(pool, schedule, job, 2) == 1);
+    CU_ASSERT(CALL(pool, schedule, job, 2) == job);
   };
 
   /* We must wait here until all the threads are done. */
@@ -192,3 +311,273 @@ TEST(ThreadPoolTest) {
 
   talloc_free(pool);
 };
+
+
+/* These jobs finish in the reverse order they were scheduled. Their
+   completions must still run in order on the scheduling thread.
+*/
+static int completion_order[20];
+static int completed = 0;
+
+CLASS(OrderedJob, ThreadPoolJob)
+    int number;
+    int ran;
+    OrderedJob METHOD(OrderedJob, Con, int number);
+END_CLASS
+
+OrderedJob OrderedJob_Con(OrderedJob self, int number) {
+  self->number = number;
+
+  return self;
+};
+
+void OrderedJob_run(ThreadPoolJob this) {
+  OrderedJob self = (OrderedJob) this;
+
+  AFF4_BEGIN_ALLOW_THREADS;
+  usleep((20 - self->number) * 2000);
+  AFF4_END_ALLOW_THREADS;
+
+  self->ran = 1;
+};
+
+int OrderedJob_complete(ThreadPoolJob this) {
+  OrderedJob self = (OrderedJob) this;
+
+  CU_ASSERT(self->ran);
+  CU_ASSERT(pthread_equal(this->owner, pthread_self()));
+  completion_order[completed++] = self->number;
+
+  return self->number * 2;
+};
+
+VIRTUAL(OrderedJob, ThreadPoolJob) {
+  VMETHOD_BASE(OrderedJob, Con) = OrderedJob_Con;
+  VMETHOD_BASE(ThreadPoolJob, run) = OrderedJob_run;
+  VMETHOD_BASE(ThreadPoolJob, complete) = OrderedJob_complete;
+} END_VIRTUAL
+
+
+TEST(ThreadPoolFutures) {
+  ThreadPool pool = CONSTRUCT(ThreadPool, ThreadPool, Con, NULL, 4);
+  ThreadPoolJob jobs[20];
+  int i;
+
+  OrderedJob_init((Object)&__OrderedJob);
+
+  for(i=0; i<20; i++) {
+    jobs[i] = CALL(pool, schedule, (ThreadPoolJob)CONSTRUCT(
+        OrderedJob, OrderedJob, Con, NULL, i), 10);
+    CU_ASSERT(jobs[i] != NULL);
+  };
+
+  /* Waiting on a job completes the jobs before it too. */
+  CU_ASSERT_EQUAL(CALL(pool, wait, jobs[9]), 18);
+  CU_ASSERT_EQUAL(completed, 10);
+
+  CU_ASSERT_EQUAL(CALL(pool, wait, jobs[19]), 38);
+  CU_ASSERT_EQUAL(completed, 20);
+
+  for(i=0; i<20; i++) {
+    CU_ASSERT_EQUAL(completion_order[i], i);
+  };
+
+  CU_ASSERT_EQUAL(CALL(pool, complete), 0);
+
+  CALL(pool, join);
+  talloc_free(pool);
+};
+
+
+/* A job which schedules more jobs from inside the pool. They go on
+   its own worker's deque so the other workers have to steal them.
+*/
+static ThreadPool stealing_pool = NULL;
+static int spawned_jobs_run = 0;
+
+CLASS(SpawningJob, ThreadPoolJob)
+    int spawn;
+    SpawningJob METHOD(SpawningJob, Con, int spawn);
+END_CLASS
+
+SpawningJob SpawningJob_Con(SpawningJob self, int spawn) {
+  self->spawn = spawn;
+
+  return self;
+};
+
+void SpawningJob_run(ThreadPoolJob this) {
+  SpawningJob self = (SpawningJob) this;
+  int i;
+
+  for(i=0; i<self->spawn; i++) {
+    SpawningJob job = CONSTRUCT(SpawningJob, SpawningJob, Con, NULL, 0);
+
+    CALL(stealing_pool, schedule, (ThreadPoolJob)job, 0);
+  };
+
+  if(!self->spawn) {
+    AFF4_BEGIN_ALLOW_THREADS;
+    usleep(10000);
+    AFF4_END_ALLOW_THREADS;
+
+    spawned_jobs_run ++;
+  };
+};
+
+VIRTUAL(SpawningJob, ThreadPoolJob) {
+  VMETHOD_BASE(SpawningJob, Con) = SpawningJob_Con;
+  VMETHOD_BASE(ThreadPoolJob, run) = SpawningJob_run;
+} END_VIRTUAL
+
+
+TEST(ThreadPoolStealing) {
+  SpawningJob job;
+
+  SpawningJob_init((Object)&__SpawningJob);
+
+  stealing_pool = CONSTRUCT(ThreadPool, ThreadPool, Con, NULL, 4);
+
+  job = CONSTRUCT(SpawningJob, SpawningJob, Con, NULL, 16);
+  CALL(stealing_pool, schedule, (ThreadPoolJob)job, 0);
+
+  CALL(stealing_pool, join);
+
+  CU_ASSERT_EQUAL(spawned_jobs_run, 16);
+  CU_ASSERT(stealing_pool->jobs_stolen > 0);
+
+  talloc_free(stealing_pool);
+};
+
+
+TEST(ThreadPoolCancel) {
+  ThreadPool pool = CONSTRUCT(ThreadPool, ThreadPool, Con, NULL, 1);
+  ThreadPoolJob first, second;
+
+  completed = 0;
+
+  first = CALL(pool, schedule, (ThreadPoolJob)CONSTRUCT(
+      OrderedJob, OrderedJob, Con, NULL, 0), 10);
+  second = CALL(pool, schedule, (ThreadPoolJob)CONSTRUCT(
+      OrderedJob, OrderedJob, Con, NULL, 1), 10);
+
+  /* The first job is running (or about to) so only the second one
+     can be cancelled.
+  */
+  CU_ASSERT_EQUAL(CALL(pool, cancel, NULL, second), 1);
+  CU_ASSERT_EQUAL(CALL(pool, wait, first), 0);
+
+  CU_ASSERT_EQUAL(completed, 1);
+  CU_ASSERT(!((OrderedJob)second)->ran);
+  talloc_free(second);
+
+  CALL(pool, join);
+  talloc_free(pool);
+};
+
+
+/* Each job records the error state it started with and raises an
+   error of its own.
+*/
+static int errors_seen[2];
+
+CLASS(FailingJob, ThreadPoolJob)
+    int number;
+    FailingJob METHOD(FailingJob, Con, int number);
+END_CLASS
+
+FailingJob FailingJob_Con(FailingJob self, int number) {
+  self->number = number;
+
+  return self;
+};
+
+void FailingJob_run(ThreadPoolJob this) {
+  FailingJob self = (FailingJob) this;
+
+  errors_seen[self->number] = *aff4_get_current_error(NULL);
+  RaiseError(ERuntimeError, "Job %d failed", self->number);
+};
+
+VIRTUAL(FailingJob, ThreadPoolJob) {
+  VMETHOD_BASE(FailingJob, Con) = FailingJob_Con;
+  VMETHOD_BASE(ThreadPoolJob, run) = FailingJob_run;
+} END_VIRTUAL
+
+
+TEST(ThreadPoolErrors) {
+  ThreadPool pool = CONSTRUCT(ThreadPool, ThreadPool, Con, NULL, 1);
+  ThreadPoolJob second;
+  int i;
+
+  FailingJob_init((Object)&__FailingJob);
+
+  for(i=0; i<2; i++) {
+    errors_seen[i] = -1;
+    second = CALL(pool, schedule, (ThreadPoolJob)CONSTRUCT(
+        FailingJob, FailingJob, Con, NULL, i), 10);
+  };
+
+  CALL(pool, wait, second);
+
+  /* The only worker ran both, but the second did not inherit the
+     first one's error.
+  */
+  CU_ASSERT_EQUAL(errors_seen[0], EZero);
+  CU_ASSERT_EQUAL(errors_seen[1], EZero);
+
+  CALL(pool, join);
+  talloc_free(pool);
+};
+
+
+/*********************************************
+  Tests the per object lock.
+*********************************************/
+static void *lock_acquire(void *data) {
+  AFF4Lock lock = (AFF4Lock)data;
+
+  CALL(lock, acquire);
+  return NULL;
+};
+
+static void *lock_release(void *data) {
+  AFF4Lock lock = (AFF4Lock)data;
+
+  return (void *)(long)CALL(lock, release);
+};
+
+TEST(AFF4LockTest) {
+  AFF4Lock lock = CONSTRUCT(AFF4Lock, AFF4Lock, Con, NULL);
+  pthread_t thread;
+  void *released;
+
+  /* The lock is recursive for its owner. */
+  CALL(lock, acquire);
+  CALL(lock, acquire);
+  CU_ASSERT_EQUAL(CALL(lock, release), 1);
+  CU_ASSERT_EQUAL(lock->depth, 1);
+
+  /* Only the owner may release it. */
+  pthread_create(&thread, NULL, lock_release, lock);
+  pthread_join(thread, &released);
+  CU_ASSERT_EQUAL((long)released, 0);
+  CU_ASSERT_EQUAL(lock->depth, 1);
+
+  /* Other threads wait for it, without needing the global lock. */
+  pthread_create(&thread, NULL, lock_acquire, lock);
+  usleep(10000);
+  CU_ASSERT_EQUAL(CALL(lock, release), 1);
+  pthread_join(thread, NULL);
+
+  CU_ASSERT_EQUAL(lock->contended, 1);
+  CU_ASSERT_EQUAL(lock->depth, 1);
+  CU_ASSERT(pthread_equal(lock->owner, thread));
+
+  /* Now we do not hold it. */
+  CU_ASSERT_EQUAL(CALL(lock, release), 0);
+  CU_ASSERT(CheckError(EProgrammingError));
+  ClearError();
+
+  talloc_free(lock);
+};
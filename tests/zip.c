@@ -3,6 +3,7 @@ This file tests the zip file volume implementation.
 ***************************************************/
 
 #include "aff4_internal.h"
+#include "benchmark.h"
 
 extern char TEMP_DIR[];
 
@@ -34,6 +35,61 @@ TEST(ZipTestWriter) {
   talloc_free(resolver);
 };
 
+/* Writing a member again supersedes the old one, but whoever still
+   holds a reference to the old member (e.g. a cached BevyIndex) can
+   keep using it.
+*/
+TEST(ZipTestSupersede) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  void *holder = talloc_named_const(NULL, 0, "holder");
+  FileLikeObject old_segment, segment;
+  char buffer[BUFF_SIZE];
+  ZipFile zip;
+  RDFURN urn;
+
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'w');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "ZipSupersede.zip");
+  CALL((AFFObject)zip, finish);
+
+  urn = CALL((RDFValue)URNOF(zip), clone, resolver);
+  CALL(urn, add, "member");
+
+  old_segment = CALL((AFF4Volume)zip, open_member, urn, 'w', ZIP_STORED);
+  CALL(old_segment, write, ZSTRING_NO_NULL("old data"));
+  CALL((AFFObject)old_segment, close);
+  talloc_reference(holder, old_segment);
+
+  segment = CALL((AFF4Volume)zip, open_member, urn, 'w', ZIP_STORED);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(segment);
+  CU_ASSERT(segment != old_segment);
+  CALL(segment, write, ZSTRING_NO_NULL("new data"));
+  CALL((AFFObject)segment, close);
+
+  // The volume let go of the old member, which now belongs to its holder.
+  CU_ASSERT(talloc_parent(old_segment) == holder);
+  CU_ASSERT_STRING_EQUAL(((ZipSegment)old_segment)->filename->value, "/member");
+  talloc_free(holder);
+
+  CU_ASSERT(CALL((AFFObject)zip, close));
+  talloc_free(zip);
+
+  /* Only the new member is in the volume. */
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "ZipSupersede.zip");
+  CU_ASSERT_FATAL(CALL((AFFObject)zip, finish));
+  CU_ASSERT_EQUAL(zip->directory_size, 1);
+
+  segment = CALL((AFF4Volume)zip, open_member, urn, 'r', 0);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(segment);
+  CU_ASSERT_EQUAL(CALL(segment, read, buffer, sizeof(buffer)), strlen("new data"));
+  CU_ASSERT(!memcmp(buffer, "new data", strlen("new data")));
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+  talloc_free(resolver);
+};
+
 TEST(ZipTestReader) {
   Resolver resolver = AFF4_get_resolver(NULL, NULL);
   ZipFile zip;
@@ -67,3 +123,1349 @@ TEST(ZipTestReader) {
   talloc_free(zip);
   talloc_free(resolver);
 };
+
+
+#define FROZEN_MEMBERS 50
+#define FROZEN_THREADS 4
+
+static void *frozen_member_reader(void *data) {
+  FileLikeObject *members = (FileLikeObject *)data;
+  char buffer[BUFF_SIZE];
+  char expected[BUFF_SIZE];
+  long errors = 0;
+  int i, j;
+
+  for(j=0; j<100; j++) {
+    for(i=0; i<FROZEN_MEMBERS; i++) {
+      int length = snprintf(expected, sizeof(expected), "member %d", i);
+
+      /* Loaded members of a read only volume are read without
+         locks, so concurrent readers must not disturb each other.
+      */
+      CALL(members[i], seek, 0, SEEK_SET);
+      if(CALL(members[i], read, buffer, sizeof(buffer)) != length ||
+         memcmp(buffer, expected, length))
+        errors++;
+    };
+  };
+
+  return (void *)errors;
+};
+
+TEST(ZipTestFrozenDirectory) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  FileLikeObject members[FROZEN_MEMBERS];
+  pthread_t threads[FROZEN_THREADS];
+  char name[BUFF_SIZE];
+  ZipFile zip;
+  RDFURN urn;
+  int i;
+
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'w');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "ZipFrozen.zip");
+  CALL((AFFObject)zip, finish);
+
+  urn = new_RDFURN(resolver);
+
+  // Write the members in reverse order so the directory has to sort them.
+  for(i=FROZEN_MEMBERS-1; i>=0; i--) {
+    FileLikeObject segment;
+
+    CALL(urn, set, URNOF(zip)->value);
+    snprintf(name, sizeof(name), "member%02d", i);
+    CALL(urn, add, name);
+
+    segment = CALL((AFF4Volume)zip, open_member, urn, 'w',
+                   i % 2 ? ZIP_DEFLATE : ZIP_STORED);
+    snprintf(name, sizeof(name), "member %d", i);
+    CALL(segment, write, ZSTRING_NO_NULL(name));
+    CALL((AFFObject)segment, close);
+  };
+
+  CALL((AFFObject)zip, close);
+  talloc_free(zip);
+
+  /* Open it again for reading. */
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "ZipFrozen.zip");
+  CU_ASSERT_FATAL(CALL((AFFObject)zip, finish));
+
+  CU_ASSERT_PTR_NOT_NULL_FATAL(zip->directory);
+  CU_ASSERT_EQUAL(zip->directory_size, FROZEN_MEMBERS);
+
+  for(i=0; i<FROZEN_MEMBERS; i++) {
+    CALL(urn, set, URNOF(zip)->value);
+    snprintf(name, sizeof(name), "member%02d", i);
+    CALL(urn, add, name);
+
+    members[i] = CALL((AFF4Volume)zip, open_member, urn, 'r', 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(members[i]);
+  };
+
+  /* Unknown members are not found, and new members can not be written. */
+  CALL(urn, set, URNOF(zip)->value);
+  CALL(urn, add, "missing");
+  CU_ASSERT_PTR_NULL(CALL((AFF4Volume)zip, open_member, urn, 'r', 0));
+  CU_ASSERT_PTR_NULL(CALL((AFF4Volume)zip, open_member, urn, 'w', ZIP_STORED));
+  CU_ASSERT(CheckError(EIOError));
+  ClearError();
+
+  for(i=0; i<FROZEN_THREADS; i++)
+    pthread_create(&threads[i], NULL, frozen_member_reader, members);
+
+  for(i=0; i<FROZEN_THREADS; i++) {
+    void *errors;
+
+    pthread_join(threads[i], &errors);
+    CU_ASSERT_EQUAL((long)errors, 0);
+  };
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+  talloc_free(resolver);
+};
+
+#define STREAM_CHUNKS 256
+#define STREAM_SMALL_MEMBERS 20
+
+static void *small_member_writer(void *data) {
+  ZipFile zip = (ZipFile)data;
+  RDFURN urn = new_RDFURN(NULL);
+  char name[BUFF_SIZE];
+  int i;
+
+  /* These are appended while the large members are streaming, so
+     they must end up after them rather than inside them.
+  */
+  for(i=0; i<STREAM_SMALL_MEMBERS; i++) {
+    FileLikeObject segment;
+
+    CALL(urn, set, URNOF(zip)->value);
+    snprintf(name, sizeof(name), "small%02d", i);
+    CALL(urn, add, name);
+
+    segment = CALL((AFF4Volume)zip, open_member, urn, 'w', ZIP_DEFLATE);
+    snprintf(name, sizeof(name), "small member %d", i);
+    CALL(segment, write, ZSTRING_NO_NULL(name));
+    CALL((AFFObject)segment, close);
+  };
+
+  talloc_free(urn);
+  return NULL;
+};
+
+TEST(ZipTestStreaming) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  int methods[] = {ZIP_DEFLATE, ZIP_STORED};
+  char chunk[BUFF_SIZE];
+  char buffer[BUFF_SIZE];
+  char name[BUFF_SIZE];
+  pthread_t thread;
+  ZipFile zip;
+  RDFURN urn;
+  int i, j;
+
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'w');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "ZipStreaming.zip");
+  CALL((AFFObject)zip, finish);
+
+  urn = new_RDFURN(resolver);
+
+  for(j=0; j<2; j++) {
+    ZipSegment segment;
+
+    CALL(urn, set, URNOF(zip)->value);
+    snprintf(name, sizeof(name), "large%d", j);
+    CALL(urn, add, name);
+
+    segment = (ZipSegment)CALL((AFF4Volume)zip, open_member, urn, 'w', methods[j]);
+    segment->stream_threshold = 0;
+
+    for(i=0; i<STREAM_CHUNKS; i++) {
+      memset(chunk, i, sizeof(chunk));
+      CALL((FileLikeObject)segment, write, chunk, sizeof(chunk));
+
+      // Compressed data never accumulates in memory.
+      CU_ASSERT(segment->buffer->size == 0);
+
+      if(j==0 && i == STREAM_CHUNKS / 2)
+        pthread_create(&thread, NULL, small_member_writer, zip);
+    };
+
+    CU_ASSERT(segment->streaming);
+    CALL((AFFObject)segment, close);
+  };
+
+  pthread_join(thread, NULL);
+  CU_ASSERT(CALL((AFFObject)zip, close));
+  talloc_free(zip);
+
+  /* Open it again for reading. */
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "ZipStreaming.zip");
+  CU_ASSERT_FATAL(CALL((AFFObject)zip, finish));
+  CU_ASSERT_EQUAL(zip->directory_size, 2 + STREAM_SMALL_MEMBERS);
+
+  for(j=0; j<2; j++) {
+    FileLikeObject segment;
+
+    CALL(urn, set, URNOF(zip)->value);
+    snprintf(name, sizeof(name), "large%d", j);
+    CALL(urn, add, name);
+
+    segment = CALL((AFF4Volume)zip, open_member, urn, 'r', 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(segment);
+    CU_ASSERT_EQUAL(((ZipSegment)segment)->cd.file_size, STREAM_CHUNKS * sizeof(chunk));
+
+    for(i=0; i<STREAM_CHUNKS; i++) {
+      memset(chunk, i, sizeof(chunk));
+      CU_ASSERT_EQUAL(CALL(segment, read, buffer, sizeof(buffer)), sizeof(buffer));
+      CU_ASSERT(!memcmp(buffer, chunk, sizeof(chunk)));
+      CALL(segment, seek, sizeof(chunk), SEEK_CUR);
+    };
+  };
+
+  for(i=0; i<STREAM_SMALL_MEMBERS; i++) {
+    FileLikeObject segment;
+    int length;
+
+    CALL(urn, set, URNOF(zip)->value);
+    snprintf(name, sizeof(name), "small%02d", i);
+    CALL(urn, add, name);
+
+    segment = CALL((AFF4Volume)zip, open_member, urn, 'r', 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(segment);
+
+    length = snprintf(name, sizeof(name), "small member %d", i);
+    CU_ASSERT_EQUAL(CALL(segment, read, buffer, sizeof(buffer)), length);
+    CU_ASSERT(!memcmp(buffer, name, length));
+  };
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+  talloc_free(resolver);
+};
+
+/* A thread streaming a member can not append other members in the
+   middle of it. Members it closes are appended after the streaming
+   member, and reservations are refused until it is closed.
+*/
+TEST(ZipTestStreamingSameThread) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  char *names[] = {"streaming", "small", "reserved"};
+  FileLikeObject segments[3];
+  char chunk[BUFF_SIZE], buffer[BUFF_SIZE];
+  char *error_str = NULL;
+  ZipFile zip;
+  RDFURN urn;
+  int i;
+
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'w');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "ZipStreamingSameThread.zip");
+  CALL((AFFObject)zip, finish);
+
+  urn = new_RDFURN(resolver);
+  for(i=0; i<3; i++) {
+    CALL(urn, set, URNOF(zip)->value);
+    CALL(urn, add, names[i]);
+    segments[i] = CALL((AFF4Volume)zip, open_member, urn, 'w', ZIP_STORED);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(segments[i]);
+  };
+
+  ((ZipSegment)segments[0])->stream_threshold = 0;
+  memset(chunk, 'x', sizeof(chunk));
+  CU_ASSERT_EQUAL(CALL(segments[0], write, chunk, sizeof(chunk)), sizeof(chunk));
+  CU_ASSERT_FATAL(((ZipSegment)segments[0])->streaming);
+
+  CU_ASSERT_EQUAL(CALL(segments[1], write, ZSTRING_NO_NULL("small member")), 12);
+  CU_ASSERT(CALL((AFFObject)segments[1], close));
+
+  CU_ASSERT_EQUAL(CALL((ZipSegment)segments[2], reserve, 10), 0);
+  CU_ASSERT_EQUAL(*aff4_get_current_error(&error_str), EIOError);
+  ClearError();
+
+  // The streaming member is still in one piece.
+  CU_ASSERT_EQUAL(CALL(segments[0], write, chunk, sizeof(chunk)), sizeof(chunk));
+  CU_ASSERT(CALL((AFFObject)segments[0], close));
+
+  CU_ASSERT(CALL((ZipSegment)segments[2], reserve, 10));
+  CU_ASSERT_EQUAL(CALL(segments[2], write, "0123456789", 10), 10);
+  CU_ASSERT(CALL((AFFObject)segments[2], close));
+
+  CU_ASSERT(CALL((AFFObject)zip, close));
+  talloc_free(zip);
+
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "ZipStreamingSameThread.zip");
+  CU_ASSERT_FATAL(CALL((AFFObject)zip, finish));
+  CU_ASSERT_EQUAL(zip->directory_size, 3);
+
+  CALL(urn, set, URNOF(zip)->value);
+  CALL(urn, add, "streaming");
+  segments[0] = CALL((AFF4Volume)zip, open_member, urn, 'r', 0);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(segments[0]);
+  CU_ASSERT_EQUAL(((ZipSegment)segments[0])->cd.file_size, 2 * sizeof(chunk));
+  CU_ASSERT_EQUAL(CALL(segments[0], read_at, sizeof(chunk), buffer, sizeof(buffer)),
+                  sizeof(buffer));
+  CU_ASSERT(!memcmp(buffer, chunk, sizeof(chunk)));
+
+  CALL(urn, set, URNOF(zip)->value);
+  CALL(urn, add, "small");
+  segments[1] = CALL((AFF4Volume)zip, open_member, urn, 'r', 0);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(segments[1]);
+  CU_ASSERT_EQUAL(CALL(segments[1], read, buffer, sizeof(buffer)), 12);
+  CU_ASSERT(!memcmp(buffer, "small member", 12));
+  CU_ASSERT(((ZipSegment)segments[1])->offset_of_file_header >
+            ((ZipSegment)segments[0])->offset_of_file_header);
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+  talloc_free(resolver);
+};
+
+static void *streaming_closer(void *data) {
+  FileLikeObject segment = (FileLikeObject)data;
+
+  CU_ASSERT(CALL((AFFObject)segment, close));
+  return NULL;
+};
+
+/* An image written while a member is streaming can not reserve room
+   for its bevies, so it fails rather than waiting for the streaming
+   member. The streaming member can then be closed by another thread.
+*/
+TEST(ZipTestStreamingImage) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  char chunk[BUFF_SIZE], buffer[BUFF_SIZE];
+  FileLikeObject segment, image;
+  char *error_str = NULL;
+  pthread_t thread;
+  ZipFile zip;
+  RDFURN urn;
+  int i;
+
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'w');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "ZipStreamingImage.zip");
+  CALL((AFFObject)zip, finish);
+  CALL(resolver, cache_return, (AFFObject)zip);
+
+  urn = CALL(URNOF(zip), copy, resolver);
+  CALL(urn, add, "streaming");
+  segment = CALL((AFF4Volume)zip, open_member, urn, 'w', ZIP_STORED);
+  ((ZipSegment)segment)->stream_threshold = 0;
+  memset(chunk, 'x', sizeof(chunk));
+  CU_ASSERT_EQUAL(CALL(segment, write, chunk, sizeof(chunk)), sizeof(chunk));
+  CU_ASSERT_FATAL(((ZipSegment)segment)->streaming);
+
+  image = (FileLikeObject)CALL(resolver, create, NULL, AFF4_IMAGE, 'w');
+  URNOF(image) = CALL(URNOF(zip), copy, image);
+  CALL(URNOF(image), add, "image");
+  ((AFF4Image)image)->stored = URNOF(zip);
+  ((AFF4Image)image)->chunk_size = 32;
+  ((AFF4Image)image)->chunks_in_segment = 10;
+  ((AFF4Image)image)->thread_count = 4;
+  CU_ASSERT_FATAL(CALL((AFFObject)image, finish));
+
+  for(i=0; i<100; i++)
+    CALL(image, write, ZSTRING_NO_NULL("hello world!"));
+
+  CU_ASSERT_EQUAL(CALL((AFFObject)image, close), -1);
+  CU_ASSERT_EQUAL(*aff4_get_current_error(&error_str), EIOError);
+  ClearError();
+  talloc_free(image);
+
+  // The streaming member is still in one piece.
+  CU_ASSERT_EQUAL(CALL(segment, write, chunk, sizeof(chunk)), sizeof(chunk));
+  pthread_create(&thread, NULL, streaming_closer, segment);
+  pthread_join(thread, NULL);
+  CU_ASSERT_PTR_NULL(zip->streaming_segment);
+
+  CU_ASSERT(CALL((AFFObject)zip, close));
+  talloc_free(zip);
+
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "ZipStreamingImage.zip");
+  CU_ASSERT_FATAL(CALL((AFFObject)zip, finish));
+  CU_ASSERT_EQUAL(zip->directory_size, 1);
+
+  CALL(urn, set, URNOF(zip)->value);
+  CALL(urn, add, "streaming");
+  segment = CALL((AFF4Volume)zip, open_member, urn, 'r', 0);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(segment);
+  CU_ASSERT_EQUAL(((ZipSegment)segment)->cd.file_size, 2 * sizeof(chunk));
+  CU_ASSERT_EQUAL(CALL(segment, read_at, sizeof(chunk), buffer, sizeof(buffer)),
+                  sizeof(buffer));
+  CU_ASSERT(!memcmp(buffer, chunk, sizeof(chunk)));
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+  talloc_free(resolver);
+};
+
+TEST(ZipTestStoredView) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  char buffer[BUFF_SIZE];
+  ZipSegment segment;
+  ZipFile zip;
+  RDFURN urn;
+  char *data;
+  int i;
+
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'w');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "ZipStored.zip");
+  CALL((AFFObject)zip, finish);
+
+  urn = new_RDFURN(resolver);
+  CALL(urn, set, URNOF(zip)->value);
+  CALL(urn, add, "stored");
+
+  segment = (ZipSegment)CALL((AFF4Volume)zip, open_member, urn, 'w', ZIP_STORED);
+  for(i=0; i<1000; i++) {
+    int length = snprintf(buffer, sizeof(buffer), "%08d", i);
+
+    CALL((FileLikeObject)segment, write, buffer, length);
+  };
+  CALL((AFFObject)segment, close);
+  CALL((AFFObject)zip, close);
+  talloc_free(zip);
+
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "ZipStored.zip");
+  CU_ASSERT_FATAL(CALL((AFFObject)zip, finish));
+
+  CALL(urn, set, URNOF(zip)->value);
+  CALL(urn, add, "stored");
+  segment = (ZipSegment)CALL((AFF4Volume)zip, open_member, urn, 'r', 0);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(segment);
+
+  // Small reads anywhere in the member.
+  CALL((FileLikeObject)segment, seek, 8 * 567, SEEK_SET);
+  CU_ASSERT_EQUAL(CALL((FileLikeObject)segment, read, buffer, 8), 8);
+  CU_ASSERT(!memcmp(buffer, "00000567", 8));
+
+  // Reads are truncated at the end of the member.
+  CALL((FileLikeObject)segment, seek, 8 * 999 + 4, SEEK_SET);
+  CU_ASSERT_EQUAL(CALL((FileLikeObject)segment, read, buffer, sizeof(buffer)), 4);
+  CU_ASSERT(!memcmp(buffer, "0999", 4));
+
+  // The member was never loaded into memory.
+  CU_ASSERT_PTR_NULL(segment->buffer);
+  CU_ASSERT(segment->data_offset > segment->offset_of_file_header);
+
+  // Read only volumes are mapped so we can borrow the data in place.
+  CU_ASSERT_PTR_NOT_NULL(segment->mapped);
+  data = CALL((FileLikeObject)segment, borrow, 8 * 123, 8);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(data);
+  CU_ASSERT(!memcmp(data, "00000123", 8));
+  CU_ASSERT_PTR_NULL(CALL((FileLikeObject)segment, borrow, 8 * 999, 9));
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+  talloc_free(resolver);
+};
+
+#define RESERVED_MEMBERS 8
+#define RESERVED_SIZE (64 * 1024)
+
+static void *reserved_member_writer(void *data) {
+  ZipSegment segment = (ZipSegment)data;
+  char buffer[1024];
+  int i;
+
+  /* The members are written in small pieces so the writers overlap. */
+  for(i=0; i<RESERVED_SIZE / sizeof(buffer); i++) {
+    memset(buffer, segment->filename->value[segment->filename->length - 1],
+           sizeof(buffer));
+    CALL((FileLikeObject)segment, write, buffer, sizeof(buffer));
+  };
+
+  CALL((AFFObject)segment, close);
+  return NULL;
+};
+
+TEST(ZipTestReservedWriters) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  ZipSegment segments[RESERVED_MEMBERS];
+  pthread_t threads[RESERVED_MEMBERS];
+  char name[BUFF_SIZE], buffer[BUFF_SIZE];
+  ZipSegment segment;
+  ZipFile zip;
+  RDFURN urn;
+  int i, j;
+
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'w');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "ZipReserved.zip");
+  CALL((AFFObject)zip, finish);
+
+  urn = new_RDFURN(resolver);
+
+  /* Reserve the members in order, then write them all at once. */
+  for(i=0; i<RESERVED_MEMBERS; i++) {
+    CALL(urn, set, URNOF(zip)->value);
+    snprintf(name, sizeof(name), "member%d", i);
+    CALL(urn, add, name);
+
+    segments[i] = (ZipSegment)CALL((AFF4Volume)zip, open_member, urn, 'w',
+                                   i % 2 ? ZIP_DEFLATE : ZIP_STORED);
+    CU_ASSERT_FATAL(CALL(segments[i], reserve, RESERVED_SIZE));
+  };
+
+  for(i=0; i<RESERVED_MEMBERS; i++)
+    pthread_create(&threads[i], NULL, reserved_member_writer, segments[i]);
+
+  for(i=0; i<RESERVED_MEMBERS; i++)
+    pthread_join(threads[i], NULL);
+
+  for(i=1; i<RESERVED_MEMBERS; i++)
+    CU_ASSERT(segments[i]->offset_of_file_header > segments[i-1]->offset_of_file_header);
+
+  /* Members can not grow past their reservation, or be reserved once
+     they are written.
+  */
+  CALL(urn, set, URNOF(zip)->value);
+  CALL(urn, add, "small");
+  segment = (ZipSegment)CALL((AFF4Volume)zip, open_member, urn, 'w', ZIP_STORED);
+  CU_ASSERT(CALL(segment, reserve, 10));
+  CU_ASSERT_EQUAL(CALL((FileLikeObject)segment, write, "0123456789", 10), 10);
+  CU_ASSERT_EQUAL(CALL((FileLikeObject)segment, write, "X", 1), -1);
+  CU_ASSERT(CheckError(EIOError));
+  ClearError();
+  CALL((AFFObject)segment, close);
+
+  CALL(urn, set, URNOF(zip)->value);
+  CALL(urn, add, "late");
+  segment = (ZipSegment)CALL((AFF4Volume)zip, open_member, urn, 'w', ZIP_STORED);
+  CALL((FileLikeObject)segment, write, "late", 4);
+  CU_ASSERT(!CALL(segment, reserve, 10));
+  CU_ASSERT(CheckError(EIOError));
+  ClearError();
+  CALL((AFFObject)segment, close);
+
+  CU_ASSERT(CALL((AFFObject)zip, close));
+  talloc_free(zip);
+
+  /* Open it again for reading. */
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "ZipReserved.zip");
+  CU_ASSERT_FATAL(CALL((AFFObject)zip, finish));
+
+  for(i=0; i<RESERVED_MEMBERS; i++) {
+    FileLikeObject member;
+
+    CALL(urn, set, URNOF(zip)->value);
+    snprintf(name, sizeof(name), "member%d", i);
+    CALL(urn, add, name);
+
+    member = CALL((AFF4Volume)zip, open_member, urn, 'r', 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(member);
+    CU_ASSERT_EQUAL(((ZipSegment)member)->cd.file_size, RESERVED_SIZE);
+
+    CALL(member, seek, RESERVED_SIZE - 1024, SEEK_SET);
+    CU_ASSERT_EQUAL(CALL(member, read, buffer, sizeof(buffer)), 1024);
+    for(j=0; j<1024; j++) {
+      if(buffer[j] != '0' + i) {
+        CU_FAIL("Data mismatch");
+        break;
+      };
+    };
+  };
+
+  CALL(urn, set, URNOF(zip)->value);
+  CALL(urn, add, "small");
+  segment = (ZipSegment)CALL((AFF4Volume)zip, open_member, urn, 'r', 0);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(segment);
+  CU_ASSERT_EQUAL(CALL((FileLikeObject)segment, read, buffer, sizeof(buffer)), 10);
+  CU_ASSERT(!memcmp(buffer, "0123456789", 10));
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+  talloc_free(resolver);
+};
+
+#define INDEX_MEMBERS 40
+
+/* Each volume is opened with a fresh resolver so none of the caches
+   still hold the last one we opened.
+*/
+static void check_index_members(int count, int from_index) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  char name[BUFF_SIZE], buffer[BUFF_SIZE];
+  ZipFile zip;
+  RDFURN urn = new_RDFURN(NULL);
+  int i;
+
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "ZipIndex.zip");
+  CU_ASSERT_FATAL(CALL((AFFObject)zip, finish));
+
+  CU_ASSERT_EQUAL(zip->directory_from_index, from_index);
+  CU_ASSERT_EQUAL(zip->directory_size, count);
+
+  for(i=0; i<count; i++) {
+    FileLikeObject segment;
+    int length;
+
+    CALL(urn, set, URNOF(zip)->value);
+    snprintf(name, sizeof(name), "member%02d", i);
+    CALL(urn, add, name);
+
+    segment = CALL((AFF4Volume)zip, open_member, urn, 'r', 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(segment);
+
+    length = snprintf(name, sizeof(name), "member %d", i);
+    CU_ASSERT_EQUAL(CALL(segment, read, buffer, sizeof(buffer)), length);
+    CU_ASSERT(!memcmp(buffer, name, length));
+  };
+
+  // The index itself is not a member.
+  CALL(urn, set, URNOF(zip)->value);
+  CALL(urn, add, ZIP_INDEX_NAME);
+  CU_ASSERT_PTR_NULL(CALL((AFF4Volume)zip, open_member, urn, 'r', 0));
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+  talloc_free(urn);
+  talloc_free(resolver);
+};
+
+static void write_index_members(int start, int end, int threshold) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  char name[BUFF_SIZE];
+  ZipFile zip;
+  RDFURN urn = new_RDFURN(NULL);
+  int i;
+
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'w');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "ZipIndex.zip");
+  CALL((AFFObject)zip, finish);
+  zip->index_threshold = threshold;
+
+  for(i=start; i<end; i++) {
+    FileLikeObject segment;
+
+    CALL(urn, set, URNOF(zip)->value);
+    snprintf(name, sizeof(name), "member%02d", i);
+    CALL(urn, add, name);
+
+    segment = CALL((AFF4Volume)zip, open_member, urn, 'w',
+                   i % 2 ? ZIP_DEFLATE : ZIP_STORED);
+    snprintf(name, sizeof(name), "member %d", i);
+    CALL(segment, write, ZSTRING_NO_NULL(name));
+    CALL((AFFObject)segment, close);
+  };
+
+  CU_ASSERT(CALL((AFFObject)zip, close));
+  talloc_free(zip);
+  talloc_free(urn);
+  talloc_free(resolver);
+};
+
+TEST(ZipTestMemberIndex) {
+  char *filename = talloc_asprintf(NULL, "%sZipIndex.zip", TEMP_DIR);
+
+  unlink(filename);
+  talloc_free(filename);
+
+  // Small volumes do not get an index.
+  write_index_members(0, INDEX_MEMBERS / 2, INDEX_MEMBERS);
+  check_index_members(INDEX_MEMBERS / 2, 0);
+
+  /* Appending the rest passes the threshold. The old members are
+     included in the index.
+  */
+  write_index_members(INDEX_MEMBERS / 2, INDEX_MEMBERS - 1, INDEX_MEMBERS / 2);
+  check_index_members(INDEX_MEMBERS - 1, 1);
+
+  // Appending again replaces the old index.
+  write_index_members(INDEX_MEMBERS - 1, INDEX_MEMBERS, INDEX_MEMBERS / 2);
+  check_index_members(INDEX_MEMBERS, 1);
+
+  // Without an index we go back to the central directory.
+  write_index_members(INDEX_MEMBERS, INDEX_MEMBERS, 0);
+  check_index_members(INDEX_MEMBERS, 0);
+};
+
+/* Damages the member index of ZipIndex.zip in place. The footer is
+   found by its magic, just before the index's data descriptor.
+*/
+static void corrupt_index(void (*damage)(struct ZipDirectoryEntry *entries,
+                                         struct ZipIndexFooter *footer)) {
+  char *filename = talloc_asprintf(NULL, "%sZipIndex.zip", TEMP_DIR);
+  FILE *fd = fopen(filename, "r+b");
+  struct ZipIndexFooter footer;
+  struct ZipDirectoryEntry *entries;
+  long offset, entries_offset;
+
+  CU_ASSERT_PTR_NOT_NULL_FATAL(fd);
+  fseek(fd, 0, SEEK_END);
+
+  for(offset = ftell(fd) - sizeof(footer); offset >= 0; offset--) {
+    fseek(fd, offset, SEEK_SET);
+    if(fread(&footer, sizeof(footer), 1, fd) == 1 &&
+       footer.magic == ZIP_INDEX_MAGIC && footer.version == ZIP_INDEX_VERSION)
+      break;
+  };
+  CU_ASSERT_FATAL(offset >= 0);
+
+  entries = talloc_array(filename, struct ZipDirectoryEntry, footer.entries);
+  entries_offset = offset - footer.names_size - footer.entries * sizeof(*entries);
+  fseek(fd, entries_offset, SEEK_SET);
+  CU_ASSERT_FATAL(fread(entries, sizeof(*entries), footer.entries, fd) ==
+                  footer.entries);
+
+  damage(entries, &footer);
+
+  fseek(fd, entries_offset, SEEK_SET);
+  fwrite(entries, sizeof(*entries), footer.entries, fd);
+  fseek(fd, offset, SEEK_SET);
+  fwrite(&footer, sizeof(footer), 1, fd);
+  fclose(fd);
+  talloc_free(filename);
+};
+
+static void name_outside_names(struct ZipDirectoryEntry *entries,
+                               struct ZipIndexFooter *footer) {
+  entries[1].name_offset = footer->names_size + 100;
+};
+
+static void name_not_terminated(struct ZipDirectoryEntry *entries,
+                                struct ZipIndexFooter *footer) {
+  // The last name ends at the end of the names.
+  footer->names_size--;
+};
+
+static void names_out_of_order(struct ZipDirectoryEntry *entries,
+                               struct ZipIndexFooter *footer) {
+  uint64_t name_offset = entries[0].name_offset;
+
+  entries[0].name_offset = entries[1].name_offset;
+  entries[1].name_offset = name_offset;
+};
+
+/* A damaged member index is ignored and the volume is opened from
+   the central directory instead.
+*/
+TEST(ZipTestCorruptIndex) {
+  void (*damages[])(struct ZipDirectoryEntry *, struct ZipIndexFooter *) = {
+    name_outside_names, name_not_terminated, names_out_of_order, NULL};
+  char *filename = talloc_asprintf(NULL, "%sZipIndex.zip", TEMP_DIR);
+  int i;
+
+  for(i=0; damages[i]; i++) {
+    unlink(filename);
+    write_index_members(0, INDEX_MEMBERS, INDEX_MEMBERS / 2);
+    check_index_members(INDEX_MEMBERS, 1);
+
+    corrupt_index(damages[i]);
+    check_index_members(INDEX_MEMBERS, 0);
+  };
+
+  talloc_free(filename);
+};
+
+
+/* Writes a volume with count small stored members directly, since
+   writing this many members through the volume is slow. The names
+   are relative to the volume URN, as the volume writes them.
+*/
+static void write_benchmark_volume(char *filename, int count) {
+  FILE *fd = fopen(filename, "wb");
+  uint64_t *offsets = talloc_array(NULL, uint64_t, count);
+  uint64_t start_of_cd, end_of_cd;
+  struct EndCentralDirectory end;
+  struct Zip64EndCD end_cd;
+  struct Zip64CDLocator locator;
+  char name[BUFF_SIZE];
+  int i;
+
+  for(i=0; i<count; i++) {
+    struct ZipFileHeader header;
+    int length = snprintf(name, sizeof(name), "/member%07d", i);
+
+    offsets[i] = ftello(fd);
+    memset(&header, 0, sizeof(header));
+    header.magic = 0x4034b50;
+    header.version = 0x14;
+    header.crc32 = crc32(0, (unsigned char *)name, length);
+    header.compress_size = header.file_size = length;
+    header.file_name_length = length;
+
+    fwrite(&header, sizeof(header), 1, fd);
+    fwrite(name, length, 1, fd);
+    fwrite(name, length, 1, fd);
+  };
+
+  start_of_cd = ftello(fd);
+  for(i=0; i<count; i++) {
+    struct CDFileHeader cd;
+    int length = snprintf(name, sizeof(name), "/member%07d", i);
+
+    memset(&cd, 0, sizeof(cd));
+    cd.magic = 0x2014b50;
+    cd.version_made_by = 0x317;
+    cd.version_needed = 0x14;
+    cd.crc32 = crc32(0, (unsigned char *)name, length);
+    cd.compress_size = cd.file_size = length;
+    cd.file_name_length = length;
+    cd.relative_offset_local_header = offsets[i];
+
+    fwrite(&cd, sizeof(cd), 1, fd);
+    fwrite(name, length, 1, fd);
+  };
+  end_of_cd = ftello(fd);
+
+  memset(&end_cd, 0, sizeof(end_cd));
+  end_cd.magic = 0x06064b50;
+  end_cd.size_of_header = sizeof(end_cd) - 12;
+  end_cd.version_made_by = 0x2d;
+  end_cd.version_needed = 0x2d;
+  end_cd.number_of_entries_in_volume = count;
+  end_cd.number_of_entries_in_total = count;
+  end_cd.size_of_cd = end_of_cd - start_of_cd;
+  end_cd.offset_of_cd = start_of_cd;
+  fwrite(&end_cd, sizeof(end_cd), 1, fd);
+
+  locator.magic = 0x07064b50;
+  locator.disk_with_cd = 0;
+  locator.offset_of_end_cd = end_of_cd;
+  locator.number_of_disks = 1;
+  fwrite(&locator, sizeof(locator), 1, fd);
+
+  memset(&end, 0, sizeof(end));
+  end.magic = 0x6054b50;
+  end.total_entries_in_cd_on_disk = 0xFFFF;
+  end.total_entries_in_cd = 0xFFFF;
+  end.size_of_cd = end_of_cd - start_of_cd;
+  end.offset_of_cd = -1;
+  fwrite(&end, sizeof(end), 1, fd);
+
+  fclose(fd);
+  talloc_free(offsets);
+};
+
+/* Opens the volume and reads one member, returning how long it took. */
+static double time_open(char *filename, int count, int from_index) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  char name[BUFF_SIZE], buffer[BUFF_SIZE];
+  FileLikeObject segment;
+  RDFURN urn = new_RDFURN(NULL);
+  ZipFile zip;
+  double start = time_now(), elapsed;
+  int length;
+
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+  CALL(zip->storage_urn, set, filename);
+  CU_ASSERT_FATAL(CALL((AFFObject)zip, finish));
+
+  CALL(urn, set, URNOF(zip)->value);
+  snprintf(name, sizeof(name), "member%07d", count / 2);
+  CALL(urn, add, name);
+  length = snprintf(name, sizeof(name), "/member%07d", count / 2);
+  segment = CALL((AFF4Volume)zip, open_member, urn, 'r', 0);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(segment);
+  CU_ASSERT_EQUAL(CALL(segment, read, buffer, sizeof(buffer)), length);
+  CU_ASSERT(!memcmp(buffer, name, length));
+  elapsed = time_now() - start;
+
+  CU_ASSERT_EQUAL(zip->directory_from_index, from_index);
+  CU_ASSERT_EQUAL(zip->directory_size, count);
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+  talloc_free(urn);
+  talloc_free(resolver);
+
+  return elapsed;
+};
+
+/* Reports how long it takes to open large volumes and find a member,
+   from the central directory and then from the member index.
+*/
+TEST(ZipOpenBenchmark) {
+  int counts[] = {10000, 100000, 1000000, 0};
+  int i;
+
+  if(!benchmarking())
+    return;
+
+  printf("\n%10s %12s %12s %12s\n", "members", "cd ms", "index ms", "append ms");
+
+  for(i=0; counts[i]; i++) {
+    Resolver resolver;
+    char *filename = talloc_asprintf(NULL, "%sZipOpen%d.zip", TEMP_DIR, counts[i]);
+    double directory_time, index_time, append_time;
+    ZipFile zip;
+
+    write_benchmark_volume(filename, counts[i]);
+    directory_time = time_open(filename, counts[i], 0);
+
+    // Appending to the volume writes the member index.
+    append_time = time_now();
+    resolver = AFF4_get_resolver(NULL, NULL);
+    zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'w');
+    CALL(zip->storage_urn, set, filename);
+    CALL((AFFObject)zip, finish);
+    CU_ASSERT(CALL((AFFObject)zip, close));
+    talloc_free(resolver);
+    append_time = time_now() - append_time;
+
+    index_time = time_open(filename, counts[i], 1);
+
+    printf("%10d %12.1f %12.1f %12.1f\n", counts[i], directory_time * 1000,
+           index_time * 1000, append_time * 1000);
+
+    unlink(filename);
+    talloc_free(filename);
+  };
+};
+
+
+#define GRAPH_OBJECTS 10
+#define GRAPH_NAME PREDICATE_NAMESPACE "name"
+
+#define GRAPH_IMAGE_DATA "hello world!"
+
+/* Writes a volume with a graph about the volume, one graph for each
+   object about that object, and an image described by a graph of its
+   own.
+*/
+static void write_graph_volume(char *filename, int count) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  RDFURN urn = new_RDFURN(NULL);
+  char name[BUFF_SIZE], statement[BUFF_SIZE];
+  char *attributes[] = {AFF4_STORED, AFF4_SIZE, AFF4_CHUNK_SIZE,
+                        AFF4_CHUNKS_IN_SEGMENT, AFF4_COMPRESSION, NULL};
+  FileLikeObject segment;
+  RDFSerializer serializer;
+  AFF4Image image;
+  ZipFile zip;
+  int i, length;
+
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'w');
+  CALL(zip->storage_urn, set, filename);
+  CALL((AFFObject)zip, finish);
+
+  CALL(urn, set, URNOF(zip)->value);
+  CALL(urn, add, AFF4_INFORMATION "turtle");
+  segment = CALL((AFF4Volume)zip, open_member, urn, 'w', ZIP_STORED);
+  length = snprintf(statement, sizeof(statement), "<%s> <%s> \"volume\" .\n",
+                    URNOF(zip)->value, GRAPH_NAME);
+  CALL(segment, write, statement, length);
+  CALL((AFFObject)segment, close);
+
+  for(i=0; i<count; i++) {
+    snprintf(name, sizeof(name), "object%07d", i);
+    CALL(urn, set, URNOF(zip)->value);
+    CALL(urn, add, name);
+    length = snprintf(statement, sizeof(statement), "<%s> <%s> \"%s\" .\n",
+                      urn->value, GRAPH_NAME, name);
+
+    // The first graph also names an object without a graph of its own.
+    if(i == 0)
+      length += snprintf(statement + length, sizeof(statement) - length,
+                         "<%s/elsewhere> <%s> \"elsewhere\" .\n",
+                         URNOF(zip)->value, GRAPH_NAME);
+
+    CALL(urn, add, AFF4_INFORMATION "turtle");
+    segment = CALL((AFF4Volume)zip, open_member, urn, 'w', ZIP_DEFLATE);
+    CALL(segment, write, statement, length);
+    CALL((AFFObject)segment, close);
+  };
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+
+  image = (AFF4Image)CALL(resolver, create, NULL, AFF4_IMAGE, 'w');
+  URNOF(image) = CALL(URNOF(zip), copy, image);
+  CALL(URNOF(image), add, "image");
+  image->stored = URNOF(zip);
+  CALL((AFFObject)image, finish);
+
+  for(i=0; i<100; i++)
+    CALL((FileLikeObject)image, write, ZSTRING_NO_NULL(GRAPH_IMAGE_DATA));
+
+  CU_ASSERT(CALL((AFFObject)image, close));
+  CALL(resolver, set, URNOF(image), AFF4_STORED, (RDFValue)URNOF(zip));
+
+  CALL(urn, set, URNOF(image)->value);
+  CALL(urn, add, AFF4_INFORMATION "turtle");
+  segment = CALL((AFF4Volume)zip, open_member, urn, 'w', ZIP_STORED);
+  serializer = CONSTRUCT(RDFSerializer, RDFSerializer, Con, NULL, URNOF(zip)->value,
+                         segment, resolver, "turtle");
+  CU_ASSERT_PTR_NOT_NULL_FATAL(serializer);
+
+  for(i=0; attributes[i]; i++)
+    CU_ASSERT(CALL(serializer, serialize_statement, URNOF(image), attributes[i]));
+
+  CALL(serializer, close);
+  CALL((AFFObject)segment, close);
+  talloc_free(image);
+
+  CU_ASSERT(CALL((AFFObject)zip, close));
+  talloc_free(zip);
+  talloc_free(urn);
+  talloc_free(resolver);
+};
+
+static ZipFile open_graph_volume(Resolver resolver, char *filename) {
+  ZipFile zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+
+  CALL(zip->storage_urn, set, filename);
+  CU_ASSERT_FATAL(CALL((AFFObject)zip, finish));
+
+  return zip;
+};
+
+/* Checks the name of the object as the graph about it has it. */
+static int check_graph_object(Resolver resolver, ZipFile zip, int i) {
+  RDFURN urn = CALL(URNOF(zip), copy, NULL);
+  char name[BUFF_SIZE];
+  XSDString value;
+  int result;
+
+  snprintf(name, sizeof(name), "object%07d", i);
+  CALL(urn, add, name);
+
+  value = (XSDString)CALL(resolver, resolve, urn, urn, GRAPH_NAME);
+  result = value && !strcmp(value->value, name);
+
+  talloc_free(urn);
+  return result;
+};
+
+static int count_graphs_loaded(ZipFile zip) {
+  int result = 0;
+  uint64_t i;
+
+  for(i=0; i<zip->directory_size; i++)
+    result += zip->graphs_loaded[i];
+
+  return result;
+};
+
+/* Opens the image in the volume and reads its first chunk. */
+static int read_graph_image(Resolver resolver, ZipFile zip) {
+  AFF4Image image = (AFF4Image)CALL(resolver, create, NULL, AFF4_IMAGE, 'r');
+  char buffer[BUFF_SIZE];
+  int result;
+
+  URNOF(image) = CALL(URNOF(zip), copy, image);
+  CALL(URNOF(image), add, "image");
+
+  result = CALL((AFFObject)image, finish) &&
+    CALL((FileLikeObject)image, read, buffer, strlen(GRAPH_IMAGE_DATA)) ==
+    strlen(GRAPH_IMAGE_DATA) &&
+    !memcmp(buffer, GRAPH_IMAGE_DATA, strlen(GRAPH_IMAGE_DATA));
+
+  talloc_free(image);
+  return result;
+};
+
+TEST(ZipTestLazyGraphs) {
+  char *filename = talloc_asprintf(NULL, "%sZipGraphs.zip", TEMP_DIR);
+  Resolver resolver;
+  XSDString value;
+  RDFURN urn;
+  ZipFile zip;
+  int i;
+
+  write_graph_volume(filename, GRAPH_OBJECTS);
+
+  /* Opening the volume parses none of the graphs, and they are all
+     parsed when the first one is needed.
+  */
+  resolver = AFF4_get_resolver(NULL, NULL);
+  zip = open_graph_volume(resolver, filename);
+  CU_ASSERT_EQUAL(count_graphs_loaded(zip), 0);
+  CU_ASSERT_EQUAL(resolver->lazy_volumes->cache_size, 1);
+
+  CU_ASSERT(check_graph_object(resolver, zip, 3));
+  CU_ASSERT_EQUAL(count_graphs_loaded(zip), GRAPH_OBJECTS + 2);
+  CU_ASSERT_EQUAL(resolver->lazy_volumes->cache_size, 0);
+
+  for(i=0; i<GRAPH_OBJECTS; i++)
+    CU_ASSERT(check_graph_object(resolver, zip, i));
+  CU_ASSERT(read_graph_image(resolver, zip));
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+  talloc_free(resolver);
+
+  /* In lazy mode only the volume's own graph is parsed, and the
+     others when their object is resolved.
+  */
+  resolver = CONSTRUCT(Resolver, Resolver, Con, NULL, NULL, RESOLVER_MODE_LAZY_GRAPHS);
+  zip = open_graph_volume(resolver, filename);
+  CU_ASSERT_EQUAL(count_graphs_loaded(zip), 1);
+  CU_ASSERT_EQUAL(resolver->lazy_volumes->cache_size, 1);
+
+  value = (XSDString)CALL(resolver, resolve, resolver, URNOF(zip), GRAPH_NAME);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(value);
+  CU_ASSERT_STRING_EQUAL(value->value, "volume");
+
+  CU_ASSERT(check_graph_object(resolver, zip, 3));
+  CU_ASSERT(check_graph_object(resolver, zip, 3));
+  CU_ASSERT_EQUAL(count_graphs_loaded(zip), 2);
+
+  /* Missing statements about a subject with a graph of its own, like
+     the configuration the image looks up, do not parse the rest.
+  */
+  CU_ASSERT(read_graph_image(resolver, zip));
+  CU_ASSERT_EQUAL(count_graphs_loaded(zip), 3);
+  CU_ASSERT_EQUAL(resolver->lazy_volumes->cache_size, 1);
+
+  // Freezing parses the rest.
+  CALL(resolver, freeze);
+  CU_ASSERT_EQUAL(count_graphs_loaded(zip), GRAPH_OBJECTS + 2);
+  CU_ASSERT_EQUAL(resolver->lazy_volumes->cache_size, 0);
+
+  for(i=0; i<GRAPH_OBJECTS; i++)
+    CU_ASSERT(check_graph_object(resolver, zip, i));
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+  talloc_free(resolver);
+
+  /* Statements about subjects without a graph of their own are still
+     found, by parsing the other graphs when the lookup misses.
+  */
+  resolver = CONSTRUCT(Resolver, Resolver, Con, NULL, NULL, RESOLVER_MODE_LAZY_GRAPHS);
+  zip = open_graph_volume(resolver, filename);
+  CU_ASSERT_EQUAL(count_graphs_loaded(zip), 1);
+
+  urn = CALL(URNOF(zip), copy, resolver);
+  CALL(urn, add, "elsewhere");
+  value = (XSDString)CALL(resolver, resolve, resolver, urn, GRAPH_NAME);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(value);
+  CU_ASSERT_STRING_EQUAL(value->value, "elsewhere");
+  CU_ASSERT_EQUAL(count_graphs_loaded(zip), GRAPH_OBJECTS + 2);
+  CU_ASSERT_EQUAL(resolver->lazy_volumes->cache_size, 0);
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+  talloc_free(resolver);
+
+  unlink(filename);
+  talloc_free(filename);
+};
+
+/* Opens the volume and reads the first chunk of its image, returning
+   how long it took. */
+static double time_first_read(char *filename, int mode) {
+  Resolver resolver = CONSTRUCT(Resolver, Resolver, Con, NULL, NULL, mode);
+  double start = time_now(), elapsed;
+  ZipFile zip;
+
+  zip = open_graph_volume(resolver, filename);
+  CU_ASSERT(read_graph_image(resolver, zip));
+  elapsed = time_now() - start;
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+  talloc_free(resolver);
+
+  return elapsed;
+};
+
+/* Reports how long it takes to open volumes with many graphs and
+   resolve one object, parsing all the graphs and then lazily.
+*/
+TEST(ZipGraphBenchmark) {
+  int counts[] = {1000, 10000, 50000, 0};
+  int i;
+
+  if(!benchmarking())
+    return;
+
+  printf("\n%10s %12s %12s\n", "graphs", "eager ms", "lazy ms");
+
+  for(i=0; counts[i]; i++) {
+    char *filename = talloc_asprintf(NULL, "%sZipGraphs%d.zip", TEMP_DIR, counts[i]);
+    double eager_time, lazy_time;
+
+    write_graph_volume(filename, counts[i]);
+    eager_time = time_first_read(filename, 0);
+    lazy_time = time_first_read(filename, RESOLVER_MODE_LAZY_GRAPHS);
+
+    printf("%10d %12.1f %12.1f\n", counts[i], eager_time * 1000, lazy_time * 1000);
+
+    unlink(filename);
+    talloc_free(filename);
+  };
+};
+
+
+#define GRAPH_TAG PREDICATE_NAMESPACE "tag"
+
+/* Writes a volume with one graph in the format, about count objects
+   which each have a name, size, where they are stored and two tags.
+*/
+static void write_statements_volume(char *filename, char *format, int count) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  char *attributes[] = {GRAPH_NAME, AFF4_SIZE, AFF4_STORED, GRAPH_TAG, NULL};
+  RDFURN urn = new_RDFURN(NULL);
+  XSDString name = new_XSDString(urn);
+  XSDInteger size = new_XSDInteger(urn);
+  FileLikeObject segment;
+  RDFSerializer serializer;
+  char buff[BUFF_SIZE];
+  ZipFile zip;
+  int i, j;
+
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'w');
+  CALL(zip->storage_urn, set, filename);
+  CALL((AFFObject)zip, finish);
+
+  snprintf(buff, sizeof(buff), AFF4_INFORMATION "%s", format);
+  CALL(urn, set, URNOF(zip)->value);
+  CALL(urn, add, buff);
+  segment = CALL((AFF4Volume)zip, open_member, urn, 'w', ZIP_DEFLATE);
+
+  /* N-Triples are also turtle, and raptor's turtle serializer takes
+     quadratic time in the number of subjects.
+  */
+  serializer = CONSTRUCT(RDFSerializer, RDFSerializer, Con, NULL, URNOF(zip)->value,
+                         segment, resolver,
+                         strcmp(format, "turtle") ? format : "ntriples");
+  CU_ASSERT_PTR_NOT_NULL_FATAL(serializer);
+
+  for(i=0; i<count; i++) {
+    snprintf(buff, sizeof(buff), "object%07d", i);
+    CALL(urn, set, URNOF(zip)->value);
+    CALL(urn, add, buff);
+
+    CALL(name, set, ZSTRING_NO_NULL(buff));
+    CALL(resolver, set, urn, GRAPH_NAME, (RDFValue)name);
+    CALL(size, set, i * 1000);
+    CALL(resolver, set, urn, AFF4_SIZE, (RDFValue)size);
+    CALL(resolver, set, urn, AFF4_STORED, (RDFValue)URNOF(zip));
+    CALL(name, set, ZSTRING_NO_NULL("first"));
+    CALL(resolver, add, urn, GRAPH_TAG, (RDFValue)name);
+    CALL(name, set, ZSTRING_NO_NULL("second"));
+    CALL(resolver, add, urn, GRAPH_TAG, (RDFValue)name);
+
+    for(j=0; attributes[j]; j++)
+      CU_ASSERT(CALL(serializer, serialize_statement, urn, attributes[j]));
+  };
+
+  CALL(serializer, close);
+  CALL((AFFObject)segment, close);
+
+  CU_ASSERT(CALL((AFFObject)zip, close));
+  talloc_free(zip);
+  talloc_free(urn);
+  talloc_free(resolver);
+};
+
+/* Checks all the statements about object i were loaded. */
+static int check_statements(Resolver resolver, ZipFile zip, int i) {
+  RDFURN urn = CALL(URNOF(zip), copy, NULL);
+  char name[BUFF_SIZE];
+  XSDString value;
+  XSDInteger size;
+  RDFURN stored;
+  int result;
+
+  snprintf(name, sizeof(name), "object%07d", i);
+  CALL(urn, add, name);
+
+  value = (XSDString)CALL(resolver, resolve, urn, urn, GRAPH_NAME);
+  size = (XSDInteger)CALL(resolver, resolve, urn, urn, AFF4_SIZE);
+  stored = (RDFURN)CALL(resolver, resolve, urn, urn, AFF4_STORED);
+
+  result = value && !strcmp(value->value, name) &&
+    size && size->value == i * 1000 &&
+    stored && !strcmp(stored->value, URNOF(zip)->value);
+
+  // Both tags are there in order.
+  value = (XSDString)CALL(resolver, resolve, urn, urn, GRAPH_TAG);
+  result = result && value && !strcmp(value->value, "first") &&
+    !strcmp(list_entry(value->super.list.next, struct XSDString_t,
+                       super.list)->value, "second");
+
+  talloc_free(urn);
+  return result;
+};
+
+TEST(ZipTestBinaryGraph) {
+  char *formats[] = {"turtle", AFF4_BINARY_GRAPH, NULL};
+  int i, j;
+
+  for(j=0; formats[j]; j++) {
+    char *filename = talloc_asprintf(NULL, "%sZipStatements.%s.zip", TEMP_DIR,
+                                     formats[j]);
+    Resolver resolver;
+    RDFValue value, i_value;
+    int contained = 0;
+    ZipFile zip;
+
+    write_statements_volume(filename, formats[j], GRAPH_OBJECTS);
+
+    resolver = AFF4_get_resolver(NULL, NULL);
+    zip = open_graph_volume(resolver, filename);
+
+    for(i=0; i<GRAPH_OBJECTS; i++)
+      CU_ASSERT(check_statements(resolver, zip, i));
+
+    CU_ASSERT_EQUAL(count_graphs_loaded(zip), 1);
+
+    // The volume contains all the objects.
+    value = CALL(resolver, resolve, resolver, URNOF(zip), AFF4_VOLATILE_CONTAINS);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(value);
+
+    contained = 1;
+    list_for_each_entry(i_value, &value->list, list)
+      contained++;
+
+    CU_ASSERT_EQUAL(contained, GRAPH_OBJECTS);
+
+    CALL(resolver, cache_return, (AFFObject)zip);
+    talloc_free(resolver);
+
+    unlink(filename);
+    talloc_free(filename);
+  };
+};
+
+/* Reports how long it takes to open volumes with a graph about many
+   objects, in turtle and as a binary graph.
+*/
+TEST(ZipBinaryGraphBenchmark) {
+  int counts[] = {1000, 10000, 100000, 0};
+  char *formats[] = {"turtle", AFF4_BINARY_GRAPH, NULL};
+  int i, j;
+
+  if(!benchmarking())
+    return;
+
+  printf("\n%10s %12s %12s\n", "objects", "turtle ms", "binary ms");
+
+  for(i=0; counts[i]; i++) {
+    double times[2];
+
+    for(j=0; formats[j]; j++) {
+      char *filename = talloc_asprintf(NULL, "%sZipStatements%d.%s.zip", TEMP_DIR,
+                                       counts[i], formats[j]);
+      Resolver resolver;
+      double start;
+      ZipFile zip;
+
+      write_statements_volume(filename, formats[j], counts[i]);
+
+      resolver = AFF4_get_resolver(NULL, NULL);
+      start = time_now();
+      zip = open_graph_volume(resolver, filename);
+      times[j] = time_now() - start;
+
+      CU_ASSERT(check_statements(resolver, zip, counts[i] / 2));
+      CALL(resolver, cache_return, (AFFObject)zip);
+      talloc_free(resolver);
+
+      unlink(filename);
+      talloc_free(filename);
+    };
+
+    printf("%10d %12.1f %12.1f\n", counts[i], times[0] * 1000, times[1] * 1000);
+  };
+};